@@ -23,6 +23,12 @@ typedef struct _tagPARANDIS_HASHING_SETTINGS
     USHORT HashSecretKeySize;
 } PARANDIS_HASHING_SETTINGS;
 
+/* Longest Toeplitz input: IPv6 source and destination addresses plus ports */
+#define PARANDIS_RSS_MAX_HASH_INPUT (NDIS_RSS_HASH_SECRET_KEY_MAX_SIZE_REVISION_2 - sizeof(ULONG))
+
+/* Per-key Toeplitz contributions, indexed by input byte offset and byte value */
+typedef UINT32 PARANDIS_HASHING_TABLE[PARANDIS_RSS_MAX_HASH_INPUT][256];
+
 
 #define INVALID_INDIRECTION_INDEX (-1)
 
@@ -41,8 +47,38 @@ typedef struct _tagPARANDIS_SCALING_SETTINGS
 
     PROCESSOR_NUMBER DefaultProcessor;
     CCHAR          DefaultQueue;
+
+    PROCESSOR_NUMBER QueueProcessor[PARANDIS_RSS_MAX_RECEIVE_QUEUES];
 } PARANDIS_SCALING_SETTINGS, *PPARANDIS_SCALING_SETTINGS;
 
+/* Flow steering: receive queue of the CPU that last transmitted on a flow, must be a power of 2 */
+#define PARANDIS_RSS_FLOW_TABLE_SIZE (1024)
+
+typedef union _tagPARANDIS_RSS_FLOW_ENTRY
+{
+    struct
+    {
+        ULONG Hash;
+        LONG  Queue;
+    };
+    LONG64 Value;
+} PARANDIS_RSS_FLOW_ENTRY;
+
+/* Minimal interval between two updates of the device indirection table by flow steering */
+#define PARANDIS_RSS_STEERING_INTERVAL_MS (50)
+
+/* Set in PROCESSOR_NUMBER.Reserved of a bucket once steered, it keeps its CPU until the next RSS change */
+#define PARANDIS_RSS_BUCKET_STEERED (1)
+
+/* Indirection bucket steered by transmitting CPUs, which update it concurrently */
+typedef union _tagPARANDIS_RSS_STEERED_BUCKET
+{
+    PROCESSOR_NUMBER Processor;
+    LONG             Value;
+} PARANDIS_RSS_STEERED_BUCKET;
+
+C_ASSERT(sizeof(PARANDIS_RSS_STEERED_BUCKET) == sizeof(PROCESSOR_NUMBER));
+
 class PARANDIS_RSS_PARAMS
 {
 public:
@@ -59,6 +95,18 @@ public:
 
     PARANDIS_HASHING_SETTINGS ActiveHashingSettings = {};
     PARANDIS_SCALING_SETTINGS ActiveRSSScalingSettings = {};
+    PARANDIS_HASHING_TABLE    ActiveHashingTable = {};
+
+    PARANDIS_RSS_FLOW_ENTRY   FlowTable[PARANDIS_RSS_FLOW_TABLE_SIZE] = {};
+    /* indirection table programmed into the device, with steered buckets */
+    PARANDIS_RSS_STEERED_BUCKET SteeredIndirectionTable[NDIS_RSS_INDIRECTION_TABLE_MAX_SIZE_REVISION_2 / sizeof(PROCESSOR_NUMBER)] = {};
+    NDIS_HANDLE               DeviceSteeringWorkItem = NULL;
+    LONG                      DeviceSteeringPending = 0;
+    /* buckets were steered since the last snapshot of the table */
+    LONG                      DeviceSteeringDirty = 0;
+    LARGE_INTEGER             DeviceSteeringTime = {};
+    /* bumped under the write lock whenever the settings are sent to the device */
+    LONG                      DeviceSettingsGeneration = 0;
 
     mutable CNdisRWLock                 rwLock;
 
@@ -105,6 +153,11 @@ CCHAR ParaNdis6_RSSGetScalingDataForPacket(
 
 CCHAR ParaNdis6_RSSGetCurrentCpuReceiveQueue(PARANDIS_RSS_PARAMS *RSSParameters);
 
+/* called with rwLock held for read */
+VOID ParaNdis6_RSSRecordTransmitFlows(PARANDIS_ADAPTER *pContext, PNET_BUFFER_LIST pNBL);
+
+VOID ParaNdis6_RSSStopDeviceSteering(PARANDIS_ADAPTER *pContext);
+
 #else
 
 #define PARANDIS_RSS_MAX_RECEIVE_QUEUES (0)
@@ -32,6 +32,7 @@ public:
 
         m_VirtQueue.Shutdown();
         m_Reinsert = false;
+        DropMergedPacket();
     }
 
     void KickRXRing();
@@ -39,6 +40,9 @@ public:
     PARANDIS_RECEIVE_QUEUE &UnclassifiedPacketsQueue() { return m_UnclassifiedPacketsQueue;  }
 
 private:
+    /* max number of completed Rx buffers fetched from the ring at once */
+    static const unsigned int m_nMaxHarvestBatch = 32;
+
     /* list of Rx buffers available for data (under VIRTIO management) */
     LIST_ENTRY              m_NetReceiveBuffers;
     UINT                    m_NetNofReceiveBuffers;
@@ -49,10 +53,24 @@ private:
 
     PARANDIS_RECEIVE_QUEUE m_UnclassifiedPacketsQueue;
 
+    /* page-sized buffers: max number of buffers a frame may span */
+    UINT m_nMaxMergedBuffers = 0;
+
+    /* page-sized buffers: frame whose buffers are being collected */
+    pRxNetDescriptor m_pMergeHead = NULL;
+    pRxNetDescriptor m_pMergeTail = NULL;
+    UINT m_nMergeBuffers = 0;
+    UINT m_nMergeBuffersLeft = 0;
+    UINT m_nMergeLength = 0;
+    bool m_bMergeDrop = false;
+
     void ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor);
+    pRxNetDescriptor MergeRxBuffer(pRxNetDescriptor pBufferDescriptor, unsigned int nLength, unsigned int *pnFullLength);
+    void DropMergedPacket();
 private:
     int PrepareReceiveBuffers();
     pRxNetDescriptor CreateRxDescriptorOnInit();
+    pRxNetDescriptor CreateRxPageDescriptorOnInit();
 };
 
 #ifdef PARANDIS_SUPPORT_RSS
@@ -50,6 +50,19 @@ public:
     }
 
     bool BindToDescriptor(CTXDescriptor &Descriptor);
+
+    // software LSO: every segment is bound to its own descriptor,
+    // segment 0 must be bound first as it computes the layout
+    bool BindSegmentToDescriptor(CTXDescriptor &Descriptor, ULONG Index);
+    ULONG GetSegmentsNumber() const
+    { return m_SegmentsNumber; }
+    // TCP payload carried by segments FirstIndex and up
+    ULONG GetSegmentsPayload(ULONG FirstIndex) const;
+    void SegmentSubmitted()
+    { m_SegmentsInFlight++; }
+    // returns true when the last descriptor referencing this NB is released
+    bool ReleaseSegment()
+    { return (m_SegmentsInFlight == 0) || (--m_SegmentsInFlight == 0); }
 private:
     ULONG Copy(PVOID Dst, ULONG Length) const;
     bool CopyHeaders(PVOID Destination, ULONG MaxSize, ULONG &HeadersLength, ULONG &L4HeaderOffset) const;
@@ -59,8 +72,9 @@ private:
     USHORT QueryL4HeaderOffset(PVOID PacketData, ULONG IpHeaderOffset) const;
     void DoIPHdrCSO(PVOID EthHeaders, ULONG HeadersLength) const;
     void SetupCSO(virtio_net_hdr *VirtioHeader, ULONG L4HeaderOffset) const;
+    void SetupSegment(virtio_net_hdr *VirtioHeader, PVOID IpHeader, ULONG Index, ULONG PayloadLength) const;
     bool FillDescriptorSGList(CTXDescriptor &Descriptor, ULONG DataOffset) const;
-    bool MapDataToVirtioSGL(CTXDescriptor &Descriptor, ULONG Offset) const;
+    bool MapDataToVirtioSGL(CTXDescriptor &Descriptor, ULONG Offset, ULONG Length = MAXULONG) const;
     void PopulateIPLength(IPHeader *IpHeader, USHORT IpLength) const;
 
     PNET_BUFFER m_NB;
@@ -68,6 +82,10 @@ private:
     PPARANDIS_ADAPTER m_Context;
     PSCATTER_GATHER_LIST m_SGL = nullptr;
 
+    ULONG m_SegmentsNumber = 0;
+    ULONG m_SegmentHeadersLength = 0;
+    ULONG m_SegmentsInFlight = 0;
+
     CNB(const CNB&) = delete;
     CNB& operator= (const CNB&) = delete;
 
@@ -130,6 +148,7 @@ public:
     { return m_TCI; }
     bool IsLSO()
     { return (m_LsoInfo.Value != nullptr); }
+    bool IsSWLSO();
     bool IsTcpCSO()
     { return m_CsoInfo.Transmit.TcpChecksum; }
     bool IsUdpCSO()
@@ -234,7 +253,7 @@ public:
     ULONG GetFreeHWBuffers()
     { return m_VirtQueue.GetFreeHWBuffers(); }
 
-    bool DoPendingTasks(CNBL *nblHolder);
+    bool DoPendingTasks(bool bFromDpc);
 
     void CompleteOutstandingNBLChain(PNET_BUFFER_LIST NBL, ULONG Flags = 0);
     void CompleteOutstandingInternalNBL(PNET_BUFFER_LIST NBL, BOOLEAN UnregisterOutstanding = TRUE);
@@ -262,6 +281,10 @@ private:
     // indication that DPC waits on TX lock
     CNdisRefCounter m_DpcWaiting;
 
+    // Send() calls mapping their NBL chain, each of them submits
+    // everything mapped meanwhile once it is done
+    CNdisRefCounter m_SendersMapping;
+
     CLockFreeCNBLQueue m_SendQueue;
 
     CRawCNBLList m_WaitingList;
@@ -207,13 +207,16 @@ public:
     void* GetBuf(unsigned int *len)
     { return virtqueue_get_buf(m_VirtQueue, len); }
 
+    unsigned int GetBufs(void *bufs[], unsigned int lens[], unsigned int max)
+    { return virtqueue_get_bufs(m_VirtQueue, bufs, lens, max); }
+
     //TODO: Needs review / temporary
     void Kick()
     { virtqueue_kick(m_VirtQueue); }
 
     //TODO: Needs review / temporary
     void KickAlways()
-    { virtqueue_notify(m_VirtQueue); }
+    { virtqueue_kick_always(m_VirtQueue); }
 
     bool Restart()
     {
@@ -302,7 +305,8 @@ private:
     ULONG m_HeaderSize;
 
     void KickQueueOnOverflow();
-    void UpdateTXStats(const CNB &NB, CTXDescriptor &Descriptor);
+    void UpdateTXStats(const CNB &NB, CTXDescriptor &Descriptor, ULONG UnsentBytes = 0);
+    SubmitTxPacketResult SubmitSegments(CNB &NB);
 
     CNdisList<CTXDescriptor, CRawAccess, CCountingObject> m_Descriptors;
     CNdisList<CTXDescriptor, CRawAccess, CNonCountingObject> m_DescriptorsInUse;
@@ -406,6 +406,7 @@ static void DumpVirtIOFeatures(PPARANDIS_ADAPTER pContext)
         {VIRTIO_RING_F_EVENT_IDX, "VIRTIO_RING_F_EVENT_IDX"},
         {VIRTIO_F_VERSION_1, "VIRTIO_F_VERSION_1"},
         {VIRTIO_F_RING_PACKED, "VIRTIO_F_RING_PACKED"},
+        {VIRTIO_F_NOTIFICATION_DATA, "VIRTIO_F_NOTIFICATION_DATA"},
         {VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, "VIRTIO_NET_F_CTRL_GUEST_OFFLOADS" },
         {VIRTIO_NET_F_RSC_EXT, "VIRTIO_NET_F_RSC_EXT" },
         {VIRTIO_NET_F_RSS, "VIRTIO_NET_F_RSS" },
@@ -461,10 +462,12 @@ static void PrintStatistics(PARANDIS_ADAPTER *pContext)
     DPrintf(0, "[Diag!] Bytes transmitted %I64u, received %I64u\n",
         pContext->Statistics.ifHCOutOctets,
         pContext->Statistics.ifHCInOctets);
-    DPrintf(0, "[Diag!] Tx frames %I64u, CSO %d, LSO %d\n",
+    DPrintf(0, "[Diag!] Tx frames %I64u, CSO %d, LSO %d (segmented %d, segments dropped %d)\n",
         totalTxFrames,
         pContext->extraStatistics.framesCSOffload,
-        pContext->extraStatistics.framesLSO);
+        pContext->extraStatistics.framesLSO,
+        pContext->extraStatistics.framesLSOSegmented,
+        pContext->extraStatistics.framesLSOSegmentsDropped);
     DPrintf(0, "[Diag!] Rx frames %I64u, Rx.Pri %d, RxHwCS.OK %d, FiltOut %d\n",
         totalRxFrames, pContext->extraStatistics.framesRxPriority,
         pContext->extraStatistics.framesRxCSHwOK, pContext->extraStatistics.framesFilteredOut);
@@ -512,12 +515,33 @@ VOID InitializeRSCState(PPARANDIS_ADAPTER pContext)
             virtio_is_feature_enabled(pContext->u64HostFeatures, VIRTIO_NET_F_GUEST_TSO6);
     }
 
+#if !defined(NETKVM_COPY_RX_DATA)
+    // without guest TSO the segments are coalesced by the driver,
+    // see ParaNdis_CoalesceReceivedPacket. Like software LSO this
+    // leaves the HW flags alone, the OID layer reports either of them.
+    pContext->RSC.bIPv4SWCoalescing = pContext->RSC.bIPv4SupportedSW && !pContext->RSC.bIPv4SupportedHW;
+    pContext->RSC.bIPv6SWCoalescing = pContext->RSC.bIPv6SupportedSW && !pContext->RSC.bIPv6SupportedHW;
+
+    if(pContext->RSC.bIPv4SWCoalescing)
+    {
+        pContext->RSC.bIPv4Enabled = TRUE;
+    }
+
+    if(pContext->RSC.bIPv6SWCoalescing)
+    {
+        pContext->RSC.bIPv6Enabled = TRUE;
+    }
+#endif
+
     pContext->RSC.bHasDynamicConfig = bDynamicOffloadsPossible;
     pContext->RSC.bQemuSupported = bQemuRscSupport;
 
     DPrintf(0, "[%s] Guest TSO state: IP4=%d, IP6=%d, Dynamic=%d\n", __FUNCTION__,
         pContext->RSC.bIPv4Enabled, pContext->RSC.bIPv6Enabled, pContext->RSC.bHasDynamicConfig);
 
+    DPrintf(0, "[%s] Software coalescing: IP4=%d, IP6=%d\n", __FUNCTION__,
+        pContext->RSC.bIPv4SWCoalescing, pContext->RSC.bIPv6SWCoalescing);
+
     DPrintf(0, "[%s] Guest QEMU RSC support state: %sresent\n", __FUNCTION__,
         pContext->RSC.bQemuSupported ? "P" : "Not p");
 #else
@@ -792,6 +816,9 @@ NDIS_STATUS ParaNdis_InitializeContext(
 
         pContext->bUseMergedBuffers = AckFeature(pContext, VIRTIO_NET_F_MRG_RXBUF);
         pContext->nVirtioHeaderSize = (pContext->bUseMergedBuffers) ? sizeof(virtio_net_hdr_mrg_rxbuf) : sizeof(virtio_net_hdr);
+        // the device spreads large frames over several buffers, so the ring
+        // does not need to hold buffers of maximal frame size
+        pContext->bRxPageBuffers = pContext->bUseMergedBuffers;
         AckFeature(pContext, VIRTIO_RING_F_EVENT_IDX);
     }
     else
@@ -872,18 +899,38 @@ NDIS_STATUS ParaNdis_InitializeContext(
     // configuration of offload tasks
     ParaNdis_ResetOffloadSettings(pContext, NULL, NULL);
 
+    pContext->bUseIndirect = AckFeature(pContext, VIRTIO_RING_F_INDIRECT_DESC);
+    pContext->bAnyLayout = AckFeature(pContext, VIRTIO_F_ANY_LAYOUT);
+
+    // without host TSO the TX path splits large sends into MSS frames itself,
+    // each one takes a single ring slot and gets its TCP checksum from the host,
+    // so VIRTIO_NET_F_CSUM is acked only when segmenting in the driver
     if (pContext->Offload.flags.fTxLso && !AckFeature(pContext, VIRTIO_NET_F_HOST_TSO4))
     {
-        DisableLSOv4Permanently(pContext, __FUNCTION__, "Host does not support TSOv4\n");
+        if (pContext->bUseIndirect && AckFeature(pContext, VIRTIO_NET_F_CSUM))
+        {
+            DPrintf(0, "[%s] Host does not support TSOv4, segmenting in the driver\n", __FUNCTION__);
+            pContext->bSWLSOv4 = true;
+        }
+        else
+        {
+            DisableLSOv4Permanently(pContext, __FUNCTION__, "Host does not support TSOv4\n");
+        }
     }
 
     if (pContext->Offload.flags.fTxLsov6 && !AckFeature(pContext, VIRTIO_NET_F_HOST_TSO6))
     {
-        DisableLSOv6Permanently(pContext, __FUNCTION__, "Host does not support TSOv6");
+        if (pContext->bUseIndirect && AckFeature(pContext, VIRTIO_NET_F_CSUM))
+        {
+            DPrintf(0, "[%s] Host does not support TSOv6, segmenting in the driver\n", __FUNCTION__);
+            pContext->bSWLSOv6 = true;
+        }
+        else
+        {
+            DisableLSOv6Permanently(pContext, __FUNCTION__, "Host does not support TSOv6");
+        }
     }
 
-    pContext->bUseIndirect = AckFeature(pContext, VIRTIO_RING_F_INDIRECT_DESC);
-    pContext->bAnyLayout = AckFeature(pContext, VIRTIO_F_ANY_LAYOUT);
     if (AckFeature(pContext, VIRTIO_F_VERSION_1))
     {
         pContext->nVirtioHeaderSize = pContext->bHashReportedByDevice ?
@@ -895,6 +942,9 @@ NDIS_STATUS ParaNdis_InitializeContext(
         {
             DPrintf(0, "[%s] Using PACKED ring\n", __FUNCTION__);
         }
+        // every notification follows a kick_prepare or kick_always, which
+        // capture the doorbell value under the queue lock
+        AckFeature(pContext, VIRTIO_F_NOTIFICATION_DATA);
     }
 
     if (pContext->bControlQueueSupported)
@@ -1130,9 +1180,10 @@ void ParaNdis_DeviceConfigureRSC(PARANDIS_ADAPTER *pContext)
 #if PARANDIS_SUPPORT_RSC
     UINT64 GuestOffloads;
 
+    // versions coalesced by the driver were not negotiated with the device
     GuestOffloads = 1 << VIRTIO_NET_F_GUEST_CSUM |
-        ((pContext->RSC.bIPv4Enabled) ? (1 << VIRTIO_NET_F_GUEST_TSO4) : 0) |
-        ((pContext->RSC.bIPv6Enabled) ? (1 << VIRTIO_NET_F_GUEST_TSO6) : 0) |
+        ((pContext->RSC.bIPv4Enabled && !pContext->RSC.bIPv4SWCoalescing) ? (1 << VIRTIO_NET_F_GUEST_TSO4) : 0) |
+        ((pContext->RSC.bIPv6Enabled && !pContext->RSC.bIPv6SWCoalescing) ? (1 << VIRTIO_NET_F_GUEST_TSO6) : 0) |
         ((pContext->RSC.bQemuSupported) ? (1LL << VIRTIO_NET_F_RSC_EXT) : 0);
 
     if (pContext->RSC.bHasDynamicConfig)
@@ -1352,6 +1403,10 @@ Parameters:
 ***********************************************************/
 static VOID ParaNdis_CleanupContext(PARANDIS_ADAPTER *pContext)
 {
+#if PARANDIS_SUPPORT_RSS
+    ParaNdis6_RSSStopDeviceSteering(pContext);
+#endif
+
     /* disable any interrupt generation */
     if (pContext->bDeviceInitialized)
     {
@@ -1537,7 +1592,8 @@ static void ProcessReceiveQueue(PARANDIS_ADAPTER *pContext,
                                 PPARANDIS_RECEIVE_QUEUE pTargetReceiveQueue,
                                 PNET_BUFFER_LIST *indicate,
                                 PNET_BUFFER_LIST *indicateTail,
-                                ULONG *nIndicate)
+                                ULONG *nIndicate,
+                                PRSC_SW_CONTEXT pRsc)
 {
     pRxNetDescriptor pBufferDescriptor;
 
@@ -1555,6 +1611,16 @@ static void ProcessReceiveQueue(PARANDIS_ADAPTER *pContext,
             if(packet != NULL)
             {
                 UpdateReceiveSuccessStatistics(pContext, pPacketInfo, nCoalescedSegmentsCount);
+#if PARANDIS_SUPPORT_RSC
+                // the segment now belongs to an NBL already in the list
+                if (ParaNdis_CoalesceReceivedPacket(pContext, pRsc, packet))
+                {
+                    (*pnPacketsToIndicateLeft)--;
+                    continue;
+                }
+#else
+                UNREFERENCED_PARAMETER(pRsc);
+#endif
                 if (*indicate == nullptr)
                 {
                     *indicate = *indicateTail = packet;
@@ -1614,12 +1680,16 @@ BOOLEAN RxDPCWorkBody(PARANDIS_ADAPTER *pContext, CPUPathBundle *pathBundle, ULO
     bool rxPathOwner = false;
     PNET_BUFFER_LIST indicate, indicateTail;
     ULONG nIndicate;
+    RSC_SW_CONTEXT rsc;
 
     CCHAR CurrCpuReceiveQueue = GetReceiveQueueForCurrentCPU(pContext);
 
     indicate = nullptr;
     indicateTail = nullptr;
     nIndicate = 0;
+    rsc.nSessions = 0;
+    rsc.nNextVictim = 0;
+    rsc.nCoalescedPkts = rsc.nCoalescedOctets = rsc.nCoalesceEvents = 0;
 
     /* pathBundle is passed from ParaNdis_DPCWorkBody and may be NULL
     if case DPC handler is scheduled by RSS to the CPU with
@@ -1633,7 +1703,7 @@ BOOLEAN RxDPCWorkBody(PARANDIS_ADAPTER *pContext, CPUPathBundle *pathBundle, ULO
         if (rxPathOwner)
         {
             ProcessReceiveQueue(pContext, &nPacketsToIndicate, &pathBundle->rxPath.UnclassifiedPacketsQueue(),
-                                &indicate, &indicateTail, &nIndicate);
+                                &indicate, &indicateTail, &nIndicate, &rsc);
         }
     }
 
@@ -1641,11 +1711,15 @@ BOOLEAN RxDPCWorkBody(PARANDIS_ADAPTER *pContext, CPUPathBundle *pathBundle, ULO
     if (CurrCpuReceiveQueue != PARANDIS_RECEIVE_NO_QUEUE)
     {
         ProcessReceiveQueue(pContext, &nPacketsToIndicate, &pContext->ReceiveQueues[CurrCpuReceiveQueue],
-                            &indicate, &indicateTail, &nIndicate);
+                            &indicate, &indicateTail, &nIndicate, &rsc);
         res |= ReceiveQueueHasBuffers(&pContext->ReceiveQueues[CurrCpuReceiveQueue]);
     }
 #endif
 
+#if PARANDIS_SUPPORT_RSC
+    ParaNdis_CoalesceComplete(pContext, &rsc);
+#endif
+
     if (nIndicate)
     {
         if(pContext->m_RxStateMachine.RegisterOutstandingItems(nIndicate))
@@ -1685,6 +1759,17 @@ void ParaNdis_ReuseRxNBLs(PNET_BUFFER_LIST pNBL)
         pNBL = NET_BUFFER_LIST_NEXT_NBL(pNBL);
         NET_BUFFER_LIST_NEXT_NBL(pTemp) = NULL;
         NdisFreeNetBufferList(pTemp);
+#if PARANDIS_SUPPORT_RSC
+        // segments coalesced into the NBL, each one may come from another queue
+        while (pBuffersDescriptor->CoalescedNext != NULL)
+        {
+            pRxNetDescriptor pCoalesced = pBuffersDescriptor->CoalescedNext;
+
+            pBuffersDescriptor->CoalescedNext = pCoalesced->CoalescedNext;
+            pCoalesced->CoalescedNext = NULL;
+            pCoalesced->Queue->ReuseReceiveBuffer(pCoalesced);
+        }
+#endif
         pBuffersDescriptor->Queue->ReuseReceiveBuffer(pBuffersDescriptor);
     }
 }
@@ -1754,7 +1839,7 @@ bool ParaNdis_RXTXDPCWorkBody(PARANDIS_ADAPTER *pContext, ULONG ulMaxPacketsToIn
             stillRequiresProcessing = true;
         }
 
-        if (pathBundle != nullptr && pathBundle->txPath.DoPendingTasks(nullptr))
+        if (pathBundle != nullptr && pathBundle->txPath.DoPendingTasks(true))
         {
             stillRequiresProcessing = true;
         }
@@ -57,6 +57,21 @@ error_exit:
     return FALSE;
 }
 
+#if PARANDIS_SUPPORT_RSC
+static BOOLEAN ParaNdis_AllocateRxCoalesceMdl(PARANDIS_ADAPTER *pContext, pRxNetDescriptor p)
+{
+    if (!pContext->RSC.bIPv4SWCoalescing && !pContext->RSC.bIPv6SWCoalescing)
+        return TRUE;
+
+    // rebuilt over the indicated part of the buffer for every coalesced NBL
+    p->CoalesceMdl = NdisAllocateMdl(
+        pContext->MiniportHandle,
+        p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual,
+        p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size);
+    return p->CoalesceMdl != NULL;
+}
+#endif
+
 static void ParaNdis_FreeRxBufferDescriptor(PARANDIS_ADAPTER *pContext, pRxNetDescriptor p)
 {
     ULONG i;
@@ -67,6 +82,14 @@ static void ParaNdis_FreeRxBufferDescriptor(PARANDIS_ADAPTER *pContext, pRxNetDe
         ParaNdis_FreePhysicalMemory(pContext, &p->PhysicalPages[i]);
     }
 
+    if (p->ContinuationMdl) NdisFreeMdl(p->ContinuationMdl);
+#if PARANDIS_SUPPORT_RSC
+    if (p->CoalesceMdl)
+    {
+        MmPrepareMdlForReuse(p->CoalesceMdl);
+        NdisFreeMdl(p->CoalesceMdl);
+    }
+#endif
     if (p->BufferSGArray) NdisFreeMemory(p->BufferSGArray, 0, 0);
     if (p->PhysicalPages) NdisFreeMemory(p->PhysicalPages, 0, 0);
     NdisFreeMemory(p, 0, 0);
@@ -94,6 +117,8 @@ bool CParaNdisRX::Create(PPARANDIS_ADAPTER Context, UINT DeviceQueueIndex)
         return false;
     }
 
+    m_nMaxMergedBuffers = m_Context->MaxPacketSize.nMaxDataSizeHwRx / PAGE_SIZE + 2;
+
     PrepareReceiveBuffers();
 
     m_nReusedRxBuffersLimit = m_Context->NetMaxReceiveBuffers / 4 + 1;
@@ -136,6 +161,11 @@ int CParaNdisRX::PrepareReceiveBuffers()
 
 pRxNetDescriptor CParaNdisRX::CreateRxDescriptorOnInit()
 {
+    if (m_Context->bRxPageBuffers)
+    {
+        return CreateRxPageDescriptorOnInit();
+    }
+
     //For RX packets we allocate following pages
     //  1 page for virtio header and indirect buffers array
     //  X pages needed to fit maximal length buffer of data
@@ -192,6 +222,73 @@ pRxNetDescriptor CParaNdisRX::CreateRxDescriptorOnInit()
     if (!ParaNdis_BindRxBufferToPacket(m_Context, p))
         goto error_exit;
 
+#if PARANDIS_SUPPORT_RSC
+    if (!ParaNdis_AllocateRxCoalesceMdl(m_Context, p))
+        goto error_exit;
+#endif
+
+    return p;
+
+error_exit:
+    ParaNdis_FreeRxBufferDescriptor(m_Context, p);
+    return NULL;
+}
+
+pRxNetDescriptor CParaNdisRX::CreateRxPageDescriptorOnInit()
+{
+    //With mergeable buffers every RX descriptor is a single page
+    //  The virtio header and the beginning of the frame share the first buffer
+    //  of a frame, larger frames continue from the start of the next buffers
+    //  PhysicalPages[0] is the page, the following entries describe the data
+    //  of the frame when the buffer is the first one, see MergeRxBuffer
+    ULONG ulHeaderSize = m_Context->nVirtioHeaderSize;
+
+    pRxNetDescriptor p = (pRxNetDescriptor)ParaNdis_AllocateMemory(m_Context, sizeof(*p));
+    if (p == NULL) return NULL;
+
+    NdisZeroMemory(p, sizeof(*p));
+
+    p->BufferSGArray = (struct VirtIOBufferDescriptor *)
+        ParaNdis_AllocateMemory(m_Context, sizeof(*p->BufferSGArray));
+    if (p->BufferSGArray == NULL) goto error_exit;
+
+    p->PhysicalPages = (tCompletePhysicalAddress *)
+        ParaNdis_AllocateMemory(m_Context,
+            sizeof(*p->PhysicalPages) * (PARANDIS_FIRST_RX_DATA_PAGE + m_nMaxMergedBuffers));
+    if (p->PhysicalPages == NULL) goto error_exit;
+
+    if (!ParaNdis_InitialAllocatePhysicalMemory(m_Context, PAGE_SIZE, &p->PhysicalPages[0]))
+        goto error_exit;
+
+    p->BufferSGLength = 1;
+    p->BufferSGArray[0].physAddr = p->PhysicalPages[0].Physical;
+    p->BufferSGArray[0].length = PAGE_SIZE;
+
+    p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual = RtlOffsetToPointer(p->PhysicalPages[0].Virtual, ulHeaderSize);
+    p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Physical.QuadPart = p->PhysicalPages[0].Physical.QuadPart + ulHeaderSize;
+    p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size = PAGE_SIZE - ulHeaderSize;
+
+    //No room for an indirect area, the single buffer does not need one
+
+    p->Holder = NdisAllocateMdl(
+        m_Context->MiniportHandle,
+        p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual,
+        p->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size);
+    if (p->Holder == NULL) goto error_exit;
+    NDIS_MDL_LINKAGE(p->Holder) = NULL;
+
+    p->ContinuationMdl = NdisAllocateMdl(
+        m_Context->MiniportHandle,
+        p->PhysicalPages[0].Virtual,
+        PAGE_SIZE);
+    if (p->ContinuationMdl == NULL) goto error_exit;
+    NDIS_MDL_LINKAGE(p->ContinuationMdl) = NULL;
+
+#if PARANDIS_SUPPORT_RSC
+    if (!ParaNdis_AllocateRxCoalesceMdl(m_Context, p))
+        goto error_exit;
+#endif
+
     return p;
 
 error_exit:
@@ -224,6 +321,24 @@ void CParaNdisRX::ReuseReceiveBufferNoLock(pRxNetDescriptor pBuffersDescriptor)
 {
     DEBUG_ENTRY(4);
 
+    // the buffers a frame continued in go back to the ring with its first one
+    if (pBuffersDescriptor->MergedNext != NULL)
+    {
+        pRxNetDescriptor pNext = pBuffersDescriptor->MergedNext;
+
+        pBuffersDescriptor->MergedNext = NULL;
+        NDIS_MDL_LINKAGE(pBuffersDescriptor->Holder) = NULL;
+        while (pNext != NULL)
+        {
+            pRxNetDescriptor pThis = pNext;
+
+            pNext = pThis->MergedNext;
+            pThis->MergedNext = NULL;
+            NDIS_MDL_LINKAGE(pThis->ContinuationMdl) = NULL;
+            ReuseReceiveBufferNoLock(pThis);
+        }
+    }
+
     if (!m_Reinsert)
     {
         InsertTailList(&m_NetReceiveBuffers, &pBuffersDescriptor->listEntry);
@@ -262,6 +377,105 @@ VOID CParaNdisRX::KickRXRing()
     m_VirtQueue.Kick();
 }
 
+/* Collects the page-sized buffers of one frame as the device returns them.
+   Returns the first buffer of the frame with all the others chained to it
+   once the last one arrives, NULL until then or if the frame is dropped.
+   Must be called under m_Lock */
+pRxNetDescriptor CParaNdisRX::MergeRxBuffer(pRxNetDescriptor pBufferDescriptor,
+    unsigned int nLength, unsigned int *pnFullLength)
+{
+    ULONG ulHeaderSize = m_Context->nVirtioHeaderSize;
+    pRxNetDescriptor pHead;
+    ULONG ulPageDescIndex;
+
+    if (m_pMergeHead == NULL)
+    {
+        virtio_net_hdr_mrg_rxbuf *pHeader = (virtio_net_hdr_mrg_rxbuf *)pBufferDescriptor->PhysicalPages[0].Virtual;
+        UINT nBuffers = pHeader->num_buffers;
+
+        pBufferDescriptor->MergedNext = NULL;
+        NDIS_MDL_LINKAGE(pBufferDescriptor->Holder) = NULL;
+
+        if (nLength < ulHeaderSize || nBuffers == 0)
+        {
+            DPrintf(0, "[%s] ERROR: bad first buffer, length %d, %d buffers\n", __FUNCTION__, nLength, nBuffers);
+            ReuseReceiveBufferNoLock(pBufferDescriptor);
+            m_Context->Statistics.ifInErrors++;
+            m_Context->Statistics.ifInDiscards++;
+            return NULL;
+        }
+
+        // the last buffer of a frame is described with its full capacity,
+        // the packet may need to be padded to the minimal length
+        pBufferDescriptor->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual =
+            RtlOffsetToPointer(pBufferDescriptor->PhysicalPages[0].Virtual, ulHeaderSize);
+        pBufferDescriptor->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Physical.QuadPart =
+            pBufferDescriptor->PhysicalPages[0].Physical.QuadPart + ulHeaderSize;
+        pBufferDescriptor->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size =
+            (nBuffers == 1) ? PAGE_SIZE - ulHeaderSize : nLength - ulHeaderSize;
+
+        m_pMergeHead = m_pMergeTail = pBufferDescriptor;
+        m_nMergeBuffers = 1;
+        m_nMergeBuffersLeft = nBuffers - 1;
+        m_nMergeLength = nLength;
+        m_bMergeDrop = nBuffers > m_nMaxMergedBuffers;
+    }
+    else
+    {
+        pHead = m_pMergeHead;
+        pBufferDescriptor->MergedNext = NULL;
+        NDIS_MDL_LINKAGE(pBufferDescriptor->ContinuationMdl) = NULL;
+
+        if (!m_bMergeDrop)
+        {
+            ulPageDescIndex = PARANDIS_FIRST_RX_DATA_PAGE + m_nMergeBuffers;
+            pHead->PhysicalPages[ulPageDescIndex] = pBufferDescriptor->PhysicalPages[0];
+            pHead->PhysicalPages[ulPageDescIndex].size = (m_nMergeBuffersLeft == 1) ? PAGE_SIZE : nLength;
+
+            NDIS_MDL_LINKAGE(m_pMergeTail == pHead ? pHead->Holder : m_pMergeTail->ContinuationMdl) =
+                pBufferDescriptor->ContinuationMdl;
+        }
+
+        m_pMergeTail->MergedNext = pBufferDescriptor;
+        m_pMergeTail = pBufferDescriptor;
+        m_nMergeBuffers++;
+        m_nMergeBuffersLeft--;
+        m_nMergeLength += nLength;
+    }
+
+    if (m_nMergeBuffersLeft > 0)
+    {
+        return NULL;
+    }
+
+    pHead = m_pMergeHead;
+    m_pMergeHead = m_pMergeTail = NULL;
+
+    if (m_bMergeDrop)
+    {
+        DPrintf(0, "[%s] ERROR: frame spans more than %d buffers\n", __FUNCTION__, m_nMaxMergedBuffers);
+        ReuseReceiveBufferNoLock(pHead);
+        m_Context->Statistics.ifInErrors++;
+        m_Context->Statistics.ifInDiscards++;
+        return NULL;
+    }
+
+    *pnFullLength = m_nMergeLength;
+    return pHead;
+}
+
+/* Returns the buffers of a partially received frame, under m_Lock */
+void CParaNdisRX::DropMergedPacket()
+{
+    pRxNetDescriptor pHead = m_pMergeHead;
+
+    if (pHead != NULL)
+    {
+        m_pMergeHead = m_pMergeTail = NULL;
+        ReuseReceiveBufferNoLock(pHead);
+    }
+}
+
 #if PARANDIS_SUPPORT_RSS
 static FORCEINLINE VOID ParaNdis_QueueRSSDpc(PARANDIS_ADAPTER *pContext, ULONG MessageIndex, PGROUP_AFFINITY pTargetAffinity)
 {
@@ -377,6 +591,9 @@ VOID CParaNdisRX::ProcessRxRing(CCHAR nCurrCpuReceiveQueue)
 {
     pRxNetDescriptor pBufferDescriptor;
     unsigned int nFullLength;
+    void *buffers[m_nMaxHarvestBatch];
+    unsigned int lengths[m_nMaxHarvestBatch];
+    unsigned int nBuffers;
 
 #ifndef PARANDIS_SUPPORT_RSS
     UNREFERENCED_PARAMETER(nCurrCpuReceiveQueue);
@@ -384,65 +601,80 @@ VOID CParaNdisRX::ProcessRxRing(CCHAR nCurrCpuReceiveQueue)
 
     TDPCSpinLocker autoLock(m_Lock);
 
-    while (NULL != (pBufferDescriptor = (pRxNetDescriptor)m_VirtQueue.GetBuf(&nFullLength)))
+    while (0 != (nBuffers = m_VirtQueue.GetBufs(buffers, lengths, m_nMaxHarvestBatch)))
     {
-        RemoveEntryList(&pBufferDescriptor->listEntry);
-        m_NetNofReceiveBuffers--;
+        for (unsigned int i = 0; i < nBuffers; i++)
+        {
+            pBufferDescriptor = (pRxNetDescriptor)buffers[i];
+            nFullLength = lengths[i];
 
-        BOOLEAN packetAnalysisRC;
+            RemoveEntryList(&pBufferDescriptor->listEntry);
+            m_NetNofReceiveBuffers--;
 
-        packetAnalysisRC = ParaNdis_PerformPacketAnalysis(
+            if (m_Context->bRxPageBuffers)
+            {
+                pBufferDescriptor = MergeRxBuffer(pBufferDescriptor, nFullLength, &nFullLength);
+                if (pBufferDescriptor == NULL)
+                {
+                    continue;
+                }
+            }
+
+            BOOLEAN packetAnalysisRC;
+
+            packetAnalysisRC = ParaNdis_PerformPacketAnalysis(
 #if PARANDIS_SUPPORT_RSS
-            &m_Context->RSSParameters,
+                &m_Context->RSSParameters,
 #endif
 
-            &pBufferDescriptor->PacketInfo,
-            pBufferDescriptor->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual,
-            nFullLength - m_Context->nVirtioHeaderSize);
+                &pBufferDescriptor->PacketInfo,
+                pBufferDescriptor->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].Virtual,
+                nFullLength - m_Context->nVirtioHeaderSize);
 
 
-        if (!packetAnalysisRC)
-        {
-            pBufferDescriptor->Queue->ReuseReceiveBufferNoLock(pBufferDescriptor);
-            m_Context->Statistics.ifInErrors++;
-            m_Context->Statistics.ifInDiscards++;
-            continue;
-        }
+            if (!packetAnalysisRC)
+            {
+                pBufferDescriptor->Queue->ReuseReceiveBufferNoLock(pBufferDescriptor);
+                m_Context->Statistics.ifInErrors++;
+                m_Context->Statistics.ifInDiscards++;
+                continue;
+            }
 
 #ifdef PARANDIS_SUPPORT_RSS
-        CCHAR nTargetReceiveQueueNum;
-        GROUP_AFFINITY TargetAffinity;
-        PROCESSOR_NUMBER TargetProcessor;
+            CCHAR nTargetReceiveQueueNum;
+            GROUP_AFFINITY TargetAffinity;
+            PROCESSOR_NUMBER TargetProcessor;
 
-        nTargetReceiveQueueNum = ParaNdis_GetScalingDataForPacket(
-            m_Context,
-            &pBufferDescriptor->PacketInfo,
-            &TargetProcessor);
+            nTargetReceiveQueueNum = ParaNdis_GetScalingDataForPacket(
+                m_Context,
+                &pBufferDescriptor->PacketInfo,
+                &TargetProcessor);
 
-        if (nTargetReceiveQueueNum == PARANDIS_RECEIVE_UNCLASSIFIED_PACKET)
-        {
-            ParaNdis_ReceiveQueueAddBuffer(&m_UnclassifiedPacketsQueue, pBufferDescriptor);
-            m_Context->extraStatistics.framesRSSUnclassified++;
-        }
-        else
-        {
-            ParaNdis_ReceiveQueueAddBuffer(&m_Context->ReceiveQueues[nTargetReceiveQueueNum], pBufferDescriptor);
-
-            if (nTargetReceiveQueueNum != nCurrCpuReceiveQueue)
+            if (nTargetReceiveQueueNum == PARANDIS_RECEIVE_UNCLASSIFIED_PACKET)
             {
-                ParaNdis_ProcessorNumberToGroupAffinity(&TargetAffinity, &TargetProcessor);
-                ParaNdis_QueueRSSDpc(m_Context, m_messageIndex, &TargetAffinity);
-                m_Context->extraStatistics.framesRSSMisses++;
-                LogRedirectedPacket(pBufferDescriptor);
+                ParaNdis_ReceiveQueueAddBuffer(&m_UnclassifiedPacketsQueue, pBufferDescriptor);
+                m_Context->extraStatistics.framesRSSUnclassified++;
             }
             else
             {
-                m_Context->extraStatistics.framesRSSHits++;
+                ParaNdis_ReceiveQueueAddBuffer(&m_Context->ReceiveQueues[nTargetReceiveQueueNum], pBufferDescriptor);
+
+                if (nTargetReceiveQueueNum != nCurrCpuReceiveQueue)
+                {
+                    ParaNdis_ProcessorNumberToGroupAffinity(&TargetAffinity, &TargetProcessor);
+                    ParaNdis_QueueRSSDpc(m_Context, m_messageIndex, &TargetAffinity);
+                    m_Context->extraStatistics.framesRSSMisses++;
+                    LogRedirectedPacket(pBufferDescriptor);
+                }
+                else
+                {
+                    m_Context->extraStatistics.framesRSSHits++;
+                }
             }
-        }
 #else
-       ParaNdis_ReceiveQueueAddBuffer(&m_UnclassifiedPacketsQueue, pBufferDescriptor);
+            ParaNdis_ReceiveQueueAddBuffer(&m_UnclassifiedPacketsQueue, pBufferDescriptor);
 #endif
+        }
     }
 }
 
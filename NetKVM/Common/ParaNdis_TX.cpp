@@ -168,6 +168,22 @@ bool CNBL::ParseLSO()
     return true;
 }
 
+bool CNBL::IsSWLSO()
+{
+    if (!IsLSO())
+    {
+        return false;
+    }
+
+    if (m_LsoInfo.LsoV2Transmit.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE &&
+        m_LsoInfo.LsoV2Transmit.IPVersion == NDIS_TCP_LARGE_SEND_OFFLOAD_IPv6)
+    {
+        return m_Context->bSWLSOv6 != FALSE;
+    }
+
+    return m_Context->bSWLSOv4 != FALSE;
+}
+
 template <typename TClassPred, typename TOffloadPred, typename TSupportedPred>
 bool CNBL::ParseCSO(TClassPred IsClass, TOffloadPred IsOffload,
                     TSupportedPred IsSupported, LPSTR OffloadName)
@@ -352,6 +368,10 @@ void CParaNdisTX::Send(PNET_BUFFER_LIST NBL)
         return;
     }
 
+    // NBLs mapped synchronously are only queued here and submitted together
+    // below, under one lock acquisition and with one kick
+    m_SendersMapping.AddRef();
+
     for(auto currNBL = NBL; currNBL != nullptr; currNBL = nextNBL)
     {
         nextNBL = NET_BUFFER_LIST_NEXT_NBL(currNBL);
@@ -385,6 +405,13 @@ void CParaNdisTX::Send(PNET_BUFFER_LIST NBL)
             NBLHolder->Release();
         }
     }
+
+    m_SendersMapping.Release();
+
+    if (HaveMappedNBLs() && m_DpcWaiting == 0)
+    {
+        DoPendingTasks(false);
+    }
 }
 
 void CParaNdisTX::NBLMappingDone(CNBL *NBLHolder)
@@ -395,9 +422,9 @@ void CParaNdisTX::NBLMappingDone(CNBL *NBLHolder)
     {
         m_SendQueue.Enqueue(NBLHolder);
 
-        if (m_DpcWaiting == 0)
+        if (m_DpcWaiting == 0 && m_SendersMapping == 0)
         {
-            DoPendingTasks(NBLHolder);
+            DoPendingTasks(false);
         }
     }
     else
@@ -678,10 +705,9 @@ void CParaNdisTX::PostProcessPendingTask(
     }
 }
 
-bool CParaNdisTX::DoPendingTasks(CNBL *nblHolder)
+bool CParaNdisTX::DoPendingTasks(bool bFromDpc)
 {
     bool bRestartQueueStatus = false;
-    bool bFromDpc = nblHolder == nullptr;
     CRawCNBList  nbToFree;
     CRawCNBLList completedNBLs;
 
@@ -828,6 +854,53 @@ void CNB::SetupCSO(virtio_net_hdr *VirtioHeader, ULONG L4HeaderOffset) const
     VirtioHeader->csum_offset = m_ParentNBL->IsTcpCSO() ? TCP_CHECKSUM_OFFSET : UDP_CHECKSUM_OFFSET;
 }
 
+void CNB::SetupSegment(virtio_net_hdr *VirtioHeader, PVOID IpHeader, ULONG Index, ULONG PayloadLength) const
+{
+    auto IpHdr = reinterpret_cast<IPHeader*>(IpHeader);
+    auto L4HeaderOffset = m_ParentNBL->TCPHeaderOffset();
+    auto TcpHdr = reinterpret_cast<TCPHeader*>(RtlOffsetToPointer(IpHeader, L4HeaderOffset - m_Context->Offload.ipHeaderOffset));
+    auto IpLength = m_SegmentHeadersLength - m_Context->Offload.ipHeaderOffset + PayloadLength;
+
+    if ((IpHdr->v4.ip_verlen & 0xF0) == 0x40)
+    {
+        IpHdr->v4.ip_length = swap_short(static_cast<USHORT>(IpLength));
+        IpHdr->v4.ip_id = swap_short(static_cast<USHORT>(swap_short(IpHdr->v4.ip_id) + Index));
+    }
+    else if ((IpHdr->v6.ip6_ver_tc & 0xF0) == 0x60)
+    {
+        IpHdr->v6.ip6_payload_len = swap_short(static_cast<USHORT>(IpLength - IPV6_HEADER_MIN_SIZE));
+    }
+
+    TcpHdr->tcp_seq = RtlUlongByteSwap(RtlUlongByteSwap(TcpHdr->tcp_seq) + Index * m_ParentNBL->MSS());
+    if (Index != 0)
+    {
+        TcpHdr->tcp_flags &= ~TCP_FLAG_CWR;
+    }
+    if (Index + 1 != m_SegmentsNumber)
+    {
+        TcpHdr->tcp_flags &= ~(TCP_FLAG_FIN | TCP_FLAG_PSH);
+    }
+
+    *VirtioHeader = {};
+
+    // the buffer holds the headers only, so just the pseudo-header
+    // checksum is placed and the host completes the rest
+    tTcpIpPacketParsingResult packetReview;
+    packetReview = ParaNdis_CheckSumVerifyFlat(IpHeader, IpLength,
+                                               pcrIpChecksum | pcrFixIPChecksum | pcrTcpChecksum | pcrFixPHChecksum,
+                                               FALSE,
+                                               __FUNCTION__);
+
+    if (packetReview.xxpCheckSum == ppresPCSOK || packetReview.fixedXxpCS)
+    {
+        u16 PriorityHdrLen = m_ParentNBL->TCI() ? ETH_PRIORITY_HEADER_SIZE : 0;
+
+        VirtioHeader->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        VirtioHeader->csum_start = static_cast<u16>(L4HeaderOffset) + PriorityHdrLen;
+        VirtioHeader->csum_offset = TCP_CHECKSUM_OFFSET;
+    }
+}
+
 void CNB::DoIPHdrCSO(PVOID IpHeader, ULONG EthPayloadLength) const
 {
     ParaNdis_CheckSumVerifyFlat(IpHeader,
@@ -842,20 +915,22 @@ bool CNB::FillDescriptorSGList(CTXDescriptor &Descriptor, ULONG ParsedHeadersLen
            MapDataToVirtioSGL(Descriptor, ParsedHeadersLength + NET_BUFFER_DATA_OFFSET(m_NB));
 }
 
-bool CNB::MapDataToVirtioSGL(CTXDescriptor &Descriptor, ULONG Offset) const
+bool CNB::MapDataToVirtioSGL(CTXDescriptor &Descriptor, ULONG Offset, ULONG Length) const
 {
-    for (ULONG i = 0; i < m_SGL->NumberOfElements; i++)
+    for (ULONG i = 0; i < m_SGL->NumberOfElements && Length != 0; i++)
     {
         if (Offset < m_SGL->Elements[i].Length)
         {
             PHYSICAL_ADDRESS PA;
             PA.QuadPart = m_SGL->Elements[i].Address.QuadPart + Offset;
+            ULONG ChunkLength = min(m_SGL->Elements[i].Length - Offset, Length);
 
-            if (!Descriptor.AddDataChunk(PA, m_SGL->Elements[i].Length - Offset))
+            if (!Descriptor.AddDataChunk(PA, ChunkLength))
             {
                 return false;
             }
 
+            Length -= ChunkLength;
             Offset = 0;
         }
         else
@@ -955,6 +1030,70 @@ bool CNB::BindToDescriptor(CTXDescriptor &Descriptor)
     return FillDescriptorSGList(Descriptor, HeadersLength);
 }
 
+bool CNB::BindSegmentToDescriptor(CTXDescriptor &Descriptor, ULONG Index)
+{
+    if (m_SGL == nullptr)
+    {
+        return false;
+    }
+
+    Descriptor.SetNB(this);
+
+    auto &HeadersArea = Descriptor.HeadersAreaAccessor();
+    auto EthHeaders = HeadersArea.EthHeadersAreaVA();
+    ULONG MSS = m_ParentNBL->MSS();
+
+    if (Index == 0)
+    {
+        ULONG L4HeaderOffset = m_ParentNBL->TCPHeaderOffset();
+        ULONG MaxSize = min(L4HeaderOffset + MAX_TCP_HEADER_SIZE, HeadersArea.MaxEthHeadersSize());
+        ULONG Copied = Copy(EthHeaders, min(MaxSize, GetDataLength()));
+
+        if (MSS == 0 || Copied < L4HeaderOffset + sizeof(TCPHeader))
+        {
+            DPrintf(0, "[%s] ERROR: can't segment NB %p (MSS %d)\n", __FUNCTION__, m_NB, MSS);
+            return false;
+        }
+
+        // TCP options are replicated into every segment
+        auto TcpHdr = reinterpret_cast<TCPHeader*>(RtlOffsetToPointer(EthHeaders, L4HeaderOffset));
+        m_SegmentHeadersLength = L4HeaderOffset + TCP_HEADER_LENGTH(TcpHdr);
+
+        if (m_SegmentHeadersLength < L4HeaderOffset + sizeof(TCPHeader) ||
+            m_SegmentHeadersLength > Copied)
+        {
+            DPrintf(0, "[%s] ERROR: bad TCP header in NB %p\n", __FUNCTION__, m_NB);
+            return false;
+        }
+
+        auto PayloadLength = GetDataLength() - m_SegmentHeadersLength;
+        m_SegmentsNumber = PayloadLength ? (PayloadLength + MSS - 1) / MSS : 1;
+    }
+    else
+    {
+        Copy(EthHeaders, m_SegmentHeadersLength);
+    }
+
+    auto SegmentOffset = Index * MSS;
+    auto SegmentLength = min(MSS, GetDataLength() - m_SegmentHeadersLength - SegmentOffset);
+
+    BuildPriorityHeader(HeadersArea.EthHeader(), HeadersArea.VlanHeader());
+    SetupSegment(HeadersArea.VirtioHeader(), HeadersArea.IPHeaders(), Index, SegmentLength);
+
+    return Descriptor.SetupHeaders(m_SegmentHeadersLength) &&
+           MapDataToVirtioSGL(Descriptor,
+                              m_SegmentHeadersLength + NET_BUFFER_DATA_OFFSET(m_NB) + SegmentOffset,
+                              SegmentLength);
+}
+
+ULONG CNB::GetSegmentsPayload(ULONG FirstIndex) const
+{
+    auto SegmentOffset = FirstIndex * m_ParentNBL->MSS();
+    auto PayloadLength = GetDataLength() - m_SegmentHeadersLength;
+
+    return (SegmentOffset < PayloadLength) ? PayloadLength - SegmentOffset : 0;
+}
+
 ULONG CNB::Copy(PVOID Dst, ULONG Length) const
 {
     ULONG CurrOffset = NET_BUFFER_CURRENT_MDL_OFFSET(m_NB);
@@ -186,13 +186,13 @@ void CTXVirtQueue::KickQueueOnOverflow()
     }
 }
 
-void CTXVirtQueue::UpdateTXStats(const CNB &NB, CTXDescriptor &Descriptor)
+void CTXVirtQueue::UpdateTXStats(const CNB &NB, CTXDescriptor &Descriptor, ULONG UnsentBytes)
 {
     auto &HeadersArea = Descriptor.HeadersAreaAccessor();
     PVOID EthHeader = HeadersArea.EthHeader();
 
     //TODO: Statistics must be atomic
-    auto BytesSent = NB.GetDataLength();
+    auto BytesSent = NB.GetDataLength() - UnsentBytes;
     auto NBL = NB.GetParentNBL();
 
     m_Context->Statistics.ifHCOutOctets += BytesSent;
@@ -220,7 +220,7 @@ void CTXVirtQueue::UpdateTXStats(const CNB &NB, CTXDescriptor &Descriptor)
         auto EthHeaders = Descriptor.HeadersAreaAccessor().EthHeadersAreaVA();
         auto TCPHdr = reinterpret_cast<TCPHeader *>(RtlOffsetToPointer(EthHeaders, NBL->TCPHeaderOffset()));
 
-        NBL->UpdateLSOTxStats(NB.GetDataLength() - NBL->TCPHeaderOffset() - TCP_HEADER_LENGTH(TCPHdr));
+        NBL->UpdateLSOTxStats(BytesSent - NBL->TCPHeaderOffset() - TCP_HEADER_LENGTH(TCPHdr));
     }
     else if (NBL->IsTcpCSO() || NBL->IsUdpCSO())
     {
@@ -228,6 +228,80 @@ void CTXVirtQueue::UpdateTXStats(const CNB &NB, CTXDescriptor &Descriptor)
     }
 }
 
+SubmitTxPacketResult CTXVirtQueue::SubmitSegments(CNB &NB)
+{
+    auto TXDescriptor = m_Descriptors.Pop();
+    if (!NB.BindSegmentToDescriptor(*TXDescriptor, 0))
+    {
+        m_Descriptors.Push(TXDescriptor);
+        return SUBMIT_FAILURE;
+    }
+
+    // A partially sent NB can't go back to its NBL, so
+    // all the segments must fit the queue at once
+    auto Segments = NB.GetSegmentsNumber();
+    if (Segments > m_TotalDescriptors || Segments > m_TotalHWBuffers)
+    {
+        DPrintf(0, "[%s] ERROR: %d segments do not fit the queue\n", __FUNCTION__, Segments);
+        m_Descriptors.Push(TXDescriptor);
+        return SUBMIT_PACKET_TOO_LARGE;
+    }
+
+    if (m_Descriptors.GetCount() + 1 < Segments || m_FreeHWBuffers < Segments)
+    {
+        m_Descriptors.Push(TXDescriptor);
+        KickQueueOnOverflow();
+        return SUBMIT_NO_PLACE_IN_QUEUE;
+    }
+
+    auto FirstDescriptor = TXDescriptor;
+    ULONG i;
+    for (i = 0; i < Segments; i++)
+    {
+        if (i != 0)
+        {
+            TXDescriptor = m_Descriptors.Pop();
+            if (!NB.BindSegmentToDescriptor(*TXDescriptor, i))
+            {
+                m_Descriptors.Push(TXDescriptor);
+                break;
+            }
+        }
+
+        auto res = TXDescriptor->Enqueue(this, m_TotalHWBuffers, m_FreeHWBuffers);
+        if (res != SUBMIT_SUCCESS)
+        {
+            m_Descriptors.Push(TXDescriptor);
+            if (i == 0)
+            {
+                return res;
+            }
+            break;
+        }
+
+        m_FreeHWBuffers -= TXDescriptor->GetUsedBuffersNum();
+        m_DescriptorsInUse.PushBack(TXDescriptor);
+        NB.SegmentSubmitted();
+    }
+
+    ULONG UnsentBytes = 0;
+    if (i < Segments)
+    {
+        // the NB is already referenced by the ring, complete it with what was sent
+        // and account the frames that never made it to the device as errors
+        DPrintf(0, "[%s] ERROR: segments %d..%d dropped\n", __FUNCTION__, i, Segments - 1);
+        m_Context->Statistics.ifOutErrors += Segments - i;
+        m_Context->extraStatistics.framesLSOSegmentsDropped += Segments - i;
+        UnsentBytes = NB.GetSegmentsPayload(i);
+    }
+
+    // only the payload that reached the ring is reported as sent
+    UpdateTXStats(NB, *FirstDescriptor, UnsentBytes);
+
+    m_Context->extraStatistics.framesLSOSegmented++;
+    return SUBMIT_SUCCESS;
+}
+
 SubmitTxPacketResult CTXVirtQueue::SubmitPacket(CNB &NB)
 {
     if (!m_Descriptors.GetCount())
@@ -236,6 +310,11 @@ SubmitTxPacketResult CTXVirtQueue::SubmitPacket(CNB &NB)
         return SUBMIT_NO_PLACE_IN_QUEUE;
     }
 
+    if (NB.GetParentNBL()->IsSWLSO())
+    {
+        return SubmitSegments(NB);
+    }
+
     auto TXDescriptor = m_Descriptors.Pop();
     if (!NB.BindToDescriptor(*TXDescriptor))
     {
@@ -279,7 +358,10 @@ void CTXVirtQueue::ReleaseOneBuffer(CTXDescriptor *TXDescriptor, CRawCNBList& li
         DPrintf(0, "[%s] ERROR: nofUsedBuffers not set!\n", __FUNCTION__);
     }
     m_FreeHWBuffers += TXDescriptor->GetUsedBuffersNum();
-    listDone.PushBack(TXDescriptor->GetNB());
+    if (TXDescriptor->GetNB()->ReleaseSegment())
+    {
+        listDone.PushBack(TXDescriptor->GetNB());
+    }
     m_Descriptors.Push(TXDescriptor);
     DPrintf(3, "[%s] Free Tx: desc %d, buff %d\n", __FUNCTION__, m_Descriptors.GetCount(), m_FreeHWBuffers);
 }
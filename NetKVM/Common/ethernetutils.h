@@ -83,6 +83,16 @@ typedef ULONG IPV6_ADDRESS[4];
 
 #define TCP_HEADER_LENGTH(Header) ((Header->tcp_flags & 0xF0) >> 2)
 
+// TCP flags as they appear in tcp_flags read from the wire
+#define TCP_FLAG_FIN    0x0100
+#define TCP_FLAG_SYN    0x0200
+#define TCP_FLAG_RST    0x0400
+#define TCP_FLAG_PSH    0x0800
+#define TCP_FLAG_ACK    0x1000
+#define TCP_FLAG_URG    0x2000
+#define TCP_FLAG_ECE    0x4000
+#define TCP_FLAG_CWR    0x8000
+
 // IP Header RFC 791
 typedef struct _tagIPv4Header {
     UCHAR       ip_verlen;             // length in 32-bit units(low nibble), version (high nibble)
@@ -381,6 +381,19 @@ struct _tagRxNetDescriptor {
     tCompletePhysicalAddress       IndirectArea;
     tPacketHolderType              Holder;
 
+    /* page-sized buffers only: MDL of the whole page, used when the buffer
+       continues a frame started in another one, and the next buffer of the
+       frame this one starts or continues */
+    PMDL                           ContinuationMdl;
+    pRxNetDescriptor               MergedNext;
+
+#if PARANDIS_SUPPORT_RSC
+    /* software RSC only: MDL of the part of the first data buffer that
+       a coalesced NBL indicates, and the next segment coalesced into it */
+    PMDL                           CoalesceMdl;
+    pRxNetDescriptor               CoalescedNext;
+#endif
+
     NET_PACKET_INFO PacketInfo;
 
     CParaNdisRX*                   Queue;
@@ -419,10 +432,13 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
     BOOLEAN                 bGuestChecksumSupported = false;
     BOOLEAN                 bControlQueueSupported = false;
     BOOLEAN                 bUseMergedBuffers = false;
+    BOOLEAN                 bRxPageBuffers = false;
     BOOLEAN                 bSurprizeRemoved = false;
     BOOLEAN                 bUsingMSIX = false;
     BOOLEAN                 bUseIndirect = false;
     BOOLEAN                 bAnyLayout = false;
+    BOOLEAN                 bSWLSOv4 = false;
+    BOOLEAN                 bSWLSOv6 = false;
     BOOLEAN                 bCtrlRXFiltersSupported = false;
     BOOLEAN                 bCtrlRXExtraFiltersSupported = false;
     BOOLEAN                 bCtrlVLANFiltersSupported = false;
@@ -459,6 +475,8 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
     {
         ULONG framesCSOffload;
         ULONG framesLSO;
+        ULONG framesLSOSegmented;
+        ULONG framesLSOSegmentsDropped;
         ULONG framesRxPriority;
         ULONG framesRxCSHwOK;
         ULONG framesFilteredOut;
@@ -532,6 +550,8 @@ struct _PARANDIS_ADAPTER : public CNdisAllocatable<_PARANDIS_ADAPTER, 'DCTX'>
         BOOLEAN                     bIPv6SupportedHW;
         BOOLEAN                     bIPv4Enabled;
         BOOLEAN                     bIPv6Enabled;
+        BOOLEAN                     bIPv4SWCoalescing;
+        BOOLEAN                     bIPv6SWCoalescing;
         BOOLEAN                     bQemuSupported;
         BOOLEAN                     bHasDynamicConfig;
         struct {
@@ -674,6 +694,43 @@ tPacketIndicationType ParaNdis_PrepareReceivedPacket(
     pRxNetDescriptor pBufferDesc,
     PUINT            pnCoalescedSegmentsCount);
 
+#define PARANDIS_RSC_SW_SESSIONS    8
+
+/* software RSC: TCP flow whose segments are coalesced into one indicated NBL */
+typedef struct _tagRscSwSession
+{
+    PNET_BUFFER_LIST    pNBL;
+    pRxNetDescriptor    pTail;
+    PVOID               pIpHeader;
+    PVOID               pTcpHeader;
+    ULONG               ulNextSeq;
+    ULONG               ulIpLength;
+    USHORT              usSegments;
+    BOOLEAN             bIPv4;
+} RSC_SW_SESSION, *PRSC_SW_SESSION;
+
+/* software RSC: state of one DPC receive batch, the sessions end with it */
+typedef struct _tagRscSwContext
+{
+    RSC_SW_SESSION      Sessions[PARANDIS_RSC_SW_SESSIONS];
+    ULONG               nSessions;
+    ULONG               nNextVictim;
+    ULONG               nCoalescedPkts;
+    ULONG               nCoalescedOctets;
+    ULONG               nCoalesceEvents;
+} RSC_SW_CONTEXT, *PRSC_SW_CONTEXT;
+
+#if PARANDIS_SUPPORT_RSC
+BOOLEAN ParaNdis_CoalesceReceivedPacket(
+    PARANDIS_ADAPTER *pContext,
+    PRSC_SW_CONTEXT  pRsc,
+    PNET_BUFFER_LIST pNBL);
+
+VOID ParaNdis_CoalesceComplete(
+    PARANDIS_ADAPTER *pContext,
+    PRSC_SW_CONTEXT  pRsc);
+#endif
+
 BOOLEAN ParaNdis_SynchronizeWithInterrupt(
     PARANDIS_ADAPTER *pContext,
     ULONG messageId,
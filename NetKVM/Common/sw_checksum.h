@@ -0,0 +1,154 @@
+/*
+ * Raw one's complement sum kernels used by the SW checksum offload
+ *
+ * Shared between sw_offload.cpp and the host-side checker in
+ * DebugTools/Netchecksum, so it must depend only on basic Windows types.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef _SW_CHECKSUM_H
+#define _SW_CHECKSUM_H
+
+// SSE2 is part of the x64 baseline and NEON of the ARM64 one, and both
+// register files may be used in kernel mode without saving extended state
+#if defined(_WIN64) && !defined(_ARM64_)
+#include <emmintrin.h>
+#define RAW_CHECKSUM_SSE2
+#elif defined(_ARM64_)
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#define RAW_CHECKSUM_NEON
+#endif
+
+// bytes consumed by one iteration of the vector kernels
+#define RAW_CHECKSUM_BLOCK (32)
+
+// All kernels return a value congruent modulo 0xFFFF to the sum of the
+// little-endian 16-bit words of the buffer, which is all that
+// RawCheckSumFinalize needs. Raw sums of separate buffers may be added
+// together as long as every buffer but the last one has an even length.
+static __inline UINT_PTR RawCheckSumScalar(PVOID buffer, ULONG len)
+{
+    UINT_PTR val = 0;
+    PUCHAR ptr = (PUCHAR)buffer;
+#if defined(_WIN64) && !defined(_ARM64_)
+    ULONG count = len >> 2;
+    while (count--) {
+        val += *(PUINT32)ptr;
+        ptr += 4;
+    }
+    if (len & 2) {
+        val += *(PUINT16)ptr;
+        ptr += 2;
+    }
+#elif defined(_ARM64_)
+    ULONG count = len >> 1;
+    while (count--) {
+        val += ptr[0];
+        val += ptr[1] << 8;
+        ptr += 2;
+    }
+#else
+    ULONG count = len >> 1;
+    while (count--) {
+        val += *(PUINT16)ptr;
+        ptr += 2;
+    }
+#endif
+    if (len & 1) {
+        val += *ptr;
+    }
+    return val;
+}
+
+#if defined(RAW_CHECKSUM_SSE2)
+// Widens 32-bit words into 64-bit lanes, so the accumulators cannot overflow
+static __inline UINT_PTR RawCheckSumVector(PUCHAR ptr, ULONG blocks)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+
+    while (blocks--) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)ptr);
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(ptr + 16));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v0, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v0, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(v1, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(v1, zero));
+        ptr += RAW_CHECKSUM_BLOCK;
+    }
+    acc0 = _mm_add_epi64(acc0, acc1);
+    acc0 = _mm_add_epi64(acc0, _mm_srli_si128(acc0, 8));
+    return (UINT_PTR)_mm_cvtsi128_si64(acc0);
+}
+#elif defined(RAW_CHECKSUM_NEON)
+// Pairwise widens 16-bit words into 32 and then 64-bit lanes
+static __inline UINT_PTR RawCheckSumVector(PUCHAR ptr, ULONG blocks)
+{
+    uint64x2_t acc0 = vdupq_n_u64(0), acc1 = vdupq_n_u64(0);
+
+    while (blocks--) {
+        uint16x8_t v0 = vreinterpretq_u16_u8(vld1q_u8(ptr));
+        uint16x8_t v1 = vreinterpretq_u16_u8(vld1q_u8(ptr + 16));
+        acc0 = vpadalq_u32(acc0, vpaddlq_u16(v0));
+        acc1 = vpadalq_u32(acc1, vpaddlq_u16(v1));
+        ptr += RAW_CHECKSUM_BLOCK;
+    }
+    return (UINT_PTR)vaddvq_u64(vaddq_u64(acc0, acc1));
+}
+#endif
+
+static __inline UINT_PTR RawCheckSumCalculator(PVOID buffer, ULONG len)
+{
+    UINT_PTR val = 0;
+    PUCHAR ptr = (PUCHAR)buffer;
+#if defined(RAW_CHECKSUM_SSE2) || defined(RAW_CHECKSUM_NEON)
+    ULONG blocks = len / RAW_CHECKSUM_BLOCK;
+    if (blocks) {
+        val = RawCheckSumVector(ptr, blocks);
+        ptr += blocks * RAW_CHECKSUM_BLOCK;
+        len -= blocks * RAW_CHECKSUM_BLOCK;
+    }
+#endif
+    return val + RawCheckSumScalar(ptr, len);
+}
+
+static __inline USHORT RawCheckSumFinalize(UINT_PTR sum)
+{
+    UINT32 sum32;
+    UINT16 sum16;
+
+#ifdef _WIN64
+    sum32 = (((sum >> 32) | (sum << 32)) + sum) >> 32;
+#else
+    sum32 = sum;
+#endif
+    sum16 = (((sum32 >> 16) | (sum32 << 16)) + sum32) >> 16;
+    return ~sum16;
+}
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * Equivalence test and benchmark of the raw checksum kernels
+ *
+ * Checks the vector kernels of Common/sw_checksum.h against the scalar
+ * version and against a byte-wise RFC 1071 reference, on every sub-range
+ * of the packet samples of this directory and on random buffers, then
+ * measures both kernels on typical frame sizes.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <chrono>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+// Linux/GCC host build, see ReadMe.txt
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__aarch64__)
+#define _WIN64
+#endif
+#if defined(__aarch64__)
+#define _ARM64_
+#endif
+#define __inline inline
+typedef unsigned char UCHAR, *PUCHAR;
+typedef uint16_t UINT16, USHORT, *PUINT16;
+typedef uint32_t UINT32, ULONG, *PUINT32;
+typedef uintptr_t UINT_PTR;
+typedef void *PVOID;
+#endif
+
+#include "../../Common/sw_checksum.h"
+
+#define MAX_BUFFER_SIZE     (0x10000)
+#define FUZZ_ITERATIONS     (200000UL)
+#define BENCH_BYTES         (1ULL << 30)
+
+static const char *Samples[] =
+{
+    "tcp-ph.txt",
+    "tcp-short.txt",
+    "tcp-cs.txt",
+    "tcp-badcs.txt",
+    "tcpv6-cs.txt",
+    "udpv6-cs.txt",
+};
+
+// extra bytes in front allow any alignment of the tested range
+static UCHAR buf[MAX_BUFFER_SIZE + 64];
+
+// Byte-wise RFC 1071 sum of little-endian 16-bit words
+static USHORT ReferenceCheckSum(const UCHAR *ptr, ULONG len)
+{
+    unsigned long long sum = 0;
+    ULONG i;
+
+    for (i = 0; i + 1 < len; i += 2)
+    {
+        sum += ptr[i] | (ptr[i + 1] << 8);
+    }
+    if (len & 1)
+    {
+        sum += ptr[len - 1];
+    }
+    while (sum >> 16)
+    {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    // the kernels keep a non-zero sum that folds to 0xffff as 0xffff
+    return (USHORT)~sum;
+}
+
+static bool CheckRange(const UCHAR *ptr, ULONG len)
+{
+    USHORT reference = ReferenceCheckSum(ptr, len);
+    USHORT scalar = RawCheckSumFinalize(RawCheckSumScalar((PVOID)ptr, len));
+    USHORT vector = RawCheckSumFinalize(RawCheckSumCalculator((PVOID)ptr, len));
+
+    if (scalar != reference || vector != reference)
+    {
+        printf("Mismatch at %p, length %lu: reference %04X, scalar %04X, vector %04X\n",
+            ptr, (unsigned long)len, reference, scalar, vector);
+        return false;
+    }
+    return true;
+}
+
+// Same text format as netchecksum: hex byte pairs up to the first letter
+static ULONG LoadSample(const char *name, UCHAR *data)
+{
+    FILE *f = fopen(name, "rt");
+    ULONG offset = 0;
+    char s[3];
+
+    if (!f)
+    {
+        return 0;
+    }
+    while (offset < MAX_BUFFER_SIZE && fread(s, 1, 1, f) == 1)
+    {
+        if (isxdigit(s[0]) && fread(s + 1, 1, 1, f) == 1 && isxdigit(s[1]))
+        {
+            s[2] = 0;
+            data[offset++] = (UCHAR)strtoul(s, NULL, 16);
+        }
+        else if (isalpha(s[0]))
+        {
+            break;
+        }
+    }
+    fclose(f);
+    return offset;
+}
+
+static unsigned long CheckSamples()
+{
+    static UCHAR sample[MAX_BUFFER_SIZE];
+    unsigned long failed = 0;
+
+    for (size_t i = 0; i < sizeof(Samples) / sizeof(Samples[0]); ++i)
+    {
+        ULONG len = LoadSample(Samples[i], sample);
+        if (!len)
+        {
+            printf("Sample %s not found, skipped\n", Samples[i]);
+            continue;
+        }
+        for (ULONG start = 0; start < len; ++start)
+        {
+            for (ULONG end = start; end <= len; ++end)
+            {
+                for (ULONG align = 0; align < 2; ++align)
+                {
+                    memcpy(buf + align, sample + start, end - start);
+                    failed += !CheckRange(buf + align, end - start);
+                }
+            }
+        }
+        printf("Sample %-16s %5lu bytes checked\n", Samples[i], (unsigned long)len);
+    }
+    return failed;
+}
+
+static unsigned long CheckRandom()
+{
+    unsigned long failed = 0;
+
+    srand(1);
+    for (unsigned long it = 0; it < FUZZ_ITERATIONS; ++it)
+    {
+        ULONG align = rand() % 64;
+        ULONG len = (it & 1) ? rand() % 256 : (((ULONG)rand() << 15) ^ rand()) % MAX_BUFFER_SIZE;
+        int pattern = rand() % 4;
+
+        for (ULONG i = 0; i < len; ++i)
+        {
+            // all-ones and all-zero buffers exercise the carry and +0/-0 corners
+            buf[align + i] = pattern == 0 ? 0xff : pattern == 1 ? 0 : (UCHAR)rand();
+        }
+        failed += !CheckRange(buf + align, len);
+    }
+    printf("Random buffers             %lu checked\n", FUZZ_ITERATIONS);
+    return failed;
+}
+
+static void Bench(const char *name, UINT_PTR (*fn)(PVOID, ULONG), ULONG len)
+{
+    unsigned long long iterations = BENCH_BYTES / len, i;
+    UINT_PTR sum = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (i = 0; i < iterations; ++i)
+    {
+        sum += fn(buf, len);
+    }
+
+    double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    printf("  %-8s %6lu bytes  %8.1f ns/call  %6.2f GB/s  (%04X)\n", name, (unsigned long)len,
+        ns / iterations, (double)iterations * len / ns, RawCheckSumFinalize(sum));
+}
+
+static UINT_PTR ScalarKernel(PVOID buffer, ULONG len)
+{
+    return RawCheckSumScalar(buffer, len);
+}
+
+static UINT_PTR DriverKernel(PVOID buffer, ULONG len)
+{
+    return RawCheckSumCalculator(buffer, len);
+}
+
+int main(int argc, char **argv)
+{
+    static const ULONG sizes[] = { 20, 64, 576, 1500, 4096, 9000, 65535 };
+    unsigned long failed;
+
+#if defined(RAW_CHECKSUM_SSE2)
+    printf("Vector kernel: SSE2\n");
+#elif defined(RAW_CHECKSUM_NEON)
+    printf("Vector kernel: NEON\n");
+#else
+    printf("Vector kernel: none, checking the scalar kernel only\n");
+#endif
+
+    failed = CheckSamples();
+    failed += CheckRandom();
+
+    if (argc < 2 || strcmp(argv[1], "-n"))
+    {
+        for (ULONG i = 0; i < MAX_BUFFER_SIZE; ++i)
+        {
+            buf[i] = (UCHAR)rand();
+        }
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+        {
+            Bench("scalar", ScalarKernel, sizes[i]);
+            Bench("driver", DriverKernel, sizes[i]);
+        }
+    }
+
+    printf("Test %s\n", failed ? "FAILED" : "PASSED");
+    return failed ? -1 : 0;
+}
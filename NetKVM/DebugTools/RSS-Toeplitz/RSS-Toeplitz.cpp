@@ -3,6 +3,7 @@
 
 #include "stdafx.h"
 #include "WinToeplitz.h"
+#include <stdlib.h>
 
 
 static uint8_t testKey[WTEP_MAX_KEY_SIZE] = {
@@ -30,6 +31,47 @@ static struct
 };
 
 #define ITERATIONS_NUMBER (1000000UL)
+#define PARITY_KEYS_NUMBER (64UL)
+#define PARITY_INPUTS_NUMBER (10000UL)
+
+// Compares the table engine with the bit-serial reference for random keys
+// and random inputs up to the IPv6 4-tuple length, split at random points
+static unsigned long CheckTableParity()
+{
+    unsigned long numFailed = 0;
+    uint8_t key[WTEP_MAX_KEY_SIZE];
+    uint8_t input[WTEP_MAX_INPUT_SIZE];
+
+    srand(1);
+    for (unsigned long k = 0; k < PARITY_KEYS_NUMBER; ++k)
+    {
+        for (int i = 0; i < sizeof(key); ++i) key[i] = (uint8_t)rand();
+        toeplitzw_build_table(key);
+
+        for (unsigned long it = 0; it < PARITY_INPUTS_NUMBER; ++it)
+        {
+            HASH_CALC_SG_BUF_ENTRY sgBuffer[3];
+            ULONG len = 1 + rand() % sizeof(input);
+            ULONG split1 = rand() % (len + 1);
+            ULONG split2 = split1 + rand() % (len - split1 + 1);
+
+            for (ULONG i = 0; i < len; ++i) input[i] = (uint8_t)rand();
+            sgBuffer[0].chunkPtr = input;
+            sgBuffer[0].chunkLen = split1;
+            sgBuffer[1].chunkPtr = input + split1;
+            sgBuffer[1].chunkLen = split2 - split1;
+            sgBuffer[2].chunkPtr = input + split2;
+            sgBuffer[2].chunkLen = len - split2;
+
+            if (ToeplitzHash(sgBuffer, 3, key) != ToeplitzHashTable(sgBuffer, 3))
+            {
+                ++numFailed;
+                printf("Table calculation differs for key %lu, input length %lu\n", k, len);
+            }
+        }
+    }
+    return numFailed;
+}
 
 int _tmain(int argc, _TCHAR* argv[])
 {
@@ -40,7 +82,9 @@ int _tmain(int argc, _TCHAR* argv[])
     unsigned long numFailedTCP = 0;
     unsigned long numSuccessfulIP = 0;
     unsigned long numFailedIP = 0;
-    ULONGLONG StartTickCount, FinishTickCount;
+    unsigned long numFailedTable = 0;
+    unsigned long numFailedParity;
+    ULONGLONG StartTickCount, FinishTickCount, TableTickCount;
 
     toeplitzw_initialize(testKey, sizeof(testKey));
 
@@ -96,14 +140,55 @@ int _tmain(int argc, _TCHAR* argv[])
 
     FinishTickCount = GetTickCount64();
 
+    toeplitzw_build_table(workingkey);
+
+    for (unsigned long it = 0; it < ITERATIONS_NUMBER; ++it)
+    {
+        for (i = 0; i < sizeof(testData)/sizeof(testData[0]); ++i)
+        {
+            HASH_CALC_SG_BUF_ENTRY sgBuffer[2];
+
+            vector[0] = testData[i].sourceIP[0];
+            vector[1] = testData[i].sourceIP[1];
+            vector[2] = testData[i].sourceIP[2];
+            vector[3] = testData[i].sourceIP[3];
+            vector[4] = testData[i].destIP[0];
+            vector[5] = testData[i].destIP[1];
+            vector[6] = testData[i].destIP[2];
+            vector[7] = testData[i].destIP[3];
+            vector[8] = testData[i].sourcePort >> 8;
+            vector[9] = testData[i].sourcePort & 0xff;
+            vector[10] = testData[i].destPort >> 8;
+            vector[11] = testData[i].destPort & 0xff;
+
+            sgBuffer[0].chunkPtr = vector;
+            sgBuffer[0].chunkLen = 8;
+            sgBuffer[1].chunkPtr = vector + 8;
+            sgBuffer[1].chunkLen = 4;
+
+            if (ToeplitzHashTable(sgBuffer, 1) != testData[i].resultIP ||
+                ToeplitzHashTable(sgBuffer, 2) != testData[i].resultTCP)
+            {
+                ++numFailedTable;
+            }
+        }
+    }
+
+    TableTickCount = GetTickCount64();
+
+    numFailedParity = CheckTableParity();
+
     printf("Correct IP calculations     %lu\n", numSuccessfulIP);
     printf("Correct TCP calculations    %lu\n", numSuccessfulTCP);
     printf("Wrong IP calculations       %lu\n", numFailedIP);
     printf("Wrong TCP calculations      %lu\n", numFailedTCP);
+    printf("Wrong table calculations    %lu\n", numFailedTable);
+    printf("Table/reference mismatches  %lu\n", numFailedParity);
     printf("Total test time             %lu Ms\n", FinishTickCount - StartTickCount);
+    printf("Total table test time       %lu Ms\n", TableTickCount - FinishTickCount);
     printf("\n\n");
 
-    if(numFailedIP || numFailedTCP)
+    if(numFailedIP || numFailedTCP || numFailedTable || numFailedParity)
     {
         printf("Test FAILED\n");
         return -1;
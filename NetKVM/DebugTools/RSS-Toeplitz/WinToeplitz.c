@@ -47,3 +47,45 @@ UINT32 ToeplitzHash(const PHASH_CALC_SG_BUF_ENTRY sgBuff, int sgEntriesNum, UINT
 }
 
 
+
+// Same engine as the driver: one 256-entry table per input byte offset
+static UINT32 workingtable[WTEP_MAX_INPUT_SIZE][256];
+
+void toeplitzw_build_table(const UINT8 *fullKey)
+{
+    UINT32 keyWord = RtlUlongByteSwap(*(UINT32*)fullKey);
+    UINT offset, bit, value;
+
+    for (offset = 0; offset < WTEP_MAX_INPUT_SIZE; ++offset)
+    {
+        UINT8 nextKeyByte = fullKey[offset + sizeof(keyWord)];
+
+        workingtable[offset][0] = 0;
+        for (bit = 0; bit < 8; ++bit)
+        {
+            workingtable[offset][0x80 >> bit] = keyWord;
+            keyWord = (keyWord << 1) | ((nextKeyByte >> (7 - bit)) & 1);
+        }
+        for (value = 1; value < 256; ++value)
+        {
+            UINT lowBit = value & (0 - value);
+            workingtable[offset][value] = workingtable[offset][lowBit] ^ workingtable[offset][value ^ lowBit];
+        }
+    }
+}
+
+UINT32 ToeplitzHashTable(const PHASH_CALC_SG_BUF_ENTRY sgBuff, int sgEntriesNum)
+{
+    UINT32 res = 0;
+    UINT byte, offset = 0;
+    PHASH_CALC_SG_BUF_ENTRY sgEntry;
+
+    for (sgEntry = sgBuff; sgEntry < sgBuff + sgEntriesNum; ++sgEntry)
+    {
+        for (byte = 0; byte < sgEntry->chunkLen; ++byte)
+        {
+            res ^= workingtable[offset++][sgEntry->chunkPtr[byte]];
+        }
+    }
+    return res;
+}
@@ -10,6 +10,7 @@
 #endif
 
 #define WTEP_MAX_KEY_SIZE   40
+#define WTEP_MAX_INPUT_SIZE (WTEP_MAX_KEY_SIZE - 4)
 
 typedef unsigned char uint8_t;
 typedef unsigned short uint16_t;
@@ -24,6 +25,9 @@ typedef struct _tagHASH_CALC_SG_BUF_ENTRY
 EXTERN_C void toeplitzw_initialize(uint8_t *key, int keysize);
 EXTERN_C UINT32 ToeplitzHash(const PHASH_CALC_SG_BUF_ENTRY sgBuff, int sgEntriesNum, UINT8 *fullKey);
 
+EXTERN_C void toeplitzw_build_table(const UINT8 *fullKey);
+EXTERN_C UINT32 ToeplitzHashTable(const PHASH_CALC_SG_BUF_ENTRY sgBuff, int sgEntriesNum);
+
 EXTERN_C uint8_t workingkey[];
 
 #endif
@@ -421,6 +421,16 @@ static NDIS_STATUS ParaNdis6_Restart(
 Required NDIS handler
 called at IRQL <= DISPATCH_LEVEL
 ***********************************************************/
+#ifdef PARANDIS_SUPPORT_RSS
+static FORCEINLINE CPUPathBundle *GetTxPathBundle(PARANDIS_ADAPTER *pContext, PNET_BUFFER_LIST pNBL)
+{
+    ULONG RSSHashValue = NET_BUFFER_LIST_GET_HASH_VALUE(pNBL);
+    ULONG indirectionIndex = RSSHashValue & (pContext->RSSParameters.ActiveRSSScalingSettings.RSSHashMask);
+
+    return pContext->RSS2QueueMap[indirectionIndex];
+}
+#endif
+
 static VOID ParaNdis6_SendNetBufferLists(
     NDIS_HANDLE miniportAdapterContext,
     PNET_BUFFER_LIST    pNBL,
@@ -438,16 +448,35 @@ static VOID ParaNdis6_SendNetBufferLists(
     CNdisPassiveReadAutoLock autoLock(pContext->RSSParameters.rwLock);
     if (pContext->RSS2QueueMap != nullptr)
     {
+        ParaNdis6_RSSRecordTransmitFlows(pContext, pNBL);
+
+        // the NBLs of one queue are sent as one chain, in their original
+        // order, so that the queue is locked and kicked once per call
         while (pNBL)
         {
-            ULONG RSSHashValue = NET_BUFFER_LIST_GET_HASH_VALUE(pNBL);
-            ULONG indirectionIndex = RSSHashValue & (pContext->RSSParameters.ActiveRSSScalingSettings.RSSHashMask);
+            CPUPathBundle *pathBundle = GetTxPathBundle(pContext, pNBL);
+            PNET_BUFFER_LIST batchNBL = pNBL, restNBL = NULL;
+            PNET_BUFFER_LIST *pBatchTail = &NET_BUFFER_LIST_NEXT_NBL(batchNBL);
+            PNET_BUFFER_LIST *pRestTail = &restNBL;
 
-            PNET_BUFFER_LIST nextNBL = NET_BUFFER_LIST_NEXT_NBL(pNBL);
-            NET_BUFFER_LIST_NEXT_NBL(pNBL) = NULL;
+            for (pNBL = NET_BUFFER_LIST_NEXT_NBL(batchNBL); pNBL != NULL; pNBL = NET_BUFFER_LIST_NEXT_NBL(pNBL))
+            {
+                if (GetTxPathBundle(pContext, pNBL) == pathBundle)
+                {
+                    *pBatchTail = pNBL;
+                    pBatchTail = &NET_BUFFER_LIST_NEXT_NBL(pNBL);
+                }
+                else
+                {
+                    *pRestTail = pNBL;
+                    pRestTail = &NET_BUFFER_LIST_NEXT_NBL(pNBL);
+                }
+            }
+            *pBatchTail = NULL;
+            *pRestTail = NULL;
 
-            pContext->RSS2QueueMap[indirectionIndex]->txPath.Send(pNBL);
-            pNBL = nextNBL;
+            pathBundle->txPath.Send(batchNBL);
+            pNBL = restNBL;
         }
     }
     else
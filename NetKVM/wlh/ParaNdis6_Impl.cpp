@@ -1063,6 +1063,332 @@ tPacketIndicationType ParaNdis_PrepareReceivedPacket(
     return CloneNblFreeOriginalForArm(pContext, pNBL, pBuffersDesc);
 }
 
+#if PARANDIS_SUPPORT_RSC
+/**********************************************************
+Software receive segment coalescing, for the IP versions the device
+does not coalesce (no guest TSO). In-order TCP segments of a flow
+indicated by the same DPC are chained behind the first one, whose
+headers are updated to describe the whole unit, so the protocol
+stack processes a single NBL instead of one NBL per segment.
+***********************************************************/
+typedef struct _tagRscSwSegment
+{
+    PNET_BUFFER_LIST    pNBL;
+    pRxNetDescriptor    pDesc;
+    PVOID               pIpHeader;
+    TCPHeader           *pTcpHeader;
+    ULONG               ulHeadersLength;
+    ULONG               ulIpLength;
+    ULONG               ulPayloadLength;
+    BOOLEAN             bCanCoalesce;
+} RSC_SW_SEGMENT, *PRSC_SW_SEGMENT;
+
+static BOOLEAN RscSwParseSegment(PARANDIS_ADAPTER *pContext, PNET_BUFFER_LIST pNBL, PRSC_SW_SEGMENT pSeg)
+{
+    pRxNetDescriptor pDesc = (pRxNetDescriptor)pNBL->MiniportReserved[0];
+    PNET_PACKET_INFO pPacketInfo = &pDesc->PacketInfo;
+    PNET_BUFFER pNB = NET_BUFFER_LIST_FIRST_NB(pNBL);
+    ULONG ulL4Offset = pPacketInfo->L2HdrLen + pPacketInfo->L3HdrLen;
+    ULONG ulTcpHeaderLength;
+
+    if (pPacketInfo->isIP4)
+    {
+        if (!pContext->RSC.bIPv4SWCoalescing || !pContext->RSC.bIPv4Enabled)
+            return FALSE;
+    }
+    else if (!pPacketInfo->isIP6 || !pContext->RSC.bIPv6SWCoalescing || !pContext->RSC.bIPv6Enabled)
+    {
+        return FALSE;
+    }
+
+    if (!pPacketInfo->isTCP || pPacketInfo->isFragment ||
+        pPacketInfo->dataLength < ulL4Offset + sizeof(TCPHeader))
+        return FALSE;
+
+    pSeg->pNBL = pNBL;
+    pSeg->pDesc = pDesc;
+    pSeg->pIpHeader = RtlOffsetToPointer(pPacketInfo->headersBuffer, pPacketInfo->L2HdrLen);
+    pSeg->pTcpHeader = (TCPHeader *)RtlOffsetToPointer(pPacketInfo->headersBuffer, ulL4Offset);
+    ulTcpHeaderLength = TCP_HEADER_LENGTH(pSeg->pTcpHeader);
+    pSeg->ulHeadersLength = ulL4Offset + ulTcpHeaderLength;
+    pSeg->ulIpLength = pPacketInfo->isIP4 ?
+        swap_short(((IPv4Header *)pSeg->pIpHeader)->ip_length) :
+        swap_short(((IPv6Header *)pSeg->pIpHeader)->ip6_payload_len) + (ULONG)sizeof(IPv6Header);
+    pSeg->ulPayloadLength = 0;
+
+    virtio_net_hdr_mrg_rxbuf *pHeader = (virtio_net_hdr_mrg_rxbuf *)pDesc->PhysicalPages[0].Virtual;
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO qCSInfo;
+    qCSInfo.Value = NET_BUFFER_LIST_INFO(pNBL, TcpIpChecksumNetBufferListInfo);
+
+    pSeg->bCanCoalesce =
+        pPacketInfo->isUnicast &&
+        // no IPv4 options or IPv6 extension headers
+        pPacketInfo->L3HdrLen == (pPacketInfo->isIP4 ? sizeof(IPv4Header) : sizeof(IPv6Header)) &&
+        ulTcpHeaderLength >= sizeof(TCPHeader) &&
+        // data without Ethernet padding
+        pSeg->ulHeadersLength < pPacketInfo->dataLength &&
+        pPacketInfo->L2HdrLen + pSeg->ulIpLength == pPacketInfo->dataLength &&
+        // plain ACK, PSH only ends the unit
+        (pSeg->pTcpHeader->tcp_flags & ~(USHORT)(0x00F0 | TCP_FLAG_PSH)) == TCP_FLAG_ACK &&
+        qCSInfo.Receive.TcpChecksumSucceeded &&
+        (pPacketInfo->isIP6 || qCSInfo.Receive.IpChecksumSucceeded) &&
+        pHeader->hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE &&
+        // the frame does not continue in other buffers
+        pDesc->MergedNext == NULL &&
+        pDesc->CoalesceMdl != NULL &&
+        NET_BUFFER_DATA_OFFSET(pNB) + NET_BUFFER_DATA_LENGTH(pNB) <=
+            pDesc->PhysicalPages[PARANDIS_FIRST_RX_DATA_PAGE].size;
+
+    if (pSeg->bCanCoalesce)
+    {
+        pSeg->ulPayloadLength = pPacketInfo->dataLength - pSeg->ulHeadersLength;
+    }
+
+    return TRUE;
+}
+
+static BOOLEAN RscSwIsSameFlow(PRSC_SW_SESSION pSession, PRSC_SW_SEGMENT pSeg)
+{
+    TCPHeader *pTcpHeader = (TCPHeader *)pSession->pTcpHeader;
+
+    if (pSession->bIPv4 != !!pSeg->pDesc->PacketInfo.isIP4 ||
+        pTcpHeader->tcp_src != pSeg->pTcpHeader->tcp_src ||
+        pTcpHeader->tcp_dest != pSeg->pTcpHeader->tcp_dest)
+        return FALSE;
+
+    if (pSession->bIPv4)
+    {
+        IPv4Header *pIpHeader = (IPv4Header *)pSession->pIpHeader;
+        IPv4Header *pSegIpHeader = (IPv4Header *)pSeg->pIpHeader;
+
+        return pIpHeader->ip_src == pSegIpHeader->ip_src &&
+               pIpHeader->ip_dest == pSegIpHeader->ip_dest;
+    }
+
+    // source and destination addresses are adjacent
+    return RtlCompareMemory(&((IPv6Header *)pSession->pIpHeader)->ip6_src_address,
+                            &((IPv6Header *)pSeg->pIpHeader)->ip6_src_address,
+                            2 * sizeof(IPV6_ADDRESS)) == 2 * sizeof(IPV6_ADDRESS);
+}
+
+static BOOLEAN RscSwCanAppend(PRSC_SW_SESSION pSession, PRSC_SW_SEGMENT pSeg)
+{
+    pRxNetDescriptor pHead = (pRxNetDescriptor)pSession->pNBL->MiniportReserved[0];
+    PNET_PACKET_INFO pHeadInfo = &pHead->PacketInfo;
+    PNET_PACKET_INFO pPacketInfo = &pSeg->pDesc->PacketInfo;
+    TCPHeader *pTcpHeader = (TCPHeader *)pSession->pTcpHeader;
+    ULONG ulTcpHeaderLength = TCP_HEADER_LENGTH(pTcpHeader);
+    PUCHAR pIpHeader = (PUCHAR)pSession->pIpHeader;
+    PUCHAR pSegIpHeader = (PUCHAR)pSeg->pIpHeader;
+
+    if (RtlUlongByteSwap(pSeg->pTcpHeader->tcp_seq) != pSession->ulNextSeq ||
+        pSeg->pTcpHeader->tcp_ack != pTcpHeader->tcp_ack ||
+        TCP_HEADER_LENGTH(pSeg->pTcpHeader) != ulTcpHeaderLength ||
+        pSession->ulIpLength + pSeg->ulPayloadLength > MAX_IP4_DATAGRAM_SIZE ||
+        pPacketInfo->L2HdrLen != pHeadInfo->L2HdrLen ||
+        NET_BUFFER_LIST_INFO(pSeg->pNBL, Ieee8021QNetBufferListInfo) !=
+            NET_BUFFER_LIST_INFO(pSession->pNBL, Ieee8021QNetBufferListInfo))
+        return FALSE;
+
+    if (RtlCompareMemory(pPacketInfo->headersBuffer, pHeadInfo->headersBuffer, pHeadInfo->L2HdrLen) !=
+        pHeadInfo->L2HdrLen)
+        return FALSE;
+
+    // IP fields other than the length, identification and checksum
+    if (pSession->bIPv4)
+    {
+        if (RtlCompareMemory(pSegIpHeader, pIpHeader, FIELD_OFFSET(IPv4Header, ip_length)) !=
+                FIELD_OFFSET(IPv4Header, ip_length) ||
+            RtlCompareMemory(pSegIpHeader + FIELD_OFFSET(IPv4Header, ip_offset),
+                             pIpHeader + FIELD_OFFSET(IPv4Header, ip_offset),
+                             FIELD_OFFSET(IPv4Header, ip_xsum) - FIELD_OFFSET(IPv4Header, ip_offset)) !=
+                FIELD_OFFSET(IPv4Header, ip_xsum) - FIELD_OFFSET(IPv4Header, ip_offset))
+            return FALSE;
+    }
+    else
+    {
+        if (RtlCompareMemory(pSegIpHeader, pIpHeader, FIELD_OFFSET(IPv6Header, ip6_payload_len)) !=
+                FIELD_OFFSET(IPv6Header, ip6_payload_len) ||
+            ((IPv6Header *)pSegIpHeader)->ip6_next_header != ((IPv6Header *)pIpHeader)->ip6_next_header ||
+            ((IPv6Header *)pSegIpHeader)->ip6_hoplimit != ((IPv6Header *)pIpHeader)->ip6_hoplimit)
+            return FALSE;
+    }
+
+    // TCP options, timestamps included, are the same in all the segments
+    return RtlCompareMemory(pSeg->pTcpHeader + 1, pTcpHeader + 1, ulTcpHeaderLength - sizeof(TCPHeader)) ==
+        ulTcpHeaderLength - sizeof(TCPHeader);
+}
+
+static __inline VOID RscSwDescribeData(pRxNetDescriptor p, PVOID pData, ULONG ulLength)
+{
+    MmPrepareMdlForReuse(p->CoalesceMdl);
+    IoBuildPartialMdl(p->Holder, p->CoalesceMdl, pData, ulLength);
+    NDIS_MDL_LINKAGE(p->CoalesceMdl) = NULL;
+}
+
+static VOID RscSwAppend(PRSC_SW_CONTEXT pRsc, PRSC_SW_SESSION pSession, PRSC_SW_SEGMENT pSeg)
+{
+    PNET_BUFFER pNB = NET_BUFFER_LIST_FIRST_NB(pSession->pNBL);
+    TCPHeader *pTcpHeader = (TCPHeader *)pSession->pTcpHeader;
+
+    if (pSession->usSegments == 1)
+    {
+        pRxNetDescriptor pHead = (pRxNetDescriptor)pSession->pNBL->MiniportReserved[0];
+        NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO qCSInfo;
+
+        // the first segment gets its own MDL to link the next ones to
+        RscSwDescribeData(pHead, pHead->PacketInfo.headersBuffer, pHead->PacketInfo.dataLength);
+        NET_BUFFER_FIRST_MDL(pNB) = NET_BUFFER_CURRENT_MDL(pNB) = pHead->CoalesceMdl;
+        NET_BUFFER_DATA_OFFSET(pNB) = 0;
+        NET_BUFFER_CURRENT_MDL_OFFSET(pNB) = 0;
+
+        qCSInfo.Value = NULL;
+        qCSInfo.Receive.IpChecksumSucceeded = TRUE;
+        qCSInfo.Receive.IpChecksumValueInvalid = TRUE;
+        qCSInfo.Receive.TcpChecksumSucceeded = TRUE;
+        qCSInfo.Receive.TcpChecksumValueInvalid = TRUE;
+        NET_BUFFER_LIST_INFO(pSession->pNBL, TcpIpChecksumNetBufferListInfo) = qCSInfo.Value;
+        NET_BUFFER_LIST_DUP_ACK_COUNT(pSession->pNBL) = 0;
+
+        pRsc->nCoalesceEvents++;
+        pRsc->nCoalescedPkts++;
+        // only the TCP payload counts, as for the segments appended below
+        pRsc->nCoalescedOctets += pSession->ulIpLength -
+            RtlPointerToOffset(pSession->pIpHeader, pTcpHeader) - TCP_HEADER_LENGTH(pTcpHeader);
+    }
+
+    RscSwDescribeData(pSeg->pDesc,
+        RtlOffsetToPointer(pSeg->pDesc->PacketInfo.headersBuffer, pSeg->ulHeadersLength),
+        pSeg->ulPayloadLength);
+    NDIS_MDL_LINKAGE(pSession->pTail->CoalesceMdl) = pSeg->pDesc->CoalesceMdl;
+    NET_BUFFER_DATA_LENGTH(pNB) += pSeg->ulPayloadLength;
+    pSession->pTail->CoalescedNext = pSeg->pDesc;
+    pSession->pTail = pSeg->pDesc;
+
+    pSession->ulNextSeq += pSeg->ulPayloadLength;
+    pSession->ulIpLength += pSeg->ulPayloadLength;
+    pSession->usSegments++;
+
+    // the headers of the first segment describe the whole unit
+    if (pSession->bIPv4)
+    {
+        ((IPv4Header *)pSession->pIpHeader)->ip_length = swap_short((USHORT)pSession->ulIpLength);
+        // the unit is indicated with a valid IP checksum
+        ParaNdis_CheckSumVerifyFlat(pSession->pIpHeader,
+                                    pSession->ulIpLength,
+                                    pcrIpChecksum | pcrFixIPChecksum, FALSE,
+                                    __FUNCTION__);
+    }
+    else
+    {
+        ((IPv6Header *)pSession->pIpHeader)->ip6_payload_len =
+            swap_short((USHORT)(pSession->ulIpLength - sizeof(IPv6Header)));
+    }
+    pTcpHeader->tcp_window = pSeg->pTcpHeader->tcp_window;
+    pTcpHeader->tcp_flags |= pSeg->pTcpHeader->tcp_flags & TCP_FLAG_PSH;
+    NET_BUFFER_LIST_COALESCED_SEG_COUNT(pSession->pNBL) = pSession->usSegments;
+
+    pRsc->nCoalescedPkts++;
+    pRsc->nCoalescedOctets += pSeg->ulPayloadLength;
+}
+
+static VOID RscSwOpenSession(PRSC_SW_CONTEXT pRsc, PRSC_SW_SEGMENT pSeg)
+{
+    PRSC_SW_SESSION pSession;
+
+    if (pRsc->nSessions < PARANDIS_RSC_SW_SESSIONS)
+    {
+        pSession = &pRsc->Sessions[pRsc->nSessions++];
+    }
+    else
+    {
+        // the replaced unit is complete already, it just can't grow anymore
+        pSession = &pRsc->Sessions[pRsc->nNextVictim];
+        pRsc->nNextVictim = (pRsc->nNextVictim + 1) % PARANDIS_RSC_SW_SESSIONS;
+    }
+
+    pSession->pNBL = pSeg->pNBL;
+    pSession->pTail = pSeg->pDesc;
+    pSession->pIpHeader = pSeg->pIpHeader;
+    pSession->pTcpHeader = pSeg->pTcpHeader;
+    pSession->ulNextSeq = RtlUlongByteSwap(pSeg->pTcpHeader->tcp_seq) + pSeg->ulPayloadLength;
+    pSession->ulIpLength = pSeg->ulIpLength;
+    pSession->usSegments = 1;
+    pSession->bIPv4 = !!pSeg->pDesc->PacketInfo.isIP4;
+}
+
+static __inline VOID RscSwCloseSession(PRSC_SW_CONTEXT pRsc, ULONG i)
+{
+    pRsc->Sessions[i] = pRsc->Sessions[--pRsc->nSessions];
+}
+
+/**********************************************************
+Coalesces the received NBL into an NBL of the same flow already
+prepared for indication in this DPC
+
+Parameters:
+    context
+    PRSC_SW_CONTEXT pRsc - coalescing state of the DPC
+    PNET_BUFFER_LIST pNBL - NBL returned by ParaNdis_PrepareReceivedPacket
+Return value:
+    TRUE  if the NBL was coalesced and freed, its buffer descriptor
+          is returned with the NBL it was coalesced into
+    FALSE if the NBL shall be indicated
+***********************************************************/
+BOOLEAN ParaNdis_CoalesceReceivedPacket(
+    PARANDIS_ADAPTER *pContext,
+    PRSC_SW_CONTEXT  pRsc,
+    PNET_BUFFER_LIST pNBL)
+{
+    RSC_SW_SEGMENT Segment;
+
+    if (!RscSwParseSegment(pContext, pNBL, &Segment))
+        return FALSE;
+
+    for (ULONG i = 0; i < pRsc->nSessions; i++)
+    {
+        PRSC_SW_SESSION pSession = &pRsc->Sessions[i];
+
+        if (!RscSwIsSameFlow(pSession, &Segment))
+            continue;
+
+        if (Segment.bCanCoalesce && RscSwCanAppend(pSession, &Segment))
+        {
+            RscSwAppend(pRsc, pSession, &Segment);
+            if (Segment.pTcpHeader->tcp_flags & TCP_FLAG_PSH)
+            {
+                RscSwCloseSession(pRsc, i);
+            }
+            NdisFreeNetBufferList(pNBL);
+            return TRUE;
+        }
+
+        // the unit is indicated before this packet, the data after it can't join it
+        RscSwCloseSession(pRsc, i);
+        break;
+    }
+
+    if (Segment.bCanCoalesce && !(Segment.pTcpHeader->tcp_flags & TCP_FLAG_PSH))
+    {
+        RscSwOpenSession(pRsc, &Segment);
+    }
+    return FALSE;
+}
+
+VOID ParaNdis_CoalesceComplete(
+    PARANDIS_ADAPTER *pContext,
+    PRSC_SW_CONTEXT  pRsc)
+{
+    if (pRsc->nCoalesceEvents)
+    {
+        NdisInterlockedAddLargeStatistic(&pContext->RSC.Statistics.CoalescedOctets, pRsc->nCoalescedOctets);
+        NdisInterlockedAddLargeStatistic(&pContext->RSC.Statistics.CoalesceEvents, pRsc->nCoalesceEvents);
+        NdisInterlockedAddLargeStatistic(&pContext->RSC.Statistics.CoalescedPkts, pRsc->nCoalescedPkts);
+    }
+    pRsc->nSessions = 0;
+}
+#endif
+
 NDIS_STATUS ParaNdis_ExactSendFailureStatus(PARANDIS_ADAPTER *pContext)
 {
     NDIS_STATUS status = NDIS_STATUS_FAILURE;
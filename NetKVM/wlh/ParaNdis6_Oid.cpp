@@ -816,8 +816,8 @@ void ParaNdis6_FillOffloadCapabilities(PARANDIS_ADAPTER *pContext)
     ParaNdis_ResetOffloadSettings(pContext, &f, NULL);
     FillOffloadStructure(po, f);
 #if PARANDIS_SUPPORT_RSC
-    po->Rsc.IPv4.Enabled = pContext->RSC.bIPv4SupportedHW;
-    po->Rsc.IPv6.Enabled = pContext->RSC.bIPv6SupportedHW;
+    po->Rsc.IPv4.Enabled = pContext->RSC.bIPv4SupportedHW || pContext->RSC.bIPv4SWCoalescing;
+    po->Rsc.IPv6.Enabled = pContext->RSC.bIPv6SupportedHW || pContext->RSC.bIPv6SWCoalescing;
 #endif
 }
 
@@ -1134,11 +1134,13 @@ NDIS_STATUS OnSetRSCParameters(PPARANDIS_ADAPTER pContext, PNDIS_OFFLOAD_PARAMET
         return NDIS_STATUS_SUCCESS;
 
     if((op->RscIPv4 != NDIS_OFFLOAD_PARAMETERS_NO_CHANGE) &&
-        (!pContext->RSC.bIPv4SupportedSW || !pContext->RSC.bIPv4SupportedHW))
+        (!pContext->RSC.bIPv4SupportedSW ||
+         !(pContext->RSC.bIPv4SupportedHW || pContext->RSC.bIPv4SWCoalescing)))
         return NDIS_STATUS_NOT_SUPPORTED;
 
     if((op->RscIPv6 != NDIS_OFFLOAD_PARAMETERS_NO_CHANGE) &&
-        (!pContext->RSC.bIPv6SupportedSW || !pContext->RSC.bIPv6SupportedHW))
+        (!pContext->RSC.bIPv6SupportedSW ||
+         !(pContext->RSC.bIPv6SupportedHW || pContext->RSC.bIPv6SWCoalescing)))
         return NDIS_STATUS_NOT_SUPPORTED;
 
     if(op->RscIPv4 != NDIS_OFFLOAD_PARAMETERS_NO_CHANGE)
@@ -15,6 +15,35 @@ static void PrintIndirectionTable(const PARANDIS_SCALING_SETTINGS *RSSScalingSet
 static void PrintRSSSettings(PPARANDIS_RSS_PARAMS RSSParameters);
 static NDIS_STATUS ParaNdis_SetupRSSQueueMap(PARANDIS_ADAPTER *pContext);
 
+// Little Endian version ONLY
+// Expands the bit-serial Toeplitz algorithm into one 256-entry table per input
+// byte offset, so that hashing costs a single lookup per byte. For the byte at
+// offset N, bit B (MSB first) selects the 32-bit key window starting at key
+// bit 8 * N + B; the entry for a byte value is the XOR of the windows selected
+// by its set bits.
+static VOID ToeplitzBuildTable(PARANDIS_HASHING_TABLE &table, PCCHAR fullKey)
+{
+    UINT32 keyWord = RtlUlongByteSwap(*(UINT32 *)fullKey);
+    UINT offset, bit, value;
+
+    for (offset = 0; offset < PARANDIS_RSS_MAX_HASH_INPUT; ++offset)
+    {
+        UCHAR nextKeyByte = (UCHAR)fullKey[offset + sizeof(keyWord)];
+
+        table[offset][0] = 0;
+        for (bit = 0; bit < 8; ++bit)
+        {
+            table[offset][0x80 >> bit] = keyWord;
+            keyWord = (keyWord << 1) | ((nextKeyByte >> (7 - bit)) & 1);
+        }
+        for (value = 1; value < 256; ++value)
+        {
+            UINT lowBit = value & (0 - value);
+            table[offset][value] = table[offset][lowBit] ^ table[offset][value ^ lowBit];
+        }
+    }
+}
+
 static VOID ApplySettings(PPARANDIS_RSS_PARAMS RSSParameters,
         PARANDIS_RSS_MODE NewRSSMode,
         PARANDIS_HASHING_SETTINGS *ReceiveHashingSettings,
@@ -26,6 +55,13 @@ static VOID ApplySettings(PPARANDIS_RSS_PARAMS RSSParameters,
 
     if(NewRSSMode != PARANDIS_RSS_DISABLED)
     {
+        if (RtlCompareMemory(RSSParameters->ActiveHashingSettings.HashSecretKey,
+                             ReceiveHashingSettings->HashSecretKey,
+                             sizeof(ReceiveHashingSettings->HashSecretKey)) != sizeof(ReceiveHashingSettings->HashSecretKey))
+        {
+            ToeplitzBuildTable(RSSParameters->ActiveHashingTable, ReceiveHashingSettings->HashSecretKey);
+        }
+
         RSSParameters->ActiveHashingSettings = *ReceiveHashingSettings;
 
         if(NewRSSMode == PARANDIS_RSS_FULL)
@@ -36,6 +72,20 @@ static VOID ApplySettings(PPARANDIS_RSS_PARAMS RSSParameters,
             RSSParameters->ActiveRSSScalingSettings = *ReceiveScalingSettings;
 
             ReceiveScalingSettings->CPUIndexMapping = NULL;
+
+            // recorded flows refer to the previous CPU <-> queue assignment
+            for (ULONG i = 0; i < PARANDIS_RSS_FLOW_TABLE_SIZE; i++)
+            {
+                RSSParameters->FlowTable[i].Hash = 0;
+                RSSParameters->FlowTable[i].Queue = PARANDIS_RECEIVE_NO_QUEUE;
+            }
+            NdisMoveMemory(RSSParameters->SteeredIndirectionTable,
+                           RSSParameters->ActiveRSSScalingSettings.IndirectionTable,
+                           sizeof(RSSParameters->SteeredIndirectionTable));
+            for (ULONG i = 0; i < ARRAYSIZE(RSSParameters->SteeredIndirectionTable); i++)
+            {
+                RSSParameters->SteeredIndirectionTable[i].Processor.Reserved = 0;
+            }
         }
     }
 }
@@ -148,6 +198,10 @@ NDIS_RECEIVE_SCALE_CAPABILITIES* ParaNdis6_RSSCreateConfiguration(PARANDIS_ADAPT
 {
     InitRSSParameters(pContext);
     InitRSSCapabilities(pContext);
+    if (pContext->bRSSSupportedByDevicePersistent)
+    {
+        pContext->RSSParameters.DeviceSteeringWorkItem = NdisAllocateIoWorkItem(pContext->MiniportHandle);
+    }
     return &pContext->RSSCapabilities;
 }
 
@@ -192,6 +246,48 @@ static USHORT ResolveQueue(PARANDIS_ADAPTER *pContext, PPROCESSOR_NUMBER proc, U
     return n;
 }
 
+// Builds the device configuration from the active settings, the caller holds the RSS lock
+static virtio_net_rss_config *BuildDeviceRSSConfig(PARANDIS_ADAPTER *pContext, ULONG *config_size)
+{
+    virtio_net_rss_config *cfg;
+    USHORT fallbackQueue = 0;
+    USHORT indirection_table_len = pContext->RSSParameters.ActiveRSSScalingSettings.IndirectionTableSize / sizeof(PROCESSOR_NUMBER);
+    UCHAR hash_key_len = (UCHAR)pContext->RSSParameters.ActiveHashingSettings.HashSecretKeySize;
+    if (!pContext->bRSSSupportedByDevice)
+    {
+        indirection_table_len = 1;
+    }
+    *config_size = virtio_net_rss_config_size(indirection_table_len, hash_key_len);
+    cfg = (virtio_net_rss_config *)ParaNdis_AllocateMemory(pContext, *config_size);
+    if (!cfg)
+    {
+        return NULL;
+    }
+    cfg->indirection_table_mask = indirection_table_len - 1;
+    cfg->unclassified_queue = ResolveQueue(pContext, &pContext->RSSParameters.ActiveRSSScalingSettings.DefaultProcessor, &fallbackQueue);
+    for (USHORT i = 0; i < indirection_table_len; ++i)
+    {
+        // transmitters may steer the bucket meanwhile, read it once
+        PARANDIS_RSS_STEERED_BUCKET bucket;
+        bucket.Value = *(volatile LONG *)&pContext->RSSParameters.SteeredIndirectionTable[i].Value;
+        cfg->indirection_table[i] = ResolveQueue(pContext, &bucket.Processor, &fallbackQueue);
+    }
+    TraceNoPrefix(0, "[%s] Translated indirections: (len = %d)\n", __FUNCTION__, indirection_table_len);
+    ParaNdis_PrintTable<80, 10>(0, cfg->indirection_table, indirection_table_len, "%d", [](const __u16 *p) {  return *p; });
+    max_tx_vq(cfg) = (USHORT)pContext->nPathBundles;
+    hash_key_length(cfg) = hash_key_len;
+    for (USHORT i = 0; i < hash_key_len; ++i)
+    {
+        hash_key_data(cfg, i) = pContext->RSSParameters.ActiveHashingSettings.HashSecretKey[i];
+    }
+    TraceNoPrefix(0, "[%s] RSS key: (len = %d)\n", __FUNCTION__, hash_key_len);
+    ParaNdis_PrintTable<80, 10>(0, (hash_key_length_ptr(cfg) + 1), hash_key_len, "%X", [](const __u8 *p) {  return *p; });
+
+    cfg->hash_types = TranslateHashTypes(pContext->RSSParameters.ActiveHashingSettings.HashInformation);
+
+    return cfg;
+}
+
 static void SetDeviceRSSSettings(PARANDIS_ADAPTER *pContext, bool bForceOff = false)
 {
     if (!pContext->bRSSSupportedByDevice && !pContext->bHashReportedByDevice)
@@ -201,6 +297,9 @@ static void SetDeviceRSSSettings(PARANDIS_ADAPTER *pContext, bool bForceOff = fa
     UCHAR command = pContext->bRSSSupportedByDevice ?
         VIRTIO_NET_CTRL_MQ_RSS_CONFIG : VIRTIO_NET_CTRL_MQ_HASH_CONFIG;
 
+    // a steering update built before this one must not be the last to reach the device
+    InterlockedIncrement(&pContext->RSSParameters.DeviceSettingsGeneration);
+
     if (pContext->RSSParameters.RSSMode == PARANDIS_RSS_DISABLED || bForceOff)
     {
         virtio_net_rss_config cfg = {};
@@ -209,41 +308,12 @@ static void SetDeviceRSSSettings(PARANDIS_ADAPTER *pContext, bool bForceOff = fa
     }
     else
     {
-        virtio_net_rss_config *cfg;
-        USHORT fallbackQueue = 0;
-        USHORT indirection_table_len = pContext->RSSParameters.ActiveRSSScalingSettings.IndirectionTableSize / sizeof(PROCESSOR_NUMBER);
-        UCHAR hash_key_len = (UCHAR)pContext->RSSParameters.ActiveHashingSettings.HashSecretKeySize;
         ULONG config_size;
-        if (!pContext->bRSSSupportedByDevice)
-        {
-            indirection_table_len = 1;
-        }
-        config_size = virtio_net_rss_config_size(indirection_table_len, hash_key_len);
-        cfg = (virtio_net_rss_config *)ParaNdis_AllocateMemory(pContext, config_size);
+        virtio_net_rss_config *cfg = BuildDeviceRSSConfig(pContext, &config_size);
         if (!cfg)
         {
             return;
         }
-        cfg->indirection_table_mask = indirection_table_len - 1;
-        cfg->unclassified_queue = ResolveQueue(pContext, &pContext->RSSParameters.ActiveRSSScalingSettings.DefaultProcessor, &fallbackQueue);
-        for (USHORT i = 0; i < indirection_table_len; ++i)
-        {
-            cfg->indirection_table[i] = ResolveQueue(pContext,
-                pContext->RSSParameters.ActiveRSSScalingSettings.IndirectionTable + i,
-                &fallbackQueue);
-        }
-        TraceNoPrefix(0, "[%s] Translated indirections: (len = %d)\n", __FUNCTION__, indirection_table_len);
-        ParaNdis_PrintTable<80, 10>(0, cfg->indirection_table, indirection_table_len, "%d", [](const __u16 *p) {  return *p; });
-        max_tx_vq(cfg) = (USHORT)pContext->nPathBundles;
-        hash_key_length(cfg) = hash_key_len;
-        for (USHORT i = 0; i < hash_key_len; ++i)
-        {
-            hash_key_data(cfg, i) = pContext->RSSParameters.ActiveHashingSettings.HashSecretKey[i];
-        }
-        TraceNoPrefix(0, "[%s] RSS key: (len = %d)\n", __FUNCTION__, hash_key_len);
-        ParaNdis_PrintTable<80, 10>(0, (hash_key_length_ptr(cfg) + 1), hash_key_len, "%X", [](const __u8 *p) {  return *p; });
-
-        cfg->hash_types = TranslateHashTypes(pContext->RSSParameters.ActiveHashingSettings.HashInformation);
 
         pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_MQ, command, cfg, config_size, NULL, 0, 2);
 
@@ -358,6 +428,7 @@ VOID FillCPUMappingArray(
 
                 if (ReceiveQueue != ReceiveQueuesNumber)
                 {
+                    RSSScalingSettings->QueueProcessor[ReceiveQueue] = *ProcNum;
                     RSSScalingSettings->CPUIndexMapping[CurrProcIdx] = ReceiveQueue++;
                 }
             }
@@ -677,40 +748,21 @@ typedef struct _tagHASH_CALC_SG_BUF_ENTRY
     ULONG  chunkLen;
 } HASH_CALC_SG_BUF_ENTRY, *PHASH_CALC_SG_BUF_ENTRY;
 
-// Little Endian version ONLY
 static
-UINT32 ToeplitzHash(const PHASH_CALC_SG_BUF_ENTRY sgBuff, int sgEntriesNum, PCCHAR fullKey)
+UINT32 ToeplitzHash(const PHASH_CALC_SG_BUF_ENTRY sgBuff, int sgEntriesNum, const PARANDIS_HASHING_TABLE &table)
 {
-#define TOEPLITZ_MAX_BIT_NUM (7)
-#define TOEPLITZ_BYTE_HAS_BIT(byte, bit) ((byte) & (1 << (TOEPLITZ_MAX_BIT_NUM - (bit))))
-#define TOEPLITZ_BYTE_BIT_STATE(byte, bit) (((byte) >> (TOEPLITZ_MAX_BIT_NUM - (bit))) & 1)
-
-    UINT32 firstKeyWord, res = 0;
-    UINT byte, bit;
+    UINT32 res = 0;
+    UINT byte, offset = 0;
     PHASH_CALC_SG_BUF_ENTRY sgEntry;
-    PCCHAR next_key_byte = fullKey + sizeof(firstKeyWord);
-    firstKeyWord = RtlUlongByteSwap(*(UINT32*)fullKey);
 
     for(sgEntry = sgBuff; sgEntry < sgBuff + sgEntriesNum; ++sgEntry)
     {
         for (byte = 0; byte < sgEntry->chunkLen; ++byte)
         {
-            for (bit = 0; bit <= TOEPLITZ_MAX_BIT_NUM; ++bit)
-            {
-                if (TOEPLITZ_BYTE_HAS_BIT(sgEntry->chunkPtr[byte], bit))
-                {
-                    res ^= firstKeyWord;
-                }
-                firstKeyWord = (firstKeyWord << 1) | TOEPLITZ_BYTE_BIT_STATE(*next_key_byte, bit);
-            }
-            ++next_key_byte;
+            res ^= table[offset++][(UCHAR)sgEntry->chunkPtr[byte]];
         }
     }
     return res;
-
-#undef TOEPLITZ_BYTE_HAS_BIT
-#undef TOEPLITZ_BYTE_BIT_STATE
-#undef TOEPLITZ_MAX_BIT_NUM
 }
 
 static __inline
@@ -756,7 +808,7 @@ VOID RSSCalcHash_Unsafe(
             sgBuff[1].chunkPtr = RtlOffsetToPointer(pTCPHeader, FIELD_OFFSET(TCPHeader, tcp_src));
             sgBuff[1].chunkLen = RTL_FIELD_SIZE(TCPHeader, tcp_src) + RTL_FIELD_SIZE(TCPHeader, tcp_dest);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, &RSSParameters->ActiveHashingSettings.HashSecretKey[0]);
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, RSSParameters->ActiveHashingTable);
             packetInfo->RSSHash.Type = NDIS_HASH_TCP_IPV4;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -773,7 +825,7 @@ VOID RSSCalcHash_Unsafe(
             sgBuff[1].chunkPtr = RtlOffsetToPointer(pUDPHeader, FIELD_OFFSET(UDPHeader, udp_src));
             sgBuff[1].chunkLen = RTL_FIELD_SIZE(UDPHeader, udp_src) + RTL_FIELD_SIZE(UDPHeader, udp_dest);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, RSSParameters->ActiveHashingSettings.HashSecretKey);
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, RSSParameters->ActiveHashingTable);
             packetInfo->RSSHash.Type = NDIS_HASH_UDP_IPV4;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -785,7 +837,7 @@ VOID RSSCalcHash_Unsafe(
             sgBuff[0].chunkPtr = RtlOffsetToPointer(dataBuffer, packetInfo->L2HdrLen + FIELD_OFFSET(IPv4Header, ip_src));
             sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv4Header, ip_src) + RTL_FIELD_SIZE(IPv4Header, ip_dest);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 1, RSSParameters->ActiveHashingSettings.HashSecretKey);
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 1, RSSParameters->ActiveHashingTable);
             packetInfo->RSSHash.Type = NDIS_HASH_IPV4;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -807,7 +859,7 @@ VOID RSSCalcHash_Unsafe(
                 sgBuff[2].chunkPtr = RtlOffsetToPointer(pTCPHeader, FIELD_OFFSET(TCPHeader, tcp_src));
                 sgBuff[2].chunkLen = RTL_FIELD_SIZE(TCPHeader, tcp_src) + RTL_FIELD_SIZE(TCPHeader, tcp_dest);
 
-                packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 3, RSSParameters->ActiveHashingSettings.HashSecretKey);
+                packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 3, RSSParameters->ActiveHashingTable);
                 packetInfo->RSSHash.Type = (hashTypes & NDIS_HASH_TCP_IPV6_EX) ? NDIS_HASH_TCP_IPV6_EX : NDIS_HASH_TCP_IPV6;
                 packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
                 return;
@@ -827,7 +879,7 @@ VOID RSSCalcHash_Unsafe(
             sgBuff[2].chunkPtr = RtlOffsetToPointer(pUDPHeader, FIELD_OFFSET(UDPHeader, udp_src));
             sgBuff[2].chunkLen = RTL_FIELD_SIZE(UDPHeader, udp_src) + RTL_FIELD_SIZE(UDPHeader, udp_dest);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 3, RSSParameters->ActiveHashingSettings.HashSecretKey);
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 3, RSSParameters->ActiveHashingTable);
             packetInfo->RSSHash.Type = (hashTypes & NDIS_HASH_UDP_IPV6_EX) ? NDIS_HASH_UDP_IPV6_EX : NDIS_HASH_UDP_IPV6;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -841,7 +893,7 @@ VOID RSSCalcHash_Unsafe(
             sgBuff[1].chunkPtr = (PCHAR) GetIP6DstAddrForHash(dataBuffer, packetInfo, hashTypes);
             sgBuff[1].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_dst_address);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, RSSParameters->ActiveHashingSettings.HashSecretKey);
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, RSSParameters->ActiveHashingTable);
             packetInfo->RSSHash.Type = (hashTypes & NDIS_HASH_IPV6_EX) ? NDIS_HASH_IPV6_EX : NDIS_HASH_IPV6;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -854,7 +906,7 @@ VOID RSSCalcHash_Unsafe(
             sgBuff[0].chunkPtr = RtlOffsetToPointer(pIpHeader, FIELD_OFFSET(IPv6Header, ip6_src_address));
             sgBuff[0].chunkLen = RTL_FIELD_SIZE(IPv6Header, ip6_src_address) + RTL_FIELD_SIZE(IPv6Header, ip6_dst_address);
 
-            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 2, RSSParameters->ActiveHashingSettings.HashSecretKey);
+            packetInfo->RSSHash.Value = ToeplitzHash(sgBuff, 1, RSSParameters->ActiveHashingTable);
             packetInfo->RSSHash.Type = NDIS_HASH_IPV6;
             packetInfo->RSSHash.Function = NdisHashFunctionToeplitz;
             return;
@@ -900,16 +952,28 @@ CCHAR ParaNdis6_RSSGetScalingDataForPacket(
     else
     {
         ULONG indirectionIndex = packetInfo->RSSHash.Value & RSSParameters->ActiveRSSScalingSettings.RSSHashMask;
+        PARANDIS_RSS_FLOW_ENTRY flow;
 
-        targetQueue = RSSParameters->ActiveRSSScalingSettings.QueueIndirectionTable[indirectionIndex];
+        flow.Value = RSSParameters->FlowTable[packetInfo->RSSHash.Value & (PARANDIS_RSS_FLOW_TABLE_SIZE - 1)].Value;
 
-        if (targetQueue == PARANDIS_RECEIVE_NO_QUEUE)
+        if (flow.Hash == packetInfo->RSSHash.Value && flow.Queue != PARANDIS_RECEIVE_NO_QUEUE)
         {
-            targetQueue = PARANDIS_RECEIVE_UNCLASSIFIED_PACKET;
+            // deliver to the CPU the flow is transmitted from
+            targetQueue = (CCHAR)flow.Queue;
+            *targetProcessor = RSSParameters->ActiveRSSScalingSettings.QueueProcessor[targetQueue];
         }
         else
         {
-            *targetProcessor = RSSParameters->ActiveRSSScalingSettings.IndirectionTable[indirectionIndex];
+            targetQueue = RSSParameters->ActiveRSSScalingSettings.QueueIndirectionTable[indirectionIndex];
+
+            if (targetQueue == PARANDIS_RECEIVE_NO_QUEUE)
+            {
+                targetQueue = PARANDIS_RECEIVE_UNCLASSIFIED_PACKET;
+            }
+            else
+            {
+                *targetProcessor = RSSParameters->ActiveRSSScalingSettings.IndirectionTable[indirectionIndex];
+            }
         }
     }
 
@@ -933,6 +997,175 @@ CCHAR ParaNdis6_RSSGetCurrentCpuReceiveQueue(PARANDIS_RSS_PARAMS *RSSParameters)
     return res;
 }
 
+static VOID DeviceSteeringWorkItem(PVOID WorkItemContext, NDIS_HANDLE NdisIoWorkItemHandle)
+{
+    PARANDIS_ADAPTER *pContext = (PARANDIS_ADAPTER *)WorkItemContext;
+    PARANDIS_RSS_PARAMS *RSSParameters = &pContext->RSSParameters;
+    LARGE_INTEGER now;
+    UNREFERENCED_PARAMETER(NdisIoWorkItemHandle);
+
+    // buckets steered while waiting out the interval go to the device in the same update
+    NdisGetCurrentSystemTime(&now);
+    LONGLONG elapsedUs = (now.QuadPart - RSSParameters->DeviceSteeringTime.QuadPart) / 10;
+    if (elapsedUs >= 0 && elapsedUs < PARANDIS_RSS_STEERING_INTERVAL_MS * 1000)
+    {
+        NdisMSleep((ULONG)(PARANDIS_RSS_STEERING_INTERVAL_MS * 1000 - elapsedUs));
+    }
+
+    virtio_net_rss_config *cfg = NULL;
+    ULONG config_size = 0;
+    LONG generation;
+
+    InterlockedExchange(&RSSParameters->DeviceSteeringDirty, 0);
+
+    // the transmit path shares the read lock, it is not held up by the snapshot
+    {
+        CNdisPassiveReadAutoLock autoLock(RSSParameters->rwLock);
+
+        generation = RSSParameters->DeviceSettingsGeneration;
+        if (pContext->bRSSSupportedByDevice && RSSParameters->RSSMode == PARANDIS_RSS_FULL)
+        {
+            cfg = BuildDeviceRSSConfig(pContext, &config_size);
+        }
+    }
+
+    if (cfg != NULL)
+    {
+        pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG,
+                                            cfg, config_size, NULL, 0, 2);
+        NdisFreeMemory(cfg, NULL, 0);
+
+        bool stale;
+        {
+            CNdisPassiveReadAutoLock autoLock(RSSParameters->rwLock);
+            stale = (generation != RSSParameters->DeviceSettingsGeneration);
+        }
+
+        // settings sent by an OID after the snapshot may have been overwritten
+        // by it, send them again (rare, so the write lock is fine here)
+        if (stale)
+        {
+            CNdisPassiveWriteAutoLock autoLock(RSSParameters->rwLock);
+
+            if (pContext->bRSSSupportedByDevice)
+            {
+                SetDeviceRSSSettings(pContext);
+            }
+            else
+            {
+                // device RSS was switched off meanwhile
+                virtio_net_rss_config off = {};
+                off.max_tx_vq = (USHORT)pContext->nPathBundles;
+                pContext->CXPath.SendControlMessage(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG,
+                                                    &off, sizeof(off), NULL, 0, 2);
+            }
+        }
+    }
+
+    NdisGetCurrentSystemTime(&RSSParameters->DeviceSteeringTime);
+    InterlockedExchange(&RSSParameters->DeviceSteeringPending, 0);
+
+    // steered after the snapshot, schedule the next update
+    if (RSSParameters->DeviceSteeringDirty && !InterlockedCompareExchange(&RSSParameters->DeviceSteeringPending, 1, 0))
+    {
+        NdisQueueIoWorkItem(RSSParameters->DeviceSteeringWorkItem, DeviceSteeringWorkItem, pContext);
+    }
+}
+
+VOID ParaNdis6_RSSRecordTransmitFlows(PARANDIS_ADAPTER *pContext, PNET_BUFFER_LIST pNBL)
+{
+    PARANDIS_RSS_PARAMS *RSSParameters = &pContext->RSSParameters;
+    PPARANDIS_SCALING_SETTINGS scalingSettings = &RSSParameters->ActiveRSSScalingSettings;
+    PARANDIS_RSS_FLOW_ENTRY flow;
+    PROCESSOR_NUMBER currProcessor;
+    bool steerDevice = false;
+
+    if (RSSParameters->RSSMode != PARANDIS_RSS_FULL ||
+        scalingSettings->FirstQueueIndirectionIndex == INVALID_INDIRECTION_INDEX)
+    {
+        return;
+    }
+
+    // CPUs without a receive queue leave their flows to the indirection table
+    flow.Queue = FindReceiveQueueForCurrentCpu(scalingSettings);
+    if (flow.Queue == PARANDIS_RECEIVE_NO_QUEUE)
+    {
+        return;
+    }
+    currProcessor = scalingSettings->QueueProcessor[flow.Queue];
+
+    for (; pNBL != NULL; pNBL = NET_BUFFER_LIST_NEXT_NBL(pNBL))
+    {
+        if (NET_BUFFER_LIST_GET_HASH_TYPE(pNBL) == 0)
+        {
+            continue;
+        }
+
+        flow.Hash = NET_BUFFER_LIST_GET_HASH_VALUE(pNBL);
+
+        PARANDIS_RSS_FLOW_ENTRY *entry = &RSSParameters->FlowTable[flow.Hash & (PARANDIS_RSS_FLOW_TABLE_SIZE - 1)];
+        // steady flows only read the entry, so it is not bounced between CPUs
+        if (entry->Value == flow.Value)
+        {
+            continue;
+        }
+        InterlockedExchange64(&entry->Value, flow.Value);
+
+        if (pContext->bRSSSupportedByDevice && RSSParameters->DeviceSteeringWorkItem != NULL)
+        {
+            PARANDIS_RSS_STEERED_BUCKET *bucket = &RSSParameters->SteeredIndirectionTable[flow.Hash & scalingSettings->RSSHashMask];
+            PARANDIS_RSS_STEERED_BUCKET current, steered;
+
+            // the first transmitter pins the bucket, flows of other CPUs
+            // hashing into it do not bounce it, and the device, between them
+            current.Value = *(volatile LONG *)&bucket->Value;
+            if (current.Processor.Reserved == PARANDIS_RSS_BUCKET_STEERED)
+            {
+                continue;
+            }
+            steered.Value = 0;
+            steered.Processor.Group = currProcessor.Group;
+            steered.Processor.Number = currProcessor.Number;
+            steered.Processor.Reserved = PARANDIS_RSS_BUCKET_STEERED;
+            // other transmitters update buckets under the read lock as well
+            if (InterlockedCompareExchange(&bucket->Value, steered.Value, current.Value) == current.Value &&
+                (current.Processor.Group != steered.Processor.Group ||
+                 current.Processor.Number != steered.Processor.Number))
+            {
+                steerDevice = true;
+            }
+        }
+    }
+
+    // the control queue waits for the device, so it is updated at PASSIVE_LEVEL
+    if (steerDevice)
+    {
+        InterlockedExchange(&RSSParameters->DeviceSteeringDirty, 1);
+    }
+    if (steerDevice && !InterlockedCompareExchange(&RSSParameters->DeviceSteeringPending, 1, 0))
+    {
+        NdisQueueIoWorkItem(RSSParameters->DeviceSteeringWorkItem, DeviceSteeringWorkItem, pContext);
+    }
+}
+
+VOID ParaNdis6_RSSStopDeviceSteering(PARANDIS_ADAPTER *pContext)
+{
+    PARANDIS_RSS_PARAMS *RSSParameters = &pContext->RSSParameters;
+
+    if (RSSParameters->DeviceSteeringWorkItem == NULL)
+    {
+        return;
+    }
+
+    while (InterlockedCompareExchange(&RSSParameters->DeviceSteeringPending, 1, 0))
+    {
+        NdisMSleep(1000);
+    }
+
+    NdisFreeIoWorkItem(RSSParameters->DeviceSteeringWorkItem);
+    RSSParameters->DeviceSteeringWorkItem = NULL;
+}
+
 static void PrintIndirectionTable(const NDIS_RECEIVE_SCALE_PARAMETERS* Params)
 {
     ULONG IndirectionTableEntries = Params->IndirectionTableSize / sizeof(PROCESSOR_NUMBER);
@@ -1069,6 +1302,8 @@ NDIS_STATUS ParaNdis_SetupRSSQueueMap(PARANDIS_ADAPTER *pContext)
 
 void ParaNdis6_EnableDeviceRssSupport(PARANDIS_ADAPTER *pContext, BOOLEAN b)
 {
+    CNdisPassiveWriteAutoLock autoLock(pContext->RSSParameters.rwLock);
+
     if (!b)
     {
         SetDeviceRSSSettings(pContext, true);
@@ -19,12 +19,34 @@ typedef int (*proc_virtqueue_add_buf)(
     void *va_indirect,
     ULONGLONG phys_indirect);
 
+/* One buffer of a virtqueue_add_bufs batch, the fields have the same meaning
+ * as the corresponding virtqueue_add_buf arguments */
+struct virtqueue_buf {
+    struct scatterlist *sg;
+    unsigned int out_num;
+    unsigned int in_num;
+    void *opaque;
+    void *va_indirect;
+    ULONGLONG phys_indirect;
+};
+
+typedef int (*proc_virtqueue_add_bufs)(
+    struct virtqueue *vq,
+    struct virtqueue_buf bufs[],
+    unsigned int num);
+
 typedef bool(*proc_virtqueue_kick_prepare)(struct virtqueue *vq);
 
 typedef void(*proc_virtqueue_kick_always)(struct virtqueue *vq);
 
 typedef void * (*proc_virtqueue_get_buf)(struct virtqueue *vq, unsigned int *len);
 
+typedef unsigned int (*proc_virtqueue_get_bufs)(
+    struct virtqueue *vq,
+    void *opaque[],
+    unsigned int len[],
+    unsigned int max);
+
 typedef void(*proc_virtqueue_disable_cb)(struct virtqueue *vq);
 
 typedef bool(*proc_virtqueue_enable_cb)(struct virtqueue *vq);
@@ -47,10 +69,13 @@ struct virtqueue {
     void         *notification_addr;
     void         *avail_va;
     void         *used_va;
+    u32          notification_data; /* doorbell value captured by the last kick */
     proc_virtqueue_add_buf add_buf;
+    proc_virtqueue_add_bufs add_bufs;
     proc_virtqueue_kick_prepare kick_prepare;
     proc_virtqueue_kick_always kick_always;
     proc_virtqueue_get_buf get_buf;
+    proc_virtqueue_get_bufs get_bufs;
     proc_virtqueue_disable_cb disable_cb;
     proc_virtqueue_enable_cb enable_cb;
     proc_virtqueue_enable_cb_delayed enable_cb_delayed;
@@ -72,6 +97,16 @@ static inline int virtqueue_add_buf(
     return vq->add_buf(vq, sg, out_num, in_num, opaque, va_indirect, phys_indirect);
 }
 
+/* Adds up to num buffers and publishes them to the device at once, returns the number
+ * of buffers added which is less than num if the queue ran out of descriptors */
+static inline int virtqueue_add_bufs(
+    struct virtqueue *vq,
+    struct virtqueue_buf bufs[],
+    unsigned int num)
+{
+    return vq->add_bufs(vq, bufs, num);
+}
+
 static inline bool virtqueue_kick_prepare(struct virtqueue *vq)
 {
     return vq->kick_prepare(vq);
@@ -82,11 +117,31 @@ static inline void virtqueue_kick_always(struct virtqueue *vq)
     vq->kick_always(vq);
 }
 
+/* Returns the VIRTIO_F_NOTIFICATION_DATA doorbell value: the queue index in bits 0-15,
+ * the position of the next available entry in bits 16-30 and its wrap counter in bit 31.
+ * The value is captured by virtqueue_kick_prepare under the caller's lock, so that the
+ * notification may be sent after the lock is dropped */
+static inline u32 virtqueue_notification_data(struct virtqueue *vq)
+{
+    return vq->notification_data;
+}
+
 static inline void *virtqueue_get_buf(struct virtqueue *vq, unsigned int *len)
 {
     return vq->get_buf(vq, len);
 }
 
+/* Gets up to max returned buffers reading the used index only once, returns the number
+ * of entries stored in opaque and len; len may be NULL if the lengths are not needed */
+static inline unsigned int virtqueue_get_bufs(
+    struct virtqueue *vq,
+    void *opaque[],
+    unsigned int len[],
+    unsigned int max)
+{
+    return vq->get_bufs(vq, opaque, len, max);
+}
+
 static inline void virtqueue_disable_cb(struct virtqueue *vq)
 {
     vq->disable_cb(vq);
@@ -125,4 +180,62 @@ static inline void virtqueue_shutdown(struct virtqueue *vq)
 void virtqueue_notify(struct virtqueue *vq);
 void virtqueue_kick(struct virtqueue *vq);
 
+/* Adaptive interrupt moderation, see VirtIOModeration.c. Decides how callbacks are
+ * re-armed after a completion pass from the number of buffers recent passes returned */
+typedef enum virtqueue_moderation_mode {
+    VIRTQUEUE_MODERATION_IMMEDIATE, /* virtqueue_enable_cb */
+    VIRTQUEUE_MODERATION_DELAYED,   /* virtqueue_enable_cb_delayed */
+    VIRTQUEUE_MODERATION_POLL,      /* callbacks stay off while the queue is polled */
+} VIRTQUEUE_MODERATION_MODE;
+
+struct virtqueue_moderation {
+    /* average buffers per pass at which callbacks are delayed */
+    unsigned int delay_threshold;
+    /* average buffers per pass at which the queue is polled */
+    unsigned int poll_threshold;
+    /* maximum number of consecutive poll passes */
+    unsigned int poll_budget;
+    /* maximum number of used ring checks while waiting for the next poll pass */
+    unsigned int poll_spins;
+
+    VIRTQUEUE_MODERATION_MODE mode;
+    /* moving average of buffers per pass, in 1/16 units */
+    unsigned int average;
+    unsigned int polls;
+    bool armed;
+    /* the last pass left callbacks disabled for virtqueue_moderation_poll */
+    volatile bool polling;
+    /* false re-arms callbacks like virtqueue_enable_cb */
+    bool enabled;
+
+    /* passes started by a callback */
+    ULONGLONG callbacks;
+    /* passes that returned buffers without a callback */
+    ULONGLONG interrupts_avoided;
+    /* buffers returned */
+    ULONGLONG completed;
+    /* callbacks re-armed with virtqueue_enable_cb_delayed */
+    ULONGLONG delayed;
+    ULONGLONG mode_changes;
+    /* poll windows which found buffers before running out of spins */
+    ULONGLONG poll_hits;
+    /* poll windows which ran out of spins */
+    ULONGLONG poll_misses;
+};
+
+void virtqueue_moderation_init(struct virtqueue_moderation *mod, bool enabled);
+
+/* Re-arms callbacks after a pass which returned completed buffers. Like virtqueue_enable_cb,
+ * returns false if the caller should disable callbacks and run another pass */
+bool virtqueue_moderation_enable_cb(
+    struct virtqueue_moderation *mod,
+    struct virtqueue *vq,
+    unsigned int completed);
+
+/* Called without the queue lock once the buffers of the last passes are completed.
+ * Returns true if the caller should take the lock and run another pass */
+bool virtqueue_moderation_poll(
+    struct virtqueue_moderation *mod,
+    struct virtqueue *vq);
+
 #endif /* _LINUX_VIRTIO_H */
@@ -0,0 +1,206 @@
+/*
+ * Adaptive interrupt moderation for virtqueues
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "osdep.h"
+#include "virtio_pci.h"
+#include "VirtIO.h"
+#include "kdebugprint.h"
+
+/*
+ * A driver completion loop normally looks like
+ *
+ *     do {
+ *         virtqueue_disable_cb(vq);
+ *         while ((buf = virtqueue_get_buf(vq, &len)) != NULL) { ... }
+ *     } while (!virtqueue_enable_cb(vq));
+ *
+ * which asks for a callback per returned buffer no matter how busy the queue is.
+ * virtqueue_moderation_enable_cb replaces the final virtqueue_enable_cb and picks
+ * how to re-arm from a moving average of the buffers returned per pass:
+ *
+ *  - few buffers per pass: re-arm immediately, latency is what matters
+ *  - more: re-arm with virtqueue_enable_cb_delayed so that the device interrupts
+ *    once ~3/4 of the in-flight buffers have been returned
+ *  - many: keep callbacks disabled and poll. After a pass, the caller drops the
+ *    queue lock and calls virtqueue_moderation_poll, which checks the used ring up
+ *    to poll_spins times, then takes the lock again for another pass. The window
+ *    closes after poll_budget passes or after a pass which found nothing, then
+ *    callbacks are re-armed delayed
+ *
+ *     lock;
+ *     do { ... } while (!virtqueue_moderation_enable_cb(mod, vq, completed));
+ *     unlock;
+ *     complete the buffers;
+ *     if (virtqueue_moderation_poll(mod, vq)) start over;
+ *
+ * Moving down a level requires the average to drop below half of the threshold
+ * so that the mode does not flap around it. The structure is per queue and must
+ * be used under the same lock as the completion loop, virtqueue_moderation_poll
+ * excepted. A disabled structure re-arms callbacks like virtqueue_enable_cb.
+ */
+
+#define MODERATION_SHIFT            4
+#define MODERATION_DELAY_THRESHOLD  4
+#define MODERATION_POLL_THRESHOLD   16
+#define MODERATION_POLL_BUDGET      8
+#define MODERATION_POLL_SPINS       64
+
+void virtqueue_moderation_init(struct virtqueue_moderation *mod, bool enabled)
+{
+    RtlZeroMemory(mod, sizeof(*mod));
+    mod->enabled = enabled;
+    mod->delay_threshold = MODERATION_DELAY_THRESHOLD;
+    mod->poll_threshold = MODERATION_POLL_THRESHOLD;
+    mod->poll_budget = MODERATION_POLL_BUDGET;
+    mod->poll_spins = MODERATION_POLL_SPINS;
+    mod->mode = VIRTQUEUE_MODERATION_IMMEDIATE;
+    mod->armed = true;
+}
+
+static VIRTQUEUE_MODERATION_MODE moderation_select_mode(struct virtqueue_moderation *mod)
+{
+    unsigned int delay = mod->delay_threshold << MODERATION_SHIFT;
+    unsigned int poll = mod->poll_threshold << MODERATION_SHIFT;
+
+    switch (mod->mode) {
+    case VIRTQUEUE_MODERATION_IMMEDIATE:
+        if (mod->average >= poll) {
+            return VIRTQUEUE_MODERATION_POLL;
+        }
+        if (mod->average >= delay) {
+            return VIRTQUEUE_MODERATION_DELAYED;
+        }
+        break;
+    case VIRTQUEUE_MODERATION_DELAYED:
+        if (mod->average >= poll) {
+            return VIRTQUEUE_MODERATION_POLL;
+        }
+        if (mod->average < delay / 2) {
+            return VIRTQUEUE_MODERATION_IMMEDIATE;
+        }
+        break;
+    case VIRTQUEUE_MODERATION_POLL:
+        if (mod->average < delay / 2) {
+            return VIRTQUEUE_MODERATION_IMMEDIATE;
+        }
+        if (mod->average < poll / 2) {
+            return VIRTQUEUE_MODERATION_DELAYED;
+        }
+        break;
+    }
+    return mod->mode;
+}
+
+bool virtqueue_moderation_enable_cb(
+    struct virtqueue_moderation *mod, /* per queue moderation state */
+    struct virtqueue *vq,             /* the queue */
+    unsigned int completed)           /* buffers returned by the pass which just ended */
+{
+    VIRTQUEUE_MODERATION_MODE mode;
+    bool done;
+
+    if (!mod->enabled) {
+        done = virtqueue_enable_cb(vq);
+        if (!done) {
+            virtqueue_disable_cb(vq);
+        }
+        return done;
+    }
+
+    if (mod->polling && completed == 0) {
+        /* the poll window found nothing, this pass only closes it and
+         * does not count towards the average */
+        mod->poll_misses++;
+        mod->polls = 0;
+        mode = mod->mode;
+    } else {
+        if (mod->polling) {
+            mod->poll_hits++;
+        }
+        if (mod->armed) {
+            mod->callbacks++;
+        } else if (completed) {
+            mod->interrupts_avoided++;
+        }
+        mod->completed += completed;
+
+        /* average += (completed - average) / 8 */
+        mod->average = mod->average - (mod->average >> 3) + ((completed << MODERATION_SHIFT) >> 3);
+
+        mode = moderation_select_mode(mod);
+        if (mode != mod->mode) {
+            DPrintf(5, "%s: queue %u moderation %d -> %d (average %u/16)\n",
+                __FUNCTION__, vq->index, mod->mode, mode, mod->average);
+            mod->mode = mode;
+            mod->polls = 0;
+            mod->mode_changes++;
+        }
+
+        if (mode == VIRTQUEUE_MODERATION_POLL) {
+            if (mod->polls < mod->poll_budget) {
+                /* callbacks stay disabled, the caller polls without the lock */
+                mod->polls++;
+                mod->armed = false;
+                mod->polling = true;
+                return true;
+            }
+            mod->polls = 0;
+        }
+    }
+    mod->polling = false;
+
+    if (mode == VIRTQUEUE_MODERATION_IMMEDIATE) {
+        done = virtqueue_enable_cb(vq);
+    } else {
+        done = virtqueue_enable_cb_delayed(vq);
+        mod->delayed++;
+    }
+    if (!done) {
+        virtqueue_disable_cb(vq);
+    }
+    mod->armed = done;
+    return done;
+}
+
+/* polling is read without the lock. It is written by the last pass, whose caller
+ * sees its own value, so a stale value here only costs an extra pass */
+bool virtqueue_moderation_poll(struct virtqueue_moderation *mod, struct virtqueue *vq)
+{
+    unsigned int spins;
+
+    if (!mod->polling) {
+        return false;
+    }
+    for (spins = 0; spins < mod->poll_spins; spins++) {
+        if (virtqueue_has_buf(vq)) {
+            break;
+        }
+        YieldProcessor();
+    }
+    /* callbacks are still disabled, the next pass either harvests
+     * the buffers or re-arms them */
+    return true;
+}
@@ -123,6 +123,8 @@ NTSTATUS virtio_set_features(VirtIODevice *vdev, u64 features)
 
     vdev->event_suppression_enabled = virtio_is_feature_enabled(features, VIRTIO_RING_F_EVENT_IDX);
     vdev->packed_ring = virtio_is_feature_enabled(features, VIRTIO_F_RING_PACKED);
+    vdev->in_order = virtio_is_feature_enabled(features, VIRTIO_F_IN_ORDER);
+    vdev->notification_data = false;
 
     status = vdev->device->set_features(vdev, features);
     if (!NT_SUCCESS(status)) {
@@ -393,8 +395,14 @@ int virtio_get_bar_index(PPCI_COMMON_HEADER pPCIHeader, PHYSICAL_ADDRESS BasePA)
 bool vp_notify(struct virtqueue *vq)
 {
     /* we write the queue's selector into the notification register to
-     * signal the other end */
-    iowrite16(vq->vdev, (unsigned short)vq->index, vq->notification_addr);
+     * signal the other end, extended with the next available position if
+     * VIRTIO_F_NOTIFICATION_DATA has been negotiated, as captured by the
+     * last virtqueue_kick_prepare */
+    if (vq->vdev->notification_data) {
+        iowrite32(vq->vdev, virtqueue_notification_data(vq), vq->notification_addr);
+    } else {
+        iowrite16(vq->vdev, (unsigned short)vq->index, vq->notification_addr);
+    }
     DPrintf(6, "virtio: vp_notify vq->index = %x\n", vq->index);
     return true;
 }
@@ -205,6 +205,10 @@ static NTSTATUS vio_modern_set_features(VirtIODevice *vdev, u64 features)
     /* Give virtio_ring a chance to accept features. */
     vring_transport_features(vdev, &features);
 
+    /* Drivers opt in to notification data, the doorbell value is captured by
+     * virtqueue_kick_prepare so every notification must follow one */
+    vdev->notification_data = virtio_is_feature_enabled(features, VIRTIO_F_NOTIFICATION_DATA);
+
     if (!virtio_is_feature_enabled(features, VIRTIO_F_VERSION_1)) {
         DPrintf(0, ("virtio: device uses modern interface but does not have VIRTIO_F_VERSION_1\n"));
         return STATUS_INVALID_PARAMETER;
@@ -290,6 +294,8 @@ static NTSTATUS vio_modern_setup_vq(struct virtqueue **queue,
     struct virtqueue *vq;
     void *vq_addr;
     u16 off;
+    /* notifications carrying VIRTIO_F_NOTIFICATION_DATA are 32-bit writes */
+    u32 notify_size = vdev->notification_data ? sizeof(u32) : sizeof(u16);
     unsigned long ring_size, heap_size;
     NTSTATUS status;
 
@@ -343,7 +349,7 @@ static NTSTATUS vio_modern_setup_vq(struct virtqueue **queue,
 
     if (vdev->notify_base) {
         /* offset should not wrap */
-        if ((u64)off * vdev->notify_offset_multiplier + 2
+        if ((u64)off * vdev->notify_offset_multiplier + notify_size
             > vdev->notify_len) {
             DPrintf(0,
                 "%p: bad notification offset %u (x %u) "
@@ -358,8 +364,8 @@ static NTSTATUS vio_modern_setup_vq(struct virtqueue **queue,
             off * vdev->notify_offset_multiplier);
     } else {
         vq->notification_addr = vio_modern_map_capability(vdev,
-            vdev->notify_map_cap, 2, 2,
-            off * vdev->notify_offset_multiplier, 2,
+            vdev->notify_map_cap, notify_size, 2,
+            off * vdev->notify_offset_multiplier, notify_size,
             NULL);
     }
 
@@ -507,6 +513,38 @@ static void find_pci_vendor_capabilities(VirtIODevice *vdev, int *Offsets, size_
     }
 }
 
+bool virtio_get_shm_region(VirtIODevice *vdev, u8 id, int *bar, u64 *offset, u64 *length)
+{
+    u8 pos = find_first_pci_vendor_capability(vdev);
+    while (pos > 0) {
+        u8 cfg_type, cap_bar, cap_id;
+        u32 lo, hi;
+
+        pci_read_config_byte(vdev, pos + offsetof(struct virtio_pci_cap, cfg_type), &cfg_type);
+        pci_read_config_byte(vdev, pos + offsetof(struct virtio_pci_cap, bar), &cap_bar);
+        pci_read_config_byte(vdev, pos + offsetof(struct virtio_pci_cap, id), &cap_id);
+
+        if (cfg_type == VIRTIO_PCI_CAP_SHARED_MEMORY_CFG &&
+            cap_id == id &&
+            cap_bar < PCI_TYPE0_ADDRESSES &&
+            pci_get_resource_len(vdev, cap_bar) > 0) {
+            pci_read_config_dword(vdev, pos + offsetof(struct virtio_pci_cap, offset), &lo);
+            pci_read_config_dword(vdev, pos + offsetof(struct virtio_pci_cap64, offset_hi), &hi);
+            *offset = ((u64)hi << 32) | lo;
+
+            pci_read_config_dword(vdev, pos + offsetof(struct virtio_pci_cap, length), &lo);
+            pci_read_config_dword(vdev, pos + offsetof(struct virtio_pci_cap64, length_hi), &hi);
+            *length = ((u64)hi << 32) | lo;
+
+            *bar = cap_bar;
+            return true;
+        }
+
+        pos = find_next_pci_vendor_capability(vdev, pos + offsetof(PCI_CAPABILITIES_HEADER, Next));
+    }
+    return false;
+}
+
 /* Modern device initialization */
 NTSTATUS vio_modern_initialize(VirtIODevice *vdev)
 {
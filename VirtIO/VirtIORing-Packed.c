@@ -32,10 +32,10 @@
 
 #include "osdep.h"
 #include "virtio_pci.h"
-#include "virtio.h"
+#include "VirtIO.h"
 #include "kdebugprint.h"
 #include "virtio_ring.h"
-#include "windows\virtio_ring_allocation.h"
+#include "windows/virtio_ring_allocation.h"
 
 #include <pshpack1.h>
 
@@ -127,6 +127,15 @@ struct virtqueue_packed {
     u16 last_used_idx;
     /* Avail used flags. */
     u16 avail_used_flags;
+    /*
+     * VIRTIO_F_IN_ORDER: buffer ids are the positions of their head descriptors
+     * and a single used descriptor may stand for a batch of buffers, the last one
+     * of which is in_order_batch_last.
+     */
+    bool in_order;
+    bool in_order_batch;
+    u16 in_order_batch_last;
+    unsigned int in_order_batch_len;
     struct
     {
         /* Driver ring wrap counter. */
@@ -168,23 +177,28 @@ unsigned long vring_size_packed(unsigned int num, unsigned long align)
     return res;
 }
 
-static int virtqueue_add_buf_packed(
-    struct virtqueue *_vq,    /* the queue */
+/* Writes the descriptors of a buffer except for the flags of the head descriptor,
+ * which make the buffer visible to the device and are returned in head_flags.
+ * Returns 0 on success, negative number on error */
+static int virtqueue_add_desc_packed(
+    struct virtqueue_packed *vq, /* the queue */
     struct scatterlist sg[], /* sg array of length out + in */
     unsigned int out,        /* number of driver->device buffer descriptors in sg */
     unsigned int in,         /* number of device->driver buffer descriptors in sg */
     void *opaque,            /* later returned from virtqueue_get_buf */
     void *va_indirect,       /* VA of the indirect page or NULL */
-    ULONGLONG phys_indirect) /* PA of the indirect page or 0 */
+    ULONGLONG phys_indirect, /* PA of the indirect page or 0 */
+    u16 *phead,              /* index of the head descriptor on return */
+    u16 *phead_flags)        /* flags to write to the head descriptor on return */
 {
-    struct virtqueue_packed *vq = packedvq(_vq);
     unsigned int descs_used;
     struct vring_packed_desc *desc;
     u16 head, id, i;
 
     descs_used = out + in;
     head = vq->packed.next_avail_idx;
-    id = (u16)vq->free_head;
+    /* In-order queues release ids in the order they were allocated, use the head position */
+    id = vq->in_order ? head : (u16)vq->free_head;
 
     BUG_ON(descs_used == 0);
     BUG_ON(id >= vq->packed.vring.num);
@@ -200,8 +214,8 @@ static int virtqueue_add_buf_packed(
         vq->packed.vring.desc[head].len = descs_used * sizeof(struct vring_packed_desc);
         vq->packed.vring.desc[head].id = id;
 
-        KeMemoryBarrier();
-        vq->packed.vring.desc[head].flags = VRING_DESC_F_INDIRECT | vq->avail_used_flags;
+        *phead = head;
+        *phead_flags = VRING_DESC_F_INDIRECT | vq->avail_used_flags;
 
         DPrintf(5, "Added buffer head %i to Q%d\n", head, vq->vq.index);
         head++;
@@ -217,7 +231,9 @@ static int virtqueue_add_buf_packed(
         vq->num_free -= 1;
         vq->num_added += 1;
 
-        vq->free_head = vq->packed.desc_state[id].next;
+        if (!vq->in_order) {
+            vq->free_head = vq->packed.desc_state[id].next;
+        }
 
         /* Store token and indirect buffer state. */
         vq->packed.desc_state[id].num = 1;
@@ -269,20 +285,17 @@ static int virtqueue_add_buf_packed(
 
         /* Update free pointer */
         vq->packed.next_avail_idx = i;
-        vq->free_head = curr;
+        if (!vq->in_order) {
+            vq->free_head = curr;
+        }
 
         /* Store token. */
         vq->packed.desc_state[id].num = (u16)descs_used;
         vq->packed.desc_state[id].data = opaque;
         vq->packed.desc_state[id].last = prev;
 
-        /*
-         * A driver MUST NOT make the first descriptor in the list
-         * available before all subsequent descriptors comprising
-         * the list are made available.
-         */
-        KeMemoryBarrier();
-        vq->packed.vring.desc[head].flags = head_flags;
+        *phead = head;
+        *phead_flags = head_flags;
         vq->num_added += descs_used;
 
         DPrintf(5, "Added buffer head @%i+%d to Q%d\n", head, descs_used, vq->vq.index);
@@ -291,6 +304,74 @@ static int virtqueue_add_buf_packed(
     return 0;
 }
 
+static int virtqueue_add_buf_packed(
+    struct virtqueue *_vq,    /* the queue */
+    struct scatterlist sg[], /* sg array of length out + in */
+    unsigned int out,        /* number of driver->device buffer descriptors in sg */
+    unsigned int in,         /* number of device->driver buffer descriptors in sg */
+    void *opaque,            /* later returned from virtqueue_get_buf */
+    void *va_indirect,       /* VA of the indirect page or NULL */
+    ULONGLONG phys_indirect) /* PA of the indirect page or 0 */
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    u16 head, head_flags;
+    int res;
+
+    res = virtqueue_add_desc_packed(vq, sg, out, in, opaque, va_indirect, phys_indirect,
+        &head, &head_flags);
+    if (res < 0) {
+        return res;
+    }
+
+    /*
+     * A driver MUST NOT make the first descriptor in the list
+     * available before all subsequent descriptors comprising
+     * the list are made available.
+     */
+    KeMemoryBarrier();
+    vq->packed.vring.desc[head].flags = head_flags;
+
+    return 0;
+}
+
+/* Adds up to num buffers to a virtqueue and makes them available after a single
+ * memory barrier, returns the number of buffers added */
+static int virtqueue_add_bufs_packed(
+    struct virtqueue *_vq,        /* the queue */
+    struct virtqueue_buf bufs[], /* buffers to add, in order */
+    unsigned int num)            /* number of entries in bufs */
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    u16 first_head = 0, first_head_flags = 0, head, head_flags;
+    unsigned int i;
+
+    for (i = 0; i < num; i++) {
+        if (virtqueue_add_desc_packed(vq, bufs[i].sg, bufs[i].out_num, bufs[i].in_num,
+            bufs[i].opaque, bufs[i].va_indirect, bufs[i].phys_indirect,
+            &head, &head_flags) < 0) {
+            break;
+        }
+        if (i == 0) {
+            first_head = head;
+            first_head_flags = head_flags;
+        } else {
+            /*
+             * The device does not look past the first head of the batch
+             * until it is made available, so the following ones can be
+             * exposed right away.
+             */
+            vq->packed.vring.desc[head].flags = head_flags;
+        }
+    }
+
+    if (i > 0) {
+        KeMemoryBarrier();
+        vq->packed.vring.desc[first_head].flags = first_head_flags;
+    }
+
+    return (int)i;
+}
+
 static void detach_buf_packed(struct virtqueue_packed *vq, unsigned int id)
 {
     struct vring_desc_state_packed *state = &vq->packed.desc_state[id];
@@ -395,7 +476,7 @@ static bool virtqueue_enable_cb_packed(struct virtqueue *_vq)
     struct virtqueue_packed *vq = packedvq(_vq);
     unsigned last_used_idx = virtqueue_enable_cb_prepare_packed(vq);
 
-    return !virtqueue_poll_packed(vq, (u16)last_used_idx);
+    return !vq->in_order_batch && !virtqueue_poll_packed(vq, (u16)last_used_idx);
 }
 
 static bool virtqueue_enable_cb_delayed_packed(struct virtqueue *_vq)
@@ -444,7 +525,7 @@ static bool virtqueue_enable_cb_delayed_packed(struct virtqueue *_vq)
      */
     KeMemoryBarrier();
 
-    if (is_used_desc_packed(vq,
+    if (vq->in_order_batch || is_used_desc_packed(vq,
         vq->last_used_idx,
         vq->packed.used_wrap_counter)) {
         return false;
@@ -537,10 +618,209 @@ static void *virtqueue_get_buf_packed(
     return ret;
 }
 
+static unsigned int virtqueue_get_bufs_packed(
+    struct virtqueue *_vq, /* the queue */
+    void *opaque[],       /* returned opaque pointers */
+    unsigned int len[],   /* number of bytes returned by the device for each buffer, or NULL */
+    unsigned int max)     /* capacity of opaque and len */
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    unsigned int n = 0;
+    u16 last_used, id;
+
+    /*
+     * There is no used index in the packed ring, every entry carries its
+     * own flags and has to be checked before its id and length are read.
+     * What is saved is the event offset update, done once for the batch.
+     */
+    while (n < max && more_used_packed(vq)) {
+        /* Only get used elements after they have been exposed by host. */
+        KeMemoryBarrier();
+
+        last_used = vq->last_used_idx;
+        id = vq->packed.vring.desc[last_used].id;
+        if (len) {
+            len[n] = vq->packed.vring.desc[last_used].len;
+        }
+
+        if (id >= vq->packed.vring.num) {
+            BAD_RING(vq, "id %u out of range\n", id);
+            break;
+        }
+        if (!vq->packed.desc_state[id].data) {
+            BAD_RING(vq, "id %u is not a head!\n", id);
+            break;
+        }
+
+        /* detach_buf_packed clears data, so grab it now. */
+        opaque[n++] = vq->packed.desc_state[id].data;
+        detach_buf_packed(vq, id);
+
+        vq->last_used_idx += vq->packed.desc_state[id].num;
+        if (vq->last_used_idx >= vq->packed.vring.num) {
+            vq->last_used_idx -= (u16)vq->packed.vring.num;
+            vq->packed.used_wrap_counter ^= 1;
+        }
+    }
+
+    /*
+     * If we expect an interrupt for the next entry, tell host
+     * by writing event index and flush out the write before
+     * the read in the next get_buf call.
+     */
+    if (n && vq->packed.event_flags_shadow == VRING_PACKED_EVENT_FLAG_DESC) {
+        vq->packed.vring.driver->off_wrap = vq->last_used_idx |
+            ((u16)vq->packed.used_wrap_counter <<
+                VRING_PACKED_EVENT_F_WRAP_CTR);
+        KeMemoryBarrier();
+    }
+
+    return n;
+}
+
+/*
+ * Consumes the used descriptor at last_used_idx on an in-order queue. The device
+ * may write a single descriptor for a batch of buffers, carrying the id of the last
+ * one, and skip forward by the size of the whole batch.
+ */
+static bool virtqueue_fetch_used_in_order_packed(struct virtqueue_packed *vq)
+{
+    u16 last_used = vq->last_used_idx;
+    u16 id = vq->packed.vring.desc[last_used].id;
+
+    if (id >= vq->packed.vring.num) {
+        BAD_RING(vq, "id %u out of range\n", id);
+        return false;
+    }
+    if (!vq->packed.desc_state[id].data) {
+        BAD_RING(vq, "id %u is not a head!\n", id);
+        return false;
+    }
+
+    vq->in_order_batch = true;
+    vq->in_order_batch_last = id;
+    vq->in_order_batch_len = vq->packed.vring.desc[last_used].len;
+    return true;
+}
+
+/*
+ * Returns the oldest outstanding buffer of an in-order queue, its id is its head
+ * position so neither the descriptor nor the free list needs to be read.
+ */
+static void *virtqueue_pop_in_order_packed(struct virtqueue_packed *vq, unsigned int *len)
+{
+    struct vring_desc_state_packed *state = &vq->packed.desc_state[vq->last_used_idx];
+    void *ret = state->data;
+
+    if (vq->last_used_idx == vq->in_order_batch_last) {
+        vq->in_order_batch = false;
+        if (len) {
+            *len = vq->in_order_batch_len;
+        }
+    } else if (len) {
+        /* Only the last buffer of a batch has its length reported */
+        *len = 0;
+    }
+
+    state->data = NULL;
+    vq->num_free += state->num;
+
+    vq->last_used_idx += state->num;
+    if (vq->last_used_idx >= vq->packed.vring.num) {
+        vq->last_used_idx -= (u16)vq->packed.vring.num;
+        vq->packed.used_wrap_counter ^= 1;
+    }
+
+    BUG_ON(ret == NULL);
+    return ret;
+}
+
+static void *virtqueue_get_buf_in_order_packed(
+    struct virtqueue *_vq, /* the queue */
+    unsigned int *len)    /* number of bytes returned by the device */
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    void *ret;
+
+    if (!vq->in_order_batch) {
+        if (!more_used_packed(vq)) {
+            DPrintf(6, "%s: No more buffers in queue\n", __FUNCTION__);
+            return NULL;
+        }
+
+        /* Only get used elements after they have been exposed by host. */
+        KeMemoryBarrier();
+
+        if (!virtqueue_fetch_used_in_order_packed(vq)) {
+            return NULL;
+        }
+    }
+
+    ret = virtqueue_pop_in_order_packed(vq, len);
+
+    if (!vq->in_order_batch &&
+        vq->packed.event_flags_shadow == VRING_PACKED_EVENT_FLAG_DESC) {
+        vq->packed.vring.driver->off_wrap = vq->last_used_idx |
+            ((u16)vq->packed.used_wrap_counter <<
+                VRING_PACKED_EVENT_F_WRAP_CTR);
+        KeMemoryBarrier();
+    }
+
+    return ret;
+}
+
+static unsigned int virtqueue_get_bufs_in_order_packed(
+    struct virtqueue *_vq, /* the queue */
+    void *opaque[],       /* returned opaque pointers */
+    unsigned int len[],   /* number of bytes returned by the device for each buffer, or NULL */
+    unsigned int max)     /* capacity of opaque and len */
+{
+    struct virtqueue_packed *vq = packedvq(_vq);
+    unsigned int n = 0;
+
+    while (n < max) {
+        if (!vq->in_order_batch) {
+            if (!more_used_packed(vq)) {
+                break;
+            }
+
+            /* Only get used elements after they have been exposed by host. */
+            KeMemoryBarrier();
+
+            if (!virtqueue_fetch_used_in_order_packed(vq)) {
+                break;
+            }
+        }
+        opaque[n] = virtqueue_pop_in_order_packed(vq, len ? &len[n] : NULL);
+        n++;
+    }
+
+    if (n && !vq->in_order_batch &&
+        vq->packed.event_flags_shadow == VRING_PACKED_EVENT_FLAG_DESC) {
+        vq->packed.vring.driver->off_wrap = vq->last_used_idx |
+            ((u16)vq->packed.used_wrap_counter <<
+                VRING_PACKED_EVENT_F_WRAP_CTR);
+        KeMemoryBarrier();
+    }
+
+    return n;
+}
+
 static BOOLEAN virtqueue_has_buf_packed(struct virtqueue *_vq)
 {
     struct virtqueue_packed *vq = packedvq(_vq);
-    return more_used_packed(vq);
+    return vq->in_order_batch || more_used_packed(vq);
+}
+
+/*
+ * Returns the doorbell value for VIRTIO_F_NOTIFICATION_DATA: the offset of the next
+ * available descriptor and the driver ring wrap counter.
+ */
+static u32 notification_data_packed(struct virtqueue_packed *vq)
+{
+    return (u32)(u16)vq->vq.index |
+        ((u32)vq->packed.next_avail_idx << 16) |
+        ((u32)vq->packed.avail_wrap_counter << 31);
 }
 
 static bool virtqueue_kick_prepare_packed(struct virtqueue *_vq)
@@ -565,6 +845,7 @@ static bool virtqueue_kick_prepare_packed(struct virtqueue *_vq)
     old = vq->packed.next_avail_idx - vq->num_added;
     new = vq->packed.next_avail_idx;
     vq->num_added = 0;
+    _vq->notification_data = notification_data_packed(vq);
 
     snapshot.value32 = *(u32 *)vq->packed.vring.device;
     flags = snapshot.flags;
@@ -591,6 +872,7 @@ static void virtqueue_kick_always_packed(struct virtqueue *_vq)
     struct virtqueue_packed *vq = packedvq(_vq);
     KeMemoryBarrier();
     vq->num_added = 0;
+    _vq->notification_data = notification_data_packed(vq);
     virtqueue_notify(_vq);
 }
 
@@ -630,6 +912,11 @@ struct virtqueue *vring_new_virtqueue_packed(
     vq->packed.next_avail_idx = 0;
     vq->packed.event_flags_shadow = 0;
     vq->packed.desc_state = vq->desc_states;
+    vq->in_order = vdev->in_order;
+    vq->in_order_batch = false;
+    vq->in_order_batch_last = 0;
+    vq->in_order_batch_len = 0;
+    vq->vq.notification_data = notification_data_packed(vq);
 
     RtlZeroMemory(vq->packed.desc_state, num * sizeof(*vq->packed.desc_state));
     for (i = 0; i < num - 1; i++) {
@@ -637,11 +924,18 @@ struct virtqueue *vring_new_virtqueue_packed(
     }
 
     vq->vq.add_buf = virtqueue_add_buf_packed;
+    vq->vq.add_bufs = virtqueue_add_bufs_packed;
     vq->vq.detach_unused_buf = virtqueue_detach_unused_buf_packed;
     vq->vq.disable_cb = virtqueue_disable_cb_packed;
     vq->vq.enable_cb = virtqueue_enable_cb_packed;
     vq->vq.enable_cb_delayed = virtqueue_enable_cb_delayed_packed;
-    vq->vq.get_buf = virtqueue_get_buf_packed;
+    if (vq->in_order) {
+        vq->vq.get_buf = virtqueue_get_buf_in_order_packed;
+        vq->vq.get_bufs = virtqueue_get_bufs_in_order_packed;
+    } else {
+        vq->vq.get_buf = virtqueue_get_buf_packed;
+        vq->vq.get_bufs = virtqueue_get_bufs_packed;
+    }
     vq->vq.has_buf = virtqueue_has_buf_packed;
     vq->vq.is_interrupt_enabled = virtqueue_is_interrupt_enabled_packed;
     vq->vq.kick_always = virtqueue_kick_always_packed;
@@ -31,10 +31,10 @@
  */
 #include "osdep.h"
 #include "virtio_pci.h"
-#include "virtio.h"
+#include "VirtIO.h"
 #include "kdebugprint.h"
 #include "virtio_ring.h"
-#include "windows\virtio_ring_allocation.h"
+#include "windows/virtio_ring_allocation.h"
 
 #define DESC_INDEX(num, i) ((i) & ((num) - 1))
 
@@ -185,6 +185,14 @@ struct virtqueue_split {
     unsigned int num_added_since_kick;
     u16 first_unused;
     u16 last_used;
+    /* VIRTIO_F_IN_ORDER: buffers are returned in the order they were made available
+     * and one used entry may stand for a batch of them. in_order_next is the avail
+     * ring position of the next buffer to return, in_order_batch_end is one past the
+     * last buffer covered by the used entry being consumed */
+    bool in_order;
+    u16 in_order_next;
+    u16 in_order_batch_end;
+    unsigned int in_order_batch_len;
     void *opaque[];
 };
 
@@ -221,9 +229,10 @@ static inline void put_unused_desc_chain(struct virtqueue_split *vq, u16 idx)
     vq->first_unused = start;
 }
 
-/* Adds a buffer to a virtqueue, returns 0 on success, negative number on error */
-static int virtqueue_add_buf_split(
-    struct virtqueue *_vq,    /* the queue */
+/* Writes the descriptors of a buffer, returns the index of the first descriptor
+ * on success, negative number on error. The caller makes it available to the device */
+static int virtqueue_add_desc_split(
+    struct virtqueue_split *vq, /* the queue */
     struct scatterlist sg[], /* sg array of length out + in */
     unsigned int out,        /* number of driver->device buffer descriptors in sg */
     unsigned int in,         /* number of device->driver buffer descriptors in sg */
@@ -231,7 +240,6 @@ static int virtqueue_add_buf_split(
     void *va_indirect,       /* VA of the indirect page or NULL */
     ULONGLONG phys_indirect) /* PA of the indirect page or 0 */
 {
-    struct virtqueue_split *vq = splitvq(_vq);
     struct vring *vring = &vq->vring;
     unsigned int i;
     u16 idx;
@@ -290,8 +298,30 @@ static int virtqueue_add_buf_split(
         vring->desc[last_idx].flags &= ~VIRTQ_DESC_F_NEXT;
     }
 
+    return idx;
+}
+
+/* Adds a buffer to a virtqueue, returns 0 on success, negative number on error */
+static int virtqueue_add_buf_split(
+    struct virtqueue *_vq,    /* the queue */
+    struct scatterlist sg[], /* sg array of length out + in */
+    unsigned int out,        /* number of driver->device buffer descriptors in sg */
+    unsigned int in,         /* number of device->driver buffer descriptors in sg */
+    void *opaque,            /* later returned from virtqueue_get_buf */
+    void *va_indirect,       /* VA of the indirect page or NULL */
+    ULONGLONG phys_indirect) /* PA of the indirect page or 0 */
+{
+    struct virtqueue_split *vq = splitvq(_vq);
+    struct vring *vring = &vq->vring;
+    int idx;
+
+    idx = virtqueue_add_desc_split(vq, sg, out, in, opaque, va_indirect, phys_indirect);
+    if (idx < 0) {
+        return idx;
+    }
+
     /* Write the first descriptor into the available ring */
-    vring->avail->ring[DESC_INDEX(vring->num, vq->master_vring_avail.idx)] = idx;
+    vring->avail->ring[DESC_INDEX(vring->num, vq->master_vring_avail.idx)] = (u16)idx;
     KeMemoryBarrier();
     vring->avail->idx = ++vq->master_vring_avail.idx;
     vq->num_added_since_kick++;
@@ -299,6 +329,40 @@ static int virtqueue_add_buf_split(
     return 0;
 }
 
+/* Adds up to num buffers to a virtqueue and publishes them with a single available
+ * index update, returns the number of buffers added */
+static int virtqueue_add_bufs_split(
+    struct virtqueue *_vq,        /* the queue */
+    struct virtqueue_buf bufs[], /* buffers to add, in order */
+    unsigned int num)            /* number of entries in bufs */
+{
+    struct virtqueue_split *vq = splitvq(_vq);
+    struct vring *vring = &vq->vring;
+    u16 avail_idx = vq->master_vring_avail.idx;
+    unsigned int i;
+    int idx;
+
+    for (i = 0; i < num; i++) {
+        idx = virtqueue_add_desc_split(vq, bufs[i].sg, bufs[i].out_num, bufs[i].in_num,
+            bufs[i].opaque, bufs[i].va_indirect, bufs[i].phys_indirect);
+        if (idx < 0) {
+            break;
+        }
+        /* Write the first descriptor into the available ring */
+        vring->avail->ring[DESC_INDEX(vring->num, avail_idx)] = (u16)idx;
+        avail_idx++;
+    }
+
+    if (i > 0) {
+        KeMemoryBarrier();
+        vq->master_vring_avail.idx = avail_idx;
+        vring->avail->idx = avail_idx;
+        vq->num_added_since_kick += i;
+    }
+
+    return (int)i;
+}
+
 /* Gets the opaque pointer associated with a returned buffer, or NULL if no buffer is available */
 static void *virtqueue_get_buf_split(
     struct virtqueue *_vq, /* the queue */
@@ -334,11 +398,185 @@ static void *virtqueue_get_buf_split(
     return opaque;
 }
 
+/* Gets up to max returned buffers after reading the used index once, returns the number
+ * of opaque pointers stored in opaque[] and the corresponding lengths in len[] (optional) */
+static unsigned int virtqueue_get_bufs_split(
+    struct virtqueue *_vq, /* the queue */
+    void *opaque[],       /* returned opaque pointers */
+    unsigned int len[],   /* number of bytes returned by the device for each buffer, or NULL */
+    unsigned int max)     /* capacity of opaque and len */
+{
+    struct virtqueue_split *vq = splitvq(_vq);
+    unsigned int n = 0;
+    u16 used_idx, idx;
+
+    used_idx = vq->vring.used->idx;
+    if (vq->last_used == used_idx) {
+        /* No descriptor index in the used ring */
+        return 0;
+    }
+    KeMemoryBarrier();
+
+    while (vq->last_used != used_idx && n < max) {
+        idx = DESC_INDEX(vq->vring.num, vq->last_used);
+        if (len) {
+            len[n] = vq->vring.used->ring[idx].len;
+        }
+
+        /* Get the first used descriptor */
+        idx = (u16)vq->vring.used->ring[idx].id;
+        opaque[n] = vq->opaque[idx];
+        ASSERT(opaque[n] != NULL);
+
+        /* Put all descriptors back to the free list */
+        put_unused_desc_chain(vq, idx);
+
+        vq->last_used++;
+        n++;
+    }
+
+    if (_vq->vdev->event_suppression_enabled && virtqueue_is_interrupt_enabled(_vq)) {
+        vring_used_event(&vq->vring) = vq->last_used;
+        KeMemoryBarrier();
+    }
+
+    return n;
+}
+
+/* Returns true if buffers covered by an already consumed in-order used entry
+ * have not been returned yet */
+static inline bool in_order_pending_split(struct virtqueue_split *vq)
+{
+    return (vq->in_order_next != vq->in_order_batch_end);
+}
+
+/* Consumes the used entry at last_used. With VIRTIO_F_IN_ORDER the device may write a
+ * single entry carrying the id of the last buffer of a batch, all buffers made available
+ * before it are complete as well */
+static void virtqueue_fetch_used_in_order_split(struct virtqueue_split *vq)
+{
+    struct vring *vring = &vq->vring;
+    struct vring_used_elem *elem = &vring->used->ring[DESC_INDEX(vring->num, vq->last_used)];
+    u16 id = (u16)elem->id;
+    u16 end = vq->in_order_next;
+
+    while (end != vq->master_vring_avail.idx &&
+           vring->avail->ring[DESC_INDEX(vring->num, end)] != id) {
+        end++;
+    }
+    if (end == vq->master_vring_avail.idx) {
+        DPrintf(0, "%s: used id %u is not outstanding\n", __FUNCTION__, id);
+        end = vq->in_order_next;
+    }
+
+    vq->in_order_batch_end = end + 1;
+    vq->in_order_batch_len = elem->len;
+    vq->last_used++;
+}
+
+/* Returns the next buffer of the current in-order batch. Descriptors are allocated
+ * sequentially in this mode so the chain ends where the next outstanding one starts
+ * and can be released without walking it */
+static void *virtqueue_pop_in_order_split(struct virtqueue_split *vq, unsigned int *len)
+{
+    struct vring *vring = &vq->vring;
+    u16 head, next_head, freed;
+    void *opaque;
+
+    head = vring->avail->ring[DESC_INDEX(vring->num, vq->in_order_next)];
+    vq->in_order_next++;
+
+    if (vq->in_order_next != vq->master_vring_avail.idx) {
+        next_head = vring->avail->ring[DESC_INDEX(vring->num, vq->in_order_next)];
+    } else {
+        next_head = vq->first_unused;
+    }
+    freed = DESC_INDEX(vring->num, next_head - head);
+    vq->num_unused += freed ? freed : vring->num;
+
+    opaque = vq->opaque[head];
+    vq->opaque[head] = NULL;
+
+    /* Only the last buffer of a batch has its length reported */
+    if (len) {
+        *len = in_order_pending_split(vq) ? 0 : vq->in_order_batch_len;
+    }
+
+    ASSERT(opaque != NULL);
+    return opaque;
+}
+
+/* virtqueue_get_buf for queues with VIRTIO_F_IN_ORDER */
+static void *virtqueue_get_buf_in_order_split(
+    struct virtqueue *_vq, /* the queue */
+    unsigned int *len)    /* number of bytes returned by the device */
+{
+    struct virtqueue_split *vq = splitvq(_vq);
+
+    if (!in_order_pending_split(vq)) {
+        if (vq->last_used == (int)vq->vring.used->idx) {
+            /* No descriptor index in the used ring */
+            return NULL;
+        }
+        KeMemoryBarrier();
+
+        virtqueue_fetch_used_in_order_split(vq);
+        if (_vq->vdev->event_suppression_enabled && virtqueue_is_interrupt_enabled(_vq)) {
+            vring_used_event(&vq->vring) = vq->last_used;
+            KeMemoryBarrier();
+        }
+    }
+
+    return virtqueue_pop_in_order_split(vq, len);
+}
+
+/* virtqueue_get_bufs for queues with VIRTIO_F_IN_ORDER */
+static unsigned int virtqueue_get_bufs_in_order_split(
+    struct virtqueue *_vq, /* the queue */
+    void *opaque[],       /* returned opaque pointers */
+    unsigned int len[],   /* number of bytes returned by the device for each buffer, or NULL */
+    unsigned int max)     /* capacity of opaque and len */
+{
+    struct virtqueue_split *vq = splitvq(_vq);
+    unsigned int n = 0;
+    u16 used_idx;
+
+    used_idx = vq->vring.used->idx;
+    if (vq->last_used != used_idx) {
+        KeMemoryBarrier();
+    }
+
+    while (n < max) {
+        if (!in_order_pending_split(vq)) {
+            if (vq->last_used == used_idx) {
+                break;
+            }
+            virtqueue_fetch_used_in_order_split(vq);
+        }
+        opaque[n] = virtqueue_pop_in_order_split(vq, len ? &len[n] : NULL);
+        n++;
+    }
+
+    if (n > 0 && _vq->vdev->event_suppression_enabled && virtqueue_is_interrupt_enabled(_vq)) {
+        vring_used_event(&vq->vring) = vq->last_used;
+        KeMemoryBarrier();
+    }
+
+    return n;
+}
+
 /* Returns true if at least one returned buffer is available, false otherwise */
 static BOOLEAN virtqueue_has_buf_split(struct virtqueue *_vq)
 {
     struct virtqueue_split *vq = splitvq(_vq);
-    return (vq->last_used != vq->vring.used->idx);
+    return (in_order_pending_split(vq) || vq->last_used != vq->vring.used->idx);
+}
+
+/* Returns the doorbell value for VIRTIO_F_NOTIFICATION_DATA, for the split ring next_off
+ * and next_wrap are simply the 16 bits of the available index */
+static u32 notification_data_split(struct virtqueue_split *vq)
+{
+    return (u32)(u16)vq->vq.index | ((u32)vq->master_vring_avail.idx << 16);
 }
 
 /* Returns true if the device should be notified, false otherwise */
@@ -354,6 +592,7 @@ static bool virtqueue_kick_prepare_split(struct virtqueue *_vq)
     old = (u16)(vq->master_vring_avail.idx - vq->num_added_since_kick);
     new = vq->master_vring_avail.idx;
     vq->num_added_since_kick = 0;
+    _vq->notification_data = notification_data_split(vq);
 
     if (_vq->vdev->event_suppression_enabled) {
         return wrap_around || (bool)vring_need_event(vring_avail_event(&vq->vring), new, old);
@@ -368,6 +607,7 @@ static void virtqueue_kick_always_split(struct virtqueue *_vq)
     struct virtqueue_split *vq = splitvq(_vq);
     KeMemoryBarrier();
     vq->num_added_since_kick = 0;
+    _vq->notification_data = notification_data_split(vq);
     virtqueue_notify(_vq);
 }
 
@@ -386,7 +626,7 @@ static bool virtqueue_enable_cb_split(struct virtqueue *_vq)
 
     vring_used_event(&vq->vring) = vq->last_used;
     KeMemoryBarrier();
-    return (vq->last_used == vq->vring.used->idx);
+    return (!in_order_pending_split(vq) && vq->last_used == vq->vring.used->idx);
 }
 
 /* Enables interrupts on a virtqueue after ~3/4 of the currently pushed buffers have been
@@ -408,7 +648,7 @@ static bool virtqueue_enable_cb_delayed_split(struct virtqueue *_vq)
     bufs = (u16)(vq->master_vring_avail.idx - vq->last_used) * 3 / 4;
     vring_used_event(&vq->vring) = vq->last_used + bufs;
     KeMemoryBarrier();
-    return ((vq->vring.used->idx - vq->last_used) <= bufs);
+    return (!in_order_pending_split(vq) && (vq->vring.used->idx - vq->last_used) <= bufs);
 }
 
 /* Disables interrupts on a virtqueue */
@@ -506,22 +746,32 @@ struct virtqueue *vring_new_virtqueue_split(
     vq->vq.vdev = vdev;
     vq->vq.notification_cb = notify;
     vq->vq.index = index;
+    vq->vq.notification_data = notification_data_split(vq);
 
-    /* Build a linked list of unused descriptors */
+    /* Build a linked list of unused descriptors. The last one links back to the first so
+     * that in-order queues, which never relink chains, allocate them sequentially */
     vq->num_unused = num;
     vq->first_unused = 0;
-    for (i = 0; i < num - 1; i++) {
+    for (i = 0; i < num; i++) {
         vq->vring.desc[i].flags = VIRTQ_DESC_F_NEXT;
-        vq->vring.desc[i].next = i + 1;
+        vq->vring.desc[i].next = DESC_INDEX(num, i + 1);
     }
+    vq->in_order = vdev->in_order;
     vq->vq.avail_va = vq->vring.avail;
     vq->vq.used_va = vq->vring.used;
     vq->vq.add_buf = virtqueue_add_buf_split;
+    vq->vq.add_bufs = virtqueue_add_bufs_split;
     vq->vq.detach_unused_buf = virtqueue_detach_unused_buf_split;
     vq->vq.disable_cb = virtqueue_disable_cb_split;
     vq->vq.enable_cb = virtqueue_enable_cb_split;
     vq->vq.enable_cb_delayed = virtqueue_enable_cb_delayed_split;
-    vq->vq.get_buf = virtqueue_get_buf_split;
+    if (vq->in_order) {
+        vq->vq.get_buf = virtqueue_get_buf_in_order_split;
+        vq->vq.get_bufs = virtqueue_get_bufs_in_order_split;
+    } else {
+        vq->vq.get_buf = virtqueue_get_buf_split;
+        vq->vq.get_bufs = virtqueue_get_bufs_split;
+    }
     vq->vq.has_buf = virtqueue_has_buf_split;
     vq->vq.is_interrupt_enabled = virtqueue_is_interrupt_enabled_split;
     vq->vq.kick_always = virtqueue_kick_always_split;
@@ -547,7 +797,7 @@ void vring_transport_features(
 }
 
 /* Returns the max number of scatter-gather elements that fit in an indirect pages */
-u32 virtio_get_indirect_page_capacity()
+unsigned long virtio_get_indirect_page_capacity()
 {
     return PAGE_SIZE / sizeof(struct vring_desc);
 }
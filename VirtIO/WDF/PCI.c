@@ -59,6 +59,7 @@ NTSTATUS PCIAllocBars(WDFCMRESLIST ResourcesTranslated,
             switch (pResDescriptor->Type) {
                 case CmResourceTypePort:
                 case CmResourceTypeMemory:
+                case CmResourceTypeMemoryLarge:
                     pBar = (PVIRTIO_WDF_BAR)ExAllocatePoolWithTag(
                         NonPagedPool,
                         sizeof(VIRTIO_WDF_BAR),
@@ -79,7 +80,12 @@ NTSTATUS PCIAllocBars(WDFCMRESLIST ResourcesTranslated,
 
                     pBar->bPortSpace = !!(pResDescriptor->Flags & CM_RESOURCE_PORT_IO);
                     pBar->BasePA = pResDescriptor->u.Memory.Start;
-                    pBar->uLength = pResDescriptor->u.Memory.Length;
+                    if (pBar->bPortSpace) {
+                        pBar->uLength = pResDescriptor->u.Port.Length;
+                    } else {
+                        /* large BARs, such as shared memory windows, encode their length */
+                        pBar->uLength = (SIZE_T)RtlCMDecodeMemIoResource(pResDescriptor, NULL);
+                    }
 
                     if (pBar->bPortSpace) {
                         pBar->pBase = (PVOID)(ULONG_PTR)pBar->BasePA.QuadPart;
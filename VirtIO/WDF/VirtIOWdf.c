@@ -338,3 +338,31 @@ UCHAR VirtIOWdfGetISRStatus(PVIRTIO_WDF_DRIVER pWdfDriver)
 {
     return virtio_read_isr_status(&pWdfDriver->VIODevice);
 }
+
+NTSTATUS VirtIOWdfGetSharedMemoryRegion(PVIRTIO_WDF_DRIVER pWdfDriver,
+                                        UCHAR id,
+                                        PHYSICAL_ADDRESS *pBasePA,
+                                        ULONGLONG *pLength)
+{
+    PSINGLE_LIST_ENTRY iter = &pWdfDriver->PCIBars;
+    int bar;
+    u64 offset, length;
+
+    if (!virtio_get_shm_region(&pWdfDriver->VIODevice, id, &bar, &offset, &length)) {
+        return STATUS_NOT_FOUND;
+    }
+
+    while (iter->Next != NULL) {
+        PVIRTIO_WDF_BAR pBar = CONTAINING_RECORD(iter->Next, VIRTIO_WDF_BAR, ListEntry);
+        if (pBar->iBar == bar) {
+            if (pBar->bPortSpace || offset + length > pBar->uLength || offset + length < offset) {
+                return STATUS_INVALID_PARAMETER;
+            }
+            pBasePA->QuadPart = pBar->BasePA.QuadPart + offset;
+            *pLength = length;
+            return STATUS_SUCCESS;
+        }
+        iter = iter->Next;
+    }
+    return STATUS_NOT_FOUND;
+}
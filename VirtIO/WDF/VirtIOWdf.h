@@ -150,6 +150,15 @@ void VirtIOWdfDeviceSet(PVIRTIO_WDF_DRIVER pWdfDriver,
                         CONST PVOID buf,
                         ULONG len);
 
+/* Returns the physical address and length of the shared memory region with
+ * the given id, STATUS_NOT_FOUND if the device does not expose one. The region
+ * is not mapped, the driver maps it with the caching type the device requires.
+ */
+NTSTATUS VirtIOWdfGetSharedMemoryRegion(PVIRTIO_WDF_DRIVER pWdfDriver,
+                                        UCHAR id,
+                                        PHYSICAL_ADDRESS *pBasePA,
+                                        ULONGLONG *pLength);
+
 /* DMA memory allocations */
 
 /* PASSIVE, optional groupTag for VirtIOWdfDeviceFreeDmaMemoryByTag
@@ -40,7 +40,7 @@ typedef struct virtio_wdf_bar {
 
     int               iBar;
     PHYSICAL_ADDRESS  BasePA;
-    ULONG             uLength;
+    SIZE_T            uLength;
     PVOID             pBase;
     bool              bPortSpace;
 } VIRTIO_WDF_BAR, *PVIRTIO_WDF_BAR;
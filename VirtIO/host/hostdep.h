@@ -0,0 +1,88 @@
+//////////////////////////////////////////////////////////////////////////////////////////
+// Module Name:
+// hostdep.h
+//
+// Abstract:
+// Host (Linux, gcc/clang) replacements for the WDK definitions used by the virtio
+// ring code. Included from osdep.h instead of ntddk.h when VIRTIO_HOST_BUILD is
+// defined, so that VirtIORing.c and VirtIORing-Packed.c can be built and profiled
+// as a user-space library.
+//
+//////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+/* linux/types.h maps u32 to unsigned long which is 64-bit on LP64 hosts,
+ * provide fixed width types before it gets a chance to do so */
+#define _LINUX_TYPES_H
+
+#define __bitwise__
+
+#define u8 uint8_t
+#define u16 uint16_t
+#define u32 uint32_t
+#define u64 ULONGLONG
+
+#define __u8 uint8_t
+#define __u16 uint16_t
+#define __le16 uint16_t
+#define __u32 uint32_t
+#define __le32 uint32_t
+#define __u64 ULONGLONG
+
+typedef uint8_t UCHAR;
+typedef uint8_t BOOLEAN;
+typedef uint16_t USHORT;
+typedef uint32_t ULONG;
+typedef int32_t LONG;
+typedef unsigned long long ULONGLONG;
+typedef long long LONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef void *PVOID;
+typedef int32_t NTSTATUS;
+
+typedef union _LARGE_INTEGER {
+    struct {
+        ULONG LowPart;
+        LONG HighPart;
+    };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, PHYSICAL_ADDRESS;
+
+/* only referenced by prototypes in virtio_pci.h */
+typedef struct _PCI_COMMON_HEADER *PPCI_COMMON_HEADER;
+
+#define TRUE 1
+#define FALSE 0
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define NT_SUCCESS(Status)              (((NTSTATUS)(Status)) >= 0)
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 0x1000
+#endif
+
+#define __forceinline __inline__ __attribute__((always_inline))
+#define __inline __inline__
+
+#define __FUNCTION__ __func__
+
+#define ASSERT(x) assert(x)
+#define RtlZeroMemory(Destination, Length) memset((Destination), 0, (Length))
+#define KeBugCheck(Code) abort()
+#define KeMemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#if defined(__i386__) || defined(__x86_64__)
+#define YieldProcessor() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define YieldProcessor() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define YieldProcessor() __asm__ __volatile__("" ::: "memory")
+#endif
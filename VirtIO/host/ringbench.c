@@ -0,0 +1,549 @@
+/*
+ * Virtio ring micro-benchmark
+ *
+ * Drives the split or packed ring engine against the simulated device and
+ * reports throughput and per-call latency of add_buf, kick_prepare and get_buf.
+ * Every returned cookie and length is checked so the benchmark doubles as a
+ * consistency check of the ring code.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "virtio_sim.h"
+#include "windows/virtio_ring_allocation.h"
+
+#define BENCH_OUT_LEN   64
+#define BENCH_IN_LEN    512
+#define BENCH_MAX_SEGS  64
+
+/* latency histogram, one bucket per nanosecond up to BENCH_HIST_NS */
+#define BENCH_HIST_NS   4096
+
+typedef struct bench_request {
+    unsigned int index;
+    bool in_flight;
+    u8 *data;
+    void *indirect;
+    struct VirtIOBufferDescriptor sg[BENCH_MAX_SEGS];
+} BenchRequest;
+
+typedef struct bench_op_stats {
+    const char *name;
+    ULONGLONG calls;
+    ULONGLONG total_ns;
+    ULONGLONG max_ns;
+    ULONGLONG hist[BENCH_HIST_NS];
+} BenchOpStats;
+
+typedef struct bench_params {
+    bool packed;
+    bool indirect;
+    bool event_idx;
+    bool threaded;
+    bool out_of_order;
+    bool in_order;
+    bool notification_data;
+    bool moderation;
+    bool timing;
+    bool vector;
+    bool harvest;
+    unsigned int queue_size;
+    unsigned int segs;
+    unsigned int batch;
+    ULONGLONG requests;
+} BenchParams;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() do {} while (0)
+#endif
+
+static VirtIOSimDevice device;
+static volatile bool device_stop;
+
+static double ns_per_tick;
+
+static inline ULONGLONG bench_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    ULONGLONG v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONGLONG)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static ULONGLONG bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONGLONG)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_calibrate(void)
+{
+    ULONGLONG ns = bench_now_ns(), ticks = bench_ticks();
+    usleep(50000);
+    ns = bench_now_ns() - ns;
+    ticks = bench_ticks() - ticks;
+    ns_per_tick = ticks ? (double)ns / (double)ticks : 1.0;
+}
+
+static inline void bench_account(BenchOpStats *op, ULONGLONG ticks)
+{
+    ULONGLONG ns = (ULONGLONG)(ticks * ns_per_tick);
+
+    op->calls++;
+    op->total_ns += ns;
+    if (ns > op->max_ns) {
+        op->max_ns = ns;
+    }
+    op->hist[ns < BENCH_HIST_NS ? ns : BENCH_HIST_NS - 1]++;
+}
+
+static ULONGLONG bench_percentile(const BenchOpStats *op, double pct)
+{
+    ULONGLONG target = (ULONGLONG)(op->calls * pct), seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < BENCH_HIST_NS; i++) {
+        seen += op->hist[i];
+        if (seen > target) {
+            return i;
+        }
+    }
+    return BENCH_HIST_NS;
+}
+
+static void bench_print_op(const BenchOpStats *op)
+{
+    if (!op->calls) {
+        return;
+    }
+    printf("  %-16s %12llu calls  avg %7.1f ns  p50 %5llu ns  p99 %5llu ns  max %7llu ns\n",
+        op->name, op->calls, (double)op->total_ns / op->calls,
+        bench_percentile(op, 0.50), bench_percentile(op, 0.99), op->max_ns);
+}
+
+static void *bench_device_thread(void *arg)
+{
+    (void)arg;
+    while (!device_stop) {
+        if (!virtio_sim_process_queue(&device, 0, 0)) {
+            cpu_relax();
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void bench_usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -r split|packed  ring layout (default split)\n"
+        "  -q N             queue size, power of 2 (default 256)\n"
+        "  -s N             scatter-gather segments per request, 1 out + N-1 in (default 2)\n"
+        "  -i               use indirect descriptors\n"
+        "  -e               negotiate VIRTIO_RING_F_EVENT_IDX\n"
+        "  -b N             requests added between kick_prepare calls (default 32)\n"
+        "  -n N             total number of requests (default 10000000)\n"
+        "  -t               run the device in its own polling thread\n"
+        "  -o               complete buffers out of order\n"
+        "  -I               negotiate VIRTIO_F_IN_ORDER, the device returns one used entry per pass\n"
+        "  -N               negotiate VIRTIO_F_NOTIFICATION_DATA and check every doorbell value\n"
+        "  -M               re-arm callbacks through virtqueue_moderation_enable_cb after each harvest\n"
+        "  -T               disable per-call timing (throughput only)\n"
+        "  -B               submit each batch with one virtqueue_add_bufs call\n"
+        "  -G               harvest completions with virtqueue_get_bufs, up to -b at a time\n",
+        name);
+}
+
+static int bench_parse(int argc, char **argv, BenchParams *p)
+{
+    int c;
+
+    p->packed = false;
+    p->indirect = false;
+    p->event_idx = false;
+    p->threaded = false;
+    p->out_of_order = false;
+    p->in_order = false;
+    p->notification_data = false;
+    p->moderation = false;
+    p->timing = true;
+    p->vector = false;
+    p->harvest = false;
+    p->queue_size = 256;
+    p->segs = 2;
+    p->batch = 32;
+    p->requests = 10000000;
+
+    while ((c = getopt(argc, argv, "r:q:s:ieb:n:toINMTBGh")) != -1) {
+        switch (c) {
+        case 'r':
+            if (!strcmp(optarg, "packed")) {
+                p->packed = true;
+            } else if (strcmp(optarg, "split")) {
+                return -1;
+            }
+            break;
+        case 'q':
+            p->queue_size = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            p->segs = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            p->indirect = true;
+            break;
+        case 'e':
+            p->event_idx = true;
+            break;
+        case 'b':
+            p->batch = (unsigned int)strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            p->requests = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            p->threaded = true;
+            break;
+        case 'o':
+            p->out_of_order = true;
+            break;
+        case 'I':
+            p->in_order = true;
+            break;
+        case 'N':
+            p->notification_data = true;
+            break;
+        case 'M':
+            p->moderation = true;
+            break;
+        case 'T':
+            p->timing = false;
+            break;
+        case 'B':
+            p->vector = true;
+            break;
+        case 'G':
+            p->harvest = true;
+            break;
+        default:
+            return -1;
+        }
+    }
+    if (p->queue_size < 2 || p->queue_size > 32768 || (p->queue_size & (p->queue_size - 1)) ||
+        p->segs < 1 || p->segs > BENCH_MAX_SEGS || !p->batch ||
+        (p->in_order && p->out_of_order)) {
+        return -1;
+    }
+    return 0;
+}
+
+static BenchRequest *bench_alloc_requests(const BenchParams *p)
+{
+    BenchRequest *reqs = calloc(p->queue_size, sizeof(*reqs));
+    unsigned int i, j;
+
+    if (!reqs) {
+        return NULL;
+    }
+    for (i = 0; i < p->queue_size; i++) {
+        BenchRequest *req = &reqs[i];
+        u8 *data = malloc(BENCH_OUT_LEN + (p->segs - 1) * BENCH_IN_LEN);
+        if (!data || (p->indirect && posix_memalign(&req->indirect, PAGE_SIZE, PAGE_SIZE))) {
+            return NULL;
+        }
+        req->index = i;
+        req->data = data;
+        req->sg[0].physAddr.QuadPart = VIRTIO_SIM_PA(data);
+        req->sg[0].length = BENCH_OUT_LEN;
+        for (j = 1; j < p->segs; j++) {
+            req->sg[j].physAddr.QuadPart = VIRTIO_SIM_PA(data + BENCH_OUT_LEN + (j - 1) * BENCH_IN_LEN);
+            req->sg[j].length = BENCH_IN_LEN;
+        }
+    }
+    return reqs;
+}
+
+static void bench_complete(const BenchParams *p, BenchRequest *req, unsigned int len)
+{
+    if (!req || !req->in_flight) {
+        fprintf(stderr, "FAIL: get_buf returned a cookie %p which is not in flight\n", (void *)req);
+        exit(2);
+    }
+    /* in-order batches only report the length of their last buffer */
+    if (len != (p->segs - 1) * BENCH_IN_LEN && !(p->in_order && len == 0)) {
+        fprintf(stderr, "FAIL: request %u completed with length %u\n", req->index, len);
+        exit(2);
+    }
+    req->in_flight = false;
+}
+
+int main(int argc, char **argv)
+{
+    static BenchOpStats add_stats = { "add_buf" };
+    static BenchOpStats kick_stats = { "kick_prepare" };
+    static BenchOpStats get_stats = { "get_buf" };
+    static BenchOpStats add_bufs_stats = { "add_bufs" };
+    static BenchOpStats get_bufs_stats = { "get_bufs" };
+    struct virtqueue_buf *bufs;
+    void **cookies;
+    unsigned int *lens;
+    BenchParams p;
+    BenchRequest *reqs, **free_reqs;
+    struct virtqueue *vq;
+    unsigned int num_free, i;
+    ULONGLONG submitted = 0, completed = 0, start_ns, elapsed_ns, t;
+    pthread_t thread;
+    u64 features = 1ULL << VIRTIO_F_VERSION_1;
+    VirtIOSimStats *stats;
+    struct virtqueue_moderation moderation;
+
+    if (bench_parse(argc, argv, &p)) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    if (p.packed) {
+        virtio_feature_enable(features, VIRTIO_F_RING_PACKED);
+    }
+    if (p.event_idx) {
+        virtio_feature_enable(features, VIRTIO_RING_F_EVENT_IDX);
+    }
+    if (p.indirect) {
+        virtio_feature_enable(features, VIRTIO_RING_F_INDIRECT_DESC);
+    }
+    if (p.in_order) {
+        virtio_feature_enable(features, VIRTIO_F_IN_ORDER);
+    }
+    if (p.notification_data) {
+        virtio_feature_enable(features, VIRTIO_F_NOTIFICATION_DATA);
+    }
+    virtio_sim_device_initialize(&device, features);
+    device.out_of_order = p.out_of_order;
+    if (!NT_SUCCESS(virtio_sim_find_queue(&device, 0, p.queue_size, &vq))) {
+        fprintf(stderr, "Failed to create the virtqueue\n");
+        return 1;
+    }
+
+    virtqueue_moderation_init(&moderation, true);
+
+    reqs = bench_alloc_requests(&p);
+    free_reqs = calloc(p.queue_size, sizeof(*free_reqs));
+    bufs = calloc(p.batch, sizeof(*bufs));
+    cookies = calloc(p.batch, sizeof(*cookies));
+    lens = calloc(p.batch, sizeof(*lens));
+    if (!reqs || !free_reqs || !bufs || !cookies || !lens) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < p.queue_size; i++) {
+        free_reqs[i] = &reqs[p.queue_size - i - 1];
+    }
+    num_free = p.queue_size;
+
+    bench_calibrate();
+    if (p.threaded && pthread_create(&thread, NULL, bench_device_thread, NULL)) {
+        fprintf(stderr, "Failed to start the device thread\n");
+        return 1;
+    }
+
+    start_ns = bench_now_ns();
+    while (completed < p.requests) {
+        unsigned int added = 0, harvested = 0, pass;
+        void *cookie;
+        unsigned int len;
+
+        if (p.vector) {
+            unsigned int n = 0;
+            int res;
+
+            while (n < p.batch && n < num_free && submitted + n < p.requests) {
+                BenchRequest *req = free_reqs[num_free - n - 1];
+                bufs[n].sg = req->sg;
+                bufs[n].out_num = 1;
+                bufs[n].in_num = p.segs - 1;
+                bufs[n].opaque = req;
+                bufs[n].va_indirect = req->indirect;
+                bufs[n].phys_indirect = VIRTIO_SIM_PA(req->indirect);
+                n++;
+            }
+            t = p.timing ? bench_ticks() : 0;
+            res = n ? virtqueue_add_bufs(vq, bufs, n) : 0;
+            if (p.timing && res > 0) {
+                bench_account(&add_bufs_stats, bench_ticks() - t);
+            }
+            for (i = 0; i < (unsigned int)res; i++) {
+                ((BenchRequest *)bufs[i].opaque)->in_flight = true;
+            }
+            num_free -= res;
+            added = res;
+            submitted += res;
+        } else {
+            while (added < p.batch && num_free && submitted < p.requests) {
+                BenchRequest *req = free_reqs[num_free - 1];
+                int res;
+
+                t = p.timing ? bench_ticks() : 0;
+                res = virtqueue_add_buf(vq, req->sg, 1, p.segs - 1, req, req->indirect,
+                    VIRTIO_SIM_PA(req->indirect));
+                if (res < 0) {
+                    /* ring full, only successful calls are accounted */
+                    break;
+                }
+                if (p.timing) {
+                    bench_account(&add_stats, bench_ticks() - t);
+                }
+                req->in_flight = true;
+                num_free--;
+                added++;
+                submitted++;
+            }
+        }
+
+        if (added) {
+            bool kick;
+            t = p.timing ? bench_ticks() : 0;
+            kick = virtqueue_kick_prepare(vq);
+            if (p.timing) {
+                bench_account(&kick_stats, bench_ticks() - t);
+            }
+            if (kick) {
+                virtqueue_notify(vq);
+            }
+        }
+
+        if (!p.threaded) {
+            /* the simulated device polls the ring, kicks are only counted */
+            virtio_sim_process_queue(&device, 0, 0);
+        }
+
+        do {
+            pass = harvested;
+            if (p.moderation) {
+                virtqueue_disable_cb(vq);
+            }
+            if (p.harvest) {
+                unsigned int n;
+
+                for (;;) {
+                    t = p.timing ? bench_ticks() : 0;
+                    n = virtqueue_get_bufs(vq, cookies, lens, p.batch);
+                    if (!n) {
+                        break;
+                    }
+                    if (p.timing) {
+                        bench_account(&get_bufs_stats, bench_ticks() - t);
+                    }
+                    for (i = 0; i < n; i++) {
+                        bench_complete(&p, cookies[i], lens[i]);
+                        free_reqs[num_free++] = cookies[i];
+                    }
+                    completed += n;
+                    harvested += n;
+                }
+            } else {
+                for (;;) {
+                    t = p.timing ? bench_ticks() : 0;
+                    cookie = virtqueue_get_buf(vq, &len);
+                    if (p.timing && cookie) {
+                        bench_account(&get_stats, bench_ticks() - t);
+                    }
+                    if (!cookie) {
+                        break;
+                    }
+                    bench_complete(&p, cookie, len);
+                    free_reqs[num_free++] = cookie;
+                    completed++;
+                    harvested++;
+                }
+            }
+            pass = harvested - pass;
+        } while (p.moderation && (!virtqueue_moderation_enable_cb(&moderation, vq, pass) ||
+                                  virtqueue_moderation_poll(&moderation, vq)));
+
+        if (p.threaded && !added && !harvested) {
+            /* let the device thread run if it shares the CPU with us */
+            sched_yield();
+        }
+    }
+    elapsed_ns = bench_now_ns() - start_ns;
+
+    if (p.threaded) {
+        device_stop = true;
+        pthread_join(thread, NULL);
+    }
+
+    stats = &device.queues[0].stats;
+    printf("%s ring, queue size %u, %u segs, %s, %s, %s %u, %s device%s\n",
+        p.packed ? "packed" : "split", p.queue_size, p.segs,
+        p.indirect ? "indirect" : "direct",
+        p.event_idx ? "event idx" : "no event idx",
+        p.vector ? "add_bufs batch" : "batch", p.batch, p.threaded ? "threaded" : "inline",
+        p.out_of_order ? ", out of order" : p.in_order ? ", in order" : "");
+    printf("  %llu requests in %.3f ms, %.2f Mreq/s\n", completed, elapsed_ns / 1e6,
+        completed * 1e3 / (double)elapsed_ns);
+    printf("  kicks %llu, interrupts %llu, descriptors %llu\n",
+        stats->kicks, stats->interrupts, stats->descriptors);
+    if (p.notification_data) {
+        printf("  notification data checked %llu\n", stats->notification_data);
+    }
+    if (p.moderation) {
+        printf("  moderation: callbacks %llu, interrupts avoided %llu, delayed re-arms %llu, mode changes %llu\n",
+            moderation.callbacks, moderation.interrupts_avoided, moderation.delayed,
+            moderation.mode_changes);
+        printf("  moderation: poll hits %llu, poll misses %llu\n",
+            moderation.poll_hits, moderation.poll_misses);
+    }
+    bench_print_op(&add_stats);
+    bench_print_op(&add_bufs_stats);
+    bench_print_op(&kick_stats);
+    bench_print_op(&get_stats);
+    bench_print_op(&get_bufs_stats);
+
+    if (stats->buffers != completed) {
+        fprintf(stderr, "FAIL: device consumed %llu buffers, driver completed %llu\n",
+            stats->buffers, completed);
+        return 2;
+    }
+    virtio_sim_device_shutdown(&device);
+    return 0;
+}
@@ -0,0 +1,519 @@
+/*
+ * Simulated virtio device for host builds of the virtio ring code
+ *
+ * The device side is written against the virtio 1.1 ring layout rather than
+ * against the driver's private structures, the same way a real device would be.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+
+#include "virtio_sim.h"
+#include "kdebugprint.h"
+#include "windows/virtio_ring_allocation.h"
+
+int virtioDebugLevel = 0;
+int bDebugPrint = 0;
+
+static void sim_debug_print(const char *format, ...)
+{
+    va_list list;
+    va_start(list, format);
+    vfprintf(stderr, format, list);
+    va_end(list);
+}
+
+tDebugPrintFunc VirtioDebugPrintProc = sim_debug_print;
+
+#define DESC_F_NEXT         1
+#define DESC_F_WRITE        2
+#define DESC_F_INDIRECT     4
+
+#define PACKED_DESC_F_AVAIL (1 << 7)
+#define PACKED_DESC_F_USED  (1 << 15)
+
+#define USED_F_NO_NOTIFY    1
+#define AVAIL_F_NO_INTERRUPT 1
+
+#define PACKED_EVENT_FLAG_ENABLE  0x0
+#define PACKED_EVENT_FLAG_DISABLE 0x1
+#define PACKED_EVENT_FLAG_DESC    0x2
+#define PACKED_EVENT_F_WRAP_CTR   15
+
+/* Device view of the split ring, see "Split Virtqueues" in the virtio spec */
+struct sim_split_desc {
+    u64 addr;
+    u32 len;
+    u16 flags;
+    u16 next;
+};
+
+struct sim_split_avail {
+    u16 flags;
+    u16 idx;
+    u16 ring[];
+};
+
+struct sim_split_used_elem {
+    u32 id;
+    u32 len;
+};
+
+struct sim_split_used {
+    u16 flags;
+    u16 idx;
+    struct sim_split_used_elem ring[];
+};
+
+/* Device view of the packed ring, see "Packed Virtqueues" in the virtio spec */
+struct sim_packed_desc {
+    u64 addr;
+    u32 len;
+    u16 id;
+    u16 flags;
+};
+
+struct sim_packed_event {
+    u16 off_wrap;
+    u16 flags;
+};
+
+#define LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static inline bool sim_need_event(u16 event_idx, u16 new_idx, u16 old)
+{
+    return (u16)(new_idx - event_idx - 1) < (u16)(new_idx - old);
+}
+
+static void sim_split_layout(VirtIOSimQueue *q, struct sim_split_desc **desc,
+                             struct sim_split_avail **avail, struct sim_split_used **used)
+{
+    ULONG_PTR p;
+
+    *desc = q->ring;
+    *avail = (struct sim_split_avail *)((u8 *)q->ring + q->num * sizeof(struct sim_split_desc));
+    p = (ULONG_PTR)&(*avail)->ring[q->num] + sizeof(u16);
+    p = (p + SMP_CACHE_BYTES - 1) & ~((ULONG_PTR)SMP_CACHE_BYTES - 1);
+    *used = (struct sim_split_used *)p;
+}
+
+/* Sums up the device-writable length of a split descriptor chain */
+static u32 sim_split_walk_chain(VirtIOSimQueue *q, struct sim_split_desc *desc, u16 head)
+{
+    struct sim_split_desc *table = desc;
+    unsigned int limit = q->num;
+    u32 len = 0;
+    u16 idx = head;
+
+    if (desc[head].flags & DESC_F_INDIRECT) {
+        table = VIRTIO_SIM_VA(desc[head].addr);
+        limit = desc[head].len / sizeof(struct sim_split_desc);
+        idx = 0;
+    }
+    for (;;) {
+        q->stats.descriptors++;
+        if (table[idx].flags & DESC_F_WRITE) {
+            len += table[idx].len;
+        }
+        if (!(table[idx].flags & DESC_F_NEXT)) {
+            break;
+        }
+        idx = table[idx].next;
+        ASSERT(idx < limit);
+    }
+    return len;
+}
+
+static void sim_split_push_used(VirtIOSimQueue *q, struct sim_split_used *used, u16 id, u32 len)
+{
+    struct sim_split_used_elem *elem = &used->ring[q->used_idx & (q->num - 1)];
+    elem->id = id;
+    elem->len = len;
+    q->used_idx++;
+}
+
+static unsigned int sim_process_split(VirtIOSimDevice *dev, VirtIOSimQueue *q, unsigned budget)
+{
+    struct sim_split_desc *desc;
+    struct sim_split_avail *avail;
+    struct sim_split_used *used;
+    unsigned int count = 0;
+    u16 avail_idx, old_used, last_head = 0;
+    u32 last_len = 0;
+
+    sim_split_layout(q, &desc, &avail, &used);
+    old_used = q->used_idx;
+
+    avail_idx = LOAD_ACQUIRE(&avail->idx);
+    while (q->last_avail_idx != avail_idx && (!budget || count < budget)) {
+        u16 head = avail->ring[q->last_avail_idx & (q->num - 1)];
+        u32 len;
+
+        ASSERT(head < q->num);
+        len = sim_split_walk_chain(q, desc, head);
+        if (dev->vdev.in_order) {
+            /* one used entry for the whole pass, written below */
+            last_head = head;
+            last_len = len;
+        } else if (dev->out_of_order) {
+            q->pending[q->num_pending].id = head;
+            q->pending[q->num_pending].len = len;
+            q->num_pending++;
+        } else {
+            sim_split_push_used(q, used, head, len);
+        }
+        q->last_avail_idx++;
+        count++;
+    }
+    while (q->num_pending) {
+        q->num_pending--;
+        sim_split_push_used(q, used, q->pending[q->num_pending].id, q->pending[q->num_pending].len);
+    }
+    if (!count) {
+        return 0;
+    }
+    if (dev->vdev.in_order) {
+        sim_split_push_used(q, used, last_head, last_len);
+    }
+    q->stats.buffers += count;
+    STORE_RELEASE(&used->idx, q->used_idx);
+
+    if (dev->vdev.event_suppression_enabled) {
+        /* ask for a kick as soon as the driver makes anything new available */
+        STORE_RELEASE((u16 *)&used->ring[q->num], q->last_avail_idx);
+    }
+    KeMemoryBarrier();
+
+    if (dev->vdev.event_suppression_enabled) {
+        if (sim_need_event(LOAD_ACQUIRE(&avail->ring[q->num]), q->used_idx, old_used)) {
+            q->stats.interrupts++;
+        }
+    } else if (!(LOAD_ACQUIRE(&avail->flags) & AVAIL_F_NO_INTERRUPT)) {
+        q->stats.interrupts++;
+    }
+    return count;
+}
+
+static inline bool sim_packed_is_avail(u16 flags, bool wrap_counter)
+{
+    return !!(flags & PACKED_DESC_F_AVAIL) == wrap_counter &&
+        !!(flags & PACKED_DESC_F_USED) != wrap_counter;
+}
+
+static void sim_packed_push_used(VirtIOSimQueue *q, struct sim_packed_desc *desc,
+                                 u16 id, u16 ndescs, u32 len)
+{
+    struct sim_packed_desc *d = &desc[q->next_used];
+    u16 flags = q->used_wrap_counter ? (PACKED_DESC_F_AVAIL | PACKED_DESC_F_USED) : 0;
+
+    d->id = id;
+    d->len = len;
+    STORE_RELEASE(&d->flags, flags);
+
+    q->next_used += ndescs;
+    if (q->next_used >= q->num) {
+        q->next_used -= (u16)q->num;
+        q->used_wrap_counter ^= 1;
+    }
+}
+
+static unsigned int sim_process_packed(VirtIOSimDevice *dev, VirtIOSimQueue *q, unsigned budget)
+{
+    struct sim_packed_desc *desc = q->ring;
+    struct sim_packed_event *driver = (struct sim_packed_event *)&desc[q->num];
+    struct sim_packed_event *device = driver + 1;
+    unsigned int count = 0;
+    u16 old_used = q->next_used;
+    bool old_wrap = q->used_wrap_counter;
+    u16 batch_id = 0, batch_ndescs = 0;
+    u32 batch_len = 0;
+
+    while (!budget || count < budget) {
+        struct sim_packed_desc *d = &desc[q->next_avail];
+        u16 flags = LOAD_ACQUIRE(&d->flags);
+        u16 id, ndescs = 0;
+        u32 len = 0;
+
+        if (!sim_packed_is_avail(flags, q->avail_wrap_counter)) {
+            break;
+        }
+        if (flags & DESC_F_INDIRECT) {
+            struct sim_packed_desc *table = VIRTIO_SIM_VA(d->addr);
+            unsigned int i, n = d->len / sizeof(struct sim_packed_desc);
+            for (i = 0; i < n; i++) {
+                if (table[i].flags & DESC_F_WRITE) {
+                    len += table[i].len;
+                }
+            }
+            q->stats.descriptors += n;
+            id = d->id;
+            ndescs = 1;
+        } else {
+            u16 pos = q->next_avail;
+            bool wrap = q->avail_wrap_counter;
+            for (;;) {
+                d = &desc[pos];
+                flags = ndescs ? d->flags : flags;
+                ASSERT(sim_packed_is_avail(flags, wrap));
+                if (flags & DESC_F_WRITE) {
+                    len += d->len;
+                }
+                ndescs++;
+                if (++pos >= q->num) {
+                    pos = 0;
+                    wrap ^= 1;
+                }
+                if (!(flags & DESC_F_NEXT)) {
+                    break;
+                }
+            }
+            /* the buffer id is taken from the last descriptor of the chain */
+            id = d->id;
+            q->stats.descriptors += ndescs;
+        }
+
+        q->next_avail += ndescs;
+        if (q->next_avail >= q->num) {
+            q->next_avail -= (u16)q->num;
+            q->avail_wrap_counter ^= 1;
+        }
+
+        if (dev->vdev.in_order) {
+            /* one used descriptor for the whole pass, carrying the last id */
+            batch_id = id;
+            batch_ndescs += ndescs;
+            batch_len = len;
+        } else if (dev->out_of_order) {
+            q->pending[q->num_pending].id = id;
+            q->pending[q->num_pending].ndescs = ndescs;
+            q->pending[q->num_pending].len = len;
+            q->num_pending++;
+        } else {
+            sim_packed_push_used(q, desc, id, ndescs, len);
+        }
+        count++;
+    }
+    while (q->num_pending) {
+        q->num_pending--;
+        sim_packed_push_used(q, desc, q->pending[q->num_pending].id,
+            q->pending[q->num_pending].ndescs, q->pending[q->num_pending].len);
+    }
+    if (!count) {
+        return 0;
+    }
+    if (dev->vdev.in_order) {
+        sim_packed_push_used(q, desc, batch_id, batch_ndescs, batch_len);
+    }
+    q->stats.buffers += count;
+
+    if (dev->vdev.event_suppression_enabled) {
+        /* ask for a kick as soon as the driver makes anything new available */
+        device->off_wrap = q->next_avail | ((u16)q->avail_wrap_counter << PACKED_EVENT_F_WRAP_CTR);
+        STORE_RELEASE(&device->flags, PACKED_EVENT_FLAG_DESC);
+    }
+    KeMemoryBarrier();
+
+    switch (LOAD_ACQUIRE(&driver->flags)) {
+    case PACKED_EVENT_FLAG_ENABLE:
+        q->stats.interrupts++;
+        break;
+    case PACKED_EVENT_FLAG_DESC: {
+        /* put the event and the new used position on a line starting at the old one */
+        u16 off_wrap = LOAD_ACQUIRE(&driver->off_wrap);
+        int event_idx = off_wrap & ~(1 << PACKED_EVENT_F_WRAP_CTR);
+        int new_used = q->next_used;
+
+        if (q->used_wrap_counter != old_wrap) {
+            new_used += q->num;
+        }
+        if ((off_wrap >> PACKED_EVENT_F_WRAP_CTR) != old_wrap) {
+            event_idx += event_idx < old_used ? (int)q->num : -(int)q->num;
+        }
+        if (event_idx >= old_used && event_idx < new_used) {
+            q->stats.interrupts++;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return count;
+}
+
+unsigned int virtio_sim_process_queue(VirtIOSimDevice *dev, unsigned index, unsigned budget)
+{
+    VirtIOSimQueue *q = &dev->queues[index];
+
+    if (dev->vdev.packed_ring) {
+        return sim_process_packed(dev, q, budget);
+    }
+    return sim_process_split(dev, q, budget);
+}
+
+/* Checks a VIRTIO_F_NOTIFICATION_DATA doorbell value against the ring */
+static void sim_check_notification_data(VirtIOSimDevice *dev, VirtIOSimQueue *q, u32 data)
+{
+    ASSERT((data & 0xffff) == q->index);
+    if (dev->vdev.packed_ring) {
+        /* the descriptor before next_off is the last one made available */
+        struct sim_packed_desc *desc = q->ring;
+        u16 next_off = (data >> 16) & 0x7fff;
+        bool wrap = !!(data >> 31);
+        u16 prev = next_off ? next_off - 1 : (u16)(q->num - 1);
+
+        if (!next_off) {
+            wrap ^= 1;
+        }
+        ASSERT(!!(desc[prev].flags & PACKED_DESC_F_AVAIL) == wrap);
+    } else {
+        struct sim_split_desc *desc;
+        struct sim_split_avail *avail;
+        struct sim_split_used *used;
+
+        sim_split_layout(q, &desc, &avail, &used);
+        ASSERT((data >> 16) == LOAD_ACQUIRE(&avail->idx));
+    }
+    q->stats.notification_data++;
+}
+
+static void sim_notify(struct virtqueue *vq)
+{
+    VirtIOSimDevice *dev = vq->vdev->DeviceContext;
+
+    if (dev->vdev.notification_data) {
+        sim_check_notification_data(dev, &dev->queues[vq->index], virtqueue_notification_data(vq));
+    }
+    dev->queues[vq->index].stats.kicks++;
+    if (dev->process_on_kick) {
+        virtio_sim_process_queue(dev, vq->index, 0);
+    }
+}
+
+/* The host build does not include VirtIOPCICommon.c, these are its equivalents */
+void virtqueue_notify(struct virtqueue *vq)
+{
+    vq->notification_cb(vq);
+}
+
+void virtqueue_kick(struct virtqueue *vq)
+{
+    if (virtqueue_kick_prepare(vq)) {
+        virtqueue_notify(vq);
+    }
+}
+
+NTSTATUS virtio_sim_device_initialize(VirtIOSimDevice *dev, u64 device_features)
+{
+    u64 features = device_features;
+
+    RtlZeroMemory(dev, sizeof(*dev));
+    dev->device_features = device_features;
+    dev->vdev.DeviceContext = dev;
+    dev->vdev.info = dev->vdev.inline_info;
+    dev->vdev.maxQueues = VIRTIO_SIM_MAX_QUEUES;
+
+    vring_transport_features(&dev->vdev, &features);
+    dev->features = features;
+    dev->vdev.event_suppression_enabled = virtio_is_feature_enabled(features, VIRTIO_RING_F_EVENT_IDX);
+    dev->vdev.packed_ring = virtio_is_feature_enabled(features, VIRTIO_F_RING_PACKED);
+    dev->vdev.in_order = virtio_is_feature_enabled(features, VIRTIO_F_IN_ORDER);
+    dev->vdev.notification_data = virtio_is_feature_enabled(features, VIRTIO_F_NOTIFICATION_DATA);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS virtio_sim_find_queue(VirtIOSimDevice *dev, unsigned index, unsigned num,
+                               struct virtqueue **vq)
+{
+    VirtIOSimQueue *q;
+    unsigned long ring_size;
+
+    if (index >= VIRTIO_SIM_MAX_QUEUES || dev->queues[index].vq) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    q = &dev->queues[index];
+    RtlZeroMemory(q, sizeof(*q));
+
+    ring_size = vring_size(num, SMP_CACHE_BYTES, dev->vdev.packed_ring);
+    ring_size = (ring_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (posix_memalign(&q->ring, PAGE_SIZE, ring_size)) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(q->ring, ring_size);
+
+    q->control = calloc(1, vring_control_block_size((u16)num, dev->vdev.packed_ring));
+    q->pending = calloc(num, sizeof(*q->pending));
+    if (!q->control || !q->pending) {
+        free(q->ring);
+        free(q->control);
+        free(q->pending);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (dev->vdev.packed_ring) {
+        q->vq = vring_new_virtqueue_packed(index, num, SMP_CACHE_BYTES, &dev->vdev,
+            q->ring, sim_notify, q->control);
+    } else {
+        q->vq = vring_new_virtqueue_split(index, num, SMP_CACHE_BYTES, &dev->vdev,
+            q->ring, sim_notify, q->control);
+    }
+    if (!q->vq) {
+        free(q->ring);
+        free(q->control);
+        free(q->pending);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    q->index = index;
+    q->num = num;
+    q->avail_wrap_counter = 1;
+    q->used_wrap_counter = 1;
+
+    dev->vdev.info[index].vq = q->vq;
+    dev->vdev.info[index].num = (u16)num;
+    dev->vdev.info[index].queue = q->ring;
+    if (dev->num_queues <= index) {
+        dev->num_queues = index + 1;
+    }
+
+    *vq = q->vq;
+    return STATUS_SUCCESS;
+}
+
+void virtio_sim_device_shutdown(VirtIOSimDevice *dev)
+{
+    unsigned int i;
+
+    for (i = 0; i < dev->num_queues; i++) {
+        VirtIOSimQueue *q = &dev->queues[i];
+        if (q->vq) {
+            free(q->ring);
+            free(q->control);
+            free(q->pending);
+            q->vq = NULL;
+        }
+    }
+    dev->num_queues = 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * Simulated virtio device for host builds of the virtio ring code
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met :
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and / or other materials provided with the distribution.
+ * 3. Neither the names of the copyright holders nor the names of their contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef _VIRTIO_SIM_H
+#define _VIRTIO_SIM_H
+
+#include "osdep.h"
+#include "virtio_pci.h"
+#include "VirtIO.h"
+#include "virtio_ring.h"
+
+/* Guest physical addresses are plain user-space pointers in the host build */
+#define VIRTIO_SIM_PA(va) ((ULONGLONG)(ULONG_PTR)(va))
+#define VIRTIO_SIM_VA(pa) ((void *)(ULONG_PTR)(pa))
+
+#define VIRTIO_SIM_MAX_QUEUES MAX_QUEUES_PER_DEVICE_DEFAULT
+
+typedef struct virtio_sim_stats {
+    /* driver->device notifications received */
+    ULONGLONG kicks;
+    /* notifications that carried and matched VIRTIO_F_NOTIFICATION_DATA */
+    ULONGLONG notification_data;
+    /* device->driver interrupts the device would have raised */
+    ULONGLONG interrupts;
+    /* buffers (descriptor chains) consumed */
+    ULONGLONG buffers;
+    /* descriptors walked, including the ones in indirect tables */
+    ULONGLONG descriptors;
+} VirtIOSimStats;
+
+typedef struct virtio_sim_queue {
+    struct virtqueue *vq;
+    unsigned int index;
+    unsigned int num;
+    void *ring;
+    void *control;
+
+    /* device side ring state, split layout */
+    u16 last_avail_idx;
+    u16 used_idx;
+
+    /* device side ring state, packed layout */
+    u16 next_avail;
+    u16 next_used;
+    bool avail_wrap_counter;
+    bool used_wrap_counter;
+
+    /* last used index the driver has been interrupted for */
+    u16 signalled_used;
+
+    /* buffers consumed but not yet returned when completing out of order */
+    unsigned int num_pending;
+    struct {
+        u16 id;
+        u16 ndescs;
+        u32 len;
+    } *pending;
+
+    VirtIOSimStats stats;
+} VirtIOSimQueue;
+
+typedef struct virtio_sim_device {
+    VirtIODevice vdev;
+    /* features offered by the simulated device */
+    u64 device_features;
+    /* features accepted by the driver */
+    u64 features;
+    /* consume descriptors synchronously from the notification callback */
+    bool process_on_kick;
+    /* return buffers in reverse order of consumption, within one processing pass,
+     * ignored if VIRTIO_F_IN_ORDER has been negotiated. In-order queues get a single
+     * used entry for all buffers consumed in one pass */
+    bool out_of_order;
+    unsigned int num_queues;
+    VirtIOSimQueue queues[VIRTIO_SIM_MAX_QUEUES];
+} VirtIOSimDevice;
+
+/* Initializes the simulated device and negotiates features with the ring code.
+ * Returns STATUS_SUCCESS or an error if memory could not be allocated.
+ */
+NTSTATUS virtio_sim_device_initialize(VirtIOSimDevice *dev, u64 device_features);
+void virtio_sim_device_shutdown(VirtIOSimDevice *dev);
+
+/* Allocates ring memory and creates a driver-side virtqueue of size num */
+NTSTATUS virtio_sim_find_queue(VirtIOSimDevice *dev, unsigned index, unsigned num,
+                               struct virtqueue **vq);
+
+/* Device side: consumes up to budget available buffers, marks them used and returns
+ * the number of buffers consumed. A budget of 0 means no limit.
+ */
+unsigned int virtio_sim_process_queue(VirtIOSimDevice *dev, unsigned index, unsigned budget);
+
+#endif /* _VIRTIO_SIM_H */
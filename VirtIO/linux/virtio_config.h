@@ -67,6 +67,14 @@
 /* This feature indicates support for the packed virtqueue layout. */
 #define VIRTIO_F_RING_PACKED            34
 
+/* This feature indicates that all buffers are used by the device in the same
+ * order in which they have been made available. */
+#define VIRTIO_F_IN_ORDER               35
+
+/* This feature indicates that the driver passes extra data (besides
+ * identifying the virtqueue) in its device notifications. */
+#define VIRTIO_F_NOTIFICATION_DATA      38
+
 // if this number is not equal to desc size, queue creation fails
 #define SIZE_OF_SINGLE_INDIRECT_DESC    16
 
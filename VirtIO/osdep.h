@@ -14,7 +14,11 @@
 
 #pragma once
 
+#ifdef VIRTIO_HOST_BUILD
+#include "host/hostdep.h"
+#else
 #include <ntddk.h>
+#endif
 
 #define ENOSPC 1
 
@@ -109,6 +109,8 @@
 #define VIRTIO_PCI_CAP_DEVICE_CFG   4
 /* PCI configuration access */
 #define VIRTIO_PCI_CAP_PCI_CFG      5
+/* Additional shared memory capability */
+#define VIRTIO_PCI_CAP_SHARED_MEMORY_CFG 8
 
 /* This is the PCI capability header: */
 struct virtio_pci_cap {
@@ -117,11 +119,18 @@ struct virtio_pci_cap {
     __u8 cap_len;       /* Generic PCI field: capability length */
     __u8 cfg_type;      /* Identifies the structure. */
     __u8 bar;           /* Where to find it. */
-    __u8 padding[3];    /* Pad to full dword. */
+    __u8 id;            /* Multiple capabilities of the same type */
+    __u8 padding[2];    /* Pad to full dword. */
     __le32 offset;      /* Offset within bar. */
     __le32 length;      /* Length of the structure, in bytes. */
 };
 
+struct virtio_pci_cap64 {
+    struct virtio_pci_cap cap;
+    __le32 offset_hi;   /* Most sig 32 bits of offset */
+    __le32 length_hi;   /* Most sig 32 bits of length */
+};
+
 struct virtio_pci_notify_cap {
     struct virtio_pci_cap cap;
     __le32 notify_off_multiplier;   /* Multiplier for queue_notify_off. */
@@ -247,6 +256,12 @@ struct virtio_device
     // true if the VIRTIO_F_RING_PACKED feature flag has been negotiated
     bool packed_ring;
 
+    // true if the VIRTIO_F_IN_ORDER feature flag has been negotiated
+    bool in_order;
+
+    // true if the VIRTIO_F_NOTIFICATION_DATA feature flag has been negotiated
+    bool notification_data;
+
     // internal device operations, implemented separately for legacy and modern
     const struct virtio_device_ops *device;
 
@@ -389,4 +404,10 @@ u8 virtio_read_isr_status(VirtIODevice *vdev);
  */
 int virtio_get_bar_index(PPCI_COMMON_HEADER pPCIHeader, PHYSICAL_ADDRESS BasePA);
 
+/* virtio_get_shm_region looks up the shared memory region with the given id
+ * (a VIRTIO_PCI_CAP_SHARED_MEMORY_CFG capability) and returns its BAR index,
+ * offset and length within the BAR. Returns false if the device has no such region.
+ */
+bool virtio_get_shm_region(VirtIODevice *vdev, u8 id, int *bar, u64 *offset, u64 *length);
+
 #endif
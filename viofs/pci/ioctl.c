@@ -32,17 +32,37 @@
 
 EVT_WDF_REQUEST_CANCEL VirtFsEvtRequestCancel;
 
-static int GetVirtQueueIndex(IN PDEVICE_CONTEXT Context)
+static int GetVirtQueueIndex(IN PDEVICE_CONTEXT Context,
+                             IN BOOLEAN HighPrio)
 {
-    int index = 0;
+    int index;
+
+    if (HighPrio)
+    {
+        index = VQ_TYPE_HIPRIO;
+    }
+    else
+    {
+        // Submitters on different processors use different request queues
+        // and so do not contend for the same queue lock.
+        index = VQ_TYPE_REQUEST + (int)(KeGetCurrentProcessorNumberEx(NULL) %
+            Context->RequestQueues);
+    }
 
-    UNREFERENCED_PARAMETER(Context);
-    
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL, "VirtQueueIndex: %d", index);
-    
+
     return index;
 }
 
+// FORGET and INTERRUPT go to the high priority queue so that they are not
+// stuck behind the requests they refer to.
+static BOOLEAN IsHighPrioRequest(IN struct fuse_in_header *Header)
+{
+    return ((Header->opcode == FUSE_FORGET) ||
+            (Header->opcode == FUSE_BATCH_FORGET) ||
+            (Header->opcode == FUSE_INTERRUPT));
+}
+
 static SIZE_T GetRequiredScatterGatherSize(IN PVIRTIO_FS_REQUEST Request)
 {
     SIZE_T n;
@@ -50,6 +70,13 @@ static SIZE_T GetRequiredScatterGatherSize(IN PVIRTIO_FS_REQUEST Request)
     n = ((Request->InputBufferLength / PAGE_SIZE) + 1) + 
         ((Request->OutputBufferLength / PAGE_SIZE) + 1);
 
+    if (Request->DataBuffer != NULL)
+    {
+        n += ADDRESS_AND_SIZE_TO_SPAN_PAGES(
+            MmGetMdlVirtualAddress(Request->DataBuffer),
+            Request->DataBufferLength);
+    }
+
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL, "Required SG Size: %Iu", n);
 
     return n;
@@ -70,26 +97,33 @@ static PMDL VirtFsAllocatePages(IN SIZE_T TotalBytes)
         MM_DONT_ZERO_ALLOCATION | MM_ALLOCATE_FULLY_REQUIRED);
 }
 
+// Handles both the driver allocated pages, which start at a page boundary,
+// and the caller's locked pages of a direct request, which may not.
 static int FillScatterGatherFromMdl(OUT struct scatterlist sg[],
                                     IN PMDL Mdl,
                                     IN size_t Length)
 {
     PPFN_NUMBER pfn;
     ULONG total_pages;
+    ULONG offset;
     ULONG len;
     ULONG j;
     int i = 0;
 
-    while (Mdl != NULL)
+    while ((Mdl != NULL) && (Length > 0))
     {
-        total_pages = MmGetMdlByteCount(Mdl) / PAGE_SIZE;
+        total_pages = ADDRESS_AND_SIZE_TO_SPAN_PAGES(
+            MmGetMdlVirtualAddress(Mdl), MmGetMdlByteCount(Mdl));
+        offset = MmGetMdlByteOffset(Mdl);
         pfn = MmGetMdlPfnArray(Mdl);
-        for (j = 0; j < total_pages; j++)
+        for (j = 0; (j < total_pages) && (Length > 0); j++)
         {
-            len = (ULONG)(min(Length, PAGE_SIZE));
+            len = (ULONG)(min(Length, PAGE_SIZE - offset));
             Length -= len;
-            sg[i].physAddr.QuadPart = (ULONGLONG)(*(pfn + j)) << PAGE_SHIFT;
+            sg[i].physAddr.QuadPart =
+                ((ULONGLONG)(*(pfn + j)) << PAGE_SHIFT) + offset;
             sg[i].length = len;
+            offset = 0;
             i += 1;
         }
         Mdl = Mdl->Next;
@@ -98,81 +132,156 @@ static int FillScatterGatherFromMdl(OUT struct scatterlist sg[],
     return i;
 }
 
+// Returns the indirect descriptor table for a request with sg_size entries,
+// or NULL if it is added with direct descriptors. The table has to be
+// physically contiguous, which a page-sized pool buffer is.
+static PVOID VirtFsGetIndirectTable(IN PDEVICE_CONTEXT Context,
+                                    IN PVIRTIO_FS_REQUEST Request,
+                                    IN SIZE_T sg_size,
+                                    OUT ULONGLONG *PhysAddr)
+{
+    NTSTATUS status;
+    PVOID va;
+
+    if (!Context->IndirectDescs || (sg_size <= VIRT_FS_INLINE_SG) ||
+        (sg_size > VIRT_FS_INDIRECT_DESCS))
+    {
+        return NULL;
+    }
+
+    status = WdfMemoryCreateFromLookaside(Context->SgLookaside,
+        &Request->IndirectHandle);
+
+    if (!NT_SUCCESS(status))
+    {
+        Request->IndirectHandle = NULL;
+        return NULL;
+    }
+
+    va = WdfMemoryGetBuffer(Request->IndirectHandle, NULL);
+    if (ADDRESS_AND_SIZE_TO_SPAN_PAGES(va,
+        sg_size * SIZE_OF_SINGLE_INDIRECT_DESC) > 1)
+    {
+        WdfObjectDelete(Request->IndirectHandle);
+        Request->IndirectHandle = NULL;
+        return NULL;
+    }
+
+    *PhysAddr = MmGetPhysicalAddress(va).QuadPart;
+
+    return va;
+}
+
 static NTSTATUS VirtFsEnqueueRequest(IN PDEVICE_CONTEXT Context,
-                                     IN PVIRTIO_FS_REQUEST Request)
+                                     IN PVIRTIO_FS_REQUEST Request,
+                                     IN BOOLEAN HighPrio)
 {
     WDFSPINLOCK vq_lock;
+    WDFMEMORY sg_handle = NULL;
     struct virtqueue *vq;
     struct scatterlist *sg;
     size_t sg_size;
+    PVOID va_indirect;
+    ULONGLONG phys_indirect = 0;
+    NTSTATUS status;
     int vq_index;
     int ret;
     int out_num, in_num;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL, "--> %!FUNC!");
 
-    vq_index = GetVirtQueueIndex(Context);
+    vq_index = GetVirtQueueIndex(Context, HighPrio);
     vq = Context->VirtQueues[vq_index];
     vq_lock = Context->VirtQueueLocks[vq_index];
 
+    // Most requests fit the request's own list, only the ones exceeding a
+    // lookaside buffer still need a pool allocation.
     sg_size = GetRequiredScatterGatherSize(Request);
-    sg = ExAllocatePoolWithTag(NonPagedPool,
-        sg_size * sizeof(struct scatterlist), VIRT_FS_MEMORY_TAG);
+    if (sg_size <= VIRT_FS_INLINE_SG)
+    {
+        sg = Request->Sg;
+    }
+    else if (sg_size <= VIRT_FS_LOOKASIDE_SG)
+    {
+        status = WdfMemoryCreateFromLookaside(Context->SgLookaside,
+            &sg_handle);
 
-    if (sg == NULL)
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTL,
+                "WdfMemoryCreateFromLookaside failed");
+            return status;
+        }
+
+        sg = WdfMemoryGetBuffer(sg_handle, NULL);
+    }
+    else
     {
-        TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTL,
-            "Failed to allocate a %Iu items scatter-gatter list", sg_size);
-        return STATUS_INSUFFICIENT_RESOURCES;
+        sg = ExAllocatePoolWithTag(NonPagedPool,
+            sg_size * sizeof(struct scatterlist), VIRT_FS_MEMORY_TAG);
+
+        if (sg == NULL)
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTL,
+                "Failed to allocate a %Iu items scatter-gatter list", sg_size);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
     }
 
     out_num = FillScatterGatherFromMdl(sg, Request->InputBuffer,
         Request->InputBufferLength);
+    if ((Request->DataBuffer != NULL) && !Request->DataWritable)
+    {
+        out_num += FillScatterGatherFromMdl(sg + out_num,
+            Request->DataBuffer, Request->DataBufferLength);
+    }
+
     in_num = FillScatterGatherFromMdl(sg + out_num, Request->OutputBuffer,
         Request->OutputBufferLength);
+    if ((Request->DataBuffer != NULL) && Request->DataWritable)
+    {
+        in_num += FillScatterGatherFromMdl(sg + out_num + in_num,
+            Request->DataBuffer, Request->DataBufferLength);
+    }
+
+    // Large transfers take a single ring slot, so that more of them can be
+    // in flight at once.
+    va_indirect = VirtFsGetIndirectTable(Context, Request, out_num + in_num,
+        &phys_indirect);
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL, "Push %p Request: %p",
         Request, Request->Request);
 
     WdfSpinLockAcquire(Context->RequestsLock);
-    PushEntryList(&Context->RequestsList, &Request->ListEntry);
+    InsertTailList(&Context->RequestsList, &Request->ListEntry);
     WdfSpinLockRelease(Context->RequestsLock);
 
     WdfSpinLockAcquire(vq_lock);
-    ret = virtqueue_add_buf(vq, sg, out_num, in_num, Request, NULL, 0);
-    if (ret < 0)
-    {
-        PSINGLE_LIST_ENTRY iter;
+    ret = virtqueue_add_buf(vq, sg, out_num, in_num, Request, va_indirect,
+        phys_indirect);
+    WdfSpinLockRelease(vq_lock);
 
-        WdfSpinLockRelease(vq_lock);
+    // The ring holds the buffers' addresses now, the list is not needed.
+    if (sg_handle != NULL)
+    {
+        WdfObjectDelete(sg_handle);
+    }
+    else if (sg != Request->Sg)
+    {
+        ExFreePoolWithTag(sg, VIRT_FS_MEMORY_TAG);
+    }
 
+    if (ret < 0)
+    {
         WdfSpinLockAcquire(Context->RequestsLock);
-        iter = &Context->RequestsList;
-        while (iter->Next != NULL)
-        {
-            PVIRTIO_FS_REQUEST removed = CONTAINING_RECORD(iter->Next,
-                VIRTIO_FS_REQUEST, ListEntry);
-
-            if (Request == removed)
-            {
-                TraceEvents(TRACE_LEVEL_VERBOSE, DBG_DPC,
-                    "Delete %p Request: %p", removed, removed->Request);
-                iter->Next = removed->ListEntry.Next;
-                break;
-            }
-
-            iter = iter->Next;
-        };
+        TraceEvents(TRACE_LEVEL_VERBOSE, DBG_DPC,
+            "Delete %p Request: %p", Request, Request->Request);
+        RemoveEntryList(&Request->ListEntry);
         WdfSpinLockRelease(Context->RequestsLock);
-        
-        ExFreePoolWithTag(sg, VIRT_FS_MEMORY_TAG);
 
         return STATUS_UNSUCCESSFUL;
     }
 
-    WdfSpinLockRelease(vq_lock);
-    ExFreePoolWithTag(sg, VIRT_FS_MEMORY_TAG);
-
     virtqueue_kick(vq);
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL, "<-- %!FUNC!");
@@ -233,17 +342,56 @@ static VOID HandleGetVolumeName(IN PDEVICE_CONTEXT Context,
     WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, size);
 }
 
+static VOID HandleGetQueueInfo(IN PDEVICE_CONTEXT Context,
+    IN WDFREQUEST Request)
+{
+    PVIRTFS_QUEUE_INFO info;
+    NTSTATUS status;
+    UINT32 i;
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*info), &info,
+        NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTL,
+            "WdfRequestRetrieveOutputBuffer failed");
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    info->QueueSize = MAXUINT32;
+    for (i = VQ_TYPE_REQUEST; i < Context->NumQueues; i++)
+    {
+        info->QueueSize = min(info->QueueSize,
+            virtio_get_queue_size(Context->VirtQueues[i]));
+    }
+
+    info->IndirectDescs = Context->IndirectDescs ? VIRT_FS_INDIRECT_DESCS : 0;
+
+    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(*info));
+}
+
 static VOID HandleSubmitFuseRequest(IN PDEVICE_CONTEXT Context,
     IN WDFREQUEST Request,
     IN size_t OutputBufferLength,
-    IN size_t InputBufferLength)
+    IN size_t InputBufferLength,
+    IN BOOLEAN Direct)
 {
+    PREQUEST_CONTEXT req_context = GetRequestContext(Request);
+    PVIRTFS_DIRECT_REQUEST direct = NULL;
     WDFMEMORY handle;
     NTSTATUS status;
     PVIRTIO_FS_REQUEST fs_req;
     PVOID in_buf_va;
     PUCHAR in_buf, out_buf;
 
+    if (Direct)
+    {
+        // The direct request header was validated in the caller's context.
+        InputBufferLength -= sizeof(VIRTFS_DIRECT_REQUEST);
+    }
+
     if (InputBufferLength < sizeof(struct fuse_in_header))
     {
         TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTL, "Insufficient in buffer");
@@ -268,6 +416,12 @@ static VOID HandleSubmitFuseRequest(IN PDEVICE_CONTEXT Context,
         goto complete_wdf_req_no_fs_req;
     }
 
+    if (Direct)
+    {
+        direct = (PVIRTFS_DIRECT_REQUEST)in_buf;
+        in_buf += sizeof(VIRTFS_DIRECT_REQUEST);
+    }
+
     status = WdfRequestRetrieveOutputBuffer(Request, OutputBufferLength,
         &out_buf, NULL);
 
@@ -295,6 +449,14 @@ static VOID HandleSubmitFuseRequest(IN PDEVICE_CONTEXT Context,
     fs_req->InputBufferLength = InputBufferLength;
     fs_req->OutputBuffer = VirtFsAllocatePages(OutputBufferLength);
     fs_req->OutputBufferLength = OutputBufferLength;
+    fs_req->DataBuffer = req_context->DataMdl;
+    fs_req->DataBufferLength = (direct != NULL) ? direct->DataLength : 0;
+    fs_req->DataWritable = (direct != NULL) && (direct->DataWritable != 0);
+    fs_req->IndirectHandle = NULL;
+    req_context->DataMdl = NULL;
+
+    // Set before the request becomes cancelable, nobody else sees it yet.
+    req_context->FsRequest = fs_req;
 
     if ((fs_req->InputBuffer == NULL) || (fs_req->OutputBuffer == NULL))
     {
@@ -316,21 +478,40 @@ static VOID HandleSubmitFuseRequest(IN PDEVICE_CONTEXT Context,
     RtlCopyMemory(in_buf_va, in_buf, InputBufferLength);
     MmUnmapLockedPages(in_buf_va, fs_req->InputBuffer);
 
-    status = WdfRequestMarkCancelableEx(Request, VirtFsEvtRequestCancel);
-    if (!NT_SUCCESS(status))
+    // The device accesses the caller's pages of a direct request, so it has
+    // to stay pending until the device gives them back.
+    if (fs_req->DataBuffer == NULL)
     {
-        TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTL,
-            "WdfRequestMarkCancelableEx failed: %!STATUS!", status);
-        goto complete_wdf_req;
+        status = WdfRequestMarkCancelableEx(Request, VirtFsEvtRequestCancel);
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTL,
+                "WdfRequestMarkCancelableEx failed: %!STATUS!", status);
+            goto complete_wdf_req;
+        }
     }
 
-    status = VirtFsEnqueueRequest(Context, fs_req);
+    status = VirtFsEnqueueRequest(Context, fs_req,
+        IsHighPrioRequest((struct fuse_in_header *)in_buf));
     if (!NT_SUCCESS(status))
     {
-        if (WdfRequestUnmarkCancelable(Request) != STATUS_CANCELLED)
+        NTSTATUS unmark_status = STATUS_SUCCESS;
+
+        WdfSpinLockAcquire(Context->RequestsLock);
+        req_context->FsRequest = NULL;
+        if (fs_req->DataBuffer == NULL)
+        {
+            unmark_status = WdfRequestUnmarkCancelable(Request);
+        }
+        WdfSpinLockRelease(Context->RequestsLock);
+
+        if (unmark_status != STATUS_CANCELLED)
         {
             goto complete_wdf_req;
         }
+
+        // The cancel routine completes the request.
+        FreeVirtFsRequest(fs_req);
     }
 
     return;
@@ -344,6 +525,187 @@ complete_wdf_req_no_fs_req:
     WdfRequestComplete(Request, status);
 }
 
+static NTSTATUS LockDirectRequestData(IN WDFREQUEST Request,
+    OUT PMDL *DataMdl)
+{
+    PVIRTFS_DIRECT_REQUEST direct;
+    NTSTATUS status;
+    PMDL mdl;
+
+    *DataMdl = NULL;
+
+    status = WdfRequestRetrieveInputBuffer(Request,
+        sizeof(VIRTFS_DIRECT_REQUEST), &direct, NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTL,
+            "WdfRequestRetrieveInputBuffer failed");
+        return status;
+    }
+
+    if (direct->DataLength == 0)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if ((ULONG_PTR)direct->Data != direct->Data)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    mdl = IoAllocateMdl((PVOID)(ULONG_PTR)direct->Data, direct->DataLength,
+        FALSE, FALSE, NULL);
+
+    if (mdl == NULL)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTL, "IoAllocateMdl failed");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    __try
+    {
+        MmProbeAndLockPages(mdl, WdfRequestGetRequestorMode(Request),
+            direct->DataWritable ? IoWriteAccess : IoReadAccess);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        status = GetExceptionCode();
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTL,
+            "MmProbeAndLockPages failed: %!STATUS!", status);
+        IoFreeMdl(mdl);
+        return status;
+    }
+
+    *DataMdl = mdl;
+
+    return STATUS_SUCCESS;
+}
+
+// Maps the whole host DAX window cached into the calling process. Only the
+// service is meant to call it: the INF limits opening the device to SYSTEM and
+// administrators, and the IOCTL requires a handle opened for read and write.
+//
+// The window holds nothing but file ranges the service itself asks the host
+// to map with FUSE_SETUPMAPPING, so a writable view of all of it gives the
+// caller no access beyond what it has through the request queues already:
+// reading and writing any file of the share. Restricting the view to the
+// mapped ranges would need a remap on every SETUPMAPPING for no gain in
+// isolation. The host backs the window with ordinary memory, hence cached.
+static VOID HandleMapDaxWindow(IN PDEVICE_CONTEXT Context,
+    IN WDFREQUEST Request)
+{
+    PFILE_CONTEXT file_context;
+    PVIRTFS_DAX_WINDOW window;
+    PVOID address = NULL;
+    NTSTATUS status;
+
+    if (WdfRequestGetRequestorMode(Request) != UserMode)
+    {
+        WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
+        return;
+    }
+
+    status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*window),
+        &window, NULL);
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTL,
+            "WdfRequestRetrieveOutputBuffer failed");
+        WdfRequestComplete(Request, status);
+        return;
+    }
+
+    file_context = GetFileContext(WdfRequestGetFileObject(Request));
+
+    // DaxLock keeps the hardware from being released under the new view
+    // before it is on the list. The window is mapped once per handle.
+    WdfWaitLockAcquire(Context->DaxLock, NULL);
+
+    if (Context->DaxMdl == NULL)
+    {
+        WdfWaitLockRelease(Context->DaxLock);
+        WdfRequestComplete(Request, STATUS_NOT_SUPPORTED);
+        return;
+    }
+
+    address = file_context->DaxAddress;
+    if (address == NULL)
+    {
+        __try
+        {
+            address = MmMapLockedPagesSpecifyCache(Context->DaxMdl, UserMode,
+                MmCached, NULL, FALSE, NormalPagePriority);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            status = GetExceptionCode();
+            WdfWaitLockRelease(Context->DaxLock);
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTL,
+                "MmMapLockedPagesSpecifyCache failed: %!STATUS!", status);
+            WdfRequestComplete(Request, status);
+            return;
+        }
+
+        file_context->DaxAddress = address;
+        file_context->DaxProcess = PsGetCurrentProcess();
+        ObReferenceObject(file_context->DaxProcess);
+        InsertTailList(&Context->DaxViews, &file_context->DaxEntry);
+    }
+
+    window->Address = (UINT64)(ULONG_PTR)address;
+    window->Length = Context->DaxLength;
+
+    WdfWaitLockRelease(Context->DaxLock);
+
+    WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS,
+        sizeof(*window));
+}
+
+VOID VirtFsEvtIoInCallerContext(IN WDFDEVICE Device,
+                                IN WDFREQUEST Request)
+{
+    WDF_REQUEST_PARAMETERS params;
+    NTSTATUS status;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request, &params);
+
+    // The DAX window is mapped into the address space of the calling process.
+    if ((params.Type == WdfRequestTypeDeviceControl) &&
+        (params.Parameters.DeviceIoControl.IoControlCode ==
+            IOCTL_VIRTFS_MAP_DAX_WINDOW))
+    {
+        HandleMapDaxWindow(GetDeviceContext(Device), Request);
+        return;
+    }
+
+    // The payload buffer of a direct request is a user address, it can only
+    // be locked in the context of the calling process.
+    if ((params.Type == WdfRequestTypeDeviceControl) &&
+        (params.Parameters.DeviceIoControl.IoControlCode ==
+            IOCTL_VIRTFS_FUSE_REQUEST_DIRECT))
+    {
+        status = LockDirectRequestData(Request,
+            &GetRequestContext(Request)->DataMdl);
+
+        if (!NT_SUCCESS(status))
+        {
+            WdfRequestComplete(Request, status);
+            return;
+        }
+    }
+
+    status = WdfDeviceEnqueueRequest(Device, Request);
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_IOCTL,
+            "WdfDeviceEnqueueRequest failed: %!STATUS!", status);
+        WdfRequestComplete(Request, status);
+    }
+}
+
 VOID VirtFsEvtIoDeviceControl(IN WDFQUEUE Queue,
                               IN WDFREQUEST Request,
                               IN size_t OutputBufferLength,
@@ -362,9 +724,15 @@ VOID VirtFsEvtIoDeviceControl(IN WDFQUEUE Queue,
             HandleGetVolumeName(context, Request, OutputBufferLength);
             break;
 
+        case IOCTL_VIRTFS_GET_QUEUE_INFO:
+            HandleGetQueueInfo(context, Request);
+            break;
+
         case IOCTL_VIRTFS_FUSE_REQUEST:
+        case IOCTL_VIRTFS_FUSE_REQUEST_DIRECT:
             HandleSubmitFuseRequest(context, Request, OutputBufferLength,
-                InputBufferLength);
+                InputBufferLength,
+                IoControlCode == IOCTL_VIRTFS_FUSE_REQUEST_DIRECT);
             break;
 
         default:
@@ -380,79 +748,131 @@ VOID VirtFsEvtIoStop(IN WDFQUEUE Queue,
                      IN ULONG ActionFlags)
 {
     PDEVICE_CONTEXT context = GetDeviceContext(WdfIoQueueGetDevice(Queue));
+    PREQUEST_CONTEXT req_context = GetRequestContext(Request);
+    BOOLEAN complete = FALSE;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL,
         "--> %!FUNC! Request: %p ActionFlags: 0x%08x", Request, ActionFlags);
 
+    WdfSpinLockAcquire(context->RequestsLock);
+
     if (ActionFlags & WdfRequestStopRequestCancelable)
     {
         if (WdfRequestUnmarkCancelable(Request) == STATUS_CANCELLED)
         {
+            WdfSpinLockRelease(context->RequestsLock);
             goto request_cancelled;
         }
     }
 
-    if (ActionFlags & WdfRequestStopActionSuspend)
-    {
-        WdfRequestStopAcknowledge(Request, FALSE);
-    }
-    else if (ActionFlags & WdfRequestStopActionPurge)
+    if (ActionFlags & WdfRequestStopActionPurge)
     {
-        PSINGLE_LIST_ENTRY iter;
+        complete = TRUE;
 
-        WdfSpinLockAcquire(context->RequestsLock);
-        iter = &context->RequestsList;
-        while (iter->Next != NULL)
+        if (req_context->FsRequest != NULL)
         {
-            PVIRTIO_FS_REQUEST removed = CONTAINING_RECORD(iter->Next,
-                VIRTIO_FS_REQUEST, ListEntry);
-
-            if (Request == removed->Request)
+            if (req_context->FsRequest->DataBuffer != NULL)
             {
-                removed->Request = NULL;
-                break;
+                // The device may still write into the caller's pages, the
+                // request completes once the DPC or the reset in D0Exit
+                // has taken them back.
+                complete = FALSE;
             }
+            else
+            {
+                // The device still owns the buffers, the DPC frees them.
+                req_context->FsRequest->Request = NULL;
+                req_context->FsRequest = NULL;
+            }
+        }
+    }
 
-            iter = iter->Next;
-        };
-        WdfSpinLockRelease(context->RequestsLock);
+    WdfSpinLockRelease(context->RequestsLock);
 
+    if (complete)
+    {
         WdfRequestComplete(Request, STATUS_CANCELLED);
     }
+    else
+    {
+        WdfRequestStopAcknowledge(Request, FALSE);
+    }
 
 request_cancelled:
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL, "<-- %!FUNC!");
 }
 
+// Called after the device has been reset, nothing returns the requests
+// still in RequestsList anymore. Completes the WDF requests they carry and
+// releases their buffers, including the caller's pages of direct requests.
+VOID VirtFsCancelPendingRequests(IN PDEVICE_CONTEXT Context)
+{
+    PVIRTIO_FS_REQUEST fs_req;
+    WDFREQUEST request;
+    LIST_ENTRY pending;
+
+    InitializeListHead(&pending);
+
+    WdfSpinLockAcquire(Context->RequestsLock);
+    while (!IsListEmpty(&Context->RequestsList))
+    {
+        fs_req = CONTAINING_RECORD(RemoveHeadList(&Context->RequestsList),
+            VIRTIO_FS_REQUEST, ListEntry);
+
+        if (fs_req->Request != NULL)
+        {
+            GetRequestContext(fs_req->Request)->FsRequest = NULL;
+
+            // The cancel routine completes a request it got to first.
+            if ((fs_req->DataBuffer == NULL) &&
+                (WdfRequestUnmarkCancelable(fs_req->Request) == STATUS_CANCELLED))
+            {
+                fs_req->Request = NULL;
+            }
+        }
+
+        InsertTailList(&pending, &fs_req->ListEntry);
+    }
+    WdfSpinLockRelease(Context->RequestsLock);
+
+    while (!IsListEmpty(&pending))
+    {
+        fs_req = CONTAINING_RECORD(RemoveHeadList(&pending),
+            VIRTIO_FS_REQUEST, ListEntry);
+
+        TraceEvents(TRACE_LEVEL_INFORMATION, DBG_IOCTL,
+            "Cancel pending request %p Request: %p", fs_req, fs_req->Request);
+
+        // Unlock the caller's pages before the caller sees the completion.
+        request = fs_req->Request;
+        FreeVirtFsRequest(fs_req);
+        if (request != NULL)
+        {
+            WdfRequestComplete(request, STATUS_CANCELLED);
+        }
+    }
+}
+
 VOID VirtFsEvtRequestCancel(IN WDFREQUEST Request)
 {
     PDEVICE_CONTEXT context = GetDeviceContext(WdfIoQueueGetDevice(
         WdfRequestGetIoQueue(Request)));
-    PSINGLE_LIST_ENTRY iter;
+    PREQUEST_CONTEXT req_context = GetRequestContext(Request);
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL,
         "--> %!FUNC! Cancelled Request: %p", Request);
-    
-    WdfRequestComplete(Request, STATUS_CANCELLED);
 
     WdfSpinLockAcquire(context->RequestsLock);
-    iter = &context->RequestsList;
-    while (iter->Next != NULL)
+    if (req_context->FsRequest != NULL)
     {
-        PVIRTIO_FS_REQUEST entry = CONTAINING_RECORD(iter->Next,
-            VIRTIO_FS_REQUEST, ListEntry);
-
-        if (Request == entry->Request)
-        {
-            TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL,
-                "Clear virtio fs request %p", entry);
-            entry->Request = NULL;
-            break;
-        }
-
-        iter = iter->Next;
-    };
+        TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL,
+            "Clear virtio fs request %p", req_context->FsRequest);
+        req_context->FsRequest->Request = NULL;
+        req_context->FsRequest = NULL;
+    }
     WdfSpinLockRelease(context->RequestsLock);
 
+    WdfRequestComplete(Request, STATUS_CANCELLED);
+
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_IOCTL, "<-- %!FUNC!");
 }
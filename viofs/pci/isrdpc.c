@@ -30,6 +30,24 @@
 #include "viofs.h"
 #include "isrdpc.tmh"
 
+// Returns the position of Interrupt in Context->Interrupts. Interrupt number
+// n serves the queues n, n + NumInterrupts, n + 2 * NumInterrupts, ...
+static ULONG VirtFsGetInterruptIndex(IN PDEVICE_CONTEXT Context,
+                                     IN WDFINTERRUPT Interrupt)
+{
+    ULONG i;
+
+    for (i = 0; i < Context->NumInterrupts; i++)
+    {
+        if (Context->Interrupts[i] == Interrupt)
+        {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
 NTSTATUS VirtFsEvtInterruptEnable(IN WDFINTERRUPT Interrupt,
                                   IN WDFDEVICE AssociatedDevice)
 {
@@ -41,7 +59,8 @@ NTSTATUS VirtFsEvtInterruptEnable(IN WDFINTERRUPT Interrupt,
 
     context = GetDeviceContext(WdfInterruptGetDevice(Interrupt));
 
-    for (ULONG i = 0; i < context->RequestQueues; i++)
+    for (ULONG i = VirtFsGetInterruptIndex(context, Interrupt);
+         i < context->NumQueues; i += context->NumInterrupts)
     {
         struct virtqueue *vq = context->VirtQueues[i];
 
@@ -65,7 +84,8 @@ NTSTATUS VirtFsEvtInterruptDisable(IN WDFINTERRUPT Interrupt,
 
     context = GetDeviceContext(WdfInterruptGetDevice(Interrupt));
 
-    for (ULONG i = 0; i < context->RequestQueues; i++)
+    for (ULONG i = VirtFsGetInterruptIndex(context, Interrupt);
+         i < context->NumQueues; i += context->NumInterrupts)
     {
         struct virtqueue *vq = context->VirtQueues[i];
 
@@ -89,10 +109,9 @@ BOOLEAN VirtFsEvtInterruptIsr(IN WDFINTERRUPT Interrupt, IN ULONG MessageId)
     context = GetDeviceContext(WdfInterruptGetDevice(Interrupt));
 
     WDF_INTERRUPT_INFO_INIT(&info);
-    WdfInterruptGetInfo(context->WdfInterrupt, &info);
+    WdfInterruptGetInfo(Interrupt, &info);
 
-    if ((info.MessageSignaled && (MessageId < context->RequestQueues)) ||
-        VirtIOWdfGetISRStatus(&context->VDevice))
+    if (info.MessageSignaled || VirtIOWdfGetISRStatus(&context->VDevice))
     {
         WdfInterruptQueueDpcForIsr(Interrupt);
         serviced = TRUE;
@@ -112,7 +131,7 @@ static VOID VirtFsReadFromQueue(PDEVICE_CONTEXT context,
                                 WDFSPINLOCK vq_lock)
 {
     PVIRTIO_FS_REQUEST fs_req;
-    PSINGLE_LIST_ENTRY iter;
+    WDFREQUEST request;
     NTSTATUS status;
     PVOID out_buf_va;
     PUCHAR out_buf;    
@@ -135,38 +154,34 @@ static VOID VirtFsReadFromQueue(PDEVICE_CONTEXT context,
         TraceEvents(TRACE_LEVEL_VERBOSE, DBG_DPC,
             "Got %p Request: %p", fs_req, fs_req->Request);
 
+        // Unmark under the lock, the cancel routine then either has not run
+        // and never will, or it has detached the request from fs_req.
         WdfSpinLockAcquire(context->RequestsLock);
-        iter = &context->RequestsList;
-        while (iter->Next != NULL)
+        RemoveEntryList(&fs_req->ListEntry);
+        if (fs_req->Request != NULL)
         {
-            PVIRTIO_FS_REQUEST removed = CONTAINING_RECORD(iter->Next,
-                VIRTIO_FS_REQUEST, ListEntry);
+            GetRequestContext(fs_req->Request)->FsRequest = NULL;
 
-            if (fs_req == removed)
+            // Direct requests are never marked cancelable, see
+            // HandleSubmitFuseRequest.
+            if ((fs_req->DataBuffer == NULL) &&
+                (WdfRequestUnmarkCancelable(fs_req->Request) == STATUS_CANCELLED))
             {
-                TraceEvents(TRACE_LEVEL_VERBOSE, DBG_DPC,
-                    "Delete %p Request: %p", removed, removed->Request);
-                iter->Next = removed->ListEntry.Next;
-                break;
-            }
-            else
-            {
-                iter = iter->Next;
-            }
-        };
-        WdfSpinLockRelease(context->RequestsLock);
-
-        if ((fs_req->Request == NULL) ||
-            (WdfRequestUnmarkCancelable(fs_req->Request) == STATUS_CANCELLED))
-        {
-            TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC,
-                "Ignoring a cancelled request: %p", fs_req->Request);
+                TraceEvents(TRACE_LEVEL_INFORMATION, DBG_DPC,
+                    "Ignoring a cancelled request: %p", fs_req->Request);
 
-            fs_req->Request = NULL;
+                fs_req->Request = NULL;
+            }
         }
+        WdfSpinLockRelease(context->RequestsLock);
 
         if (fs_req->Request != NULL)
         {
+            // The used length of a direct read also counts the data that the
+            // device wrote into the caller's pages, only the reply header
+            // went to the bounce buffer.
+            length = min(length, (unsigned)fs_req->OutputBufferLength);
+
             status = WdfRequestRetrieveOutputBuffer(fs_req->Request, length,
                 &out_buf, &out_len);
 
@@ -201,11 +216,18 @@ static VOID VirtFsReadFromQueue(PDEVICE_CONTEXT context,
                 "Complete Request: %p Status: %!STATUS! Length: %d",
                 fs_req->Request, status, length);
 
-            WdfRequestCompleteWithInformation(fs_req->Request, status,
+            // Unlock the caller's pages of a direct request before the
+            // caller learns that the request is done.
+            request = fs_req->Request;
+            FreeVirtFsRequest(fs_req);
+
+            WdfRequestCompleteWithInformation(request, status,
                 (ULONG_PTR)length);
         }
-
-        FreeVirtFsRequest(fs_req);
+        else
+        {
+            FreeVirtFsRequest(fs_req);
+        }
     }
 }
 
@@ -213,9 +235,6 @@ VOID VirtFsEvtInterruptDpc(IN WDFINTERRUPT Interrupt,
                            IN WDFOBJECT AssociatedObject)
 {
     PDEVICE_CONTEXT context;
-    WDF_INTERRUPT_INFO info;
-    struct virtqueue *vq = NULL;
-    WDFSPINLOCK vq_lock = NULL;
     ULONG i;
 
     UNREFERENCED_PARAMETER(AssociatedObject);
@@ -225,29 +244,13 @@ VOID VirtFsEvtInterruptDpc(IN WDFINTERRUPT Interrupt,
 
     context = GetDeviceContext(WdfInterruptGetDevice(Interrupt));
 
-    WDF_INTERRUPT_INFO_INIT(&info);
-    WdfInterruptGetInfo(context->WdfInterrupt, &info);
-
-    if ((info.MessageSignaled == TRUE) &&
-        (info.MessageNumber < context->RequestQueues))
+    // Each MSI-X message completes only the queues bound to it, a line
+    // interrupt is the only one and serves them all.
+    for (i = VirtFsGetInterruptIndex(context, Interrupt);
+         i < context->NumQueues; i += context->NumInterrupts)
     {
-        vq = context->VirtQueues[info.MessageNumber];
-        vq_lock = context->VirtQueueLocks[info.MessageNumber];
-    }
-
-    if (vq != NULL)
-    {
-        VirtFsReadFromQueue(context, vq, vq_lock);
-    }
-    else
-    {
-        for (i = 0; i < context->RequestQueues; i++)
-        {
-            vq = context->VirtQueues[i];
-            vq_lock = context->VirtQueueLocks[i];
-
-            VirtFsReadFromQueue(context, vq, vq_lock);
-        }
+        VirtFsReadFromQueue(context, context->VirtQueues[i],
+            context->VirtQueueLocks[i]);
     }
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_DPC, "<-- %!FUNC!");
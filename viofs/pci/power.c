@@ -37,6 +37,153 @@
 #pragma alloc_text(PAGE, VirtFsEvtDeviceD0Exit)
 #endif
 
+// Creates an interrupt object for each MSI-X message beyond the first one,
+// which is owned by the interrupt created in VirtFsEvtDeviceAdd. With fewer
+// messages than queues, or with a line interrupt, the queues share them.
+static NTSTATUS VirtFsCreateQueueInterrupts(IN WDFDEVICE Device,
+                                            IN WDFCMRESLIST ResourcesRaw,
+                                            IN WDFCMRESLIST ResourcesTranslated)
+{
+#if (NTDDI_VERSION >= NTDDI_WIN8)
+    PDEVICE_CONTEXT context = GetDeviceContext(Device);
+    PCM_PARTIAL_RESOURCE_DESCRIPTOR desc;
+    WDF_INTERRUPT_CONFIG interruptConfig;
+    NTSTATUS status;
+    BOOLEAN first = TRUE;
+    ULONG count;
+    ULONG i;
+
+    count = WdfCmResourceListGetCount(ResourcesTranslated);
+    for (i = 0; (i < count) && (context->NumInterrupts < context->NumQueues); i++)
+    {
+        desc = WdfCmResourceListGetDescriptor(ResourcesTranslated, i);
+        if ((desc == NULL) || (desc->Type != CmResourceTypeInterrupt) ||
+            !(desc->Flags & CM_RESOURCE_INTERRUPT_MESSAGE))
+        {
+            continue;
+        }
+
+        if (first)
+        {
+            first = FALSE;
+            continue;
+        }
+
+        WDF_INTERRUPT_CONFIG_INIT(&interruptConfig,
+            VirtFsEvtInterruptIsr, VirtFsEvtInterruptDpc);
+
+        interruptConfig.EvtInterruptEnable = VirtFsEvtInterruptEnable;
+        interruptConfig.EvtInterruptDisable = VirtFsEvtInterruptDisable;
+        interruptConfig.InterruptTranslated = desc;
+        interruptConfig.InterruptRaw = WdfCmResourceListGetDescriptor(
+            ResourcesRaw, i);
+
+        status = WdfInterruptCreate(Device, &interruptConfig,
+            WDF_NO_OBJECT_ATTRIBUTES,
+            &context->Interrupts[context->NumInterrupts]);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_POWER,
+                "WdfInterruptCreate failed: %!STATUS!", status);
+            return status;
+        }
+
+        context->NumInterrupts++;
+    }
+#else
+    UNREFERENCED_PARAMETER(Device);
+    UNREFERENCED_PARAMETER(ResourcesRaw);
+    UNREFERENCED_PARAMETER(ResourcesTranslated);
+#endif
+
+    return STATUS_SUCCESS;
+}
+
+// Maps the DAX window, if the device has one, and describes it with an MDL
+// so that it can be mapped into the service. The window is ordinary memory
+// on the host side and is mapped cached. Failing to map it is not fatal,
+// the file system then transfers all data through the request queues.
+static VOID VirtFsMapDaxWindow(IN PDEVICE_CONTEXT Context)
+{
+    ULONGLONG length;
+    NTSTATUS status;
+
+    status = VirtIOWdfGetSharedMemoryRegion(&Context->VDevice,
+        VIRTIO_FS_SHMCAP_ID_CACHE, &Context->DaxBasePA, &length);
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_INFORMATION, DBG_POWER,
+            "No DAX window: %!STATUS!", status);
+        return;
+    }
+
+    Context->DaxLength = (SIZE_T)min(length, VIRT_FS_DAX_MAX_LENGTH);
+
+#if defined(NTDDI_WINTHRESHOLD) && (NTDDI_VERSION >= NTDDI_WINTHRESHOLD)
+    Context->DaxBase = MmMapIoSpaceEx(Context->DaxBasePA, Context->DaxLength,
+        PAGE_READWRITE);
+#else
+    Context->DaxBase = MmMapIoSpace(Context->DaxBasePA, Context->DaxLength,
+        MmCached);
+#endif
+
+    if (Context->DaxBase == NULL)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_POWER,
+            "Failed to map the DAX window");
+        return;
+    }
+
+    Context->DaxMdl = IoAllocateMdl(Context->DaxBase,
+        (ULONG)Context->DaxLength, FALSE, FALSE, NULL);
+
+    if (Context->DaxMdl == NULL)
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_POWER,
+            "Failed to allocate the DAX window MDL");
+        MmUnmapIoSpace(Context->DaxBase, Context->DaxLength);
+        Context->DaxBase = NULL;
+        return;
+    }
+
+    MmBuildMdlForNonPagedPool(Context->DaxMdl);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_POWER,
+        "DAX window: %I64x length %Iu (%I64u available)",
+        Context->DaxBasePA.QuadPart, Context->DaxLength, length);
+}
+
+// Also unmaps the window from every process still holding a view, an access
+// after the hardware is gone then faults instead of reaching freed space.
+static VOID VirtFsUnmapDaxWindow(IN PDEVICE_CONTEXT Context)
+{
+    WdfWaitLockAcquire(Context->DaxLock, NULL);
+
+    while (!IsListEmpty(&Context->DaxViews))
+    {
+        VirtFsUnmapDaxView(Context, CONTAINING_RECORD(Context->DaxViews.Flink,
+            FILE_CONTEXT, DaxEntry));
+    }
+
+    if (Context->DaxMdl != NULL)
+    {
+        IoFreeMdl(Context->DaxMdl);
+        Context->DaxMdl = NULL;
+    }
+
+    if (Context->DaxBase != NULL)
+    {
+        MmUnmapIoSpace(Context->DaxBase, Context->DaxLength);
+        Context->DaxBase = NULL;
+    }
+
+    Context->DaxLength = 0;
+
+    WdfWaitLockRelease(Context->DaxLock);
+}
+
 NTSTATUS VirtFsEvtDevicePrepareHardware(IN WDFDEVICE Device,
                                         IN WDFCMRESLIST Resources,
                                         IN WDFCMRESLIST ResourcesTranslated)
@@ -45,8 +192,6 @@ NTSTATUS VirtFsEvtDevicePrepareHardware(IN WDFDEVICE Device,
     NTSTATUS status = STATUS_SUCCESS;
     u64 HostFeatures, GuestFeatures = 0;
 
-    UNREFERENCED_PARAMETER(Resources);
-
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_POWER, "--> %!FUNC! Device: %p",
         Device);
 
@@ -63,6 +208,13 @@ NTSTATUS VirtFsEvtDevicePrepareHardware(IN WDFDEVICE Device,
 
     HostFeatures = VirtIOWdfGetDeviceFeatures(&context->VDevice);
 
+    context->IndirectDescs = virtio_is_feature_enabled(HostFeatures,
+        VIRTIO_RING_F_INDIRECT_DESC);
+    if (context->IndirectDescs)
+    {
+        virtio_feature_enable(GuestFeatures, VIRTIO_RING_F_INDIRECT_DESC);
+    }
+
     VirtIOWdfSetDriverFeatures(&context->VDevice, GuestFeatures,
 		VIRTIO_F_ACCESS_PLATFORM);
 
@@ -74,14 +226,22 @@ NTSTATUS VirtFsEvtDevicePrepareHardware(IN WDFDEVICE Device,
     TraceEvents(TRACE_LEVEL_INFORMATION, DBG_POWER,
         "Request queues: %d", context->RequestQueues);
 
+    // More request queues than processors would not add any parallelism.
+    context->RequestQueues = max(context->RequestQueues, 1);
+    context->RequestQueues = min(context->RequestQueues,
+        VIRT_FS_MAX_REQUEST_QUEUES);
+    context->RequestQueues = min(context->RequestQueues,
+        KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS));
+    context->NumQueues = VQ_TYPE_REQUEST + context->RequestQueues;
+
     context->VirtQueues = ExAllocatePoolWithTag(NonPagedPool,
-        context->RequestQueues * sizeof(struct virtqueue*),
+        context->NumQueues * sizeof(struct virtqueue*),
         VIRT_FS_MEMORY_TAG);
 
     if (context->VirtQueues != NULL)
     {
         RtlZeroMemory(context->VirtQueues,
-            context->RequestQueues * sizeof(struct virtqueue*));
+            context->NumQueues * sizeof(struct virtqueue*));
     }
     else
     {
@@ -94,7 +254,7 @@ NTSTATUS VirtFsEvtDevicePrepareHardware(IN WDFDEVICE Device,
     if (NT_SUCCESS(status))
     {
         context->VirtQueueLocks = ExAllocatePoolWithTag(NonPagedPool,
-            context->RequestQueues * sizeof(WDFSPINLOCK),
+            context->NumQueues * sizeof(WDFSPINLOCK),
             VIRT_FS_MEMORY_TAG);
     }
 
@@ -104,7 +264,7 @@ NTSTATUS VirtFsEvtDevicePrepareHardware(IN WDFDEVICE Device,
         WDFSPINLOCK *lock;
         ULONG i;
 
-        for (i = 0; i < context->RequestQueues; i++)
+        for (i = 0; i < context->NumQueues; i++)
         {
             lock = &context->VirtQueueLocks[i];
 
@@ -128,6 +288,20 @@ NTSTATUS VirtFsEvtDevicePrepareHardware(IN WDFDEVICE Device,
         status = STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    if (NT_SUCCESS(status))
+    {
+        status = VirtFsCreateQueueInterrupts(Device, Resources,
+            ResourcesTranslated);
+
+        TraceEvents(TRACE_LEVEL_INFORMATION, DBG_POWER,
+            "Queue interrupts: %d", context->NumInterrupts);
+    }
+
+    if (NT_SUCCESS(status))
+    {
+        VirtFsMapDaxWindow(context);
+    }
+
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_POWER,
         "<-- %!FUNC! Status: %!STATUS!", status);
 
@@ -145,6 +319,8 @@ NTSTATUS VirtFsEvtDeviceReleaseHardware(IN WDFDEVICE Device,
 
     PAGED_CODE();
 
+    VirtFsUnmapDaxWindow(context);
+
     VirtIOWdfShutdown(&context->VDevice);
 
     if (context->VirtQueues != NULL)
@@ -159,6 +335,10 @@ NTSTATUS VirtFsEvtDeviceReleaseHardware(IN WDFDEVICE Device,
         context->VirtQueueLocks = NULL;
     }
 
+    // Interrupts created in VirtFsEvtDevicePrepareHardware are deleted by
+    // the framework.
+    context->NumInterrupts = 1;
+
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_POWER, "<-- %!FUNC!");
 
     return STATUS_SUCCESS;
@@ -169,7 +349,8 @@ NTSTATUS VirtFsEvtDeviceD0Entry(IN WDFDEVICE Device,
 {
     NTSTATUS status = STATUS_SUCCESS;
     PDEVICE_CONTEXT context = GetDeviceContext(Device);
-    VIRTIO_WDF_QUEUE_PARAM param;
+    VIRTIO_WDF_QUEUE_PARAM params[VIRT_FS_MAX_QUEUES];
+    ULONG i;
 
     UNREFERENCED_PARAMETER(PreviousState);
 
@@ -178,10 +359,14 @@ NTSTATUS VirtFsEvtDeviceD0Entry(IN WDFDEVICE Device,
 
     PAGED_CODE();
 
-    param.Interrupt = context->WdfInterrupt;
+    for (i = 0; i < context->NumQueues; i++)
+    {
+        params[i].Interrupt =
+            context->Interrupts[i % context->NumInterrupts];
+    }
 
     status = VirtIOWdfInitQueues(&context->VDevice,
-        context->RequestQueues, context->VirtQueues, &param);
+        context->NumQueues, context->VirtQueues, params);
 
     if (NT_SUCCESS(status))
     {
@@ -213,6 +398,9 @@ NTSTATUS VirtFsEvtDeviceD0Exit(IN WDFDEVICE Device,
 
     VirtIOWdfDestroyQueues(&context->VDevice);
 
+    // The device is reset, requests it still held will never come back.
+    VirtFsCancelPendingRequests(context);
+
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_POWER, "<-- %!FUNC!");
 
     return STATUS_SUCCESS;
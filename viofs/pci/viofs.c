@@ -84,6 +84,7 @@ NTSTATUS VirtFsEvtDeviceAdd(IN WDFDRIVER Driver,
     WDFQUEUE queue;
     WDF_IO_QUEUE_CONFIG queueConfig;
     WDF_INTERRUPT_CONFIG interruptConfig;
+    WDF_FILEOBJECT_CONFIG fileConfig;
     PDEVICE_CONTEXT context;
 
     UNREFERENCED_PARAMETER(Driver);
@@ -102,6 +103,19 @@ NTSTATUS VirtFsEvtDeviceAdd(IN WDFDRIVER Driver,
     WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &pnpPowerCallbacks);
     WdfDeviceInitSetIoType(DeviceInit, WdfDeviceIoDirect);
 
+    WdfDeviceInitSetIoInCallerContextCallback(DeviceInit,
+        VirtFsEvtIoInCallerContext);
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, REQUEST_CONTEXT);
+    attributes.EvtCleanupCallback = VirtFsEvtRequestContextCleanup;
+    WdfDeviceInitSetRequestAttributes(DeviceInit, &attributes);
+
+    WDF_FILEOBJECT_CONFIG_INIT(&fileConfig, WDF_NO_EVENT_CALLBACK,
+        WDF_NO_EVENT_CALLBACK, VirtFsEvtFileCleanup);
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, FILE_CONTEXT);
+    WdfDeviceInitSetFileObjectConfig(DeviceInit, &fileConfig, &attributes);
+
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, DEVICE_CONTEXT);
     attributes.EvtCleanupCallback = VirtFsEvtDeviceContextCleanup;
 
@@ -115,6 +129,9 @@ NTSTATUS VirtFsEvtDeviceAdd(IN WDFDRIVER Driver,
 
     context = GetDeviceContext(device);
 
+    InitializeListHead(&context->RequestsList);
+    InitializeListHead(&context->DaxViews);
+
     WDF_INTERRUPT_CONFIG_INIT(&interruptConfig,
         VirtFsEvtInterruptIsr, VirtFsEvtInterruptDpc);
 
@@ -131,6 +148,9 @@ NTSTATUS VirtFsEvtDeviceAdd(IN WDFDRIVER Driver,
         return status;
     }
 
+    context->Interrupts[0] = context->WdfInterrupt;
+    context->NumInterrupts = 1;
+
     WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
     attributes.ParentObject = device;
     status = WdfSpinLockCreate(&attributes,
@@ -143,6 +163,17 @@ NTSTATUS VirtFsEvtDeviceAdd(IN WDFDRIVER Driver,
         return status;
     }
 
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = device;
+    status = WdfWaitLockCreate(&attributes, &context->DaxLock);
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT,
+            "WdfWaitLockCreate failed: %!STATUS!", status);
+        return status;
+    }
+
     status = WdfDeviceCreateDeviceInterface(device,
         &GUID_DEVINTERFACE_VIRT_FS, NULL);
 
@@ -153,7 +184,9 @@ NTSTATUS VirtFsEvtDeviceAdd(IN WDFDRIVER Driver,
         return status;
     }
 
-    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchSequential);
+    // FUSE requests complete asynchronously from the DPC, let several of them
+    // be in flight so that all request queues can be used.
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchParallel);
     queueConfig.EvtIoDeviceControl = VirtFsEvtIoDeviceControl;
     queueConfig.EvtIoStop = VirtFsEvtIoStop;
     queueConfig.AllowZeroLengthRequests = FALSE;
@@ -192,6 +225,17 @@ NTSTATUS VirtFsEvtDeviceAdd(IN WDFDRIVER Driver,
         return status;
     }
 
+    status = WdfLookasideListCreate(&attributes, VIRT_FS_SG_BUFFER_SIZE,
+        NonPagedPool, WDF_NO_OBJECT_ATTRIBUTES, VIRT_FS_MEMORY_TAG,
+        &context->SgLookaside);
+
+    if (!NT_SUCCESS(status))
+    {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT,
+            "WdfLookasideListCreate failed: %!STATUS!", status);
+        return status;
+    }
+
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "<-- %!FUNC!");
 
     return status;
@@ -200,20 +244,18 @@ NTSTATUS VirtFsEvtDeviceAdd(IN WDFDRIVER Driver,
 VOID VirtFsEvtDeviceContextCleanup(IN WDFOBJECT DeviceObject)
 {
     PDEVICE_CONTEXT context = GetDeviceContext(DeviceObject);
-    PSINGLE_LIST_ENTRY iter;
+    PVIRTIO_FS_REQUEST fs_req;
+    PLIST_ENTRY iter;
 
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "--> %!FUNC!");
 
     WdfSpinLockAcquire(context->RequestsLock);
-    iter = PopEntryList(&context->RequestsList);
-    while (iter != NULL)
+    while (!IsListEmpty(&context->RequestsList))
     {
-        PVIRTIO_FS_REQUEST fs_req = CONTAINING_RECORD(iter,
-            VIRTIO_FS_REQUEST, ListEntry);
+        iter = RemoveHeadList(&context->RequestsList);
+        fs_req = CONTAINING_RECORD(iter, VIRTIO_FS_REQUEST, ListEntry);
 
         FreeVirtFsRequest(fs_req);
-
-        iter = PopEntryList(&context->RequestsList);
     };
     WdfSpinLockRelease(context->RequestsLock);
 
@@ -232,6 +274,61 @@ VOID VirtFsEvtDriverContextCleanup(IN WDFOBJECT DriverObject)
     WPP_CLEANUP(WdfDriverWdmGetDriverObject(DriverObject));
 }
 
+VOID VirtFsEvtRequestContextCleanup(IN WDFOBJECT Object)
+{
+    PREQUEST_CONTEXT req_context = GetRequestContext(Object);
+
+    // A direct request completed before it reached the device.
+    if (req_context->DataMdl != NULL)
+    {
+        MmUnlockPages(req_context->DataMdl);
+        IoFreeMdl(req_context->DataMdl);
+        req_context->DataMdl = NULL;
+    }
+}
+
+VOID VirtFsEvtFileCleanup(IN WDFFILEOBJECT FileObject)
+{
+    PDEVICE_CONTEXT context = GetDeviceContext(
+        WdfFileObjectGetDevice(FileObject));
+    PFILE_CONTEXT file_context = GetFileContext(FileObject);
+
+    WdfWaitLockAcquire(context->DaxLock, NULL);
+    if (file_context->DaxAddress != NULL)
+    {
+        VirtFsUnmapDaxView(context, file_context);
+    }
+    WdfWaitLockRelease(context->DaxLock);
+}
+
+// Unmaps the DAX window from the process it was mapped into. The handle may
+// be closed by another process and the hardware released from a system
+// thread, so attach to the owner unless it is already current. Called with
+// DaxLock held.
+VOID VirtFsUnmapDaxView(IN PDEVICE_CONTEXT Context,
+    IN PFILE_CONTEXT FileContext)
+{
+    KAPC_STATE apc_state;
+    BOOLEAN attach = (FileContext->DaxProcess != PsGetCurrentProcess());
+
+    if (attach)
+    {
+        KeStackAttachProcess(FileContext->DaxProcess, &apc_state);
+    }
+
+    MmUnmapLockedPages(FileContext->DaxAddress, Context->DaxMdl);
+
+    if (attach)
+    {
+        KeUnstackDetachProcess(&apc_state);
+    }
+
+    RemoveEntryList(&FileContext->DaxEntry);
+    ObDereferenceObject(FileContext->DaxProcess);
+    FileContext->DaxProcess = NULL;
+    FileContext->DaxAddress = NULL;
+}
+
 void FreeVirtFsRequest(IN PVIRTIO_FS_REQUEST Request)
 {
     if (Request->InputBuffer != NULL)
@@ -248,6 +345,20 @@ void FreeVirtFsRequest(IN PVIRTIO_FS_REQUEST Request)
         Request->OutputBufferLength = 0;
     }
 
+    if (Request->DataBuffer != NULL)
+    {
+        MmUnlockPages(Request->DataBuffer);
+        IoFreeMdl(Request->DataBuffer);
+        Request->DataBuffer = NULL;
+        Request->DataBufferLength = 0;
+    }
+
+    if (Request->IndirectHandle != NULL)
+    {
+        WdfObjectDelete(Request->IndirectHandle);
+        Request->IndirectHandle = NULL;
+    }
+
     if (Request->Handle != NULL)
     {
         WdfObjectDelete(Request->Handle);
@@ -47,6 +47,32 @@
 
 #define MAX_FILE_SYSTEM_NAME 36
 
+// The high priority queue comes first, the request queues follow it.
+#define VQ_TYPE_HIPRIO 0
+#define VQ_TYPE_REQUEST 1
+
+// Id of the shared memory region holding the DAX window.
+#define VIRTIO_FS_SHMCAP_ID_CACHE 0
+
+// The DAX window is described by a single MDL, a larger window is only
+// partially used.
+#define VIRT_FS_DAX_MAX_LENGTH (2ULL * 1024 * 1024 * 1024)
+
+// Scatter-gather entries held by every request, enough for the requests
+// without a sizable payload.
+#define VIRT_FS_INLINE_SG 8
+
+// Larger requests take their scatter-gather list and indirect descriptor
+// table from page-sized lookaside buffers, so that they use a single ring
+// slot. Even larger ones fall back to pool and direct descriptors.
+#define VIRT_FS_SG_BUFFER_SIZE PAGE_SIZE
+#define VIRT_FS_LOOKASIDE_SG (VIRT_FS_SG_BUFFER_SIZE / sizeof(struct scatterlist))
+#define VIRT_FS_INDIRECT_DESCS \
+    (VIRT_FS_SG_BUFFER_SIZE / SIZE_OF_SINGLE_INDIRECT_DESC)
+
+#define VIRT_FS_MAX_REQUEST_QUEUES 16
+#define VIRT_FS_MAX_QUEUES (VQ_TYPE_REQUEST + VIRT_FS_MAX_REQUEST_QUEUES)
+
 typedef struct _VIRTIO_FS_CONFIG
 {
     CHAR Tag[MAX_FILE_SYSTEM_NAME];
@@ -56,7 +82,8 @@ typedef struct _VIRTIO_FS_CONFIG
 
 typedef struct _VIRTIO_FS_REQUEST
 {
-    SINGLE_LIST_ENTRY ListEntry;
+    // Entry in the device's list of in-flight requests.
+    LIST_ENTRY ListEntry;
 
     // The memory object of the allocated virtio fs request. Required because
     // virtio fs requests are allocated from a look aside list.
@@ -72,27 +99,97 @@ typedef struct _VIRTIO_FS_REQUEST
     PMDL OutputBuffer;
     size_t OutputBufferLength;
 
+    // Caller's locked pages holding the payload of a direct request. They
+    // follow the device-writable part when DataWritable is set and the
+    // device-readable part otherwise, and stay locked until the device has
+    // returned them.
+    PMDL DataBuffer;
+    size_t DataBufferLength;
+    BOOLEAN DataWritable;
+
+    // Indirect descriptor table the device reads the request's buffers from,
+    // NULL if the request was added with direct descriptors.
+    WDFMEMORY IndirectHandle;
+
+    struct scatterlist Sg[VIRT_FS_INLINE_SG];
+
 } VIRTIO_FS_REQUEST, *PVIRTIO_FS_REQUEST;
 
 void FreeVirtFsRequest(IN PVIRTIO_FS_REQUEST Request);
 
+// Context of every WDFREQUEST delivered to the device. Points back to the
+// virtio fs request carrying it so that cancellation finds it directly.
+// Updated under RequestsLock.
+typedef struct _REQUEST_CONTEXT
+{
+    PVIRTIO_FS_REQUEST FsRequest;
+
+    // Payload of a direct request, locked in the caller's context and owned
+    // by the request until it is moved to the virtio fs request.
+    PMDL DataMdl;
+
+} REQUEST_CONTEXT, *PREQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(REQUEST_CONTEXT, GetRequestContext);
+
 typedef struct _DEVICE_CONTEXT {
 
     VIRTIO_WDF_DRIVER   VDevice;
     UINT32              RequestQueues;
+    // The high priority queue and the request queues.
+    UINT32              NumQueues;
     struct virtqueue    **VirtQueues;
 
+    // VIRTIO_RING_F_INDIRECT_DESC was negotiated.
+    BOOLEAN             IndirectDescs;
+
     WDFINTERRUPT        WdfInterrupt;
+    // Interrupts[0] is WdfInterrupt, the others are the additional MSI-X
+    // messages. Queue i is served by Interrupts[i % NumInterrupts].
+    WDFINTERRUPT        Interrupts[VIRT_FS_MAX_QUEUES];
+    ULONG               NumInterrupts;
     WDFSPINLOCK         *VirtQueueLocks;
 
     WDFLOOKASIDE        RequestsLookaside;
-    SINGLE_LIST_ENTRY   RequestsList;
+    // Page-sized buffers for the scatter-gather lists and indirect
+    // descriptor tables of the larger requests.
+    WDFLOOKASIDE        SgLookaside;
+    // Requests submitted to the device and not completed yet, unlinked in
+    // constant time by the completion DPC.
+    LIST_ENTRY          RequestsList;
     WDFSPINLOCK         RequestsLock;
 
+    // The DAX window, mapped cached. DaxMdl is NULL if the device has none.
+    PHYSICAL_ADDRESS    DaxBasePA;
+    PVOID               DaxBase;
+    SIZE_T              DaxLength;
+    PMDL                DaxMdl;
+    // File objects with the window mapped into their process, linked by
+    // FILE_CONTEXT.DaxEntry. Unmapped before the window itself goes away.
+    LIST_ENTRY          DaxViews;
+    WDFWAITLOCK         DaxLock;
+
 } DEVICE_CONTEXT, *PDEVICE_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, GetDeviceContext);
 
+VOID VirtFsCancelPendingRequests(IN PDEVICE_CONTEXT Context);
+
+typedef struct _FILE_CONTEXT
+{
+    // The DAX window mapped into DaxProcess, the process which asked for it.
+    // Protected by DEVICE_CONTEXT.DaxLock.
+    PVOID DaxAddress;
+    PEPROCESS DaxProcess;
+    LIST_ENTRY DaxEntry;
+
+} FILE_CONTEXT, *PFILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILE_CONTEXT, GetFileContext);
+
+VOID VirtFsUnmapDaxView(IN PDEVICE_CONTEXT Context,
+    IN PFILE_CONTEXT FileContext);
+
 #ifndef _IRQL_requires_
 #define _IRQL_requires_(level)
 #endif
@@ -104,6 +201,7 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, GetDeviceContext);
 DRIVER_INITIALIZE DriverEntry;
 EVT_WDF_DRIVER_DEVICE_ADD VirtFsEvtDeviceAdd;
 EVT_WDF_OBJECT_CONTEXT_CLEANUP VirtFsEvtDeviceContextCleanup;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP VirtFsEvtRequestContextCleanup;
 
 // Context cleanup callbacks generally run at IRQL <= DISPATCH_LEVEL but
 // WDFDRIVER context cleanup is guaranteed to run at PASSIVE_LEVEL.
@@ -116,10 +214,13 @@ EVT_WDF_DEVICE_RELEASE_HARDWARE VirtFsEvtDeviceReleaseHardware;
 EVT_WDF_DEVICE_D0_ENTRY VirtFsEvtDeviceD0Entry;
 EVT_WDF_DEVICE_D0_EXIT VirtFsEvtDeviceD0Exit;
 
+EVT_WDF_FILE_CLEANUP VirtFsEvtFileCleanup;
+
 EVT_WDF_INTERRUPT_ISR VirtFsEvtInterruptIsr;
 EVT_WDF_INTERRUPT_DPC VirtFsEvtInterruptDpc;
 EVT_WDF_INTERRUPT_ENABLE VirtFsEvtInterruptEnable;
 EVT_WDF_INTERRUPT_DISABLE VirtFsEvtInterruptDisable;
 
+EVT_WDF_IO_IN_CALLER_CONTEXT VirtFsEvtIoInCallerContext;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL VirtFsEvtIoDeviceControl;
 EVT_WDF_IO_QUEUE_IO_STOP VirtFsEvtIoStop;
@@ -895,4 +895,31 @@ struct fuse_copy_file_range_in {
     uint64_t    flags;
 };
 
+#define FUSE_SETUPMAPPING_FLAG_WRITE (1ull << 0)
+#define FUSE_SETUPMAPPING_FLAG_READ (1ull << 1)
+struct fuse_setupmapping_in {
+    /* An already open handle */
+    uint64_t    fh;
+    /* Offset into the file to start the mapping */
+    uint64_t    foffset;
+    /* Length of mapping required */
+    uint64_t    len;
+    /* Flags, FUSE_SETUPMAPPING_FLAG_* */
+    uint64_t    flags;
+    /* Offset in Memory Window */
+    uint64_t    moffset;
+};
+
+struct fuse_removemapping_in {
+    /* number of fuse_removemapping_one follows */
+    uint32_t    count;
+};
+
+struct fuse_removemapping_one {
+    /* Offset into the dax window start the unmapping */
+    uint64_t    moffset;
+    /* Length of mapping required */
+    uint64_t    len;
+};
+
 #endif /* _LINUX_FUSE_H */
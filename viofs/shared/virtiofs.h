@@ -44,3 +44,57 @@ DEFINE_GUID(GUID_DEVINTERFACE_VIRT_FS,
     0x801, \
     METHOD_BUFFERED, \
     FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+#define IOCTL_VIRTFS_FUSE_REQUEST_DIRECT CTL_CODE(FILE_DEVICE_UNKNOWN, \
+    0x802, \
+    METHOD_BUFFERED, \
+    FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+// Prefixes the FUSE request headers in the input buffer of
+// IOCTL_VIRTFS_FUSE_REQUEST_DIRECT, the output buffer receives the reply
+// headers. The payload of a FUSE_WRITE request or of a FUSE_READ reply is not
+// copied through the ioctl buffers: the driver locks the caller's Data buffer
+// and hands its pages to the device.
+typedef struct _VIRTFS_DIRECT_REQUEST
+{
+    UINT64  Data;
+    UINT32  DataLength;
+
+    // Non-zero if the device writes the payload (a read).
+    UINT32  DataWritable;
+
+} VIRTFS_DIRECT_REQUEST, *PVIRTFS_DIRECT_REQUEST;
+
+#define IOCTL_VIRTFS_MAP_DAX_WINDOW CTL_CODE(FILE_DEVICE_UNKNOWN, \
+    0x803, \
+    METHOD_BUFFERED, \
+    FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+
+// Output of IOCTL_VIRTFS_MAP_DAX_WINDOW. The device's DAX window is mapped
+// into the calling process until the handle is closed, the moffset of
+// FUSE_SETUPMAPPING and FUSE_REMOVEMAPPING is an offset into this window.
+// The ioctl fails with STATUS_NOT_SUPPORTED if the device has no window.
+typedef struct _VIRTFS_DAX_WINDOW
+{
+    UINT64  Address;
+    UINT64  Length;
+
+} VIRTFS_DAX_WINDOW, *PVIRTFS_DAX_WINDOW;
+
+#define IOCTL_VIRTFS_GET_QUEUE_INFO CTL_CODE(FILE_DEVICE_UNKNOWN, \
+    0x804, \
+    METHOD_BUFFERED, \
+    FILE_READ_ACCESS)
+
+// Output of IOCTL_VIRTFS_GET_QUEUE_INFO, so that the requests kept in flight
+// at once fit the request queues. A request takes a single ring slot if it
+// needs at most IndirectDescs descriptors, one per descriptor otherwise.
+typedef struct _VIRTFS_QUEUE_INFO
+{
+    // Ring slots of the smallest request queue.
+    UINT32  QueueSize;
+
+    // Descriptors an indirect table holds, 0 if the device has none.
+    UINT32  IndirectDescs;
+
+} VIRTFS_QUEUE_INFO, *PVIRTFS_QUEUE_INFO;
@@ -30,6 +30,7 @@
 #pragma once
 
 #include "fuse.h"
+#include "virtiofs.h"
 
 typedef struct
 {
@@ -144,6 +145,14 @@ typedef struct
 
 } FUSE_READ_OUT, *PFUSE_READ_OUT;
 
+typedef struct
+{
+    VIRTFS_DIRECT_REQUEST   direct;
+    struct fuse_in_header   hdr;
+    struct fuse_read_in     read;
+
+} FUSE_READ_DIRECT_IN, *PFUSE_READ_DIRECT_IN;
+
 typedef struct
 {
     struct fuse_in_header   hdr;
@@ -165,6 +174,14 @@ typedef struct
 
 } FUSE_WRITE_IN, *PFUSE_WRITE_IN;
 
+typedef struct
+{
+    VIRTFS_DIRECT_REQUEST   direct;
+    struct fuse_in_header   hdr;
+    struct fuse_write_in    write;
+
+} FUSE_WRITE_DIRECT_IN, *PFUSE_WRITE_DIRECT_IN;
+
 typedef struct
 {
     struct fuse_out_header  hdr;
@@ -240,3 +257,52 @@ typedef struct
     struct fuse_out_header  hdr;
 
 } FUSE_FALLOCATE_OUT;
+
+typedef struct
+{
+    struct fuse_in_header   hdr;
+    struct fuse_forget_in   forget;
+
+} FUSE_FORGET_IN;
+
+#define FUSE_BATCH_FORGET_MAX 64
+
+typedef struct
+{
+    struct fuse_in_header       hdr;
+    struct fuse_batch_forget_in batch;
+    struct fuse_forget_one      forgets[FUSE_BATCH_FORGET_MAX];
+
+} FUSE_BATCH_FORGET_IN;
+
+typedef struct
+{
+    struct fuse_in_header       hdr;
+    struct fuse_setupmapping_in setupmapping;
+
+} FUSE_SETUPMAPPING_IN;
+
+typedef struct
+{
+    struct fuse_out_header  hdr;
+
+} FUSE_SETUPMAPPING_OUT;
+
+#define FUSE_REMOVEMAPPING_MAX 64
+
+// The ranges to unmap follow the 32-bit count without any padding.
+#pragma pack(push, 4)
+typedef struct
+{
+    struct fuse_in_header           hdr;
+    struct fuse_removemapping_in    removemapping;
+    struct fuse_removemapping_one   removes[FUSE_REMOVEMAPPING_MAX];
+
+} FUSE_REMOVEMAPPING_IN;
+#pragma pack(pop)
+
+typedef struct
+{
+    struct fuse_out_header  hdr;
+
+} FUSE_REMOVEMAPPING_OUT;
@@ -54,6 +54,33 @@
 
 #define INVALID_FILE_HANDLE ((uint64_t)(-1))
 
+// FUSE requests a single read or write may keep outstanding at once.
+#define MAX_INFLIGHT_REQUESTS 8
+
+#define FUSE_PAGE_SIZE 4096
+
+// Request buffers are cached per thread in size classes of 4KB, 16KB, 64KB,
+// 256KB and 1MB, a few of each. Every class has a page more room for the
+// FUSE headers, so that a 1MB transfer with its header is pooled too.
+#define BUFFER_POOL_CLASSES 5
+#define BUFFER_POOL_MIN_SHIFT 12
+#define BUFFER_POOL_CLASS_SHIFT 2
+#define BUFFER_POOL_DEPTH 2
+
+// Longest name a FUSE directory entry can carry.
+#define FUSE_NAME_MAX 1024
+
+// Files are mapped into the DAX window in chunks of this size.
+#define DAX_CHUNK_SHIFT 21
+#define DAX_CHUNK_SIZE (1ULL << DAX_CHUNK_SHIFT)
+#define DAX_BUCKETS 256
+
+// Readahead window announced to the host when caching is enabled.
+#define FUSE_MAX_READAHEAD (1024 * 1024)
+
+// Used when the host's attributes timeout can't be obtained.
+#define DEFAULT_FILE_INFO_TIMEOUT 1000
+
 // Some of the constants defined in Windows doesn't match the values that are
 // used in Linux. Don't try just to understand, just redefine them to match.
 #undef O_DIRECTORY
@@ -73,15 +100,161 @@
 
 #define ReadAndExecute(x) ((x) | (((x) & 0444) >> 2))
 
+#define LOOKUP_CACHE_BUCKETS        1024
+#define LOOKUP_CACHE_MAX_ENTRIES    8192
+
+// A name resolved with FUSE_LOOKUP (or created with FUSE_CREATE/FUSE_MKDIR)
+// keyed by its parent node id and its name. The host counts one lookup of
+// NodeId for every such reply, the counts are accumulated in NLookup and
+// handed back with FUSE_FORGET once the entry is dropped and unused.
+typedef struct
+{
+    LIST_ENTRY  NameLink;
+    LIST_ENTRY  NodeLink;
+    LIST_ENTRY  LruLink;
+
+    // One reference is held by the cache while the entry is hashed and one
+    // by every user (a path walk in progress or an open file).
+    ULONG       RefCount;
+
+    uint64_t    Parent;
+    uint64_t    NodeId;
+    uint64_t    NLookup;
+
+    // GetTickCount64() based expiration of the name and of the attributes.
+    ULONGLONG   EntryExpire;
+    ULONGLONG   AttrExpire;
+
+    struct fuse_attr Attr;
+
+    ULONG       Hash;
+    char        Name[];
+
+} VIRTFS_ENTRY, *PVIRTFS_ENTRY;
+
+typedef struct
+{
+    SRWLOCK     Lock;
+
+    ULONG       Count;
+    LIST_ENTRY  Lru;
+
+    // Entries are hashed both by (parent, name) and by node id, the latter
+    // is used to refresh the attributes after the file was changed.
+    LIST_ENTRY  NameBuckets[LOOKUP_CACHE_BUCKETS];
+    LIST_ENTRY  NodeBuckets[LOOKUP_CACHE_BUCKETS];
+
+} VIRTFS_LOOKUP_CACHE;
+
+typedef struct
+{
+    ULONG   Count;
+    struct fuse_forget_one Forgets[FUSE_BATCH_FORGET_MAX];
+
+} VIRTFS_FORGET_LIST;
+
+// A FUSE request submitted to the device with overlapped I/O.
+typedef struct
+{
+    OVERLAPPED  Overlapped;
+    LPVOID      OutBuffer;
+    DWORD       OutBufferSize;
+
+} VIRTFS_ASYNC_REQUEST;
+
+// One chunk of a read or write split across several FUSE requests.
+typedef struct
+{
+    VIRTFS_ASYNC_REQUEST Async;
+    ULONG Length;
+
+    FUSE_READ_DIRECT_IN read_in;
+    FUSE_READ_OUT read_out;
+
+    FUSE_WRITE_DIRECT_IN write_in;
+    FUSE_WRITE_OUT write_out;
+
+} VIRTFS_IO_CHUNK;
+
+// A DAX_CHUNK_SIZE part of the DAX window and the file range mapped there.
+typedef struct
+{
+    LIST_ENTRY  NodeLink;
+    LIST_ENTRY  LruLink;
+
+    // Chunk ChunkIndex of NodeId, valid while Mapped is set.
+    uint64_t    NodeId;
+    uint64_t    ChunkIndex;
+    BOOLEAN     Mapped;
+    BOOLEAN     Writable;
+
+    // A mapping of the chunk is being set up or removed on the host, the
+    // lock is not held meanwhile. Users of the chunk wait on ChunkWait.
+    BOOLEAN     Busy;
+
+    // Copies in progress, a chunk in use is not reclaimed.
+    ULONG       RefCount;
+
+} VIRTFS_DAX_CHUNK, *PVIRTFS_DAX_CHUNK;
+
+typedef struct
+{
+    SRWLOCK     Lock;
+    CONDITION_VARIABLE ChunkWait;
+
+    // The DAX window mapped into the service, NULL if DAX is not used.
+    BYTE        *Window;
+    ULONG       NumChunks;
+    PVIRTFS_DAX_CHUNK Chunks;
+
+    // All chunks, the least recently used first.
+    LIST_ENTRY  Lru;
+
+    // Mapped chunks hashed by node id.
+    LIST_ENTRY  NodeBuckets[DAX_BUCKETS];
+
+} VIRTFS_DAX;
+
+typedef enum
+{
+    // Nothing is cached, every access goes to the host.
+    CachePolicyNone,
+
+    // Metadata is cached for the host's attributes timeout, file data is
+    // flushed and purged when the last handle is closed.
+    CachePolicyMetadata,
+
+    // File data stays cached across opens and writes are cached too. Only
+    // safe if the shared directory isn't modified behind the guest's back.
+    CachePolicyFull
+
+} VIRTFS_CACHE_POLICY;
+
 typedef struct
 {
     FSP_FILE_SYSTEM *FileSystem;
     
     HANDLE  Device;
 
+    VIRTFS_LOOKUP_CACHE LookupCache;
+
+    VIRTFS_DAX Dax;
+
+    VIRTFS_CACHE_POLICY CachePolicy;
+
+    // FUSE_WRITEBACK_CACHE was negotiated, the cache manager may read from
+    // files opened for writing only.
+    BOOLEAN WritebackCache;
+
     // A write request buffer size must not exceed this value.
     UINT32  MaxWrite;
 
+    // Size of the chunks large reads are split into.
+    UINT32  MaxRead;
+
+    // Geometry of the request queues, QueueSize is 0 if unknown.
+    VIRTFS_QUEUE_INFO QueueInfo;
+
     // Uid/Gid used to describe files' owner on the guest side.
     UINT32  LocalUid;
     UINT32  LocalGid;
@@ -94,12 +267,15 @@ typedef struct
 
 typedef struct
 {
-    PVOID   DirBuffer;
     BOOLEAN IsDirectory;
 
     uint64_t NodeId;
     uint64_t FileHandle;
 
+    // Lookup cache entry that keeps NodeId known to the host while the
+    // file is open.
+    PVIRTFS_ENTRY Entry;
+
 } VIRTFS_FILE_CONTEXT, *PVIRTFS_FILE_CONTEXT;
 
 static NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
@@ -109,6 +285,11 @@ static NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
 static NTSTATUS SetFileSize(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
     UINT64 NewSize, BOOLEAN SetAllocationSize, FSP_FSCTL_FILE_INFO *FileInfo);
 
+static VOID LookupCacheDestroy(VIRTFS *VirtFs);
+
+static VOID DaxRemoveMappings(VIRTFS *VirtFs, uint64_t NodeId,
+    uint64_t FirstChunk);
+
 static int64_t GetUniqueIdentifier()
 {
     static int64_t uniq = 1;
@@ -138,10 +319,14 @@ static VOID VirtFsDelete(VIRTFS *VirtFs)
 
     if (VirtFs->Device != INVALID_HANDLE_VALUE)
     {
+        LookupCacheDestroy(VirtFs);
         CloseHandle(VirtFs->Device);
         VirtFs->Device = INVALID_HANDLE_VALUE;
     }
 
+    // Closing the device unmapped the DAX window.
+    SafeHeapFree(VirtFs->Dax.Chunks);
+
     SafeHeapFree(VirtFs);
 }
 
@@ -208,7 +393,7 @@ static NTSTATUS FindDeviceInterface(PHANDLE Device)
     SecurityAttributes.bInheritHandle = FALSE;
 
     *Device = CreateFile(DevicePath, GENERIC_READ | GENERIC_WRITE,
-        0, &SecurityAttributes, OPEN_EXISTING, 0L, NULL);
+        0, &SecurityAttributes, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
 
     if (*Device == INVALID_HANDLE_VALUE)
     {
@@ -276,7 +461,7 @@ static UINT32 PosixUnixModeToAttributes(uint32_t mode)
     return Attributes;
 }
 
-static uint32_t AccessToUnixFlags(UINT32 GrantedAccess)
+static uint32_t AccessToUnixFlags(VIRTFS *VirtFs, UINT32 GrantedAccess)
 {
     uint32_t flags;
 
@@ -300,6 +485,12 @@ static uint32_t AccessToUnixFlags(UINT32 GrantedAccess)
         flags = O_RDWR;
     }
 
+    // With writeback caching partial page writes are read in first.
+    if (VirtFs->WritebackCache && (flags == O_WRONLY))
+    {
+        flags = O_RDWR;
+    }
+
     return flags;
 }
 
@@ -345,26 +536,10 @@ static VOID SetFileInfo(struct fuse_attr *attr, FSP_FSCTL_FILE_INFO *FileInfo)
         attr->uid, attr->gid, attr->rdev, attr->blksize);
 }
 
-static NTSTATUS VirtFsFuseRequest(HANDLE Device, LPVOID InBuffer,
-    DWORD InBufferSize, LPVOID OutBuffer, DWORD OutBufferSize)
+static NTSTATUS VirtFsFuseReplyStatus(struct fuse_out_header *out_hdr,
+    DWORD BytesReturned, DWORD OutBufferSize)
 {
     NTSTATUS Status = STATUS_SUCCESS;
-    DWORD BytesReturned = 0;
-    BOOL Result;
-    struct fuse_in_header *in_hdr = InBuffer;
-    struct fuse_out_header *out_hdr = OutBuffer;
-
-    DBG(">>req: %d unique: %I64u len: %u", in_hdr->opcode, in_hdr->unique,
-        in_hdr->len);
-
-    Result = DeviceIoControl(Device, IOCTL_VIRTFS_FUSE_REQUEST,
-        InBuffer, InBufferSize, OutBuffer, OutBufferSize,
-        &BytesReturned, NULL);
-
-    if (Result == FALSE)
-    {
-        return FspNtStatusFromWin32(GetLastError());
-    }
 
     DBG("<<len: %u error: %d unique: %I64u", out_hdr->len, out_hdr->error,
         out_hdr->unique);
@@ -424,132 +599,1375 @@ static NTSTATUS VirtFsFuseRequest(HANDLE Device, LPVOID InBuffer,
     return Status;
 }
 
-static NTSTATUS VirtFsCreateFile(VIRTFS *VirtFs,
-    VIRTFS_FILE_CONTEXT *FileContext, UINT32 GrantedAccess, CHAR *FileName,
-    UINT64 Parent, UINT32 Mode, UINT64 AllocationSize,
-    FSP_FSCTL_FILE_INFO *FileInfo)
+static HANDLE GetRequestEvent(ULONG Index)
 {
-    NTSTATUS Status;
-    FUSE_CREATE_IN create_in;
-    FUSE_CREATE_OUT create_out;
+    // WinFsp dispatcher threads live as long as the file system, so each of
+    // them creates its events once and reuses them for every request.
+    static __declspec(thread) HANDLE Events[MAX_INFLIGHT_REQUESTS];
 
-    FUSE_HEADER_INIT(&create_in.hdr, FUSE_CREATE, Parent,
-        sizeof(struct fuse_create_in) + lstrlenA(FileName) + 1);
+    if (Events[Index] == NULL)
+    {
+        Events[Index] = CreateEvent(NULL, TRUE, FALSE, NULL);
+    }
+
+    return Events[Index];
+}
 
-    create_in.hdr.uid = VirtFs->OwnerUid;
-    create_in.hdr.gid = VirtFs->OwnerGid;
+// Buffers freed by a dispatcher thread are kept for its next requests, so
+// that large requests neither take the process heap lock nor fault in fresh
+// pages every time. The pool hangs off a fiber local storage slot, whose
+// callback gives the buffers back when the thread exits or the slot is
+// freed at service exit.
+typedef struct
+{
+    PVOID   Buffers[BUFFER_POOL_CLASSES][BUFFER_POOL_DEPTH];
+    ULONG   Count[BUFFER_POOL_CLASSES];
 
-    lstrcpyA(create_in.name, FileName);
-    create_in.create.mode = Mode;
-    create_in.create.umask = 0;
-    create_in.create.flags = AccessToUnixFlags(GrantedAccess) | O_EXCL;
+} VIRTFS_BUFFER_POOL;
 
-    DBG("create_in.create.flags: 0x%08x", create_in.create.flags);
-    DBG("create_in.create.mode: 0x%08x", create_in.create.mode);
+static DWORD BufferPoolIndex = FLS_OUT_OF_INDEXES;
 
-    Status = VirtFsFuseRequest(VirtFs->Device, &create_in, create_in.hdr.len,
-        &create_out, sizeof(create_out));
+static VOID WINAPI BufferPoolDrain(PVOID Data)
+{
+    VIRTFS_BUFFER_POOL *Pool = Data;
+    ULONG Class;
 
-    if (NT_SUCCESS(Status))
+    if (Pool == NULL)
     {
-        FileContext->NodeId = create_out.entry.nodeid;
-        FileContext->FileHandle = create_out.open.fh;
+        return;
+    }
 
-        if (AllocationSize > 0)
+    for (Class = 0; Class < BUFFER_POOL_CLASSES; Class++)
+    {
+        while (Pool->Count[Class] > 0)
         {
-            Status = SetFileSize(VirtFs->FileSystem, FileContext,
-                AllocationSize, TRUE, FileInfo);
+            VirtualFree(Pool->Buffers[Class][--Pool->Count[Class]], 0,
+                MEM_RELEASE);
         }
-        else
+    }
+
+    HeapFree(GetProcessHeap(), 0, Pool);
+}
+
+// Returns the calling thread's pool, NULL if it can't have one.
+static VIRTFS_BUFFER_POOL *BufferPoolGet(VOID)
+{
+    VIRTFS_BUFFER_POOL *Pool;
+
+    if (BufferPoolIndex == FLS_OUT_OF_INDEXES)
+    {
+        return NULL;
+    }
+
+    Pool = FlsGetValue(BufferPoolIndex);
+    if (Pool == NULL)
+    {
+        Pool = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*Pool));
+        if ((Pool != NULL) && !FlsSetValue(BufferPoolIndex, Pool))
         {
-            SetFileInfo(&create_out.entry.attr, FileInfo);
+            HeapFree(GetProcessHeap(), 0, Pool);
+            Pool = NULL;
         }
     }
 
-    return Status;
+    return Pool;
 }
 
-static NTSTATUS VirtFsCreateDir(VIRTFS *VirtFs,
-    VIRTFS_FILE_CONTEXT *FileContext, CHAR *FileName, UINT64 Parent,
-    UINT32 Mode, FSP_FSCTL_FILE_INFO *FileInfo)
+static SIZE_T BufferPoolClassSize(ULONG Class)
 {
-    NTSTATUS Status;
-    FUSE_MKDIR_IN mkdir_in;
-    FUSE_MKDIR_OUT mkdir_out;
+    return ((SIZE_T)1 << (BUFFER_POOL_MIN_SHIFT +
+        Class * BUFFER_POOL_CLASS_SHIFT)) + FUSE_PAGE_SIZE;
+}
 
-    FUSE_HEADER_INIT(&mkdir_in.hdr, FUSE_MKDIR, Parent,
-        sizeof(struct fuse_mkdir_in) + lstrlenA(FileName) + 1);
+// Returns BUFFER_POOL_CLASSES for sizes too large to be pooled.
+static ULONG BufferPoolClass(SIZE_T Size)
+{
+    ULONG Class;
 
-    mkdir_in.hdr.uid = VirtFs->OwnerUid;
-    mkdir_in.hdr.gid = VirtFs->OwnerGid;
+    for (Class = 0; Class < BUFFER_POOL_CLASSES; Class++)
+    {
+        if (Size <= BufferPoolClassSize(Class))
+        {
+            break;
+        }
+    }
 
-    lstrcpyA(mkdir_in.name, FileName);
-    mkdir_in.mkdir.mode = Mode | 0111; /* ---x--x--x */
-    mkdir_in.mkdir.umask = 0;
+    return Class;
+}
 
-    Status = VirtFsFuseRequest(VirtFs->Device, &mkdir_in, mkdir_in.hdr.len,
-        &mkdir_out, sizeof(mkdir_out));
+// Allocates a page-aligned request or reply buffer of at least Size bytes.
+// It must be released with VirtFsFreeBuffer and the same Size.
+static PVOID VirtFsAllocBuffer(SIZE_T Size)
+{
+    ULONG Class = BufferPoolClass(Size);
+    VIRTFS_BUFFER_POOL *Pool;
 
-    if (NT_SUCCESS(Status))
+    if (Class < BUFFER_POOL_CLASSES)
     {
-        FileContext->NodeId = mkdir_out.entry.nodeid;
-        SetFileInfo(&mkdir_out.entry.attr, FileInfo);
+        Pool = BufferPoolGet();
+        if ((Pool != NULL) && (Pool->Count[Class] > 0))
+        {
+            return Pool->Buffers[Class][--Pool->Count[Class]];
+        }
+
+        Size = BufferPoolClassSize(Class);
     }
 
-    return Status;
+    return VirtualAlloc(NULL, Size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
 }
 
-static VOID SubmitDeleteRequest(HANDLE Device,
-    VIRTFS_FILE_CONTEXT *FileContext, CHAR *FileName, UINT64 Parent)
+static VOID VirtFsFreeBuffer(PVOID Buffer, SIZE_T Size)
 {
-    FUSE_UNLINK_IN unlink_in;
-    FUSE_UNLINK_OUT unlink_out;
+    ULONG Class = BufferPoolClass(Size);
+    VIRTFS_BUFFER_POOL *Pool;
 
-    FUSE_HEADER_INIT(&unlink_in.hdr,
-        FileContext->IsDirectory ? FUSE_RMDIR : FUSE_UNLINK, Parent,
-        lstrlenA(FileName) + 1);
+    if (Buffer == NULL)
+    {
+        return;
+    }
 
-    lstrcpyA(unlink_in.name, FileName);
+    if (Class < BUFFER_POOL_CLASSES)
+    {
+        Pool = BufferPoolGet();
+        if ((Pool != NULL) && (Pool->Count[Class] < BUFFER_POOL_DEPTH))
+        {
+            Pool->Buffers[Class][Pool->Count[Class]++] = Buffer;
+            return;
+        }
+    }
 
-    (VOID)VirtFsFuseRequest(Device, &unlink_in, unlink_in.hdr.len,
-        &unlink_out, sizeof(unlink_out));
+    VirtualFree(Buffer, 0, MEM_RELEASE);
 }
 
-static NTSTATUS SubmitLookupRequest(HANDLE Device, uint64_t parent,
-    char *filename, FUSE_LOOKUP_OUT *LookupOut)
+// Starts a FUSE request without waiting for the reply. Index selects one of
+// the calling thread's events, every outstanding request needs its own.
+static NTSTATUS VirtFsSubmitRequest(HANDLE Device, DWORD IoControlCode,
+    LPVOID InBuffer, DWORD InBufferSize, LPVOID OutBuffer,
+    DWORD OutBufferSize, ULONG Index, VIRTFS_ASYNC_REQUEST *Request)
+{
+    struct fuse_in_header *in_hdr = InBuffer;
+    BOOL Result;
+
+    if (IoControlCode == IOCTL_VIRTFS_FUSE_REQUEST_DIRECT)
+    {
+        in_hdr = (struct fuse_in_header *)((PVIRTFS_DIRECT_REQUEST)InBuffer + 1);
+    }
+
+    DBG(">>req: %d unique: %I64u len: %u", in_hdr->opcode, in_hdr->unique,
+        in_hdr->len);
+
+    ZeroMemory(&Request->Overlapped, sizeof(Request->Overlapped));
+    Request->Overlapped.hEvent = GetRequestEvent(Index);
+    Request->OutBuffer = OutBuffer;
+    Request->OutBufferSize = OutBufferSize;
+
+    if (Request->Overlapped.hEvent == NULL)
+    {
+        return FspNtStatusFromWin32(GetLastError());
+    }
+
+    Result = DeviceIoControl(Device, IoControlCode, InBuffer, InBufferSize,
+        OutBuffer, OutBufferSize, NULL, &Request->Overlapped);
+
+    if ((Result == FALSE) && (GetLastError() != ERROR_IO_PENDING))
+    {
+        return FspNtStatusFromWin32(GetLastError());
+    }
+
+    return STATUS_PENDING;
+}
+
+static NTSTATUS VirtFsWaitForRequest(HANDLE Device,
+    VIRTFS_ASYNC_REQUEST *Request)
+{
+    DWORD BytesReturned = 0;
+
+    if (GetOverlappedResult(Device, &Request->Overlapped, &BytesReturned,
+        TRUE) == FALSE)
+    {
+        return FspNtStatusFromWin32(GetLastError());
+    }
+
+    return VirtFsFuseReplyStatus(Request->OutBuffer, BytesReturned,
+        Request->OutBufferSize);
+}
+
+static NTSTATUS VirtFsFuseRequest(HANDLE Device, LPVOID InBuffer,
+    DWORD InBufferSize, LPVOID OutBuffer, DWORD OutBufferSize)
 {
+    VIRTFS_ASYNC_REQUEST Request;
     NTSTATUS Status;
-    FUSE_LOOKUP_IN lookup_in;
 
-    FUSE_HEADER_INIT(&lookup_in.hdr, FUSE_LOOKUP, parent,
-        lstrlenA(filename) + 1);
+    Status = VirtFsSubmitRequest(Device, IOCTL_VIRTFS_FUSE_REQUEST, InBuffer,
+        InBufferSize, OutBuffer, OutBufferSize, 0, &Request);
+
+    if (Status != STATUS_PENDING)
+    {
+        return Status;
+    }
 
-    lstrcpyA(lookup_in.name, filename);
+    return VirtFsWaitForRequest(Device, &Request);
+}
 
-    Status = VirtFsFuseRequest(Device, &lookup_in, lookup_in.hdr.len,
-        LookupOut, sizeof(*LookupOut));
+static VOID InitReadChunk(VIRTFS_FILE_CONTEXT *FileContext,
+    VIRTFS_IO_CHUNK *Chunk, PVOID Buffer, UINT64 Offset)
+{
+    FUSE_READ_DIRECT_IN *read_in = &Chunk->read_in;
+
+    // The device writes the data straight into the caller's buffer.
+    read_in->direct.Data = (UINT64)(ULONG_PTR)Buffer;
+    read_in->direct.DataLength = Chunk->Length;
+    read_in->direct.DataWritable = TRUE;
+
+    FUSE_HEADER_INIT(&read_in->hdr, FUSE_READ, FileContext->NodeId,
+        sizeof(read_in->read));
+
+    read_in->read.fh = FileContext->FileHandle;
+    read_in->read.offset = Offset;
+    read_in->read.size = Chunk->Length;
+    read_in->read.read_flags = 0;
+    read_in->read.lock_owner = 0;
+    read_in->read.flags = 0;
+}
 
-    if (NT_SUCCESS(Status))
+static VOID InitWriteChunk(VIRTFS_FILE_CONTEXT *FileContext,
+    VIRTFS_IO_CHUNK *Chunk, PVOID Buffer, UINT64 Offset)
+{
+    FUSE_WRITE_DIRECT_IN *write_in = &Chunk->write_in;
+
+    // The device reads the data straight from the caller's buffer.
+    write_in->direct.Data = (UINT64)(ULONG_PTR)Buffer;
+    write_in->direct.DataLength = Chunk->Length;
+    write_in->direct.DataWritable = FALSE;
+
+    FUSE_HEADER_INIT(&write_in->hdr, FUSE_WRITE, FileContext->NodeId,
+        sizeof(write_in->write) + Chunk->Length);
+
+    write_in->write.fh = FileContext->FileHandle;
+    write_in->write.offset = Offset;
+    write_in->write.size = Chunk->Length;
+    write_in->write.write_flags = 0;
+    write_in->write.lock_owner = 0;
+    write_in->write.flags = 0;
+}
+
+// Returns how many ChunkSize requests a transfer may keep outstanding, no
+// more than fit the request queue. A direct request takes a descriptor per
+// payload page, one more for an unaligned buffer and a few for the headers.
+static ULONG VirtFsMaxInflight(VIRTFS *VirtFs, ULONG ChunkSize)
+{
+    ULONG Descs = ChunkSize / FUSE_PAGE_SIZE + 4;
+    ULONG Slots;
+
+    if (VirtFs->QueueInfo.QueueSize == 0)
     {
-        struct fuse_attr *attr = &LookupOut->entry.attr;
+        return MAX_INFLIGHT_REQUESTS;
+    }
 
-        DBG("nodeid=%I64u ino=%I64u size=%I64u blocks=%I64u atime=%I64u mtime=%I64u "
-            "ctime=%I64u atimensec=%u mtimensec=%u ctimensec=%u mode=%x "
-            "nlink=%u uid=%u gid=%u rdev=%u blksize=%u",
-            LookupOut->entry.nodeid, attr->ino, attr->size, attr->blocks,
-            attr->atime, attr->mtime, attr->ctime, attr->atimensec,
-            attr->mtimensec, attr->ctimensec, attr->mode, attr->nlink,
-            attr->uid, attr->gid, attr->rdev, attr->blksize);
+    Slots = (Descs <= VirtFs->QueueInfo.IndirectDescs) ? 1 : Descs;
+
+    return max(1, min(MAX_INFLIGHT_REQUESTS,
+        VirtFs->QueueInfo.QueueSize / Slots));
+}
+
+// Splits a read or a write into ChunkSize requests and keeps up to
+// MAX_INFLIGHT_REQUESTS of them outstanding, so that a large transfer costs
+// about one round trip instead of one per chunk. Reports the bytes
+// transferred up to the first short or failed chunk. Chunks of a write
+// after that one may have been written all the same.
+static NTSTATUS VirtFsTransferChunks(VIRTFS *VirtFs,
+    VIRTFS_FILE_CONTEXT *FileContext, BOOLEAN Write, PVOID Buffer,
+    UINT64 Offset, ULONG Length, ULONG ChunkSize, PULONG PBytesTransferred)
+{
+    VIRTFS_IO_CHUNK Chunks[MAX_INFLIGHT_REQUESTS];
+    VIRTFS_IO_CHUNK *Chunk;
+    NTSTATUS Status = STATUS_SUCCESS, ChunkStatus;
+    ULONG NumChunks = (Length + ChunkSize - 1) / ChunkSize;
+    ULONG MaxInflight = VirtFsMaxInflight(VirtFs, ChunkSize);
+    ULONG Submitted = 0, Completed = 0;
+    ULONG Position, Done;
+    BOOLEAN Stop = FALSE;
+
+    *PBytesTransferred = 0;
+
+    while ((Completed < Submitted) || ((Stop == FALSE) &&
+        (Submitted < NumChunks)))
+    {
+        if ((Stop == FALSE) && (Submitted < NumChunks) &&
+            (Submitted - Completed < MaxInflight))
+        {
+            Chunk = &Chunks[Submitted % MAX_INFLIGHT_REQUESTS];
+            Position = Submitted * ChunkSize;
+            Chunk->Length = min(ChunkSize, Length - Position);
+
+            if (Write == TRUE)
+            {
+                InitWriteChunk(FileContext, Chunk, (BYTE *)Buffer + Position,
+                    Offset + Position);
+
+                ChunkStatus = VirtFsSubmitRequest(VirtFs->Device,
+                    IOCTL_VIRTFS_FUSE_REQUEST_DIRECT, &Chunk->write_in,
+                    sizeof(Chunk->write_in), &Chunk->write_out,
+                    sizeof(Chunk->write_out),
+                    Submitted % MAX_INFLIGHT_REQUESTS, &Chunk->Async);
+            }
+            else
+            {
+                InitReadChunk(FileContext, Chunk, (BYTE *)Buffer + Position,
+                    Offset + Position);
+
+                ChunkStatus = VirtFsSubmitRequest(VirtFs->Device,
+                    IOCTL_VIRTFS_FUSE_REQUEST_DIRECT, &Chunk->read_in,
+                    sizeof(Chunk->read_in), &Chunk->read_out,
+                    sizeof(Chunk->read_out),
+                    Submitted % MAX_INFLIGHT_REQUESTS, &Chunk->Async);
+            }
+
+            if (ChunkStatus != STATUS_PENDING)
+            {
+                Status = ChunkStatus;
+                Stop = TRUE;
+                continue;
+            }
+
+            Submitted++;
+            continue;
+        }
+
+        // Chunks complete in submission order, the ones after a short or
+        // failed chunk are waited for but not accounted.
+        Chunk = &Chunks[Completed % MAX_INFLIGHT_REQUESTS];
+        ChunkStatus = VirtFsWaitForRequest(VirtFs->Device, &Chunk->Async);
+        Completed++;
+
+        if (Stop == TRUE)
+        {
+            continue;
+        }
+
+        if (!NT_SUCCESS(ChunkStatus))
+        {
+            Status = ChunkStatus;
+            Stop = TRUE;
+            continue;
+        }
+
+        if (Write == TRUE)
+        {
+            Done = Chunk->write_out.write.size;
+        }
+        else
+        {
+            // The data went straight into the caller's buffer, only the
+            // header length tells how much of it the host filled.
+            if ((Chunk->read_out.hdr.len < sizeof(struct fuse_out_header)) ||
+                (Chunk->read_out.hdr.len - sizeof(struct fuse_out_header) >
+                    Chunk->Length))
+            {
+                DBG("Bad direct read reply length: %u", Chunk->read_out.hdr.len);
+                Status = STATUS_UNSUCCESSFUL;
+                Stop = TRUE;
+                continue;
+            }
+
+            Done = Chunk->read_out.hdr.len - sizeof(struct fuse_out_header);
+        }
+
+        *PBytesTransferred += Done;
+
+        if (Done < Chunk->Length)
+        {
+            Stop = TRUE;
+        }
+    }
+
+    // Data transferred before a failure is reported like a short transfer.
+    if (*PBytesTransferred > 0)
+    {
+        Status = STATUS_SUCCESS;
+    }
+
+    return Status;
+}
+
+static VOID SubmitForgetRequests(VIRTFS *VirtFs, VIRTFS_FORGET_LIST *List)
+{
+    struct fuse_out_header out_hdr;
+    ULONG i;
+
+    // A forgotten node id may be reused by the host for another file.
+    for (i = 0; i < List->Count; i++)
+    {
+        DaxRemoveMappings(VirtFs, List->Forgets[i].nodeid, 0);
+    }
+
+    // FUSE_FORGET and FUSE_BATCH_FORGET have no reply, the device returns
+    // the buffers without writing anything into them.
+    ZeroMemory(&out_hdr, sizeof(out_hdr));
+
+    if (List->Count == 1)
+    {
+        FUSE_FORGET_IN forget_in;
+
+        FUSE_HEADER_INIT(&forget_in.hdr, FUSE_FORGET,
+            List->Forgets[0].nodeid, sizeof(forget_in.forget));
+
+        forget_in.forget.nlookup = List->Forgets[0].nlookup;
+
+        (VOID)VirtFsFuseRequest(VirtFs->Device, &forget_in,
+            sizeof(forget_in), &out_hdr, sizeof(out_hdr));
+    }
+    else if (List->Count > 1)
+    {
+        FUSE_BATCH_FORGET_IN forget_in;
+        DWORD Length = sizeof(forget_in.batch) +
+            List->Count * sizeof(struct fuse_forget_one);
+
+        FUSE_HEADER_INIT(&forget_in.hdr, FUSE_BATCH_FORGET, FUSE_ROOT_ID,
+            Length);
+
+        forget_in.batch.count = List->Count;
+        forget_in.batch.dummy = 0;
+        CopyMemory(forget_in.forgets, List->Forgets,
+            List->Count * sizeof(struct fuse_forget_one));
+
+        (VOID)VirtFsFuseRequest(VirtFs->Device, &forget_in,
+            forget_in.hdr.len, &out_hdr, sizeof(out_hdr));
+    }
+
+    List->Count = 0;
+}
+
+// Queues the lookups of the node id to be given back, a full list is sent
+// right away.
+static VOID ForgetListAdd(VIRTFS *VirtFs, VIRTFS_FORGET_LIST *List,
+    uint64_t NodeId, uint64_t NLookup)
+{
+    if (List->Count == FUSE_BATCH_FORGET_MAX)
+    {
+        SubmitForgetRequests(VirtFs, List);
+    }
+
+    List->Forgets[List->Count].nodeid = NodeId;
+    List->Forgets[List->Count].nlookup = NLookup;
+    List->Count++;
+}
+
+static VOID CacheListInit(PLIST_ENTRY Head)
+{
+    Head->Flink = Head->Blink = Head;
+}
+
+static VOID CacheListInsertTail(PLIST_ENTRY Head, PLIST_ENTRY Entry)
+{
+    Entry->Flink = Head;
+    Entry->Blink = Head->Blink;
+    Head->Blink->Flink = Entry;
+    Head->Blink = Entry;
+}
+
+static VOID CacheListRemove(PLIST_ENTRY Entry)
+{
+    Entry->Blink->Flink = Entry->Flink;
+    Entry->Flink->Blink = Entry->Blink;
+}
+
+static ULONG LookupCacheHash(uint64_t Parent, const char *Name)
+{
+    // FNV-1a over the parent node id and the name.
+    ULONG Hash = 2166136261u;
+    ULONG i;
+
+    for (i = 0; i < sizeof(Parent); i++)
+    {
+        Hash = (Hash ^ (UCHAR)(Parent >> (i * 8))) * 16777619u;
+    }
+
+    while (*Name != '\0')
+    {
+        Hash = (Hash ^ (UCHAR)*Name++) * 16777619u;
+    }
+
+    return Hash;
+}
+
+static ULONG LookupCacheNodeBucket(uint64_t NodeId)
+{
+    return (ULONG)((NodeId ^ (NodeId >> 32)) % LOOKUP_CACHE_BUCKETS);
+}
+
+static ULONGLONG LookupCacheExpire(ULONGLONG Now, uint64_t Valid,
+    uint32_t ValidNsec)
+{
+    // Hosts use very large timeouts to mean "forever", avoid overflowing.
+    if (Valid > MAXULONG)
+    {
+        Valid = MAXULONG;
+    }
+
+    return Now + Valid * 1000 + ValidNsec / 1000000;
+}
+
+static VOID LookupCacheInitialize(VIRTFS *VirtFs)
+{
+    VIRTFS_LOOKUP_CACHE *Cache = &VirtFs->LookupCache;
+    ULONG i;
+
+    InitializeSRWLock(&Cache->Lock);
+    CacheListInit(&Cache->Lru);
+    Cache->Count = 0;
+
+    for (i = 0; i < LOOKUP_CACHE_BUCKETS; i++)
+    {
+        CacheListInit(&Cache->NameBuckets[i]);
+        CacheListInit(&Cache->NodeBuckets[i]);
+    }
+}
+
+// Drops a reference, the last one gives the entry's lookups back to the host.
+// Called with the cache lock held.
+static VOID LookupCachePut(VIRTFS *VirtFs, PVIRTFS_ENTRY Entry,
+    VIRTFS_FORGET_LIST *Forgets)
+{
+    if (--Entry->RefCount > 0)
+    {
+        return;
+    }
+
+    ForgetListAdd(VirtFs, Forgets, Entry->NodeId, Entry->NLookup);
+
+    DBG("forget nodeid: %I64u nlookup: %I64u", Entry->NodeId, Entry->NLookup);
+
+    SafeHeapFree(Entry);
+}
+
+// Removes the entry from the cache. It stays valid for the users still
+// holding a reference. Called with the cache lock held.
+static VOID LookupCacheUnhash(VIRTFS *VirtFs, PVIRTFS_ENTRY Entry,
+    VIRTFS_FORGET_LIST *Forgets)
+{
+    CacheListRemove(&Entry->NameLink);
+    CacheListRemove(&Entry->NodeLink);
+    CacheListRemove(&Entry->LruLink);
+    VirtFs->LookupCache.Count--;
+
+    LookupCachePut(VirtFs, Entry, Forgets);
+}
+
+static PVIRTFS_ENTRY LookupCacheFind(VIRTFS_LOOKUP_CACHE *Cache,
+    uint64_t Parent, const char *Name, ULONG Hash)
+{
+    PLIST_ENTRY Bucket = &Cache->NameBuckets[Hash % LOOKUP_CACHE_BUCKETS];
+    PLIST_ENTRY Link;
+
+    for (Link = Bucket->Flink; Link != Bucket; Link = Link->Flink)
+    {
+        PVIRTFS_ENTRY Entry = CONTAINING_RECORD(Link, VIRTFS_ENTRY, NameLink);
+
+        if ((Entry->Hash == Hash) && (Entry->Parent == Parent) &&
+            (lstrcmpA(Entry->Name, Name) == 0))
+        {
+            return Entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Returns a referenced entry if the name is cached and has not expired.
+static PVIRTFS_ENTRY LookupCacheGet(VIRTFS *VirtFs, uint64_t Parent,
+    const char *Name, BOOLEAN NeedAttr)
+{
+    VIRTFS_LOOKUP_CACHE *Cache = &VirtFs->LookupCache;
+    ULONGLONG Now = GetTickCount64();
+    PVIRTFS_ENTRY Entry;
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+
+    Entry = LookupCacheFind(Cache, Parent, Name,
+        LookupCacheHash(Parent, Name));
+
+    if ((Entry != NULL) && (Now < Entry->EntryExpire) &&
+        ((NeedAttr == FALSE) || (Now < Entry->AttrExpire)))
+    {
+        Entry->RefCount++;
+        CacheListRemove(&Entry->LruLink);
+        CacheListInsertTail(&Cache->Lru, &Entry->LruLink);
+    }
+    else
+    {
+        Entry = NULL;
+    }
+
+    ReleaseSRWLockExclusive(&Cache->Lock);
+
+    return Entry;
+}
+
+// Accounts a lookup of entry->nodeid counted by the host and caches the
+// name. The lookups of evicted entries are added to Forgets, and the one
+// just taken if no memory. With Release set, no reference is returned.
+static PVIRTFS_ENTRY LookupCacheInsertLookup(VIRTFS *VirtFs, uint64_t Parent,
+    const char *Name, struct fuse_entry_out *entry, BOOLEAN Release,
+    VIRTFS_FORGET_LIST *Forgets)
+{
+    VIRTFS_LOOKUP_CACHE *Cache = &VirtFs->LookupCache;
+    ULONGLONG Now = GetTickCount64();
+    ULONG Hash = LookupCacheHash(Parent, Name);
+    PVIRTFS_ENTRY Entry;
+    int NameSize = lstrlenA(Name) + 1;
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+
+    Entry = LookupCacheFind(Cache, Parent, Name, Hash);
+    if ((Entry != NULL) && (Entry->NodeId != entry->nodeid))
+    {
+        LookupCacheUnhash(VirtFs, Entry, Forgets);
+        Entry = NULL;
+    }
+
+    if (Entry != NULL)
+    {
+        Entry->NLookup++;
+        Entry->RefCount++;
+        CacheListRemove(&Entry->LruLink);
+        CacheListInsertTail(&Cache->Lru, &Entry->LruLink);
+    }
+    else
+    {
+        Entry = HeapAlloc(GetProcessHeap(), 0, sizeof(*Entry) + NameSize);
+        if (Entry == NULL)
+        {
+            ForgetListAdd(VirtFs, Forgets, entry->nodeid, 1);
+        }
+        else
+        {
+            Entry->RefCount = 2;
+            Entry->Parent = Parent;
+            Entry->NodeId = entry->nodeid;
+            Entry->NLookup = 1;
+            Entry->Hash = Hash;
+            CopyMemory(Entry->Name, Name, NameSize);
+
+            CacheListInsertTail(&Cache->NameBuckets[Hash % LOOKUP_CACHE_BUCKETS],
+                &Entry->NameLink);
+            CacheListInsertTail(
+                &Cache->NodeBuckets[LookupCacheNodeBucket(Entry->NodeId)],
+                &Entry->NodeLink);
+            CacheListInsertTail(&Cache->Lru, &Entry->LruLink);
+            Cache->Count++;
+
+            // Evicted entries in use are forgotten when the last user goes.
+            while (Cache->Count > LOOKUP_CACHE_MAX_ENTRIES)
+            {
+                LookupCacheUnhash(VirtFs, CONTAINING_RECORD(Cache->Lru.Flink,
+                    VIRTFS_ENTRY, LruLink), Forgets);
+            }
+        }
+    }
+
+    if (Entry != NULL)
+    {
+        Entry->Attr = entry->attr;
+        Entry->EntryExpire = LookupCacheExpire(Now, entry->entry_valid,
+            entry->entry_valid_nsec);
+        Entry->AttrExpire = LookupCacheExpire(Now, entry->attr_valid,
+            entry->attr_valid_nsec);
+
+        if (Release == TRUE)
+        {
+            LookupCachePut(VirtFs, Entry, Forgets);
+            Entry = NULL;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&Cache->Lock);
+
+    return Entry;
+}
+
+// Accounts a lookup of entry->nodeid counted by the host and returns a
+// referenced entry. Returns NULL if no memory, the lookup is forgotten then.
+static PVIRTFS_ENTRY LookupCacheInsert(VIRTFS *VirtFs, uint64_t Parent,
+    const char *Name, struct fuse_entry_out *entry)
+{
+    VIRTFS_FORGET_LIST Forgets;
+    PVIRTFS_ENTRY Entry;
+
+    Forgets.Count = 0;
+
+    Entry = LookupCacheInsertLookup(VirtFs, Parent, Name, entry, FALSE,
+        &Forgets);
+
+    SubmitForgetRequests(VirtFs, &Forgets);
+
+    return Entry;
+}
+
+static VOID LookupCacheRelease(VIRTFS *VirtFs, PVIRTFS_ENTRY Entry)
+{
+    VIRTFS_FORGET_LIST Forgets;
+
+    Forgets.Count = 0;
+
+    AcquireSRWLockExclusive(&VirtFs->LookupCache.Lock);
+    LookupCachePut(VirtFs, Entry, &Forgets);
+    ReleaseSRWLockExclusive(&VirtFs->LookupCache.Lock);
+
+    SubmitForgetRequests(VirtFs, &Forgets);
+}
+
+// Drops the name after it was unlinked or renamed.
+static VOID LookupCacheRemove(VIRTFS *VirtFs, uint64_t Parent,
+    const char *Name)
+{
+    VIRTFS_FORGET_LIST Forgets;
+    PVIRTFS_ENTRY Entry;
+
+    Forgets.Count = 0;
+
+    AcquireSRWLockExclusive(&VirtFs->LookupCache.Lock);
+
+    Entry = LookupCacheFind(&VirtFs->LookupCache, Parent, Name,
+        LookupCacheHash(Parent, Name));
+
+    if (Entry != NULL)
+    {
+        LookupCacheUnhash(VirtFs, Entry, &Forgets);
+    }
+
+    ReleaseSRWLockExclusive(&VirtFs->LookupCache.Lock);
+
+    SubmitForgetRequests(VirtFs, &Forgets);
+}
+
+// Refreshes the cached attributes of all names of the node, or invalidates
+// them when attr is NULL.
+static VOID LookupCacheUpdateAttr(VIRTFS *VirtFs, uint64_t NodeId,
+    struct fuse_attr_out *attr)
+{
+    VIRTFS_LOOKUP_CACHE *Cache = &VirtFs->LookupCache;
+    PLIST_ENTRY Bucket = &Cache->NodeBuckets[LookupCacheNodeBucket(NodeId)];
+    ULONGLONG Now = GetTickCount64();
+    PLIST_ENTRY Link;
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+
+    for (Link = Bucket->Flink; Link != Bucket; Link = Link->Flink)
+    {
+        PVIRTFS_ENTRY Entry = CONTAINING_RECORD(Link, VIRTFS_ENTRY, NodeLink);
+
+        if (Entry->NodeId != NodeId)
+        {
+            continue;
+        }
+
+        if (attr != NULL)
+        {
+            Entry->Attr = attr->attr;
+            Entry->AttrExpire = LookupCacheExpire(Now, attr->attr_valid,
+                attr->attr_valid_nsec);
+        }
+        else
+        {
+            Entry->AttrExpire = 0;
+        }
+    }
+
+    ReleaseSRWLockExclusive(&Cache->Lock);
+}
+
+// Returns FALSE if the entry has no valid attributes.
+static BOOLEAN LookupCacheGetFileSize(VIRTFS *VirtFs, PVIRTFS_ENTRY Entry,
+    UINT64 *FileSize)
+{
+    VIRTFS_LOOKUP_CACHE *Cache = &VirtFs->LookupCache;
+    BOOLEAN Valid = FALSE;
+
+    if (Entry == NULL)
+    {
+        return FALSE;
+    }
+
+    AcquireSRWLockShared(&Cache->Lock);
+
+    if (GetTickCount64() < Entry->AttrExpire)
+    {
+        *FileSize = Entry->Attr.size;
+        Valid = TRUE;
+    }
+
+    ReleaseSRWLockShared(&Cache->Lock);
+
+    return Valid;
+}
+
+static VOID LookupCacheDestroy(VIRTFS *VirtFs)
+{
+    VIRTFS_LOOKUP_CACHE *Cache = &VirtFs->LookupCache;
+    VIRTFS_FORGET_LIST Forgets;
+
+    Forgets.Count = 0;
+
+    AcquireSRWLockExclusive(&Cache->Lock);
+
+    while (Cache->Lru.Flink != &Cache->Lru)
+    {
+        LookupCacheUnhash(VirtFs, CONTAINING_RECORD(Cache->Lru.Flink,
+            VIRTFS_ENTRY, LruLink), &Forgets);
+    }
+
+    ReleaseSRWLockExclusive(&Cache->Lock);
+
+    SubmitForgetRequests(VirtFs, &Forgets);
+}
+
+static VOID DaxInitialize(VIRTFS *VirtFs)
+{
+    VIRTFS_DAX *Dax = &VirtFs->Dax;
+    ULONG i;
+
+    InitializeSRWLock(&Dax->Lock);
+    InitializeConditionVariable(&Dax->ChunkWait);
+    CacheListInit(&Dax->Lru);
+
+    for (i = 0; i < DAX_BUCKETS; i++)
+    {
+        CacheListInit(&Dax->NodeBuckets[i]);
+    }
+}
+
+// Maps the device's DAX window into the service. Without a window, or if
+// the host can't map chunk aligned file ranges, all data goes through the
+// request queues.
+static VOID DaxMapWindow(VIRTFS *VirtFs, struct fuse_init_out *init)
+{
+    VIRTFS_DAX *Dax = &VirtFs->Dax;
+    VIRTFS_DAX_WINDOW Window;
+    OVERLAPPED Overlapped;
+    DWORD BytesReturned;
+    BOOL Result;
+    ULONG i;
+
+    if ((init->flags & FUSE_MAP_ALIGNMENT) &&
+        (init->map_alignment > DAX_CHUNK_SHIFT))
+    {
+        DBG("map_alignment %u is not supported", init->map_alignment);
+        return;
+    }
+
+    ZeroMemory(&Overlapped, sizeof(Overlapped));
+    Overlapped.hEvent = GetRequestEvent(0);
+
+    Result = DeviceIoControl(VirtFs->Device, IOCTL_VIRTFS_MAP_DAX_WINDOW,
+        NULL, 0, &Window, sizeof(Window), NULL, &Overlapped);
+
+    if ((Result == FALSE) && (GetLastError() == ERROR_IO_PENDING))
+    {
+        Result = GetOverlappedResult(VirtFs->Device, &Overlapped,
+            &BytesReturned, TRUE);
+    }
+
+    if (Result == FALSE)
+    {
+        DBG("No DAX window: %u", GetLastError());
+        return;
+    }
+
+    Dax->NumChunks = (ULONG)(Window.Length / DAX_CHUNK_SIZE);
+    if (Dax->NumChunks == 0)
+    {
+        return;
+    }
+
+    Dax->Chunks = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+        Dax->NumChunks * sizeof(*Dax->Chunks));
+
+    if (Dax->Chunks == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < Dax->NumChunks; i++)
+    {
+        CacheListInit(&Dax->Chunks[i].NodeLink);
+        CacheListInsertTail(&Dax->Lru, &Dax->Chunks[i].LruLink);
+    }
+
+    Dax->Window = (BYTE *)(ULONG_PTR)Window.Address;
+
+    DBG("DAX window: %p chunks: %u", Dax->Window, Dax->NumChunks);
+}
+
+static ULONG DaxNodeBucket(uint64_t NodeId)
+{
+    return (ULONG)((NodeId ^ (NodeId >> 32)) % DAX_BUCKETS);
+}
+
+static uint64_t DaxChunkOffset(VIRTFS_DAX *Dax, PVIRTFS_DAX_CHUNK Chunk)
+{
+    return (uint64_t)(Chunk - Dax->Chunks) * DAX_CHUNK_SIZE;
+}
+
+// Returns the chunk of the window the given chunk of the file is mapped at,
+// with a reference. The least recently used chunk not being copied from is
+// reclaimed if the file range isn't mapped yet, a new mapping replaces the
+// old one on the host. Returns NULL if no chunk is free or the host refused
+// the mapping.
+static PVIRTFS_DAX_CHUNK DaxGetChunk(VIRTFS *VirtFs,
+    VIRTFS_FILE_CONTEXT *FileContext, uint64_t ChunkIndex, BOOLEAN Write)
+{
+    VIRTFS_DAX *Dax = &VirtFs->Dax;
+    PLIST_ENTRY Head = &Dax->NodeBuckets[DaxNodeBucket(FileContext->NodeId)];
+    PVIRTFS_DAX_CHUNK Chunk, Candidate;
+    PLIST_ENTRY Item;
+    FUSE_SETUPMAPPING_IN setup_in;
+    FUSE_SETUPMAPPING_OUT setup_out;
+    NTSTATUS Status;
+
+    AcquireSRWLockExclusive(&Dax->Lock);
+
+Lookup:
+    Chunk = NULL;
+    for (Item = Head->Flink; Item != Head; Item = Item->Flink)
+    {
+        Candidate = CONTAINING_RECORD(Item, VIRTFS_DAX_CHUNK, NodeLink);
+        if ((Candidate->NodeId == FileContext->NodeId) &&
+            (Candidate->ChunkIndex == ChunkIndex))
+        {
+            Chunk = Candidate;
+            break;
+        }
+    }
+
+    // The file range is being mapped by another thread. The chunk may be
+    // reclaimed if that fails, so look it up again.
+    if ((Chunk != NULL) && Chunk->Busy)
+    {
+        SleepConditionVariableSRW(&Dax->ChunkWait, &Dax->Lock, INFINITE, 0);
+        goto Lookup;
+    }
+
+    // A chunk mapped for reading only is mapped again for writing.
+    if ((Chunk == NULL) || (Write && !Chunk->Writable))
+    {
+        if (Chunk == NULL)
+        {
+            for (Item = Dax->Lru.Flink; Item != &Dax->Lru; Item = Item->Flink)
+            {
+                Candidate = CONTAINING_RECORD(Item, VIRTFS_DAX_CHUNK,
+                    LruLink);
+
+                if ((Candidate->RefCount == 0) && !Candidate->Busy)
+                {
+                    Chunk = Candidate;
+                    break;
+                }
+            }
+
+            if (Chunk == NULL)
+            {
+                ReleaseSRWLockExclusive(&Dax->Lock);
+                return NULL;
+            }
+
+            if (Chunk->Mapped == TRUE)
+            {
+                CacheListRemove(&Chunk->NodeLink);
+            }
+
+            // Hashed right away so that the file range is never mapped
+            // twice, concurrent users of it wait for this mapping.
+            Chunk->NodeId = FileContext->NodeId;
+            Chunk->ChunkIndex = ChunkIndex;
+            Chunk->Mapped = TRUE;
+            Chunk->Writable = FALSE;
+            CacheListInsertTail(Head, &Chunk->NodeLink);
+        }
+
+        // The host round trip is made without the lock, copies from other
+        // chunks and mappings of other file ranges go on meanwhile.
+        Chunk->Busy = TRUE;
+        ReleaseSRWLockExclusive(&Dax->Lock);
+
+        FUSE_HEADER_INIT(&setup_in.hdr, FUSE_SETUPMAPPING, FileContext->NodeId,
+            sizeof(setup_in.setupmapping));
+
+        setup_in.setupmapping.fh = FileContext->FileHandle;
+        setup_in.setupmapping.foffset = ChunkIndex * DAX_CHUNK_SIZE;
+        setup_in.setupmapping.len = DAX_CHUNK_SIZE;
+        setup_in.setupmapping.flags = FUSE_SETUPMAPPING_FLAG_READ |
+            (Write ? FUSE_SETUPMAPPING_FLAG_WRITE : 0);
+        setup_in.setupmapping.moffset = DaxChunkOffset(Dax, Chunk);
+
+        Status = VirtFsFuseRequest(VirtFs->Device, &setup_in,
+            sizeof(setup_in), &setup_out, sizeof(setup_out));
+
+        AcquireSRWLockExclusive(&Dax->Lock);
+
+        Chunk->Busy = FALSE;
+        WakeAllConditionVariable(&Dax->ChunkWait);
+
+        if (!NT_SUCCESS(Status))
+        {
+            // The previous mapping may be gone as well.
+            CacheListRemove(&Chunk->NodeLink);
+            Chunk->Mapped = FALSE;
+
+            ReleaseSRWLockExclusive(&Dax->Lock);
+            return NULL;
+        }
+
+        Chunk->Writable = Write;
+    }
+
+    Chunk->RefCount++;
+    CacheListRemove(&Chunk->LruLink);
+    CacheListInsertTail(&Dax->Lru, &Chunk->LruLink);
+
+    ReleaseSRWLockExclusive(&Dax->Lock);
+
+    return Chunk;
+}
+
+static VOID DaxPutChunk(VIRTFS *VirtFs, PVIRTFS_DAX_CHUNK Chunk)
+{
+    AcquireSRWLockExclusive(&VirtFs->Dax.Lock);
+    Chunk->RefCount--;
+    ReleaseSRWLockExclusive(&VirtFs->Dax.Lock);
+}
+
+static VOID SubmitRemoveMappingRequest(VIRTFS *VirtFs, uint64_t NodeId,
+    FUSE_REMOVEMAPPING_IN *remove_in, ULONG Count)
+{
+    FUSE_REMOVEMAPPING_OUT remove_out;
+
+    FUSE_HEADER_INIT(&remove_in->hdr, FUSE_REMOVEMAPPING, NodeId,
+        sizeof(remove_in->removemapping) +
+        Count * sizeof(struct fuse_removemapping_one));
+
+    remove_in->removemapping.count = Count;
+
+    (VOID)VirtFsFuseRequest(VirtFs->Device, remove_in, remove_in->hdr.len,
+        &remove_out, sizeof(remove_out));
+}
+
+// Unmaps the chunks of a file from FirstChunk on, after the file has been
+// truncated or deleted, or before its node id is forgotten. Chunks being
+// copied from stay mapped, the copies are limited to the file size.
+static VOID DaxRemoveMappings(VIRTFS *VirtFs, uint64_t NodeId,
+    uint64_t FirstChunk)
+{
+    VIRTFS_DAX *Dax = &VirtFs->Dax;
+    PLIST_ENTRY Head = &Dax->NodeBuckets[DaxNodeBucket(NodeId)];
+    PLIST_ENTRY Item, Next;
+    PVIRTFS_DAX_CHUNK Chunk;
+    PVIRTFS_DAX_CHUNK Removed[FUSE_REMOVEMAPPING_MAX];
+    FUSE_REMOVEMAPPING_IN remove_in;
+    ULONG Count, i;
+
+    if (Dax->Window == NULL)
+    {
+        return;
+    }
+
+    AcquireSRWLockExclusive(&Dax->Lock);
+
+    do
+    {
+        Count = 0;
+
+        for (Item = Head->Flink; (Item != Head) &&
+            (Count < FUSE_REMOVEMAPPING_MAX); Item = Next)
+        {
+            Next = Item->Flink;
+            Chunk = CONTAINING_RECORD(Item, VIRTFS_DAX_CHUNK, NodeLink);
+
+            if ((Chunk->NodeId != NodeId) ||
+                (Chunk->ChunkIndex < FirstChunk) ||
+                (Chunk->RefCount > 0) || Chunk->Busy)
+            {
+                continue;
+            }
+
+            // Unhashed right away, but not reclaimed until the host has
+            // dropped the mapping.
+            CacheListRemove(&Chunk->NodeLink);
+            Chunk->Mapped = FALSE;
+            Chunk->Busy = TRUE;
+            Removed[Count] = Chunk;
+
+            remove_in.removes[Count].moffset = DaxChunkOffset(Dax, Chunk);
+            remove_in.removes[Count].len = DAX_CHUNK_SIZE;
+            Count++;
+        }
+
+        if (Count > 0)
+        {
+            ReleaseSRWLockExclusive(&Dax->Lock);
+            SubmitRemoveMappingRequest(VirtFs, NodeId, &remove_in, Count);
+            AcquireSRWLockExclusive(&Dax->Lock);
+
+            for (i = 0; i < Count; i++)
+            {
+                Removed[i]->Busy = FALSE;
+            }
+            WakeAllConditionVariable(&Dax->ChunkWait);
+        }
+
+    } while (Count == FUSE_REMOVEMAPPING_MAX);
+
+    ReleaseSRWLockExclusive(&Dax->Lock);
+}
+
+// Copies between the caller's buffer and the DAX window, chunk by chunk.
+// Returns the bytes copied up to the first chunk that couldn't be mapped,
+// the remainder is left to the request queues.
+static ULONG DaxTransfer(VIRTFS *VirtFs, VIRTFS_FILE_CONTEXT *FileContext,
+    BOOLEAN Write, PVOID Buffer, UINT64 Offset, ULONG Length)
+{
+    VIRTFS_DAX *Dax = &VirtFs->Dax;
+    PVIRTFS_DAX_CHUNK Chunk;
+    ULONG Done = 0, Count, ChunkOffset;
+    BYTE *Address;
+
+    while (Done < Length)
+    {
+        ChunkOffset = (ULONG)((Offset + Done) & (DAX_CHUNK_SIZE - 1));
+        Count = (ULONG)min(Length - Done, DAX_CHUNK_SIZE - ChunkOffset);
+
+        Chunk = DaxGetChunk(VirtFs, FileContext,
+            (Offset + Done) >> DAX_CHUNK_SHIFT, Write);
+
+        if (Chunk == NULL)
+        {
+            break;
+        }
+
+        Address = Dax->Window + DaxChunkOffset(Dax, Chunk) + ChunkOffset;
+
+        if (Write == TRUE)
+        {
+            CopyMemory(Address, (BYTE *)Buffer + Done, Count);
+        }
+        else
+        {
+            CopyMemory((BYTE *)Buffer + Done, Address, Count);
+        }
+
+        DaxPutChunk(VirtFs, Chunk);
+
+        Done += Count;
+    }
+
+    return Done;
+}
+
+static NTSTATUS VirtFsCreateFile(VIRTFS *VirtFs,
+    VIRTFS_FILE_CONTEXT *FileContext, UINT32 GrantedAccess, CHAR *FileName,
+    UINT64 Parent, UINT32 Mode, UINT64 AllocationSize,
+    FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    NTSTATUS Status;
+    FUSE_CREATE_IN *create_in;
+    FUSE_CREATE_OUT create_out;
+
+    create_in = VirtFsAllocBuffer(sizeof(*create_in));
+
+    if (create_in == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    FUSE_HEADER_INIT(&create_in->hdr, FUSE_CREATE, Parent,
+        sizeof(struct fuse_create_in) + lstrlenA(FileName) + 1);
+
+    create_in->hdr.uid = VirtFs->OwnerUid;
+    create_in->hdr.gid = VirtFs->OwnerGid;
+
+    lstrcpyA(create_in->name, FileName);
+    create_in->create.mode = Mode;
+    create_in->create.umask = 0;
+    create_in->create.flags = AccessToUnixFlags(VirtFs, GrantedAccess) |
+        O_EXCL;
+
+    DBG("create_in->create.flags: 0x%08x", create_in->create.flags);
+    DBG("create_in->create.mode: 0x%08x", create_in->create.mode);
+
+    Status = VirtFsFuseRequest(VirtFs->Device, create_in, create_in->hdr.len,
+        &create_out, sizeof(create_out));
+
+    VirtFsFreeBuffer(create_in, sizeof(*create_in));
+
+    if (NT_SUCCESS(Status))
+    {
+        FileContext->NodeId = create_out.entry.nodeid;
+        FileContext->FileHandle = create_out.open.fh;
+        FileContext->Entry = LookupCacheInsert(VirtFs, Parent, FileName,
+            &create_out.entry);
+
+        if (AllocationSize > 0)
+        {
+            Status = SetFileSize(VirtFs->FileSystem, FileContext,
+                AllocationSize, TRUE, FileInfo);
+        }
+        else
+        {
+            SetFileInfo(&create_out.entry.attr, FileInfo);
+        }
+    }
+
+    return Status;
+}
+
+static NTSTATUS VirtFsCreateDir(VIRTFS *VirtFs,
+    VIRTFS_FILE_CONTEXT *FileContext, CHAR *FileName, UINT64 Parent,
+    UINT32 Mode, FSP_FSCTL_FILE_INFO *FileInfo)
+{
+    NTSTATUS Status;
+    FUSE_MKDIR_IN *mkdir_in;
+    FUSE_MKDIR_OUT mkdir_out;
+
+    mkdir_in = VirtFsAllocBuffer(sizeof(*mkdir_in));
+
+    if (mkdir_in == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    FUSE_HEADER_INIT(&mkdir_in->hdr, FUSE_MKDIR, Parent,
+        sizeof(struct fuse_mkdir_in) + lstrlenA(FileName) + 1);
+
+    mkdir_in->hdr.uid = VirtFs->OwnerUid;
+    mkdir_in->hdr.gid = VirtFs->OwnerGid;
+
+    lstrcpyA(mkdir_in->name, FileName);
+    mkdir_in->mkdir.mode = Mode | 0111; /* ---x--x--x */
+    mkdir_in->mkdir.umask = 0;
+
+    Status = VirtFsFuseRequest(VirtFs->Device, mkdir_in, mkdir_in->hdr.len,
+        &mkdir_out, sizeof(mkdir_out));
+
+    VirtFsFreeBuffer(mkdir_in, sizeof(*mkdir_in));
+
+    if (NT_SUCCESS(Status))
+    {
+        FileContext->NodeId = mkdir_out.entry.nodeid;
+        FileContext->Entry = LookupCacheInsert(VirtFs, Parent, FileName,
+            &mkdir_out.entry);
+        SetFileInfo(&mkdir_out.entry.attr, FileInfo);
+    }
+
+    return Status;
+}
+
+static VOID SubmitDeleteRequest(VIRTFS *VirtFs,
+    VIRTFS_FILE_CONTEXT *FileContext, CHAR *FileName, UINT64 Parent)
+{
+    FUSE_UNLINK_IN *unlink_in;
+    FUSE_UNLINK_OUT unlink_out;
+
+    unlink_in = VirtFsAllocBuffer(sizeof(*unlink_in));
+
+    if (unlink_in != NULL)
+    {
+        FUSE_HEADER_INIT(&unlink_in->hdr,
+            FileContext->IsDirectory ? FUSE_RMDIR : FUSE_UNLINK, Parent,
+            lstrlenA(FileName) + 1);
+
+        lstrcpyA(unlink_in->name, FileName);
+
+        (VOID)VirtFsFuseRequest(VirtFs->Device, unlink_in,
+            unlink_in->hdr.len, &unlink_out, sizeof(unlink_out));
+
+        VirtFsFreeBuffer(unlink_in, sizeof(*unlink_in));
+    }
+
+    // The mappings would keep the host file's data alive.
+    DaxRemoveMappings(VirtFs, FileContext->NodeId, 0);
+
+    LookupCacheRemove(VirtFs, Parent, FileName);
+}
+
+static NTSTATUS SubmitLookupRequest(HANDLE Device, uint64_t parent,
+    char *filename, FUSE_LOOKUP_OUT *LookupOut)
+{
+    NTSTATUS Status;
+    FUSE_LOOKUP_IN *lookup_in;
+
+    lookup_in = VirtFsAllocBuffer(sizeof(*lookup_in));
+
+    if (lookup_in == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    FUSE_HEADER_INIT(&lookup_in->hdr, FUSE_LOOKUP, parent,
+        lstrlenA(filename) + 1);
+
+    lstrcpyA(lookup_in->name, filename);
+
+    Status = VirtFsFuseRequest(Device, lookup_in, lookup_in->hdr.len,
+        LookupOut, sizeof(*LookupOut));
+
+    VirtFsFreeBuffer(lookup_in, sizeof(*lookup_in));
+
+    if (NT_SUCCESS(Status))
+    {
+        struct fuse_attr *attr = &LookupOut->entry.attr;
+
+        DBG("nodeid=%I64u ino=%I64u size=%I64u blocks=%I64u atime=%I64u mtime=%I64u "
+            "ctime=%I64u atimensec=%u mtimensec=%u ctimensec=%u mode=%x "
+            "nlink=%u uid=%u gid=%u rdev=%u blksize=%u",
+            LookupOut->entry.nodeid, attr->ino, attr->size, attr->blocks,
+            attr->atime, attr->mtime, attr->ctime, attr->atimensec,
+            attr->mtimensec, attr->ctimensec, attr->mode, attr->nlink,
+            attr->uid, attr->gid, attr->rdev, attr->blksize);
+    }
+
+    return Status;
+}
+
+static NTSTATUS VirtFsLookupEntry(VIRTFS *VirtFs, uint64_t parent,
+    char *filename, BOOLEAN NeedAttr, PVIRTFS_ENTRY *Entry)
+{
+    NTSTATUS Status;
+    FUSE_LOOKUP_OUT LookupOut;
+
+    *Entry = LookupCacheGet(VirtFs, parent, filename, NeedAttr);
+    if (*Entry != NULL)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    Status = SubmitLookupRequest(VirtFs->Device, parent, filename,
+        &LookupOut);
+
+    if (NT_SUCCESS(Status))
+    {
+        // A zero node id is a negative entry, the name doesn't exist.
+        if (LookupOut.entry.nodeid == 0)
+        {
+            return STATUS_OBJECT_NAME_NOT_FOUND;
+        }
+
+        *Entry = LookupCacheInsert(VirtFs, parent, filename,
+            &LookupOut.entry);
+
+        if (*Entry == NULL)
+        {
+            Status = STATUS_INSUFFICIENT_RESOURCES;
+        }
     }
 
     return Status;
 }
 
-static NTSTATUS PathWalkthough(HANDLE Device, CHAR *FullPath,
+static NTSTATUS PathWalkthough(VIRTFS *VirtFs, CHAR *FullPath,
     CHAR **FileName, UINT64 *Parent)
 {
     NTSTATUS Status = STATUS_SUCCESS;
-    FUSE_LOOKUP_OUT LookupOut;
+    PVIRTFS_ENTRY Entry;
     CHAR *Separator;
 
     *Parent = FUSE_ROOT_ID;
@@ -559,21 +1977,27 @@ static NTSTATUS PathWalkthough(HANDLE Device, CHAR *FullPath,
     {
         *Separator = '\0';
 
-        Status = SubmitLookupRequest(Device, *Parent, *FileName, &LookupOut);
+        Status = VirtFsLookupEntry(VirtFs, *Parent, *FileName, FALSE,
+            &Entry);
+
         if (!NT_SUCCESS(Status))
         {
             break;
         }
 
-        *Parent = LookupOut.entry.nodeid;
+        // The directory was just moved to the tail of the LRU list, so it
+        // stays known to the host while the caller uses its node id.
+        *Parent = Entry->NodeId;
+        LookupCacheRelease(VirtFs, Entry);
+
         *FileName = Separator + 1;
     }
 
     return Status;
 }
 
-static NTSTATUS VirtFsLookupFileName(HANDLE Device, PWSTR FileName,
-    FUSE_LOOKUP_OUT *LookupOut)
+static NTSTATUS VirtFsLookupFileName(VIRTFS *VirtFs, PWSTR FileName,
+    PVIRTFS_ENTRY *Entry)
 {
     NTSTATUS Status;
     char *filename, *fullpath;
@@ -591,10 +2015,10 @@ static NTSTATUS VirtFsLookupFileName(HANDLE Device, PWSTR FileName,
         return Status;
     }
 
-    Status = PathWalkthough(Device, fullpath, &filename, &parent);
+    Status = PathWalkthough(VirtFs, fullpath, &filename, &parent);
     if (NT_SUCCESS(Status))
     {
-        Status = SubmitLookupRequest(Device, parent, filename, LookupOut);
+        Status = VirtFsLookupEntry(VirtFs, parent, filename, TRUE, Entry);
     }
 
     FspPosixDeletePath(fullpath);
@@ -607,7 +2031,7 @@ static NTSTATUS GetFileInfoInternal(VIRTFS *VirtFs,
     PSECURITY_DESCRIPTOR *SecurityDescriptor)
 {
     NTSTATUS Status;
-    FUSE_GETATTR_IN getattr_in;
+    FUSE_GETATTR_IN *getattr_in;
     FUSE_GETATTR_OUT getattr_out;
 
     if ((FileInfo != NULL) && (SecurityDescriptor != NULL))
@@ -615,24 +2039,35 @@ static NTSTATUS GetFileInfoInternal(VIRTFS *VirtFs,
         return STATUS_INVALID_PARAMETER;
     }
 
-    FUSE_HEADER_INIT(&getattr_in.hdr, FUSE_GETATTR, FileContext->NodeId,
-        sizeof(getattr_in.getattr));
+    getattr_in = VirtFsAllocBuffer(sizeof(*getattr_in));
+
+    if (getattr_in == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    FUSE_HEADER_INIT(&getattr_in->hdr, FUSE_GETATTR, FileContext->NodeId,
+        sizeof(getattr_in->getattr));
 
     if (FileContext->FileHandle != INVALID_FILE_HANDLE)
     {
-        getattr_in.getattr.fh = FileContext->FileHandle;
-        getattr_in.getattr.getattr_flags |= FUSE_GETATTR_FH;
+        getattr_in->getattr.fh = FileContext->FileHandle;
+        getattr_in->getattr.getattr_flags |= FUSE_GETATTR_FH;
     }
 
-    getattr_in.getattr.getattr_flags = 0;
+    getattr_in->getattr.getattr_flags = 0;
         
-    Status = VirtFsFuseRequest(VirtFs->Device, &getattr_in,
-        sizeof(getattr_in), &getattr_out, sizeof(getattr_out));
+    Status = VirtFsFuseRequest(VirtFs->Device, getattr_in,
+        sizeof(*getattr_in), &getattr_out, sizeof(getattr_out));
+
+    VirtFsFreeBuffer(getattr_in, sizeof(*getattr_in));
 
     if (NT_SUCCESS(Status))
     {
         struct fuse_attr *attr = &getattr_out.attr.attr;
 
+        LookupCacheUpdateAttr(VirtFs, FileContext->NodeId, &getattr_out.attr);
+
         if (FileInfo != NULL)
         {
             SetFileInfo(attr, FileInfo);
@@ -654,20 +2089,26 @@ static NTSTATUS IsEmptyDirectory(FSP_FILE_SYSTEM *FileSystem,
 {
     VIRTFS *VirtFs = FileSystem->UserContext;
     VIRTFS_FILE_CONTEXT *FileContext = FileContext0;
-    BYTE ReadOutBuf[0x1000];
     struct fuse_dirent *DirEntry;
     NTSTATUS Status = STATUS_SUCCESS;
     UINT32 Entries;
     UINT32 Remains;
     FUSE_READ_IN read_in;
-    FUSE_READ_OUT *read_out = (FUSE_READ_OUT *)ReadOutBuf;
+    FUSE_READ_OUT *read_out;
+
+    read_out = VirtFsAllocBuffer(FUSE_PAGE_SIZE);
+
+    if (read_out == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
     FUSE_HEADER_INIT(&read_in.hdr, FUSE_READDIR, FileContext->NodeId,
         sizeof(read_in.read));
 
     read_in.read.fh = FileContext->FileHandle;
     read_in.read.offset = 0;
-    read_in.read.size = sizeof(ReadOutBuf) - sizeof(struct fuse_out_header);
+    read_in.read.size = FUSE_PAGE_SIZE - sizeof(struct fuse_out_header);
     read_in.read.read_flags = 0;
     read_in.read.lock_owner = 0;
     read_in.read.flags = 0;
@@ -695,17 +2136,57 @@ static NTSTATUS IsEmptyDirectory(FSP_FILE_SYSTEM *FileSystem,
         }
     }
 
+    VirtFsFreeBuffer(read_out, FUSE_PAGE_SIZE);
+
     return Status;
 }
 
+static VOID GetQueueInfo(HANDLE Device, VIRTFS_QUEUE_INFO *QueueInfo)
+{
+    OVERLAPPED Overlapped;
+    DWORD BytesReturned;
+    BOOL Result;
+
+    ZeroMemory(&Overlapped, sizeof(Overlapped));
+    Overlapped.hEvent = GetRequestEvent(0);
+
+    Result = DeviceIoControl(Device, IOCTL_VIRTFS_GET_QUEUE_INFO, NULL, 0,
+        QueueInfo, sizeof(*QueueInfo), NULL, &Overlapped);
+
+    if ((Result == FALSE) && (GetLastError() == ERROR_IO_PENDING))
+    {
+        Result = GetOverlappedResult(Device, &Overlapped, &BytesReturned,
+            TRUE);
+    }
+
+    // An older driver, transfers keep MAX_INFLIGHT_REQUESTS in flight.
+    if (Result == FALSE)
+    {
+        ZeroMemory(QueueInfo, sizeof(*QueueInfo));
+    }
+
+    DBG("QueueSize: %u IndirectDescs: %u", QueueInfo->QueueSize,
+        QueueInfo->IndirectDescs);
+}
+
 static VOID GetVolumeName(HANDLE Device, PWSTR VolumeName,
     DWORD VolumeNameSize)
 {
+    OVERLAPPED Overlapped;
     DWORD BytesReturned;
     BOOL Result;
 
+    ZeroMemory(&Overlapped, sizeof(Overlapped));
+    Overlapped.hEvent = GetRequestEvent(0);
+
     Result = DeviceIoControl(Device, IOCTL_VIRTFS_GET_VOLUME_NAME, NULL, 0,
-        VolumeName, VolumeNameSize, &BytesReturned, NULL);
+        VolumeName, VolumeNameSize, NULL, &Overlapped);
+
+    if ((Result == FALSE) && (GetLastError() == ERROR_IO_PENDING))
+    {
+        Result = GetOverlappedResult(Device, &Overlapped, &BytesReturned,
+            TRUE);
+    }
 
     if (Result == FALSE)
     {
@@ -753,14 +2234,14 @@ static NTSTATUS GetSecurityByName(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
     PSECURITY_DESCRIPTOR Security = NULL;
     DWORD SecuritySize;
     NTSTATUS Status;
-    FUSE_LOOKUP_OUT lookup_out;
+    PVIRTFS_ENTRY Entry;
 
     DBG("\"%S\"", FileName);
 
-    Status = VirtFsLookupFileName(VirtFs->Device, FileName, &lookup_out);
+    Status = VirtFsLookupFileName(VirtFs, FileName, &Entry);
     if (NT_SUCCESS(Status))
     {
-        struct fuse_attr *attr = &lookup_out.entry.attr;
+        struct fuse_attr *attr = &Entry->Attr;
 
         if (lstrcmp(FileName, TEXT("\\")) == 0)
         {
@@ -803,6 +2284,8 @@ static NTSTATUS GetSecurityByName(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
         {
             *PSecurityDescriptorSize = SecuritySize;
         }
+
+        LookupCacheRelease(VirtFs, Entry);
     }
 
     return Status;
@@ -833,7 +2316,7 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
         return Status;
     }
 
-    Status = PathWalkthough(VirtFs->Device, fullpath, &filename, &parent);
+    Status = PathWalkthough(VirtFs, fullpath, &filename, &parent);
     if (!NT_SUCCESS(Status) && (Status != STATUS_OBJECT_NAME_NOT_FOUND))
     {
         FspPosixDeletePath(fullpath);
@@ -872,6 +2355,10 @@ static NTSTATUS Create(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
 
     if (!NT_SUCCESS(Status))
     {
+        if (FileContext->Entry != NULL)
+        {
+            LookupCacheRelease(VirtFs, FileContext->Entry);
+        }
         SafeHeapFree(FileContext);
         return Status;
     }
@@ -888,7 +2375,7 @@ static NTSTATUS Open(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
     VIRTFS *VirtFs = FileSystem->UserContext;
     VIRTFS_FILE_CONTEXT *FileContext;
     NTSTATUS Status;
-    FUSE_LOOKUP_OUT lookup_out;
+    PVIRTFS_ENTRY Entry;
     FUSE_OPEN_IN open_in;
     FUSE_OPEN_OUT open_out;
 
@@ -903,20 +2390,20 @@ static NTSTATUS Open(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    Status = VirtFsLookupFileName(VirtFs->Device, FileName, &lookup_out);
+    Status = VirtFsLookupFileName(VirtFs, FileName, &Entry);
     if (!NT_SUCCESS(Status))
     {
         SafeHeapFree(FileContext);
         return Status;
     }
 
-    FileContext->IsDirectory = !!(lookup_out.entry.attr.mode & S_IFDIR);
+    FileContext->IsDirectory = !!(Entry->Attr.mode & S_IFDIR);
 
     FUSE_HEADER_INIT(&open_in.hdr,
         (FileContext->IsDirectory == TRUE) ? FUSE_OPENDIR : FUSE_OPEN,
-        lookup_out.entry.nodeid, sizeof(open_in.open));
+        Entry->NodeId, sizeof(open_in.open));
 
-    open_in.open.flags = AccessToUnixFlags(GrantedAccess);
+    open_in.open.flags = AccessToUnixFlags(VirtFs, GrantedAccess);
 
     if (FileContext->IsDirectory == TRUE)
     {
@@ -928,16 +2415,18 @@ static NTSTATUS Open(FSP_FILE_SYSTEM *FileSystem, PWSTR FileName,
 
     if (!NT_SUCCESS(Status))
     {
+        LookupCacheRelease(VirtFs, Entry);
         SafeHeapFree(FileContext);
         return Status;
     }
 
-    FileContext->NodeId = lookup_out.entry.nodeid;
+    FileContext->NodeId = Entry->NodeId;
     FileContext->FileHandle = open_out.open.fh;
+    FileContext->Entry = Entry;
     
     DBG("fh: %I64u nodeid: %I64u", FileContext->FileHandle, FileContext->NodeId);
 
-    SetFileInfo(&lookup_out.entry.attr, FileInfo);
+    SetFileInfo(&Entry->Attr, FileInfo);
     
     *PFileContext = FileContext;
 
@@ -1006,50 +2495,82 @@ static VOID Close(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0)
     (VOID)VirtFsFuseRequest(VirtFs->Device, &release_in, sizeof(release_in),
         &release_out, sizeof(release_out));
 
-    FspFileSystemDeleteDirectoryBuffer(&FileContext->DirBuffer);
+    if (FileContext->Entry != NULL)
+    {
+        LookupCacheRelease(VirtFs, FileContext->Entry);
+    }
 
     SafeHeapFree(FileContext);
 }
 
+// Returns the file size, the cached one while it is valid. The host faults
+// accesses to mapped pages past the end of a file, so DAX accesses are
+// limited to it.
+static NTSTATUS VirtFsGetFileSize(VIRTFS *VirtFs,
+    VIRTFS_FILE_CONTEXT *FileContext, UINT64 *FileSize)
+{
+    FSP_FSCTL_FILE_INFO FileInfo;
+    NTSTATUS Status;
+
+    if (LookupCacheGetFileSize(VirtFs, FileContext->Entry, FileSize))
+    {
+        return STATUS_SUCCESS;
+    }
+
+    Status = GetFileInfoInternal(VirtFs, FileContext, &FileInfo, NULL);
+    if (NT_SUCCESS(Status))
+    {
+        *FileSize = FileInfo.FileSize;
+    }
+
+    return Status;
+}
+
 static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
     PVOID Buffer, UINT64 Offset, ULONG Length, PULONG PBytesTransferred)
 {
     VIRTFS *VirtFs = FileSystem->UserContext;
     VIRTFS_FILE_CONTEXT *FileContext = FileContext0;
-    FUSE_READ_IN read_in;
-    FUSE_READ_OUT *read_out;
-    NTSTATUS Status;
+    NTSTATUS Status = STATUS_SUCCESS;
+    UINT64 FileSize;
+    ULONG Done = 0;
 
     DBG("Offset: %I64u Length: %u", Offset, Length);
     DBG("fh: %I64u nodeid: %I64u", FileContext->FileHandle, FileContext->NodeId);
 
     *PBytesTransferred = 0;
 
-    read_out = HeapAlloc(GetProcessHeap(), 0, sizeof(*read_out) + Length);
-    if (read_out == NULL)
+    if (VirtFs->Dax.Window != NULL)
     {
-        return STATUS_INSUFFICIENT_RESOURCES;
-    }
-
-    read_in.read.fh = FileContext->FileHandle;
-    read_in.read.offset = Offset;
-    read_in.read.size = Length;
-    read_in.read.read_flags = 0;
-    read_in.read.lock_owner = 0;
-    read_in.read.flags = 0;
+        Status = VirtFsGetFileSize(VirtFs, FileContext, &FileSize);
+        if (!NT_SUCCESS(Status))
+        {
+            return Status;
+        }
 
-    FUSE_HEADER_INIT(&read_in.hdr, FUSE_READ, FileContext->NodeId, Length);
+        if (Offset >= FileSize)
+        {
+            return STATUS_END_OF_FILE;
+        }
 
-    Status = VirtFsFuseRequest(VirtFs->Device, &read_in, sizeof(read_in),
-        read_out, sizeof(*read_out) + Length);
+        Length = (ULONG)min(Length, FileSize - Offset);
+        Done = DaxTransfer(VirtFs, FileContext, FALSE, Buffer, Offset, Length);
+    }
 
-    if (!NT_SUCCESS(Status))
+    if (Done < Length)
     {
-        SafeHeapFree(read_out);
-        return Status;
+        Status = VirtFsTransferChunks(VirtFs, FileContext, FALSE,
+            (BYTE *)Buffer + Done, Offset + Done, Length - Done,
+            VirtFs->MaxRead, PBytesTransferred);
+
+        if (!NT_SUCCESS(Status) && (Done == 0))
+        {
+            return Status;
+        }
     }
 
-    *PBytesTransferred = read_out->hdr.len - sizeof(struct fuse_out_header);
+    *PBytesTransferred += Done;
+    Status = STATUS_SUCCESS;
 
     // A successful read with no bytes read mean file offset is at or past the
     // end of file.
@@ -1058,18 +2579,28 @@ static NTSTATUS Read(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
         Status = STATUS_END_OF_FILE;
     }
 
-    if (Buffer != NULL)
-    {
-        CopyMemory(Buffer, read_out->buf, *PBytesTransferred);
-    }
-
     DBG("BytesTransferred: %d", *PBytesTransferred);
 
-    SafeHeapFree(read_out);
-
     return Status;
 }
 
+// Cuts the file back to Size if a write that stopped short grew it further.
+static VOID VirtFsTruncateTail(VIRTFS *VirtFs,
+    VIRTFS_FILE_CONTEXT *FileContext, UINT64 Size)
+{
+    FSP_FSCTL_FILE_INFO FileInfo;
+
+    if (NT_SUCCESS(GetFileInfoInternal(VirtFs, FileContext, &FileInfo,
+        NULL)) && (FileInfo.FileSize > Size))
+    {
+        DBG("Truncating %I64u to %I64u after a short write",
+            FileInfo.FileSize, Size);
+
+        (VOID)SetFileSize(VirtFs->FileSystem, FileContext, Size, FALSE,
+            &FileInfo);
+    }
+}
+
 static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
     PVOID Buffer, UINT64 Offset, ULONG Length, BOOLEAN WriteToEndOfFile,
     BOOLEAN ConstrainedIo, PULONG PBytesTransferred,
@@ -1077,10 +2608,10 @@ static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
 {
     VIRTFS *VirtFs = FileSystem->UserContext;
     VIRTFS_FILE_CONTEXT *FileContext = FileContext0;
-    ULONG WriteSize;
     NTSTATUS Status;
-    FUSE_WRITE_IN *write_in;
-    FUSE_WRITE_OUT write_out;
+    UINT64 FileSize, End;
+    BOOLEAN SizeKnown = FALSE;
+    ULONG Done = 0;
 
     DBG("Buffer: %p Offset: %I64u Length: %u WriteToEndOfFile: %d "
         "ConstrainedIo: %d", Buffer, Offset, Length, WriteToEndOfFile,
@@ -1097,6 +2628,12 @@ static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
         }
     }
 
+    if ((WriteToEndOfFile == TRUE) || (ConstrainedIo == TRUE))
+    {
+        FileSize = FileInfo->FileSize;
+        SizeKnown = TRUE;
+    }
+
     if (WriteToEndOfFile == TRUE)
     {
         Offset = FileInfo->FileSize;
@@ -1115,49 +2652,53 @@ static NTSTATUS Write(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
         }
     }
 
-    WriteSize = min(Length, VirtFs->MaxWrite);
+    *PBytesTransferred = 0;
 
-    write_in = HeapAlloc(GetProcessHeap(), 0, sizeof(*write_in) + WriteSize);
-    if (write_in == NULL)
+    // Writes that extend the file go through the request queues, a file
+    // can't grow through its mapping.
+    if ((VirtFs->Dax.Window != NULL) && (SizeKnown == FALSE) &&
+        NT_SUCCESS(VirtFsGetFileSize(VirtFs, FileContext, &FileSize)))
     {
-        return STATUS_INSUFFICIENT_RESOURCES;
+        SizeKnown = TRUE;
     }
 
-    do
+    if ((VirtFs->Dax.Window != NULL) && (SizeKnown == TRUE) &&
+        (Offset + Length <= FileSize))
     {
-        FUSE_HEADER_INIT(&write_in->hdr, FUSE_WRITE, FileContext->NodeId,
-            sizeof(struct fuse_write_in) + WriteSize);
+        Done = DaxTransfer(VirtFs, FileContext, TRUE, Buffer, Offset, Length);
+    }
 
-        write_in->write.fh = FileContext->FileHandle;
-        write_in->write.offset = Offset + *PBytesTransferred;
-        write_in->write.size = WriteSize;
-        write_in->write.write_flags = 0;
-        write_in->write.lock_owner = 0;
-        write_in->write.flags = 0;
+    if (Done < Length)
+    {
+        // Chunks following a short or failed one may have been written and
+        // have grown the file past the data reported written, which is cut
+        // off again below.
+        if ((Length - Done > VirtFs->MaxWrite) && (SizeKnown == FALSE) &&
+            NT_SUCCESS(VirtFsGetFileSize(VirtFs, FileContext, &FileSize)))
+        {
+            SizeKnown = TRUE;
+        }
 
-        CopyMemory(write_in->buf, (BYTE*)Buffer + *PBytesTransferred,
-            WriteSize);
+        Status = VirtFsTransferChunks(VirtFs, FileContext, TRUE,
+            (BYTE *)Buffer + Done, Offset + Done, Length - Done,
+            VirtFs->MaxWrite, PBytesTransferred);
 
-        Status = VirtFsFuseRequest(VirtFs->Device, write_in,
-            write_in->hdr.len, &write_out, sizeof(write_out));
+        End = Offset + Done + *PBytesTransferred;
 
-        if (!NT_SUCCESS(Status))
+        if ((Length - Done > VirtFs->MaxWrite) && (SizeKnown == TRUE) &&
+            (*PBytesTransferred < Length - Done) &&
+            (Offset + Length > FileSize))
         {
-            break;
+            VirtFsTruncateTail(VirtFs, FileContext, max(FileSize, End));
         }
 
-        *PBytesTransferred += write_out.write.size;
-        Length -= write_out.write.size;
-        WriteSize = min(Length, VirtFs->MaxWrite);
+        if (!NT_SUCCESS(Status) && (Done == 0))
+        {
+            return Status;
+        }
     }
-    while (Length > 0);
 
-    SafeHeapFree(write_in);
-
-    if (!NT_SUCCESS(Status))
-    {
-        return Status;
-    }
+    *PBytesTransferred += Done;
 
     return GetFileInfoInternal(VirtFs, FileContext, FileInfo, NULL);
 }
@@ -1210,44 +2751,51 @@ static NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
     VIRTFS *VirtFs = FileSystem->UserContext;
     VIRTFS_FILE_CONTEXT *FileContext = FileContext0;
     NTSTATUS Status;
-    FUSE_SETATTR_IN setattr_in;
+    FUSE_SETATTR_IN *setattr_in;
     FUSE_SETATTR_OUT setattr_out;
 
     DBG("fh: %I64u nodeid: %I64u", FileContext->FileHandle, FileContext->NodeId);
 
-    FUSE_HEADER_INIT(&setattr_in.hdr, FUSE_SETATTR, FileContext->NodeId,
-        sizeof(setattr_in.setattr));
+    setattr_in = VirtFsAllocBuffer(sizeof(*setattr_in));
+
+    if (setattr_in == NULL)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    FUSE_HEADER_INIT(&setattr_in->hdr, FUSE_SETATTR, FileContext->NodeId,
+        sizeof(setattr_in->setattr));
 
-    ZeroMemory(&setattr_in.setattr, sizeof(setattr_in.setattr));
+    ZeroMemory(&setattr_in->setattr, sizeof(setattr_in->setattr));
     
     if ((FileContext->IsDirectory == FALSE) &&
         (FileContext->FileHandle != INVALID_FILE_HANDLE))
     {
-        setattr_in.setattr.valid |= FATTR_FH;
-        setattr_in.setattr.fh = FileContext->FileHandle;
+        setattr_in->setattr.valid |= FATTR_FH;
+        setattr_in->setattr.fh = FileContext->FileHandle;
     }
 
     if (FileAttributes != INVALID_FILE_ATTRIBUTES)
     {
-        setattr_in.setattr.valid |= FATTR_MODE;
-        setattr_in.setattr.mode = 0664 /* -rw-rw-r-- */;
+        setattr_in->setattr.valid |= FATTR_MODE;
+        setattr_in->setattr.mode = 0664 /* -rw-rw-r-- */;
 
         if (!!(FileAttributes & FILE_ATTRIBUTE_READONLY) == TRUE)
         {
-            setattr_in.setattr.mode &= ~0222;
+            setattr_in->setattr.mode &= ~0222;
         }
 
         if (!!(FileAttributes & FILE_ATTRIBUTE_DIRECTORY) == TRUE)
         {
-            setattr_in.setattr.mode |= 040111;
+            setattr_in->setattr.mode |= 040111;
         }
     }
 
     if (LastAccessTime != 0)
     {
-        setattr_in.setattr.valid |= FATTR_ATIME;
-        FileTimeToUnixTime(LastAccessTime, &setattr_in.setattr.atime,
-            &setattr_in.setattr.atimensec);
+        setattr_in->setattr.valid |= FATTR_ATIME;
+        FileTimeToUnixTime(LastAccessTime, &setattr_in->setattr.atime,
+            &setattr_in->setattr.atimensec);
     }
     if ((LastWriteTime != 0) || (ChangeTime != 0))
     {
@@ -1255,19 +2803,21 @@ static NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
         {
             LastWriteTime = ChangeTime;
         }
-        setattr_in.setattr.valid |= FATTR_MTIME;
-        FileTimeToUnixTime(LastWriteTime, &setattr_in.setattr.mtime,
-            &setattr_in.setattr.mtimensec);
+        setattr_in->setattr.valid |= FATTR_MTIME;
+        FileTimeToUnixTime(LastWriteTime, &setattr_in->setattr.mtime,
+            &setattr_in->setattr.mtimensec);
     }
     if (CreationTime != 0)
     {
-        setattr_in.setattr.valid |= FATTR_CTIME;
-        FileTimeToUnixTime(CreationTime, &setattr_in.setattr.ctime,
-            &setattr_in.setattr.ctimensec);
+        setattr_in->setattr.valid |= FATTR_CTIME;
+        FileTimeToUnixTime(CreationTime, &setattr_in->setattr.ctime,
+            &setattr_in->setattr.ctimensec);
     }
 
-    Status = VirtFsFuseRequest(VirtFs->Device, &setattr_in,
-        sizeof(setattr_in), &setattr_out, sizeof(setattr_out));
+    Status = VirtFsFuseRequest(VirtFs->Device, setattr_in,
+        sizeof(*setattr_in), &setattr_out, sizeof(setattr_out));
+
+    VirtFsFreeBuffer(setattr_in, sizeof(*setattr_in));
 
     if (!NT_SUCCESS(Status))
     {
@@ -1302,7 +2852,7 @@ static VOID Cleanup(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
         return;
     }
 
-    Status = PathWalkthough(VirtFs->Device, fullpath, &filename, &parent);
+    Status = PathWalkthough(VirtFs, fullpath, &filename, &parent);
     if (!NT_SUCCESS(Status))
     {
         FspPosixDeletePath(fullpath);
@@ -1311,7 +2861,7 @@ static VOID Cleanup(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
 
     if (Flags & FspCleanupDelete)
     {
-        SubmitDeleteRequest(VirtFs->Device, FileContext, filename, parent);
+        SubmitDeleteRequest(VirtFs, FileContext, filename, parent);
     }
     else
     {
@@ -1386,18 +2936,33 @@ static NTSTATUS SetFileSize(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
     }
     else
     {
-        FUSE_SETATTR_IN setattr_in;
+        FUSE_SETATTR_IN *setattr_in;
         FUSE_SETATTR_OUT setattr_out;
 
-        FUSE_HEADER_INIT(&setattr_in.hdr, FUSE_SETATTR, FileContext->NodeId,
-            sizeof(setattr_in.setattr));
+        setattr_in = VirtFsAllocBuffer(sizeof(*setattr_in));
+
+        if (setattr_in == NULL)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        FUSE_HEADER_INIT(&setattr_in->hdr, FUSE_SETATTR, FileContext->NodeId,
+            sizeof(setattr_in->setattr));
+
+        ZeroMemory(&setattr_in->setattr, sizeof(setattr_in->setattr));
+        setattr_in->setattr.valid = FATTR_SIZE;
+        setattr_in->setattr.size = NewSize;
 
-        ZeroMemory(&setattr_in.setattr, sizeof(setattr_in.setattr));
-        setattr_in.setattr.valid = FATTR_SIZE;
-        setattr_in.setattr.size = NewSize;
+        Status = VirtFsFuseRequest(VirtFs->Device, setattr_in,
+            sizeof(*setattr_in), &setattr_out, sizeof(setattr_out));
 
-        Status = VirtFsFuseRequest(VirtFs->Device, &setattr_in,
-            sizeof(setattr_in), &setattr_out, sizeof(setattr_out));
+        VirtFsFreeBuffer(setattr_in, sizeof(*setattr_in));
+
+        if (NT_SUCCESS(Status))
+        {
+            DaxRemoveMappings(VirtFs, FileContext->NodeId,
+                (NewSize + DAX_CHUNK_SIZE - 1) >> DAX_CHUNK_SHIFT);
+        }
     }
 
     if (!NT_SUCCESS(Status))
@@ -1434,6 +2999,7 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
     NTSTATUS Status;
     char *oldname, *newname, *oldfullpath, *newfullpath;
     int oldname_size, newname_size;
+    SIZE_T rename2_in_size;
     uint64_t oldparent, newparent;
 
     DBG("\"%S\" -> \"%S\" ReplaceIfExist: %d", FileName, NewFileName,
@@ -1455,7 +3021,7 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
         return Status;
     }
 
-    Status = PathWalkthough(VirtFs->Device, oldfullpath, &oldname, &oldparent);
+    Status = PathWalkthough(VirtFs, oldfullpath, &oldname, &oldparent);
     if (!NT_SUCCESS(Status))
     {
         FspPosixDeletePath(oldfullpath);
@@ -1463,7 +3029,7 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
         return Status;
     }
 
-    Status = PathWalkthough(VirtFs->Device, newfullpath, &newname, &newparent);
+    Status = PathWalkthough(VirtFs, newfullpath, &newname, &newparent);
     if (!NT_SUCCESS(Status))
     {
         FspPosixDeletePath(oldfullpath);
@@ -1477,8 +3043,8 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
     DBG("old: %s (%d) new: %s (%d)", oldname, oldname_size, newname,
         newname_size);
 
-    rename2_in = HeapAlloc(GetProcessHeap(), 0, sizeof(*rename2_in) +
-        oldname_size + newname_size);
+    rename2_in_size = sizeof(*rename2_in) + oldname_size + newname_size;
+    rename2_in = VirtFsAllocBuffer(rename2_in_size);
 
     if (rename2_in == NULL)
     {
@@ -1506,6 +3072,9 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
     Status = VirtFsFuseRequest(VirtFs->Device, rename2_in,
         rename2_in->hdr.len, &rename_out, sizeof(rename_out));
 
+    LookupCacheRemove(VirtFs, oldparent, rename2_in->names);
+    LookupCacheRemove(VirtFs, newparent, rename2_in->names + oldname_size);
+
     // Fix to expected error when renaming a directory to existing directory.
     if ((FileContext->IsDirectory == TRUE) && (ReplaceIfExists == TRUE) &&
         (Status == STATUS_OBJECT_NAME_COLLISION))
@@ -1513,7 +3082,7 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
         Status = STATUS_ACCESS_DENIED;
     }
 
-    SafeHeapFree(rename2_in);
+    VirtFsFreeBuffer(rename2_in, rename2_in_size);
 
     return Status;
 }
@@ -1609,23 +3178,69 @@ static NTSTATUS SetSecurity(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
 
     if (Mode != NewMode)
     {
-        FUSE_SETATTR_IN setattr_in;
+        FUSE_SETATTR_IN *setattr_in;
         FUSE_SETATTR_OUT setattr_out;
 
-        FUSE_HEADER_INIT(&setattr_in.hdr, FUSE_SETATTR, FileContext->NodeId,
-            sizeof(setattr_in.setattr));
+        setattr_in = VirtFsAllocBuffer(sizeof(*setattr_in));
+
+        if (setattr_in == NULL)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        FUSE_HEADER_INIT(&setattr_in->hdr, FUSE_SETATTR, FileContext->NodeId,
+            sizeof(setattr_in->setattr));
+
+        ZeroMemory(&setattr_in->setattr, sizeof(setattr_in->setattr));
+        setattr_in->setattr.valid = FATTR_MODE;
+        setattr_in->setattr.mode = NewMode;
 
-        ZeroMemory(&setattr_in.setattr, sizeof(setattr_in.setattr));
-        setattr_in.setattr.valid = FATTR_MODE;
-        setattr_in.setattr.mode = NewMode;
+        Status = VirtFsFuseRequest(VirtFs->Device, setattr_in,
+            sizeof(*setattr_in), &setattr_out, sizeof(setattr_out));
 
-        Status = VirtFsFuseRequest(VirtFs->Device, &setattr_in,
-            sizeof(setattr_in), &setattr_out, sizeof(setattr_out));
+        VirtFsFreeBuffer(setattr_in, sizeof(*setattr_in));
+
+        LookupCacheUpdateAttr(VirtFs, FileContext->NodeId,
+            NT_SUCCESS(Status) ? &setattr_out.attr : NULL);
     }
 
     return Status;
 }
 
+// The host took a lookup of every READDIRPLUS entry but "." and ".." and
+// the ones without a node id, the cache gives it back once the entry is
+// evicted. Lookups to give back are collected in Forgets, the caller sends
+// them once for the whole reply.
+static VOID LookupCacheInsertDirEntry(VIRTFS *VirtFs, uint64_t Parent,
+    struct fuse_direntplus *DirEntryPlus, VIRTFS_FORGET_LIST *Forgets)
+{
+    struct fuse_dirent *dirent = &DirEntryPlus->dirent;
+    char Name[FUSE_NAME_MAX + 1];
+
+    if ((DirEntryPlus->entry_out.nodeid == 0) ||
+        ((dirent->namelen == 1) && (dirent->name[0] == '.')) ||
+        ((dirent->namelen == 2) && (dirent->name[0] == '.') &&
+            (dirent->name[1] == '.')))
+    {
+        return;
+    }
+
+    if (dirent->namelen > FUSE_NAME_MAX)
+    {
+        ForgetListAdd(VirtFs, Forgets, DirEntryPlus->entry_out.nodeid, 1);
+        return;
+    }
+
+    CopyMemory(Name, dirent->name, dirent->namelen);
+    Name[dirent->namelen] = '\0';
+
+    (VOID)LookupCacheInsertLookup(VirtFs, Parent, Name,
+        &DirEntryPlus->entry_out, TRUE, Forgets);
+}
+
+// Directories are enumerated straight from the host. The marker is the
+// FUSE offset of the next entry (DirectoryMarkerAsNextOffset) and only as
+// many READDIRPLUS replies are requested as fit into the caller's buffer.
 static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
     PWSTR Pattern, PWSTR Marker, PVOID Buffer, ULONG BufferLength,
     PULONG PBytesTransferred)
@@ -1636,115 +3251,122 @@ static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM *FileSystem, PVOID FileContext0,
     FSP_FSCTL_DIR_INFO *DirInfo = (FSP_FSCTL_DIR_INFO *)DirInfoBuf;
     struct fuse_direntplus *DirEntryPlus;
     NTSTATUS Status = STATUS_SUCCESS;
-    UINT64 Offset = 0;
-    UINT32 Remains;
-    BOOLEAN Result;
+    UINT64 Offset;
+    UINT32 Remains, Size;
+    BOOLEAN Full = FALSE;
     int FileNameLength;
     FUSE_READ_IN read_in;
     FUSE_READ_OUT *read_out;
+    VIRTFS_FORGET_LIST Forgets;
 
-    DBG("Pattern: %S Marker: %S BufferLength: %u",
-        Pattern ? Pattern : TEXT("(null)"), Marker ? Marker : TEXT("(null)"),
+    DBG("Pattern: %S Marker: %I64u BufferLength: %u",
+        Pattern ? Pattern : TEXT("(null)"), Marker ? *(PUINT64)Marker : 0,
         BufferLength);
 
-    Result = FspFileSystemAcquireDirectoryBuffer(&FileContext->DirBuffer,
-        Marker == NULL, &Status);
+    Offset = (Marker != NULL) ? *(PUINT64)Marker : 0;
+    *PBytesTransferred = 0;
+    Forgets.Count = 0;
+
+    // FUSE entries are about half as large again as the directory info
+    // built from them.
+    Size = min(VirtFs->MaxRead, max(FUSE_PAGE_SIZE, BufferLength / 2 * 3));
 
-    if (Result == TRUE)
+    read_out = VirtFsAllocBuffer(sizeof(struct fuse_out_header) + Size);
+
+    if (read_out == NULL)
     {
-        read_out = HeapAlloc(GetProcessHeap(), 0,
-            sizeof(struct fuse_out_header) + BufferLength * 2);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-        if (read_out != NULL)
-        {
-            for (;;)
-            {
-                FUSE_HEADER_INIT(&read_in.hdr, FUSE_READDIRPLUS,
-                    FileContext->NodeId, sizeof(read_in.read));
+    while (Full == FALSE)
+    {
+        FUSE_HEADER_INIT(&read_in.hdr, FUSE_READDIRPLUS, FileContext->NodeId,
+            sizeof(read_in.read));
 
-                read_in.read.fh = FileContext->FileHandle;
-                read_in.read.offset = Offset;
-                read_in.read.size = BufferLength * 2;
-                read_in.read.read_flags = 0;
-                read_in.read.lock_owner = 0;
-                read_in.read.flags = 0;
+        read_in.read.fh = FileContext->FileHandle;
+        read_in.read.offset = Offset;
+        read_in.read.size = Size;
+        read_in.read.read_flags = 0;
+        read_in.read.lock_owner = 0;
+        read_in.read.flags = 0;
 
-                Status = VirtFsFuseRequest(VirtFs->Device, &read_in,
-                    sizeof(read_in), read_out,
-                    sizeof(struct fuse_out_header) + read_in.read.size);
+        Status = VirtFsFuseRequest(VirtFs->Device, &read_in, sizeof(read_in),
+            read_out, sizeof(struct fuse_out_header) + read_in.read.size);
 
-                if (!NT_SUCCESS(Status))
-                {
-                    break;
-                }
+        if (!NT_SUCCESS(Status))
+        {
+            break;
+        }
 
-                Remains = read_out->hdr.len - sizeof(struct fuse_out_header);
-                if (Remains == 0)
-                {
-                    // A successful request with no data means no more
-                    // entries.
-                    break;
-                }
+        Remains = read_out->hdr.len - sizeof(struct fuse_out_header);
+        if (Remains == 0)
+        {
+            // A successful request with no data means no more entries.
+            FspFileSystemAddDirInfo(NULL, Buffer, BufferLength,
+                PBytesTransferred);
+            break;
+        }
 
-                DirEntryPlus = (struct fuse_direntplus *)read_out->buf;
+        DirEntryPlus = (struct fuse_direntplus *)read_out->buf;
 
-                while (Remains > sizeof(struct fuse_direntplus))
-                {
-                    DBG("ino=%I64u off=%I64u namelen=%u type=%u name=%s",
-                        DirEntryPlus->dirent.ino, DirEntryPlus->dirent.off,
-                        DirEntryPlus->dirent.namelen,
-                        DirEntryPlus->dirent.type, DirEntryPlus->dirent.name);
+        // Entries which don't fit anymore are returned again by the next
+        // call, but every entry of the reply has to be accounted.
+        while (Remains > sizeof(struct fuse_direntplus))
+        {
+            DBG("ino=%I64u off=%I64u namelen=%u type=%u name=%s",
+                DirEntryPlus->dirent.ino, DirEntryPlus->dirent.off,
+                DirEntryPlus->dirent.namelen,
+                DirEntryPlus->dirent.type, DirEntryPlus->dirent.name);
 
-                    ZeroMemory(DirInfoBuf, sizeof(DirInfoBuf));
+            LookupCacheInsertDirEntry(VirtFs, FileContext->NodeId,
+                DirEntryPlus, &Forgets);
 
-                    // Not using FspPosixMapPosixToWindowsPath so we can do
-                    // the conversion in-place.
-                    FileNameLength = MultiByteToWideChar(CP_UTF8, 0,
-                        DirEntryPlus->dirent.name,
-                        DirEntryPlus->dirent.namelen, DirInfo->FileNameBuf,
-                        MAX_PATH);
+            if (Full == FALSE)
+            {
+                ZeroMemory(DirInfoBuf, sizeof(DirInfoBuf));
 
-                    DBG("\"%S\" (%d)", DirInfo->FileNameBuf, FileNameLength);
+                // Not using FspPosixMapPosixToWindowsPath so we can do the
+                // conversion in-place.
+                FileNameLength = MultiByteToWideChar(CP_UTF8, 0,
+                    DirEntryPlus->dirent.name, DirEntryPlus->dirent.namelen,
+                    DirInfo->FileNameBuf, MAX_PATH);
 
-                    if (FileNameLength > 0)
-                    {
-                        DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) +
-                            FileNameLength * sizeof(WCHAR));
+                DBG("\"%S\" (%d)", DirInfo->FileNameBuf, FileNameLength);
 
-                        SetFileInfo(&DirEntryPlus->entry_out.attr,
-                            &DirInfo->FileInfo);
+                if (FileNameLength > 0)
+                {
+                    DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) +
+                        FileNameLength * sizeof(WCHAR));
+                    DirInfo->NextOffset = DirEntryPlus->dirent.off;
 
-                        Result = FspFileSystemFillDirectoryBuffer(
-                            &FileContext->DirBuffer, DirInfo, &Status);
+                    SetFileInfo(&DirEntryPlus->entry_out.attr,
+                        &DirInfo->FileInfo);
 
-                        if (Result == FALSE)
-                        {
-                            break;
-                        }
-                    }
+                    Full = !FspFileSystemAddDirInfo(DirInfo, Buffer,
+                        BufferLength, PBytesTransferred);
+                }
 
+                if (Full == FALSE)
+                {
                     Offset = DirEntryPlus->dirent.off;
-                    Remains -= FUSE_DIRENTPLUS_SIZE(DirEntryPlus);
-                    DirEntryPlus = (struct fuse_direntplus *)(
-                        (PBYTE)DirEntryPlus +
-                        FUSE_DIRENTPLUS_SIZE(DirEntryPlus));
                 }
             }
 
-            SafeHeapFree(read_out);
-        }
-        else
-        {
-            Status = STATUS_INSUFFICIENT_RESOURCES;
+            Remains -= FUSE_DIRENTPLUS_SIZE(DirEntryPlus);
+            DirEntryPlus = (struct fuse_direntplus *)(
+                (PBYTE)DirEntryPlus + FUSE_DIRENTPLUS_SIZE(DirEntryPlus));
         }
 
-        FspFileSystemReleaseDirectoryBuffer(&FileContext->DirBuffer);
+        // One BATCH_FORGET for the entries the reply pushed out of the cache.
+        SubmitForgetRequests(VirtFs, &Forgets);
     }
 
-    if (NT_SUCCESS(Status))
+    VirtFsFreeBuffer(read_out, sizeof(struct fuse_out_header) + Size);
+
+    // Entries already returned are not lost by a failure to read more.
+    if (*PBytesTransferred > 0)
     {
-        FspFileSystemReadDirectoryBuffer(&FileContext->DirBuffer, Marker,
-            Buffer, BufferLength, PBytesTransferred);
+        Status = STATUS_SUCCESS;
     }
 
     return Status;
@@ -1779,6 +3401,49 @@ static ULONG wcstol_deflt(wchar_t *w, ULONG deflt)
     return L'\0' != w[0] && L'\0' == *endp ? ul : deflt;
 }
 
+static UINT32 GetFileInfoTimeout(VIRTFS *VirtFs)
+{
+    NTSTATUS Status;
+    FUSE_GETATTR_IN getattr_in;
+    FUSE_GETATTR_OUT getattr_out;
+    UINT64 Timeout;
+
+    if (VirtFs->CachePolicy == CachePolicyNone)
+    {
+        return 0;
+    }
+
+    // WinFsp has a single FileInfo timeout per volume, use the one the host
+    // reports for the root so that the guest caches metadata as long as the
+    // host allows (e.g. 0 for cache=never, 1s for cache=auto).
+    FUSE_HEADER_INIT(&getattr_in.hdr, FUSE_GETATTR, FUSE_ROOT_ID,
+        sizeof(getattr_in.getattr));
+
+    getattr_in.getattr.getattr_flags = 0;
+    getattr_in.getattr.dummy = 0;
+    getattr_in.getattr.fh = 0;
+
+    Status = VirtFsFuseRequest(VirtFs->Device, &getattr_in,
+        sizeof(getattr_in), &getattr_out, sizeof(getattr_out));
+
+    if (!NT_SUCCESS(Status))
+    {
+        return DEFAULT_FILE_INFO_TIMEOUT;
+    }
+
+    // Hosts use very large timeouts to mean "forever", INFINITE is the
+    // WinFsp equivalent.
+    if (getattr_out.attr.attr_valid >= INFINITE / 1000)
+    {
+        return INFINITE;
+    }
+
+    Timeout = getattr_out.attr.attr_valid * 1000 +
+        getattr_out.attr.attr_valid_nsec / 1000000;
+
+    return (Timeout < INFINITE) ? (UINT32)Timeout : INFINITE;
+}
+
 static NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
 {
 #define argtos(v) if (arge > ++argp) v = *argp; else goto usage
@@ -1791,6 +3456,8 @@ static NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
     ULONG DebugFlags = 0;
     HANDLE DebugLogHandle = INVALID_HANDLE_VALUE;
     PWSTR MountPoint = TEXT("*");
+    PWSTR CachePolicyName = TEXT("metadata");
+    VIRTFS_CACHE_POLICY CachePolicy;
     VIRTFS *VirtFs;
     DWORD SessionId;
     FILETIME FileTime;
@@ -1809,6 +3476,9 @@ static NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         {
             case L'?':
                 goto usage;
+            case L'c':
+                argtos(CachePolicyName);
+                break;
             case L'd':
                 argtol(DebugFlags);
                 break;
@@ -1828,6 +3498,23 @@ static NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         goto usage;
     }
 
+    if (lstrcmpi(CachePolicyName, TEXT("none")) == 0)
+    {
+        CachePolicy = CachePolicyNone;
+    }
+    else if (lstrcmpi(CachePolicyName, TEXT("metadata")) == 0)
+    {
+        CachePolicy = CachePolicyMetadata;
+    }
+    else if (lstrcmpi(CachePolicyName, TEXT("full")) == 0)
+    {
+        CachePolicy = CachePolicyFull;
+    }
+    else
+    {
+        goto usage;
+    }
+
     if (DebugLogFile != 0)
     {
         if (0 == wcscmp(L"-", DebugLogFile))
@@ -1857,6 +3544,10 @@ static NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    LookupCacheInitialize(VirtFs);
+    DaxInitialize(VirtFs);
+    VirtFs->CachePolicy = CachePolicy;
+
     Status = FindDeviceInterface(&VirtFs->Device);
     if (!NT_SUCCESS(Status))
     {
@@ -1870,7 +3561,19 @@ static NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
     init_in.init.major = FUSE_KERNEL_VERSION;
     init_in.init.minor = FUSE_KERNEL_MINOR_VERSION;
     init_in.init.max_readahead = 0;
-    init_in.init.flags = FUSE_DO_READDIRPLUS;
+    // Large reads are split into requests that are in flight together.
+    init_in.init.flags = FUSE_DO_READDIRPLUS | FUSE_MAX_PAGES |
+        FUSE_ASYNC_READ | FUSE_MAP_ALIGNMENT;
+
+    if (CachePolicy != CachePolicyNone)
+    {
+        init_in.init.max_readahead = FUSE_MAX_READAHEAD;
+    }
+
+    if (CachePolicy == CachePolicyFull)
+    {
+        init_in.init.flags |= FUSE_WRITEBACK_CACHE;
+    }
 
     Status = VirtFsFuseRequest(VirtFs->Device, &init_in, sizeof(init_in),
         &init_out, sizeof(init_out));
@@ -1883,6 +3586,23 @@ static NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
 
     VirtFs->MaxWrite = init_out.init.max_write;
 
+    if ((init_out.init.flags & FUSE_MAX_PAGES) &&
+        (init_out.init.max_pages > 0))
+    {
+        VirtFs->MaxRead = init_out.init.max_pages * FUSE_PAGE_SIZE;
+    }
+    else
+    {
+        VirtFs->MaxRead = VirtFs->MaxWrite;
+    }
+
+    VirtFs->WritebackCache =
+        ((init_out.init.flags & FUSE_WRITEBACK_CACHE) != 0);
+
+    GetQueueInfo(VirtFs->Device, &VirtFs->QueueInfo);
+
+    DaxMapWindow(VirtFs, &init_out.init);
+
     SessionId = WTSGetActiveConsoleSessionId();
     if (SessionId != 0xFFFFFFFF)
     {
@@ -1897,16 +3617,17 @@ static NTSTATUS SvcStart(FSP_SERVICE *Service, ULONG argc, PWSTR *argv)
     VolumeParams.SectorsPerAllocationUnit = 1;
     VolumeParams.VolumeCreationTime = ((PLARGE_INTEGER)&FileTime)->QuadPart;
 //    VolumeParams.VolumeSerialNumber = 0;
-    VolumeParams.FileInfoTimeout = 1000;
+    VolumeParams.FileInfoTimeout = GetFileInfoTimeout(VirtFs);
     VolumeParams.CaseSensitiveSearch = 1;
     VolumeParams.CasePreservedNames = 1;
     VolumeParams.UnicodeOnDisk = 1;
     VolumeParams.PersistentAcls = 1;
     VolumeParams.PostCleanupWhenModifiedOnly = 1;
 //    VolumeParams.PassQueryDirectoryPattern = 1;
-    VolumeParams.FlushAndPurgeOnCleanup = 1;
+    VolumeParams.FlushAndPurgeOnCleanup =
+        (CachePolicy != CachePolicyFull) ? 1 : 0;
     VolumeParams.UmFileContextIsUserContext2 = 1;
-//    VolumeParams.DirectoryMarkerAsNextOffset = 1;
+    VolumeParams.DirectoryMarkerAsNextOffset = 1;
     wcscpy_s(VolumeParams.FileSystemName,
         sizeof(VolumeParams.FileSystemName) / sizeof(WCHAR), FS_SERVICE_NAME);
 
@@ -1948,6 +3669,7 @@ usage:
         "Usage: %s OPTIONS\n"
         "\n"
         "options:\n"
+        "    -c CachePolicy      [none|metadata|full (default: metadata)]\n"
         "    -d DebugFlags       [-1: enable all debug logs]\n"
         "    -D DebugLogFile     [file path; use - for stderr]\n"
         "    -m MountPoint       [X:|* (required if no UNC prefix)]\n";
@@ -2010,6 +3732,9 @@ int wmain(int argc, wchar_t **argv)
         return ERROR_DELAY_LOAD_FAILED;
     }
 
+    // Without the slot, request buffers simply aren't pooled.
+    BufferPoolIndex = FlsAlloc(BufferPoolDrain);
+
     Result = FspServiceCreate(FS_SERVICE_NAME, SvcStart, SvcStop, SvcControl,
         &Service);
 
@@ -2026,6 +3751,12 @@ int wmain(int argc, wchar_t **argv)
     ExitCode = FspServiceGetExitCode(Service);
     FspServiceDelete(Service);
 
+    // Drains the pools of the threads still alive.
+    if (BufferPoolIndex != FLS_OUT_OF_INDEXES)
+    {
+        FlsFree(BufferPoolIndex);
+    }
+
     if (!NT_SUCCESS(Result))
     {
         FspServiceLog(EVENTLOG_ERROR_TYPE,
@@ -40,6 +40,102 @@
                       pa = va ? StorPortGetPhysicalAddress(DeviceExtension, NULL, va, &len).QuadPart : 0; \
                     }
 
+/* Publishes srbExt to the pending ring of a request queue, may be called on any CPU.
+ * Returns FALSE if the ring is full or was not allocated.
+ */
+static BOOLEAN
+PendingRingPush(
+    IN PREQUEST_LIST element,
+    IN PSRB_EXTENSION srbExt
+    )
+{
+    PPENDING_SLOT slot;
+    LONG head;
+
+    if (element->ring == NULL) {
+        return FALSE;
+    }
+    for (;;) {
+        LONG diff;
+
+        head = element->producer_head;
+        slot = &element->ring[head & (PENDING_RING_SIZE - 1)];
+        diff = slot->seq - head;
+        /* the slot still holds a request of the previous lap */
+        if (diff < 0) {
+            return FALSE;
+        }
+        if (diff == 0 &&
+            InterlockedCompareExchange(&element->producer_head, head + 1, head) == head) {
+            break;
+        }
+    }
+
+    slot->srbExt = srbExt;
+    /* publish the slot only after its request */
+    InterlockedExchange(&slot->seq, head + 1);
+    return TRUE;
+}
+
+/* Moves up to max published requests off the pending ring into batch, returns
+ * the number moved. Caller must hold the virtqueue lock.
+ */
+static ULONG
+PendingRingPop(
+    IN PREQUEST_LIST element,
+    OUT PSRB_EXTENSION *batch,
+    IN ULONG max
+    )
+{
+    LONG tail = element->consumer;
+    ULONG i;
+
+    if (element->ring == NULL) {
+        return 0;
+    }
+    for (i = 0; i < max; i++) {
+        PPENDING_SLOT slot = &element->ring[(tail + i) & (PENDING_RING_SIZE - 1)];
+
+        /* a submitter which reserved this slot has not published it yet, it
+         * finds the ring not empty afterwards and drains it itself */
+        if (slot->seq != tail + (LONG)i + 1) {
+            break;
+        }
+        /* read the request only after seq */
+        KeMemoryBarrier();
+        batch[i] = slot->srbExt;
+        /* hand the slot over to the next lap only after it has been read */
+        InterlockedExchange(&slot->seq, tail + (LONG)i + PENDING_RING_SIZE);
+    }
+    if (i > 0) {
+        InterlockedExchange(&element->consumer, tail + (LONG)i);
+    }
+    return i;
+}
+
+/* Pulls the next batch of pending requests, the ones already returned to srb_list
+ * first so that requests bounced by a full virtqueue keep their place.
+ * Caller must hold the virtqueue lock.
+ */
+static ULONG
+PendingListPop(
+    IN PREQUEST_LIST element,
+    OUT PSRB_EXTENSION *batch,
+    IN ULONG max
+    )
+{
+    ULONG num = 0;
+
+    while (num < max && !IsListEmpty(&element->srb_list)) {
+        PSRB_EXTENSION srbExt = (PSRB_EXTENSION)ExInterlockedRemoveHeadList(&element->srb_list, &element->srb_list_lock);
+        if (srbExt == NULL) {
+            break;
+        }
+        batch[num++] = srbExt;
+    }
+    return num + PendingRingPop(element, &batch[num], max - num);
+}
+
 VOID
 SendSRB(
     IN PVOID DeviceExtension,
@@ -58,6 +154,8 @@ SendSRB(
     STOR_LOCK_HANDLE    LockHandle = { 0 };
     ULONG               status = STOR_STATUS_SUCCESS;
     PREQUEST_LIST       element = NULL;
+    PSRB_EXTENSION      batch[MAX_SUBMIT_BATCH];
+    struct virtqueue_buf bufs[MAX_SUBMIT_BATCH];
 
 ENTER_FN_SRB();
 
@@ -85,7 +183,9 @@ ENTER_FN_SRB();
         srbExt = SRB_EXTENSION(Srb);
         srbExt->vq_num = QueueNumber;
         element = &adaptExt->pending_list[QueueNumber - VIRTIO_SCSI_REQUEST_QUEUE_0];
-        ExInterlockedInsertTailList(&element->srb_list, &srbExt->list_entry, &element->srb_list_lock);
+        if (!PendingRingPush(element, srbExt)) {
+            ExInterlockedInsertTailList(&element->srb_list, &srbExt->list_entry, &element->srb_list_lock);
+        }
 #endif // USE_CPU_TO_VQ_MAP
     }
     else {
@@ -93,34 +193,56 @@ ENTER_FN_SRB();
         element = &adaptExt->pending_list[QueueNumber - VIRTIO_SCSI_REQUEST_QUEUE_0];
     }
 
-    srbExt = (PSRB_EXTENSION)ExInterlockedRemoveHeadList(&element->srb_list, &element->srb_list_lock);
-
-    if (!srbExt) {
-        RhelDbgPrint(TRACE_LEVEL_INFORMATION, " No SRB Ext after ExInterlockedRemoveHeadList QueueNumber (%d) \n", QueueNumber);
+    /* Unlocked peek: a submitter checks only after publishing its own request, and the
+     * consumer never moves past a slot not published yet, so an empty queue here means
+     * that request has already been taken by the lock holder */
+    if (element->producer_head == element->consumer && IsListEmpty(&element->srb_list)) {
+        RhelDbgPrint(TRACE_LEVEL_INFORMATION, " No pending SRB QueueNumber (%d) \n", QueueNumber);
         return;
     }
 
-    RhelDbgPrint(TRACE_LEVEL_INFORMATION, " ExInterlockedRemoveHeadList SRB %p srbExt %p, QueueNumber %d vq_num %d.\n", srbExt->Srb, srbExt, QueueNumber, srbExt->vq_num);
-
     MessageID = QUEUE_TO_MESSAGE(QueueNumber);
 
     VioScsiVQLock(DeviceExtension, MessageID, &LockHandle, isr);
 
-    while (srbExt) {
-        RhelDbgPrint(TRACE_LEVEL_INFORMATION, " add packet to queue (%d) SRB = %p isr = %d.\n", QueueNumber, srbExt->Srb, isr);
-        SET_VA_PA();
-        if (virtqueue_add_buf(adaptExt->vq[QueueNumber],
-                         srbExt->psgl,
-                         srbExt->out, srbExt->in,
-                         &srbExt->cmd, va, pa) >= 0){
-            notify  = virtqueue_kick_prepare(adaptExt->vq[QueueNumber]) ? TRUE : notify;
-            srbExt = (PSRB_EXTENSION)ExInterlockedRemoveHeadList(&element->srb_list, &element->srb_list_lock);
+    for (;;) {
+        ULONG num;
+        ULONG added;
+        ULONG i;
+
+        /* Collect pending requests and publish them to the device in one go */
+        num = PendingListPop(element, batch, MAX_SUBMIT_BATCH);
+        if (num == 0) {
+            break;
         }
-        else {
-            RhelDbgPrint(TRACE_LEVEL_FATAL, " can not add packet to queue (%d) SRB = %p .\n", QueueNumber, srbExt->Srb);
-            ExInterlockedInsertHeadList(&element->srb_list, &srbExt->list_entry, &element->srb_list_lock);
+        for (i = 0; i < num; i++) {
+            srbExt = batch[i];
+            RhelDbgPrint(TRACE_LEVEL_INFORMATION, " add packet to queue (%d) SRB = %p isr = %d.\n", QueueNumber, srbExt->Srb, isr);
+            SET_VA_PA();
+            bufs[i].sg = srbExt->psgl;
+            bufs[i].out_num = srbExt->out;
+            bufs[i].in_num = srbExt->in;
+            bufs[i].opaque = &srbExt->cmd;
+            bufs[i].va_indirect = va;
+            bufs[i].phys_indirect = pa;
+        }
+
+        added = (ULONG)virtqueue_add_bufs(adaptExt->vq[QueueNumber], bufs, num);
+        if (added > 0) {
+            notify = virtqueue_kick_prepare(adaptExt->vq[QueueNumber]) ? TRUE : notify;
+        }
+        if (added < num) {
+            RhelDbgPrint(TRACE_LEVEL_FATAL, " can not add packet to queue (%d) SRB = %p .\n", QueueNumber, batch[added]->Srb);
+            /* Return the requests which did not fit, keeping their order */
+            while (num > added) {
+                num--;
+                ExInterlockedInsertHeadList(&element->srb_list, &batch[num]->list_entry, &element->srb_list_lock);
+            }
             notify = TRUE;
-            srbExt = NULL;
+            break;
+        }
+        if (num < MAX_SUBMIT_BATCH) {
+            break;
         }
     }
 
@@ -129,6 +251,10 @@ ENTER_FN_SRB();
     if (notify) {
         virtqueue_notify(adaptExt->vq[QueueNumber]);
     }
+
+    if (Srb && !isr && adaptExt->poll_budget) {
+        PollQueue(DeviceExtension, MessageID);
+    }
 #ifdef USE_WORK_ITEM
 #if (NTDDI_VERSION > NTDDI_WIN7)
     if (adaptExt->num_queues > 1) {
@@ -314,6 +440,9 @@ ENTER_FN();
         if (CHECKBIT(adaptExt->features, VIRTIO_F_RING_PACKED)) {
             guestFeatures |= (1ULL << VIRTIO_F_RING_PACKED);
         }
+        if (CHECKBIT(adaptExt->features, VIRTIO_F_IN_ORDER)) {
+            guestFeatures |= (1ULL << VIRTIO_F_IN_ORDER);
+        }
     }
     if (CHECKBIT(adaptExt->features, VIRTIO_F_ANY_LAYOUT)) {
         guestFeatures |= (1ULL << VIRTIO_F_ANY_LAYOUT);
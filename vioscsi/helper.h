@@ -201,6 +201,12 @@ ProcessQueue(
     IN BOOLEAN isr
     );
 
+VOID
+PollQueue(
+    IN PVOID DeviceExtension,
+    IN ULONG MessageID
+    );
+
 VOID
 //FORCEINLINE
 VioScsiVQLock(
@@ -339,6 +339,81 @@ BOOLEAN VioScsiReadRegistry(
 }
 #endif
 
+/* Unlike PhysicalBreaks, PollBudget is honoured on Windows 7 as well */
+VOID VioScsiReadPollBudget(
+    IN PVOID DeviceExtension
+)
+{
+    ULONG Len = sizeof(ULONG);
+    UCHAR* pBuf = NULL;
+    PADAPTER_EXTENSION adaptExt;
+    ULONG budget = 0;
+
+    adaptExt = (PADAPTER_EXTENSION)DeviceExtension;
+    adaptExt->poll_budget = 0;
+    pBuf = StorPortAllocateRegistryBuffer(DeviceExtension, &Len);
+    if (pBuf == NULL) {
+        RhelDbgPrint(TRACE_LEVEL_FATAL, "StorPortAllocateRegistryBuffer failed to allocate buffer\n");
+        return;
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (StorPortRegistryRead(DeviceExtension,
+                             POLL_BUDGET,
+                             1,
+                             MINIPORT_REG_DWORD,
+                             pBuf,
+                             &Len) && Len != 0) {
+        StorPortCopyMemory((PVOID)(&budget),
+               (PVOID)pBuf,
+               sizeof(ULONG));
+        /* 0 disables polling, 1 selects the default budget */
+        if (budget == 1) {
+            budget = POLL_BUDGET_DEFAULT;
+        }
+        adaptExt->poll_budget = min(budget, POLL_BUDGET_MAX);
+    }
+
+    StorPortFreeRegistryBuffer(DeviceExtension, pBuf);
+    RhelDbgPrint(TRACE_LEVEL_INFORMATION, " poll budget %d us\n", adaptExt->poll_budget);
+}
+
+VOID VioScsiReadInterruptModeration(
+    IN PVOID DeviceExtension
+)
+{
+    ULONG Len = sizeof(ULONG);
+    UCHAR* pBuf = NULL;
+    PADAPTER_EXTENSION adaptExt;
+    ULONG value = 1;
+
+    adaptExt = (PADAPTER_EXTENSION)DeviceExtension;
+    adaptExt->moderation_disabled = FALSE;
+    pBuf = StorPortAllocateRegistryBuffer(DeviceExtension, &Len);
+    if (pBuf == NULL) {
+        RhelDbgPrint(TRACE_LEVEL_FATAL, "StorPortAllocateRegistryBuffer failed to allocate buffer\n");
+        return;
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (StorPortRegistryRead(DeviceExtension,
+                             INTERRUPT_MODERATION,
+                             1,
+                             MINIPORT_REG_DWORD,
+                             pBuf,
+                             &Len) && Len != 0) {
+        StorPortCopyMemory((PVOID)(&value),
+               (PVOID)pBuf,
+               sizeof(ULONG));
+        adaptExt->moderation_disabled = (value == 0);
+    }
+
+    StorPortFreeRegistryBuffer(DeviceExtension, pBuf);
+    RhelDbgPrint(TRACE_LEVEL_INFORMATION, " interrupt moderation %d\n", !adaptExt->moderation_disabled);
+}
+
 
 ULONG
 DriverEntry(
@@ -506,6 +581,8 @@ ENTER_FN();
             VioScsiReadRegistry(DeviceExtension);
         }
 #endif
+        VioScsiReadPollBudget(DeviceExtension);
+        VioScsiReadInterruptModeration(DeviceExtension);
         ConfigInfo->NumberOfPhysicalBreaks = adaptExt->max_physical_breaks + 1;
     }
     RhelDbgPrint(TRACE_LEVEL_INFORMATION, " NumberOfPhysicalBreaks %d\n", ConfigInfo->NumberOfPhysicalBreaks);
@@ -592,6 +669,7 @@ ENTER_FN();
         adaptExt->poolAllocationSize += ROUND_TO_CACHE_LINES(sizeof(VirtIOSCSIEventNode) * 8);
         adaptExt->poolAllocationSize += ROUND_TO_CACHE_LINES(sizeof(STOR_DPC) * max_queues);
     }
+    adaptExt->poolAllocationSize += ROUND_TO_CACHE_LINES(sizeof(PENDING_SLOT) * PENDING_RING_SIZE * max_queues);
     if (max_queues + VIRTIO_SCSI_REQUEST_QUEUE_0 > MAX_QUEUES_PER_DEVICE_DEFAULT)
     {
         adaptExt->poolAllocationSize += ROUND_TO_CACHE_LINES(
@@ -688,6 +766,7 @@ EXIT_FN();
 static BOOLEAN InitializeVirtualQueues(PADAPTER_EXTENSION adaptExt, ULONG numQueues)
 {
     NTSTATUS status;
+    ULONG index;
 
     status = virtio_find_queues(
         &adaptExt->vdev,
@@ -698,6 +777,12 @@ static BOOLEAN InitializeVirtualQueues(PADAPTER_EXTENSION adaptExt, ULONG numQue
         return FALSE;
     }
 
+    for (index = VIRTIO_SCSI_REQUEST_QUEUE_0; index < numQueues; ++index) {
+        virtqueue_moderation_init(&adaptExt->moderation[index - VIRTIO_SCSI_REQUEST_QUEUE_0], !adaptExt->moderation_disabled);
+        RtlZeroMemory(&adaptExt->poll[index - VIRTIO_SCSI_REQUEST_QUEUE_0], sizeof(POLL_STATE));
+        adaptExt->poll[index - VIRTIO_SCSI_REQUEST_QUEUE_0].budget = adaptExt->poll_budget;
+    }
+
     return TRUE;
 }
 
@@ -790,6 +875,18 @@ ENTER_FN();
 
     for (index = 0; index < adaptExt->num_queues; ++index) {
           PREQUEST_LIST  element = &adaptExt->pending_list[index];
+          /* the ring survives an adapter restart, only its indices are reset */
+          if (element->ring == NULL) {
+              element->ring = (PPENDING_SLOT)VioScsiPoolAlloc(DeviceExtension, sizeof(PENDING_SLOT) * PENDING_RING_SIZE);
+          }
+          if (element->ring != NULL) {
+              ULONG slot;
+              for (slot = 0; slot < PENDING_RING_SIZE; ++slot) {
+                  element->ring[slot].seq = (LONG)slot;
+              }
+          }
+          element->producer_head = 0;
+          element->consumer = 0;
           InitializeListHead(&element->srb_list);
           KeInitializeSpinLock(&element->srb_list_lock);
     }
@@ -1453,7 +1550,6 @@ ProcessQueue(
 )
 {
     PVirtIOSCSICmd      cmd;
-    unsigned int        len;
     PADAPTER_EXTENSION  adaptExt;
     ULONG               index = MESSAGE_TO_QUEUE(MessageID) - VIRTIO_SCSI_REQUEST_QUEUE_0;
     STOR_LOCK_HANDLE    queueLock = { 0 };
@@ -1463,6 +1559,10 @@ ProcessQueue(
     LIST_ENTRY          complete_list;
     PSRB_TYPE           Srb = NULL;
     PSRB_EXTENSION      srbExt = NULL;
+    PVOID               cmds[MAX_COMPLETION_BATCH];
+    ULONG               num;
+    ULONG               i;
+    ULONG               completed;
 ENTER_FN();
 #ifdef USE_WORK_ITEM
     handleResponseInline = (adaptExt->num_queues == 1);
@@ -1472,47 +1572,60 @@ ENTER_FN();
     vq = adaptExt->vq[VIRTIO_SCSI_REQUEST_QUEUE_0 + index];
     InitializeListHead(&complete_list);
 
-    VioScsiVQLock(DeviceExtension, MessageID, &queueLock, isr);
-
     do {
-        virtqueue_disable_cb(vq);
-        while ((cmd = (PVirtIOSCSICmd)virtqueue_get_buf(vq, &len)) != NULL) {
+        VioScsiVQLock(DeviceExtension, MessageID, &queueLock, isr);
+
+        do {
+            virtqueue_disable_cb(vq);
+            completed = 0;
             if (handleResponseInline) {
-                Srb = (PSRB_TYPE)(cmd->srb);
-                srbExt = SRB_EXTENSION(Srb);
-                InsertTailList(&complete_list, &srbExt->list_entry);
+                while ((num = virtqueue_get_bufs(vq, cmds, NULL, MAX_COMPLETION_BATCH)) != 0) {
+                    completed += num;
+                    for (i = 0; i < num; i++) {
+                        cmd = (PVirtIOSCSICmd)cmds[i];
+                        Srb = (PSRB_TYPE)(cmd->srb);
+                        srbExt = SRB_EXTENSION(Srb);
+                        InsertTailList(&complete_list, &srbExt->list_entry);
+                    }
+                }
             }
 #ifdef USE_WORK_ITEM
             else {
+                unsigned int len;
+                while ((cmd = (PVirtIOSCSICmd)virtqueue_get_buf(vq, &len)) != NULL) {
 #if (NTDDI_VERSION > NTDDI_WIN7)
-                PSRB_TYPE Srb = (PSRB_TYPE)(cmd->srb);
-                PSRB_EXTENSION srbExt = SRB_EXTENSION(Srb);
-                ULONG status = STOR_STATUS_SUCCESS;
-                PSTOR_SLIST_ENTRY Result = NULL;
-                VioScsiVQUnlock(DeviceExtension, MessageID, &queueLock, isr);
-                srbExt->priv = (PVOID)cmd;
-                status = StorPortInterlockedPushEntrySList(DeviceExtension, &adaptExt->srb_list[index], &srbExt->list_entry, &Result);
-                if (status != STOR_STATUS_SUCCESS) {
-                    RhelDbgPrint(TRACE_LEVEL_FATAL, " StorPortInterlockedPushEntrySList failed with status 0x%x\n\n", status);
-                }
-                cnt++;
-                VioScsiVQLock(DeviceExtension, MessageID, &queueLock, isr);
+                    PSRB_TYPE Srb = (PSRB_TYPE)(cmd->srb);
+                    PSRB_EXTENSION srbExt = SRB_EXTENSION(Srb);
+                    ULONG status = STOR_STATUS_SUCCESS;
+                    PSTOR_SLIST_ENTRY Result = NULL;
+                    VioScsiVQUnlock(DeviceExtension, MessageID, &queueLock, isr);
+                    srbExt->priv = (PVOID)cmd;
+                    status = StorPortInterlockedPushEntrySList(DeviceExtension, &adaptExt->srb_list[index], &srbExt->list_entry, &Result);
+                    if (status != STOR_STATUS_SUCCESS) {
+                        RhelDbgPrint(TRACE_LEVEL_FATAL, " StorPortInterlockedPushEntrySList failed with status 0x%x\n\n", status);
+                    }
+                    cnt++;
+                    completed++;
+                    VioScsiVQLock(DeviceExtension, MessageID, &queueLock, isr);
 #else
-                NT_ASSERT(0);
+                    NT_ASSERT(0);
 #endif
+                }
             }
 #endif
-        }
-    } while (!virtqueue_enable_cb(vq));
+        } while (!virtqueue_moderation_enable_cb(&adaptExt->moderation[index], vq, completed));
 
-    VioScsiVQUnlock(DeviceExtension, MessageID, &queueLock, isr);
+        VioScsiVQUnlock(DeviceExtension, MessageID, &queueLock, isr);
 
-    SendSRB(DeviceExtension, NULL, isr, MessageID);
+        SendSRB(DeviceExtension, NULL, isr, MessageID);
 
-    while (!IsListEmpty(&complete_list)) {
-        srbExt = (PSRB_EXTENSION)RemoveHeadList(&complete_list);
-        HandleResponse(DeviceExtension, &srbExt->cmd);
-    }
+        while (!IsListEmpty(&complete_list)) {
+            srbExt = (PSRB_EXTENSION)RemoveHeadList(&complete_list);
+            HandleResponse(DeviceExtension, &srbExt->cmd);
+        }
+
+        /* callbacks stay disabled while the queue is polled, without the lock */
+    } while (virtqueue_moderation_poll(&adaptExt->moderation[index], vq));
 
 #ifdef USE_WORK_ITEM
 #if (NTDDI_VERSION > NTDDI_WIN7)
@@ -1536,6 +1649,50 @@ ENTER_FN();
 EXIT_FN();
 }
 
+VOID
+PollQueue(
+    IN PVOID DeviceExtension,
+    IN ULONG MessageID
+)
+{
+    PADAPTER_EXTENSION  adaptExt = (PADAPTER_EXTENSION)DeviceExtension;
+    ULONG               index = MESSAGE_TO_QUEUE(MessageID) - VIRTIO_SCSI_REQUEST_QUEUE_0;
+    PPOLL_STATE         poll = &adaptExt->poll[index];
+    struct virtqueue    *vq = adaptExt->vq[MESSAGE_TO_QUEUE(MessageID)];
+    ULONG               budget = poll->budget;
+    ULONG               waited;
+
+    if (poll->backoff) {
+        /* polling kept missing, rely on the interrupt for a while */
+        if (--poll->backoff == 0) {
+            poll->budget = adaptExt->poll_budget;
+        }
+        return;
+    }
+
+    for (waited = 0; waited < budget; waited++) {
+        if (virtqueue_has_buf(vq)) {
+            break;
+        }
+        StorPortStallExecution(1);
+    }
+
+    if (waited < budget) {
+        /* avg_latency is kept in 1/8 us, poll for twice the average next time */
+        poll->avg_latency += waited - (poll->avg_latency >> 3);
+        poll->budget = min(max(poll->avg_latency >> 2, POLL_BUDGET_MIN), adaptExt->poll_budget);
+        poll->hits++;
+        ProcessQueue(DeviceExtension, MessageID, FALSE);
+    }
+    else {
+        poll->misses++;
+        if (budget <= POLL_BUDGET_MIN) {
+            poll->backoff = POLL_BACKOFF;
+        }
+        poll->budget = max(budget / 2, POLL_BUDGET_MIN);
+    }
+}
+
 VOID
 VioScsiCompleteDpcRoutine(
     IN PSTOR_DPC  Dpc,
@@ -2405,9 +2562,10 @@ IN PVOID Context,
 OUT PUCHAR Buffer
 )
 {
-    UCHAR numberOfBytes = sizeof(VioScsiExtendedInfo) - 1;
+    UCHAR numberOfBytes = sizeof(VioScsiExtendedInfo);
     PADAPTER_EXTENSION    adaptExt;
     PVioScsiExtendedInfo  extInfo;
+    ULONG                 index;
 
 ENTER_FN();
 
@@ -2426,6 +2584,15 @@ ENTER_FN();
     extInfo->InterruptMsgRanges = CHECKFLAG(adaptExt->perfFlags, STOR_PERF_INTERRUPT_MESSAGE_RANGES);
     extInfo->CompletionDuringStartIo = CHECKFLAG(adaptExt->perfFlags, STOR_PERF_OPTIMIZE_FOR_COMPLETION_DURING_STARTIO);
     extInfo->PhysicalBreaks = adaptExt->max_physical_breaks;
+    for (index = 0; index < adaptExt->num_queues; ++index) {
+        struct virtqueue_moderation *mod = &adaptExt->moderation[index];
+
+        extInfo->ModerationCallbacks += mod->callbacks;
+        extInfo->ModerationInterruptsAvoided += mod->interrupts_avoided;
+        extInfo->ModerationDelayed += mod->delayed;
+        extInfo->ModerationPollHits += mod->poll_hits;
+        extInfo->ModerationPollMisses += mod->poll_misses;
+    }
 
 EXIT_FN();
 }
@@ -53,8 +53,23 @@ typedef struct VirtIOBufferDescriptor VIO_SG, *PVIO_SG;
 #define SECTOR_SIZE             512
 #define IO_PORT_LENGTH          0x40
 #define MAX_CPU                 256
+#define MAX_SUBMIT_BATCH        16
+/* Entries in the per request queue pending ring, must be a power of two */
+#define PENDING_RING_SIZE       128
+#define MAX_COMPLETION_BATCH    32
 
 #define MAX_PH_BREAKS           "PhysicalBreaks"
+#define POLL_BUDGET             "PollBudget"
+/* 0 turns the adaptive interrupt moderation of the request queues off */
+#define INTERRUPT_MODERATION    "InterruptModeration"
+
+/* Busy-poll budget bounds in microseconds, PollBudget sets the maximum. The
+ * submitter spins in StartIo, so the cap stays near a fast device's latency */
+#define POLL_BUDGET_MIN         2
+#define POLL_BUDGET_DEFAULT     10
+#define POLL_BUDGET_MAX         20
+/* Submissions skipped after the budget has shrunk to the minimum without a hit */
+#define POLL_BACKOFF            64
 
 
 /* Feature Bits */
@@ -260,11 +275,39 @@ typedef struct {
 }TMF_COMMAND, * PTMF_COMMAND;
 #pragma pack()
 
+/* A pending ring slot. seq equals the ring index the slot is free for, and that
+ * index + 1 once the request stored for it is published.
+ */
+typedef struct _PENDING_SLOT {
+    volatile LONG         seq;
+    PSRB_EXTENSION        srbExt;
+} PENDING_SLOT, *PPENDING_SLOT;
+
+/* Pending requests of one request queue. Submitters on any CPU reserve a ring slot
+ * with a compare-exchange on producer_head and publish it through the slot's own
+ * sequence number, so no submitter waits for another one. The ring has a single
+ * consumer, whoever holds the virtqueue lock, which stops at the first slot not
+ * published yet. Requests that find the ring full or have to be returned because
+ * the virtqueue was full go to srb_list, which is drained first.
+ */
 typedef struct _REQUEST_LIST {
+    volatile LONG         producer_head;
+    volatile LONG         consumer;
+    PPENDING_SLOT         ring;
     LIST_ENTRY            srb_list;
     KSPIN_LOCK            srb_list_lock;
 } REQUEST_LIST, *PREQUEST_LIST;
 
+/* Per request queue busy-poll state, updated without a lock by concurrent
+ * submitters, races only skew the estimates */
+typedef struct _POLL_STATE {
+    ULONG                 budget;
+    ULONG                 avg_latency;
+    ULONG                 backoff;
+    ULONGLONG             hits;
+    ULONGLONG             misses;
+} POLL_STATE, *PPOLL_STATE;
+
 typedef struct virtio_bar {
     PHYSICAL_ADDRESS  BasePA;
     ULONG             uLength;
@@ -284,6 +327,8 @@ typedef struct _ADAPTER_EXTENSION {
     ULONG                 poolOffset;
 
     struct virtqueue *    vq[VIRTIO_SCSI_QUEUE_LAST];
+    struct virtqueue_moderation moderation[MAX_CPU];
+    BOOLEAN               moderation_disabled;
     ULONG_PTR             device_base;
     VirtIOSCSIConfig      scsi_config;
     union {
@@ -314,6 +359,8 @@ typedef struct _ADAPTER_EXTENSION {
     UCHAR                 cpu_to_vq_map[MAX_CPU];
 #endif
     REQUEST_LIST          pending_list[MAX_CPU];
+    ULONG                 poll_budget;
+    POLL_STATE            poll[MAX_CPU];
     ULONG                 perfFlags;
     PGROUP_AFFINITY       pmsg_affinity;
     BOOLEAN               dpc_ok;
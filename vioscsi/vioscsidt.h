@@ -64,8 +64,33 @@ typedef struct _VioScsiExtendedInfo
     #define VioScsiExtendedInfo_PhysicalBreaks_SIZE sizeof(ULONG)
     #define VioScsiExtendedInfo_PhysicalBreaks_ID 10
 
+    // 
+    ULONGLONG ModerationCallbacks;
+    #define VioScsiExtendedInfo_ModerationCallbacks_SIZE sizeof(ULONGLONG)
+    #define VioScsiExtendedInfo_ModerationCallbacks_ID 11
+
+    // 
+    ULONGLONG ModerationInterruptsAvoided;
+    #define VioScsiExtendedInfo_ModerationInterruptsAvoided_SIZE sizeof(ULONGLONG)
+    #define VioScsiExtendedInfo_ModerationInterruptsAvoided_ID 12
+
+    // 
+    ULONGLONG ModerationDelayed;
+    #define VioScsiExtendedInfo_ModerationDelayed_SIZE sizeof(ULONGLONG)
+    #define VioScsiExtendedInfo_ModerationDelayed_ID 13
+
+    // 
+    ULONGLONG ModerationPollHits;
+    #define VioScsiExtendedInfo_ModerationPollHits_SIZE sizeof(ULONGLONG)
+    #define VioScsiExtendedInfo_ModerationPollHits_ID 14
+
+    // 
+    ULONGLONG ModerationPollMisses;
+    #define VioScsiExtendedInfo_ModerationPollMisses_SIZE sizeof(ULONGLONG)
+    #define VioScsiExtendedInfo_ModerationPollMisses_ID 15
+
 } VioScsiExtendedInfo, *PVioScsiExtendedInfo;
 
-#define VioScsiExtendedInfo_SIZE (FIELD_OFFSET(VioScsiExtendedInfo, PhysicalBreaks) + VioScsiExtendedInfo_PhysicalBreaks_SIZE)
+#define VioScsiExtendedInfo_SIZE (FIELD_OFFSET(VioScsiExtendedInfo, ModerationPollMisses) + VioScsiExtendedInfo_ModerationPollMisses_SIZE)
 
 #endif
@@ -315,6 +315,41 @@ static ULONG InitVirtIODevice(PVOID DeviceExtension)
     return SP_RETURN_FOUND;
 }
 
+static VOID
+VioStorReadInterruptModeration(
+    IN PVOID DeviceExtension
+    )
+{
+    PADAPTER_EXTENSION adaptExt = (PADAPTER_EXTENSION)DeviceExtension;
+    ULONG Len = sizeof(ULONG);
+    UCHAR* pBuf = NULL;
+    ULONG value = 1;
+
+    adaptExt->moderation_disabled = FALSE;
+    pBuf = StorPortAllocateRegistryBuffer(DeviceExtension, &Len);
+    if (pBuf == NULL) {
+        RhelDbgPrint(TRACE_LEVEL_FATAL, " StorPortAllocateRegistryBuffer failed to allocate buffer\n");
+        return;
+    }
+
+    memset(pBuf, 0, sizeof(ULONG));
+
+    if (StorPortRegistryRead(DeviceExtension,
+                             INTERRUPT_MODERATION,
+                             1,
+                             MINIPORT_REG_DWORD,
+                             pBuf,
+                             &Len) && Len != 0) {
+        StorPortCopyMemory((PVOID)(&value),
+               (PVOID)pBuf,
+               sizeof(ULONG));
+        adaptExt->moderation_disabled = (value == 0);
+    }
+
+    StorPortFreeRegistryBuffer(DeviceExtension, pBuf);
+    RhelDbgPrint(TRACE_LEVEL_INFORMATION, " interrupt moderation %d\n", !adaptExt->moderation_disabled);
+}
+
 ULONG
 VirtIoFindAdapter(
     IN PVOID DeviceExtension,
@@ -477,6 +512,7 @@ VirtIoFindAdapter(
     if(adaptExt->dump_mode) {
         ConfigInfo->NumberOfPhysicalBreaks = 8;
     } else {
+        VioStorReadInterruptModeration(DeviceExtension);
         ConfigInfo->NumberOfPhysicalBreaks = MAX_PHYS_SEGMENTS + 1;
     }
 
@@ -623,6 +659,7 @@ static BOOLEAN InitializeVirtualQueues(PADAPTER_EXTENSION adaptExt)
 {
     NTSTATUS status;
     ULONG numQueues = adaptExt->num_queues;
+    ULONG index;
 
     RhelDbgPrint(TRACE_LEVEL_FATAL, " InitializeVirtualQueues numQueues %d\n", numQueues);
     status = virtio_find_queues(
@@ -634,6 +671,10 @@ static BOOLEAN InitializeVirtualQueues(PADAPTER_EXTENSION adaptExt)
         return FALSE;
     }
 
+    for (index = 0; index < numQueues; ++index) {
+        virtqueue_moderation_init(&adaptExt->moderation[index], !adaptExt->moderation_disabled);
+    }
+
     return TRUE;
 }
 
@@ -650,6 +691,9 @@ RhelSetGuestFeatures(
         if (CHECKBIT(adaptExt->features, VIRTIO_F_RING_PACKED)) {
             guestFeatures |= (1ULL << VIRTIO_F_RING_PACKED);
         }
+        if (CHECKBIT(adaptExt->features, VIRTIO_F_IN_ORDER)) {
+            guestFeatures |= (1ULL << VIRTIO_F_IN_ORDER);
+        }
     }
 
 #if (WINVER == 0x0A00)
@@ -2002,6 +2046,7 @@ VioStorCompleteRequest(
     PSRB_EXTENSION      srbExt = NULL;
     LIST_ENTRY          complete_list;
     UCHAR               srbStatus = SRB_STATUS_SUCCESS;
+    unsigned int        completed;
 
     RhelDbgPrint(TRACE_LEVEL_VERBOSE, " ---> MessageID 0x%x\n", MessageID);
 
@@ -2011,75 +2056,81 @@ VioStorCompleteRequest(
 
     InitializeListHead(&complete_list);
 
-    VioStorVQLock(DeviceExtension, MessageID, &queueLock, bIsr);
     do {
-        virtqueue_disable_cb(vq);
-        while ((vbr = (pblk_req)virtqueue_get_buf(vq, &len)) != NULL) {
-            InsertTailList(&complete_list, &vbr->list_entry);
+        VioStorVQLock(DeviceExtension, MessageID, &queueLock, bIsr);
+        do {
+            virtqueue_disable_cb(vq);
+            completed = 0;
+            while ((vbr = (pblk_req)virtqueue_get_buf(vq, &len)) != NULL) {
+                InsertTailList(&complete_list, &vbr->list_entry);
+                completed++;
 #ifdef DBG
-            InterlockedDecrement((LONG volatile*)&adaptExt->inqueue_cnt);
+                InterlockedDecrement((LONG volatile*)&adaptExt->inqueue_cnt);
 #endif
-        }
-    } while (!virtqueue_enable_cb(vq));
-    VioStorVQUnlock(DeviceExtension, MessageID, &queueLock, bIsr);
-
-    while (!IsListEmpty(&complete_list)) {
-        vbr = (pblk_req)RemoveHeadList(&complete_list);
-        Srb = (PSRB_TYPE)vbr->req;
-        if (vbr->out_hdr.type == VIRTIO_BLK_T_GET_ID) {
-            adaptExt->sn_ok = TRUE;
-            if (Srb) {
-                PCDB cdb = SRB_CDB(Srb);
-
-                if (!cdb)
-                    continue;
-
-                if ((cdb->CDB6INQUIRY3.PageCode == VPD_SERIAL_NUMBER) &&
-                    (cdb->CDB6INQUIRY3.EnableVitalProductData == 1)) {
-                    PVPD_SERIAL_NUMBER_PAGE SerialPage;
-                    ULONG dataLen = SRB_DATA_TRANSFER_LENGTH(Srb);
-                    UCHAR len = strlen(adaptExt->sn);
-
-                    SerialPage = (PVPD_SERIAL_NUMBER_PAGE)SRB_DATA_BUFFER(Srb);
-                    RhelDbgPrint(TRACE_LEVEL_INFORMATION, "dataLen = %d\n", dataLen);
-                    RtlZeroMemory(SerialPage, dataLen);
-                    SerialPage->DeviceType = DIRECT_ACCESS_DEVICE;
-                    SerialPage->DeviceTypeQualifier = DEVICE_CONNECTED;
-                    SerialPage->PageCode = VPD_SERIAL_NUMBER;
-
-                    SerialPage->PageLength = min(BLOCK_SERIAL_STRLEN, len);
-                    StorPortCopyMemory(&SerialPage->SerialNumber, &adaptExt->sn, SerialPage->PageLength);
-                    RhelDbgPrint(TRACE_LEVEL_FATAL, "PageLength = %d (%d)\n", SerialPage->PageLength, len);
-
-                    SRB_SET_DATA_TRANSFER_LENGTH(Srb, (sizeof(VPD_SERIAL_NUMBER_PAGE) + SerialPage->PageLength));
-                    CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_SUCCESS);
-                }
-                else if ((cdb->CDB6INQUIRY3.PageCode == VPD_DEVICE_IDENTIFIERS) &&
-                    (cdb->CDB6INQUIRY3.EnableVitalProductData == 1))
-                {
-                    ReportDeviceIdentifier(DeviceExtension, Srb);
-                    CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_SUCCESS);
-                }
             }
-            continue;
-        }
-        if (Srb) {
-            srbExt = SRB_EXTENSION(Srb);
-            srbStatus = DeviceToSrbStatus(vbr->status);
-            RhelDbgPrint(TRACE_LEVEL_INFORMATION, " srb %p, QueueNumber %lu, MessageId %lu, srbExt->MessageId %lu.\n",
-                        Srb, QueueNumber, MessageID, srbExt->MessageID);
-            if (srbExt->fua == TRUE) {
-                SRB_SET_SRB_STATUS(Srb, SRB_STATUS_PENDING);
-                if (!RhelDoFlush(DeviceExtension, Srb, TRUE, bIsr)) {
-                    CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_ERROR);
+        } while (!virtqueue_moderation_enable_cb(&adaptExt->moderation[QueueNumber], vq, completed));
+        VioStorVQUnlock(DeviceExtension, MessageID, &queueLock, bIsr);
+
+        while (!IsListEmpty(&complete_list)) {
+            vbr = (pblk_req)RemoveHeadList(&complete_list);
+            Srb = (PSRB_TYPE)vbr->req;
+            if (vbr->out_hdr.type == VIRTIO_BLK_T_GET_ID) {
+                adaptExt->sn_ok = TRUE;
+                if (Srb) {
+                    PCDB cdb = SRB_CDB(Srb);
+
+                    if (!cdb)
+                        continue;
+
+                    if ((cdb->CDB6INQUIRY3.PageCode == VPD_SERIAL_NUMBER) &&
+                        (cdb->CDB6INQUIRY3.EnableVitalProductData == 1)) {
+                        PVPD_SERIAL_NUMBER_PAGE SerialPage;
+                        ULONG dataLen = SRB_DATA_TRANSFER_LENGTH(Srb);
+                        UCHAR len = strlen(adaptExt->sn);
+
+                        SerialPage = (PVPD_SERIAL_NUMBER_PAGE)SRB_DATA_BUFFER(Srb);
+                        RhelDbgPrint(TRACE_LEVEL_INFORMATION, "dataLen = %d\n", dataLen);
+                        RtlZeroMemory(SerialPage, dataLen);
+                        SerialPage->DeviceType = DIRECT_ACCESS_DEVICE;
+                        SerialPage->DeviceTypeQualifier = DEVICE_CONNECTED;
+                        SerialPage->PageCode = VPD_SERIAL_NUMBER;
+
+                        SerialPage->PageLength = min(BLOCK_SERIAL_STRLEN, len);
+                        StorPortCopyMemory(&SerialPage->SerialNumber, &adaptExt->sn, SerialPage->PageLength);
+                        RhelDbgPrint(TRACE_LEVEL_FATAL, "PageLength = %d (%d)\n", SerialPage->PageLength, len);
+
+                        SRB_SET_DATA_TRANSFER_LENGTH(Srb, (sizeof(VPD_SERIAL_NUMBER_PAGE) + SerialPage->PageLength));
+                        CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_SUCCESS);
+                    }
+                    else if ((cdb->CDB6INQUIRY3.PageCode == VPD_DEVICE_IDENTIFIERS) &&
+                        (cdb->CDB6INQUIRY3.EnableVitalProductData == 1))
+                    {
+                        ReportDeviceIdentifier(DeviceExtension, Srb);
+                        CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_SUCCESS);
+                    }
                 }
-                srbExt->fua = FALSE;
+                continue;
             }
-            else {
-                CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, srbStatus);
+            if (Srb) {
+                srbExt = SRB_EXTENSION(Srb);
+                srbStatus = DeviceToSrbStatus(vbr->status);
+                RhelDbgPrint(TRACE_LEVEL_INFORMATION, " srb %p, QueueNumber %lu, MessageId %lu, srbExt->MessageId %lu.\n",
+                            Srb, QueueNumber, MessageID, srbExt->MessageID);
+                if (srbExt->fua == TRUE) {
+                    SRB_SET_SRB_STATUS(Srb, SRB_STATUS_PENDING);
+                    if (!RhelDoFlush(DeviceExtension, Srb, TRUE, bIsr)) {
+                        CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, SRB_STATUS_ERROR);
+                    }
+                    srbExt->fua = FALSE;
+                }
+                else {
+                    CompleteRequestWithStatus(DeviceExtension, (PSRB_TYPE)Srb, srbStatus);
+                }
             }
         }
-    }
+
+        /* callbacks stay disabled while the queue is polled, without the lock */
+    } while (virtqueue_moderation_poll(&adaptExt->moderation[QueueNumber], vq));
 
     RhelDbgPrint(TRACE_LEVEL_VERBOSE, " <--- MessageID 0x%x\n", MessageID);
 }
@@ -97,6 +97,9 @@ typedef struct VirtIOBufferDescriptor VIO_SG, *PVIO_SG;
 
 #define VIOBLK_MAX_TRANSFER     MAX_PHYS_SEGMENTS * PAGE_SIZE
 
+/* 0 turns the adaptive interrupt moderation of the request queues off */
+#define INTERRUPT_MODERATION    "InterruptModeration"
+
 #pragma pack(1)
 typedef struct virtio_blk_config {
     /* The capacity (in 512-byte sectors). */
@@ -209,6 +212,8 @@ typedef struct _ADAPTER_EXTENSION {
     ULONG                 poolOffset;
 
     struct virtqueue *    vq[VIRTIO_BLK_QUEUE_LAST];
+    struct virtqueue_moderation moderation[VIRTIO_BLK_QUEUE_LAST];
+    BOOLEAN               moderation_disabled;
     USHORT                num_queues;
     INQUIRYDATA           inquiry_data;
     blk_config            info;